@@ -25,9 +25,14 @@
 
 #include "wookie/storage.hpp"
 #include "wookie/basic_elliptics_splitter.hpp"
+#include "wookie/delta_index.hpp"
 #include "wookie/split.hpp"
 #include "wookie/operators.hpp"
 
+#include <iostream>
+
+#include <unistd.h>
+
 using namespace ioremap;
 using namespace ioremap::wookie;
 
@@ -60,8 +65,6 @@ struct on_upload : public rift::io::on_upload<T>
 
 		const swarm::url_query &query_list = req.url().query();
 
-		ioremap::elliptics::session sess = this->server()->elliptics()->session();
-
 		auto base_index = query_list.item_value("base_index");
 		auto name = query_list.item_value("name");
 
@@ -74,47 +77,51 @@ struct on_upload : public rift::io::on_upload<T>
 		m_doc.data.assign(boost::asio::buffer_cast<const char*>(buffer), boost::asio::buffer_size(buffer));
 		m_doc.key = *name;
 
-		sess.write_data(m_doc.key, std::move(storage::pack_document(m_doc)), 0)
+		// storage writes metadata, chunks large bodies and invalidates cached document
+		this->server()->get_storage().write_document(m_doc)
 				.connect(std::bind(&on_upload<T>::on_write_finished_update_index,
 					this->shared_from_this(), std::placeholders::_1, std::placeholders::_2));
 	}
 
-	void on_write_finished_update_index(const ioremap::elliptics::sync_write_result &result,
-			const ioremap::elliptics::error_info &error) {
+	void on_write_finished_update_index(const int &, const ioremap::elliptics::error_info &error) {
 		if (error) {
 			this->send_reply(swarm::url_fetcher::response::service_unavailable);
 			return;
 		}
 
-		std::vector<std::string> ids;
-		std::vector<elliptics::data_pointer> objs;
-
-		this->server()->get_splitter().prepare_indexes(m_doc, m_base_index, ids, objs);
-
-		if (ids.size()) {
-			rift::io::upload_completion::fill_upload_reply(result, m_result_object,
-					m_result_object.GetAllocator());
-
-			thevoid::simple_request_stream<T>::log(ioremap::swarm::SWARM_LOG_INFO,
-					"rindex update: time: %s, url: '%s', index-number: %zd",
-					dnet_print_time(&m_doc.ts), m_doc.key.c_str(), ids.size());
-			ioremap::elliptics::session sess = this->server()->elliptics()->session();
-			sess.set_indexes(m_doc.key, ids, objs)
-				.connect(std::bind(&on_upload<T>::on_index_update_finished,
-					this->shared_from_this(), std::placeholders::_1, std::placeholders::_2));
-		} else {
-			this->on_write_finished(result, error);
-		}
-	}
-
-	void on_index_update_finished(const ioremap::elliptics::sync_set_indexes_result &result,
-			const ioremap::elliptics::error_info &error) {
-		if (error) {
+		// document is searchable as soon as it is in delta index,
+		// secondary indexes are updated later by delta index flush in batches
+		delta_document doc;
+		doc.id = this->server()->get_storage().transform_key(m_doc.key);
+		doc.key = m_doc.key;
+		doc.ts = m_doc.ts;
+		doc.pos = this->server()->get_splitter().positions(m_doc.data);
+		doc.collection = m_base_index;
+
+		thevoid::simple_request_stream<T>::log(ioremap::swarm::SWARM_LOG_INFO,
+				"rindex update: time: %s, url: '%s', index-number: %zd",
+				dnet_print_time(&m_doc.ts), m_doc.key.c_str(), doc.pos.size() + 1);
+
+		// this is storage completion thread, so upload is rejected instead of waiting for flushes
+		try {
+			this->server()->get_delta_index().add(doc, false);
+		} catch (const std::exception &e) {
+			thevoid::simple_request_stream<T>::log(ioremap::swarm::SWARM_LOG_ERROR,
+					"rindex update: url: '%s': %s", m_doc.key.c_str(), e.what());
 			this->send_reply(swarm::url_fetcher::response::service_unavailable);
 			return;
 		}
 
-		(void) result;
+		char id_str[2 * DNET_ID_SIZE + 1];
+		dnet_dump_id_len_raw(doc.id.id, DNET_ID_SIZE, id_str);
+
+		rapidjson::Value id(id_str, m_result_object.GetAllocator());
+		rapidjson::Value key(m_doc.key.c_str(), m_result_object.GetAllocator());
+		rapidjson::Value size((uint64_t)m_doc.data.size());
+
+		m_result_object.AddMember("id", id, m_result_object.GetAllocator());
+		m_result_object.AddMember("key", key, m_result_object.GetAllocator());
+		m_result_object.AddMember("size", size, m_result_object.GetAllocator());
 
 		auto data = m_result_object.ToString();
 
@@ -130,8 +137,34 @@ struct on_upload : public rift::io::on_upload<T>
 template <typename T>
 struct on_get : public rift::io::on_get<T>
 {
-	virtual void on_read_finished(const ioremap::elliptics::sync_read_result &result,
-			const ioremap::elliptics::error_info &error) {
+	// the same hack as in on_upload
+	std::shared_ptr<on_get> shared_from_this() {
+		return std::static_pointer_cast<on_get>(rift::io::on_get<T>::shared_from_this());
+	}
+
+	virtual void checked(const swarm::http_request &req, const boost::asio::const_buffer &buffer,
+			const rift::bucket_meta_raw &meta, swarm::http_response::status_type verdict) {
+		(void) buffer;
+
+		if ((verdict != swarm::http_response::ok) && !meta.noauth_all()) {
+			this->send_reply(verdict);
+			return;
+		}
+
+		auto name = req.url().query().item_value("name");
+		if (!name) {
+			this->send_reply(ioremap::swarm::http_response::bad_request);
+			return;
+		}
+
+		// documents are uploaded via storage, which chunks large bodies and compresses
+		// them with per-host dictionaries, so they are read back via storage too
+		this->server()->get_storage().async_read_document(*name)
+				.connect(std::bind(&on_get<T>::on_read_document_finished,
+					this->shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+	}
+
+	void on_read_document_finished(const document &doc, const ioremap::elliptics::error_info &error) {
 		if (error.code() == -ENOENT) {
 			this->send_reply(swarm::url_fetcher::response::not_found);
 			return;
@@ -140,10 +173,6 @@ struct on_get : public rift::io::on_get<T>
 			return;
 		}
 
-		const ioremap::elliptics::read_result_entry &entry = result[0];
-
-		document doc = storage::unpack_document(entry.file());
-
 		const swarm::http_request &request = this->request();
 
 		if (auto modified_since = request.headers().if_modified_since()) {
@@ -159,7 +188,8 @@ struct on_get : public rift::io::on_get<T>
 		reply.headers().set_content_type("text/plain");
 		reply.headers().set_last_modified(doc.ts.tsec);
 
-		this->send_reply(std::move(reply), std::move(doc.data));
+		std::string data = doc.data;
+		this->send_reply(std::move(reply), std::move(data));
 	}
 };
 
@@ -167,6 +197,21 @@ struct on_get : public rift::io::on_get<T>
 class http_server : public ioremap::thevoid::server<http_server>
 {
 public:
+	~http_server() {
+		// delta index flushes the rest of documents via storage, so it has to go first
+		if (m_storage)
+			m_storage->set_delta_index(std::shared_ptr<delta_index>());
+		m_delta.reset();
+
+		if (m_storage && m_stats_file.size()) {
+			try {
+				m_storage->get_collection_stats().save(m_stats_file);
+			} catch (const std::exception &e) {
+				std::cerr << "could not save collection stats: " << e.what() << std::endl;
+			}
+		}
+	}
+
 	virtual bool initialize(const rapidjson::Value &config) {
 		if (!m_elliptics.initialize(config, logger())) {
 			return false;
@@ -174,12 +219,44 @@ public:
 
 		m_storage.reset(new storage(elliptics()->session()));
 
+		// collection statistics are kept in memory and survive restarts only via this file
+		if (config.HasMember("stats_file")) {
+			m_stats_file = config["stats_file"].GetString();
+			if (access(m_stats_file.c_str(), F_OK) == 0)
+				m_storage->get_collection_stats().load(m_stats_file);
+		}
+
+		size_t delta_batch_docs = 1000;
+		if (config.HasMember("delta_batch_docs"))
+			delta_batch_docs = config["delta_batch_docs"].GetUint64();
+
+		long delta_flush_interval = 1000;
+		if (config.HasMember("delta_flush_interval"))
+			delta_flush_interval = config["delta_flush_interval"].GetInt64();
+
+		// documents which are not flushed yet are held in memory, uploads wait beyond this limit
+		size_t delta_max_docs = 100000;
+		if (config.HasMember("delta_max_docs"))
+			delta_max_docs = config["delta_max_docs"].GetUint64();
+
+		m_delta = std::make_shared<delta_index>(delta_index::storage_handler(*m_storage),
+				delta_batch_docs, std::chrono::milliseconds(delta_flush_interval), delta_max_docs);
+
+		// without spill file exit waits until indexes of all uploaded documents are flushed
+		if (config.HasMember("delta_spill_file"))
+			m_delta->set_spill_file(config["delta_spill_file"].GetString());
+
+		m_storage->set_delta_index(m_delta);
+
 		on<on_get<http_server>>(
 			options::exact_match("/get"),
 			options::methods("GET")
 		);
+		// reply is {id, key, size} of the stored document instead of rift's per-replica
+		// write results, since large documents are written as several chunks,
+		// so the endpoint is versioned and old /upload is not served anymore
 		on<on_upload<http_server>>(
-			options::exact_match("/upload"),
+			options::exact_match("/v2/upload"),
 			options::methods("POST")
 		);
 		on<on_search>(
@@ -206,6 +283,10 @@ public:
 		return *m_storage;
 	}
 
+	ioremap::wookie::delta_index &get_delta_index() {
+		return *m_delta;
+	}
+
 	struct on_search  : public ioremap::thevoid::simple_request_stream<http_server>,
 			    public std::enable_shared_from_this<on_search> {
 		virtual void on_request(const swarm::http_request &req,
@@ -219,7 +300,7 @@ public:
 
 			if (auto text = query.item_value("text")) {
 				ioremap::wookie::operators op(server()->get_storage());
-				shared_find_t fobj = op.find(*text);
+				op.find(*text, std::bind(&on_search::on_search_finished, shared_from_this(), _1, _2));
 			} else {
 				send_reply(ioremap::swarm::url_fetcher::response::bad_request);
 			}
@@ -301,6 +382,8 @@ private:
 	rift::elliptics_base m_elliptics;
 
 	std::unique_ptr<ioremap::wookie::storage> m_storage;
+	std::shared_ptr<ioremap::wookie::delta_index> m_delta;
+	std::string m_stats_file;
 };
 
 int main(int argc, char **argv)
@@ -0,0 +1,97 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WOOKIE_ANCHOR_INDEX_HPP
+#define __WOOKIE_ANCHOR_INDEX_HPP
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <stdint.h>
+
+namespace ioremap { namespace wookie {
+
+// Text of the links pointing to every document, it is indexed as fields::anchor
+// field of the target document.
+//
+// Links are appended to a pending batch, which is merged into the index when it grows
+// to @batch_links or when anchors are requested. Merge sorts the batch by target,
+// so every target is looked up and updated once per batch however many links point to it.
+// The same text from the same source page (e.g. recrawled one) is counted once,
+// every target keeps at most @max_texts distinct texts.
+class anchor_index {
+	public:
+		struct anchor {
+			std::string	text;
+			uint32_t	sources;	// number of distinct pages linking with this text
+		};
+
+		explicit anchor_index(size_t batch_links = 10000, size_t max_texts = 64);
+
+		// @text is normalized (whitespace is collapsed), links without text are ignored
+		void add(const std::string &source, const std::string &target, const std::string &text);
+
+		// merges pending links, returns targets whose anchors have changed since the previous
+		// flush(), including merges made by add() and anchors(), already indexed targets
+		// have to be indexed again with the new texts
+		std::vector<std::string> flush();
+
+		// anchors of @target, the most popular first
+		std::vector<anchor> anchors(const std::string &target);
+
+		// texts of anchors() for fields::document_fields
+		std::vector<std::string> texts(const std::string &target);
+
+		size_t targets_num();
+
+		// binary dump of merged anchors, it is written under temporary name and renamed
+		void save(const std::string &path);
+		// replaces current content
+		void load(const std::string &path);
+
+	private:
+		struct link {
+			std::string	target;
+			std::string	text;
+			uint64_t	seen;		// hash of the source and the text
+		};
+
+		struct target_anchors {
+			std::vector<anchor>	anchors;
+			std::vector<uint64_t>	seen;	// sorted
+		};
+
+		size_t m_batch_links;
+		size_t m_max_texts;
+
+		std::mutex m_pending_lock;
+		std::vector<link> m_pending;
+
+		std::mutex m_lock;
+		std::unordered_map<std::string, target_anchors> m_targets;
+		// targets updated since the previous flush()
+		std::unordered_set<std::string> m_changed;
+
+		void merge_pending();
+		void merge(std::vector<link> &links);
+};
+
+}} // namespace ioremap::wookie
+
+#endif /* __WOOKIE_ANCHOR_INDEX_HPP */
@@ -0,0 +1,158 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WOOKIE_BACKEND_HPP
+#define __WOOKIE_BACKEND_HPP
+
+#include "wookie/cache.hpp"
+#include "wookie/future.hpp"
+
+#include <elliptics/session.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include <string.h>
+
+namespace ioremap { namespace wookie {
+
+struct read_reply {
+	elliptics::data_pointer file;
+	int group;	// group which has replied, -1 if backend has no groups
+
+	read_reply() : group(-1) {}
+};
+
+typedef std::vector<elliptics::find_indexes_result_entry> find_result_t;
+
+// documents which contain any of the groups are excluded from search results,
+// every group is a single token or a phrase (tokens in the phrase order)
+typedef std::vector<std::vector<std::string>> exclusion_t;
+
+// secondary indexes object @id has to be added to
+struct object_indexes {
+	dnet_raw_id id;
+	std::vector<elliptics::index_entry> entries;
+};
+
+// Low-level key-value and secondary index operations wookie::storage is built on.
+// Objects and indexes are addressed by already transformed IDs, storage is responsible
+// for key naming, namespaces, packing, caching and replica group selection.
+// All operations are asynchronous, returned futures may be completed from backend's thread.
+class backend {
+	public:
+		virtual ~backend() {}
+
+		// name to ID transformation within given namespace
+		virtual dnet_raw_id transform(const std::string &ns, const std::string &name) = 0;
+
+		// @groups is the order replica groups should be tried in, it may be empty
+		virtual future<read_reply> read(const dnet_raw_id &id, const std::vector<int> &groups) = 0;
+		virtual future<int> write(const dnet_raw_id &id, const elliptics::data_pointer &data) = 0;
+		virtual future<int> remove(const dnet_raw_id &id) = 0;
+
+		// adds object @id to every index in @entries with associated data
+		virtual future<int> set_indexes(const dnet_raw_id &id, const std::vector<elliptics::index_entry> &entries) = 0;
+
+		// the same for many objects at once, completes after all of them with the first error,
+		// by default requests are sent concurrently one per object
+		virtual future<int> set_indexes_batch(const std::vector<object_indexes> &objects);
+
+		// returns objects which are present in all @indexes
+		virtual future<find_result_t> find(const std::vector<dnet_raw_id> &indexes, const std::vector<int> &groups) = 0;
+};
+
+// elliptics cluster backend
+class elliptics_backend : public backend {
+	public:
+		explicit elliptics_backend(elliptics::node &&node);
+
+		void set_groups(const std::vector<int> &groups);
+
+		virtual dnet_raw_id transform(const std::string &ns, const std::string &name);
+
+		virtual future<read_reply> read(const dnet_raw_id &id, const std::vector<int> &groups);
+		virtual future<int> write(const dnet_raw_id &id, const elliptics::data_pointer &data);
+		virtual future<int> remove(const dnet_raw_id &id);
+		virtual future<int> set_indexes(const dnet_raw_id &id, const std::vector<elliptics::index_entry> &entries);
+		virtual future<find_result_t> find(const std::vector<dnet_raw_id> &indexes, const std::vector<int> &groups);
+
+		elliptics::session create_session(void);
+		elliptics::node get_node();
+
+	private:
+		elliptics::node m_node;
+		elliptics::session m_sess;
+
+		elliptics::session create_session(const std::vector<int> &groups);
+};
+
+// In-process backend: objects live in a hash map, secondary indexes are emulated
+// with per-index sorted object maps. It allows to run and profile engine, operators
+// and http server on a single box without elliptics cluster.
+// Every completion can be delayed by @latency to emulate network round trip,
+// delayed completions are executed by the backend's own thread.
+class memory_backend : public backend {
+	public:
+		explicit memory_backend(std::chrono::microseconds latency = std::chrono::microseconds(0));
+		~memory_backend();
+
+		virtual dnet_raw_id transform(const std::string &ns, const std::string &name);
+
+		virtual future<read_reply> read(const dnet_raw_id &id, const std::vector<int> &groups);
+		virtual future<int> write(const dnet_raw_id &id, const elliptics::data_pointer &data);
+		virtual future<int> remove(const dnet_raw_id &id);
+		virtual future<int> set_indexes(const dnet_raw_id &id, const std::vector<elliptics::index_entry> &entries);
+		virtual future<int> set_indexes_batch(const std::vector<object_indexes> &objects);
+		virtual future<find_result_t> find(const std::vector<dnet_raw_id> &indexes, const std::vector<int> &groups);
+
+		size_t objects_num();
+		size_t indexes_num();
+
+	private:
+		struct raw_id_less {
+			bool operator() (const dnet_raw_id &a, const dnet_raw_id &b) const {
+				return memcmp(a.id, b.id, sizeof(a.id)) < 0;
+			}
+		};
+
+		typedef std::map<dnet_raw_id, elliptics::data_pointer, raw_id_less> index_t;
+
+		std::chrono::microseconds m_latency;
+
+		std::mutex m_lock;
+		std::unordered_map<dnet_raw_id, elliptics::data_pointer, raw_id_hash, raw_id_equal> m_objects;
+		std::unordered_map<dnet_raw_id, index_t, raw_id_hash, raw_id_equal> m_indexes;
+
+		typedef std::chrono::steady_clock clock;
+		std::mutex m_delayed_lock;
+		std::condition_variable m_delayed_cond;
+		std::multimap<clock::time_point, std::function<void ()>> m_delayed;
+		bool m_need_exit;
+		std::thread m_thread;
+
+		// runs @fn after configured latency
+		void complete(const std::function<void ()> &fn);
+		void delayed_worker();
+};
+
+}} // namespace ioremap::wookie
+
+#endif /* __WOOKIE_BACKEND_HPP */
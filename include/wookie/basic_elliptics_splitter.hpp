@@ -19,6 +19,7 @@
 
 #include <elliptics/utils.hpp>
 #include <wookie/document.hpp>
+#include <wookie/fields.hpp>
 #include <wookie/split.hpp>
 
 #include <atomic>
@@ -47,6 +48,19 @@ class basic_elliptics_splitter {
 				const dnet_time &ts, const std::string &base_index,
 				std::vector<std::string> &ids, std::vector<elliptics::data_pointer> &objs);
 
+		// the same as above for already split content
+		void prepare_indexes(const std::string &key, const mpos_t &pos,
+				const dnet_time &ts, const std::string &base_index,
+				std::vector<std::string> &ids, std::vector<elliptics::data_pointer> &objs);
+
+		// token positions of @content
+		mpos_t positions(const std::string &content);
+
+		// token positions of all fields, see fields::positions()
+		mpos_t positions(const fields::document_fields &doc);
+		// see fields::replace_anchors()
+		void replace_anchors(mpos_t &pos, const std::vector<std::string> &anchors);
+
 	private:
 		wookie::split m_splitter;
 };
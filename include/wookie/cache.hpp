@@ -0,0 +1,239 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WOOKIE_CACHE_HPP
+#define __WOOKIE_CACHE_HPP
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <string.h>
+
+#include <elliptics/packet.h>
+
+namespace ioremap { namespace wookie {
+
+struct raw_id_hash {
+	size_t operator() (const dnet_raw_id &id) const {
+		size_t h;
+		memcpy(&h, id.id, sizeof(size_t));
+		return h;
+	}
+};
+
+struct raw_id_equal {
+	bool operator() (const dnet_raw_id &a, const dnet_raw_id &b) const {
+		return memcmp(a.id, b.id, sizeof(a.id)) == 0;
+	}
+};
+
+struct raw_id_less {
+	bool operator() (const dnet_raw_id &a, const dnet_raw_id &b) const {
+		return memcmp(a.id, b.id, sizeof(a.id)) < 0;
+	}
+};
+
+struct cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t size;		// bytes currently accounted
+	uint64_t entries;
+
+	double hit_ratio() const {
+		if (!hits && !misses)
+			return 0;
+
+		return (double)hits / (double)(hits + misses);
+	}
+};
+
+// Size-bounded LRU cache.
+// It is split into shards with own lock and LRU list, key is mapped to shard by its hash,
+// so concurrent readers of different keys do not contend. Every entry is accounted
+// with the size provided by the caller, each shard evicts least recently used entries
+// once its part of the byte budget is exceeded.
+//
+// Every shard counts erase() calls: value read from the source before a concurrent update
+// is inserted with the generation taken before the read and is dropped if the shard has
+// been invalidated meanwhile, so stale values do not get back into the cache.
+template <typename Key, typename Value, typename Hash = std::hash<Key>, typename Equal = std::equal_to<Key>>
+class lru_cache {
+	public:
+		lru_cache(size_t max_size, int shards_num = 16) :
+		m_shards(shards_num), m_hits(0), m_misses(0), m_evictions(0) {
+			for (auto & sh : m_shards)
+				sh.max_size = max_size / shards_num;
+		}
+
+		lru_cache(const lru_cache &) = delete;
+		lru_cache &operator =(const lru_cache &) = delete;
+
+		// returns true and fills @value if key has been found
+		bool get(const Key &key, Value &value) {
+			shard &sh = get_shard(key);
+
+			std::unique_lock<std::mutex> guard(sh.lock);
+			auto it = sh.map.find(key);
+			if (it == sh.map.end()) {
+				++m_misses;
+				return false;
+			}
+
+			sh.lru.splice(sh.lru.begin(), sh.lru, it->second);
+			value = it->second->value;
+			++m_hits;
+			return true;
+		}
+
+		// has to be taken before reading the value which will be inserted
+		uint64_t generation(const Key &key) {
+			shard &sh = get_shard(key);
+
+			std::unique_lock<std::mutex> guard(sh.lock);
+			return sh.generation;
+		}
+
+		void insert(const Key &key, const Value &value, size_t size) {
+			shard &sh = get_shard(key);
+
+			std::unique_lock<std::mutex> guard(sh.lock);
+			insert_locked(sh, key, value, size);
+		}
+
+		// returns false and does nothing if there were erase() calls in the shard since @generation
+		bool insert(const Key &key, const Value &value, size_t size, uint64_t generation) {
+			shard &sh = get_shard(key);
+
+			std::unique_lock<std::mutex> guard(sh.lock);
+			if (sh.generation != generation)
+				return false;
+
+			insert_locked(sh, key, value, size);
+			return true;
+		}
+
+		void erase(const Key &key) {
+			shard &sh = get_shard(key);
+
+			std::unique_lock<std::mutex> guard(sh.lock);
+			++sh.generation;
+
+			auto it = sh.map.find(key);
+			if (it != sh.map.end()) {
+				sh.size -= it->second->size;
+				sh.lru.erase(it->second);
+				sh.map.erase(it);
+			}
+		}
+
+		void clear() {
+			for (auto & sh : m_shards) {
+				std::unique_lock<std::mutex> guard(sh.lock);
+				sh.map.clear();
+				sh.lru.clear();
+				sh.size = 0;
+			}
+		}
+
+		cache_stats stats() {
+			cache_stats st;
+
+			st.hits = m_hits;
+			st.misses = m_misses;
+			st.evictions = m_evictions;
+			st.size = 0;
+			st.entries = 0;
+
+			for (auto & sh : m_shards) {
+				std::unique_lock<std::mutex> guard(sh.lock);
+				st.size += sh.size;
+				st.entries += sh.map.size();
+			}
+
+			return st;
+		}
+
+	private:
+		struct entry {
+			Key key;
+			Value value;
+			size_t size;
+
+			entry(const Key &k, const Value &v, size_t sz) : key(k), value(v), size(sz) {}
+		};
+
+		typedef std::list<entry> lru_list_t;
+
+		struct shard {
+			std::mutex lock;
+			lru_list_t lru;
+			std::unordered_map<Key, typename lru_list_t::iterator, Hash, Equal> map;
+			size_t size;
+			size_t max_size;
+			uint64_t generation;
+
+			shard() : size(0), max_size(0), generation(0) {}
+		};
+
+		std::vector<shard> m_shards;
+		Hash m_hash;
+
+		std::atomic<uint64_t> m_hits;
+		std::atomic<uint64_t> m_misses;
+		std::atomic<uint64_t> m_evictions;
+
+		void insert_locked(shard &sh, const Key &key, const Value &value, size_t size) {
+			// objects which do not fit shard at all are not cached
+			if (size > sh.max_size)
+				return;
+
+			auto it = sh.map.find(key);
+			if (it != sh.map.end()) {
+				sh.size -= it->second->size;
+				sh.lru.erase(it->second);
+				sh.map.erase(it);
+			}
+
+			sh.lru.emplace_front(key, value, size);
+			sh.map.insert(std::make_pair(key, sh.lru.begin()));
+			sh.size += size;
+
+			while (sh.size > sh.max_size) {
+				entry &last = sh.lru.back();
+
+				sh.size -= last.size;
+				sh.map.erase(last.key);
+				sh.lru.pop_back();
+				++m_evictions;
+			}
+		}
+
+		shard &get_shard(const Key &key) {
+			// lower bits are used by the unordered_map itself
+			size_t h = m_hash(key);
+			return m_shards[(h >> 16) % m_shards.size()];
+		}
+};
+
+}} // namespace ioremap::wookie
+
+#endif /* __WOOKIE_CACHE_HPP */
@@ -0,0 +1,133 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WOOKIE_CHUNK_HPP
+#define __WOOKIE_CHUNK_HPP
+
+#include "wookie/document.hpp"
+#include "wookie/future.hpp"
+
+#include <deque>
+
+namespace ioremap { namespace wookie {
+
+static const size_t default_chunk_size = 1024 * 1024;
+
+// Large documents are stored as a manifest plus a number of chunk objects.
+// Manifest is packed into the document object itself with compress::chunked codec,
+// every chunk is a separate document (with the same key and timestamp) in the
+// chunks namespace, it is compressed independently.
+//
+// Chunk names include document timestamp (version 1 manifests refer to chunks named
+// by key and number only), so rewrite never touches chunks of the version readers may
+// still be streaming, chunks of the replaced version are removed after the new manifest
+// has been written.
+struct chunk_manifest {
+	int				version;
+	uint64_t			size;		// uncompressed size of the whole body
+	uint32_t			chunk_size;	// uncompressed size of every chunk but the last one
+	uint32_t			chunks_num;
+
+	enum {
+		current_version = 2,
+	};
+
+	chunk_manifest() : version(current_version), size(0), chunk_size(0), chunks_num(0) {}
+};
+
+class storage;
+
+// Streams document body into storage chunk by chunk.
+// Memory usage is bounded by (@max_inflight + 1) chunks regardless of the document size,
+// write() blocks when there are @max_inflight chunk writes in flight.
+// Manifest and metadata are written by commit() only after all chunks have been
+// stored, so readers never see partially written body.
+class chunk_writer {
+	public:
+		chunk_writer(storage &st, const std::string &key, const dnet_time &ts, size_t max_inflight = 2);
+
+		void write(const char *data, size_t size);
+		void write(const std::string &data);
+
+		// metadata is written as is
+		future<int> commit(const document_meta &meta);
+
+		// metadata is generated, its hash is chained over chunks and thus differs from
+		// the hash of the same document written in one piece
+		future<int> commit();
+
+		uint64_t size() const;
+
+	private:
+		storage &m_st;
+		std::string m_key;
+		dnet_time m_ts;
+		size_t m_max_inflight;
+
+		std::string m_buffer;
+		chunk_manifest m_manifest;
+		uint64_t m_hash;
+
+		std::deque<future<int>> m_inflight;
+		elliptics::error_info m_error;
+
+		// object being replaced, read before the manifest is written
+		future<document> m_previous;
+
+		void flush();
+		void wait_inflight(size_t limit);
+};
+
+}} // namespace ioremap::wookie
+
+namespace msgpack
+{
+static inline ioremap::wookie::chunk_manifest &operator >>(msgpack::object o, ioremap::wookie::chunk_manifest &m)
+{
+	if (o.type != msgpack::type::ARRAY || o.via.array.size != 4)
+		ioremap::elliptics::throw_error(-EPROTO, "msgpack: chunk manifest array size mismatch: compiled: %d, unpacked: %d",
+				4, o.via.array.size);
+
+	object *p = o.via.array.ptr;
+
+	p[0].convert(&m.version);
+
+	if (m.version < 1 || m.version > ioremap::wookie::chunk_manifest::current_version)
+		ioremap::elliptics::throw_error(-EPROTO, "msgpack: chunk manifest version mismatch: compiled: %d, unpacked: %d",
+				ioremap::wookie::chunk_manifest::current_version, m.version);
+
+	p[1].convert(&m.size);
+	p[2].convert(&m.chunk_size);
+	p[3].convert(&m.chunks_num);
+
+	return m;
+}
+
+template <typename Stream>
+static inline msgpack::packer<Stream> &operator <<(msgpack::packer<Stream> &o, const ioremap::wookie::chunk_manifest &m)
+{
+	o.pack_array(4);
+	o.pack(m.version);
+	o.pack(m.size);
+	o.pack(m.chunk_size);
+	o.pack(m.chunks_num);
+
+	return o;
+}
+
+} /* namespace msgpack */
+
+#endif /* __WOOKIE_CHUNK_HPP */
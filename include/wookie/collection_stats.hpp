@@ -0,0 +1,102 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WOOKIE_COLLECTION_STATS_HPP
+#define __WOOKIE_COLLECTION_STATS_HPP
+
+#include "wookie/cache.hpp"
+#include "wookie/rank.hpp"
+#include "wookie/split.hpp"
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <stdint.h>
+
+namespace ioremap { namespace wookie {
+
+// Collection statistics maintained while documents are indexed: document frequency
+// of every term, length (number of tokens) of every document, number of documents
+// and tokens in the collection.
+//
+// Counters are split into shards with own lock, terms and documents are mapped to shards
+// by hash, so concurrent indexing threads rarely contend and a lookup takes a single
+// shard lock. Collection totals are kept per shard too and are summed on read.
+//
+// Terms are kept as 64-bit hashes, hashes of the terms of every document are kept too,
+// so reindexed document replaces its previous length and only the difference between
+// its previous and new terms changes document frequencies, wherever the previous
+// version has been indexed.
+class collection_stats {
+	public:
+		explicit collection_stats(int shards_num = 16);
+
+		// accounts document @id with term positions @pos, replaces its previous version
+		void add(const dnet_raw_id &id, const mpos_t &pos);
+
+		// 0 for unknown terms and documents
+		uint64_t df(const std::string &term) const;
+		uint32_t length(const dnet_raw_id &id) const;
+
+		uint64_t docs_num() const;
+		uint64_t tokens_num() const;
+
+		// statistics of the query @terms for scoring
+		rank::stats get(const std::vector<std::string> &terms) const;
+
+		// binary dump, it is written under temporary name and renamed
+		void save(const std::string &path) const;
+		// replaces current content, version 1 dumps have no terms of the documents,
+		// so their previous versions are not subtracted when they are reindexed
+		void load(const std::string &path);
+
+	private:
+		struct term_shard {
+			mutable std::mutex lock;
+			std::unordered_map<uint64_t, uint64_t> df;
+		};
+
+		struct doc_entry {
+			uint32_t length;
+			std::vector<uint64_t> terms;	// sorted term hashes
+
+			doc_entry() : length(0) {}
+		};
+
+		struct doc_shard {
+			mutable std::mutex lock;
+			std::unordered_map<dnet_raw_id, doc_entry, raw_id_hash, raw_id_equal> docs;
+			uint64_t tokens_num;
+
+			doc_shard() : tokens_num(0) {}
+		};
+
+		std::vector<term_shard> m_terms;
+		std::vector<doc_shard> m_docs;
+
+		static uint64_t term_hash(const std::string &term);
+
+		term_shard &shard(uint64_t term);
+		const term_shard &shard(uint64_t term) const;
+		doc_shard &shard(const dnet_raw_id &id);
+		const doc_shard &shard(const dnet_raw_id &id) const;
+};
+
+}} // namespace ioremap::wookie
+
+#endif /* __WOOKIE_COLLECTION_STATS_HPP */
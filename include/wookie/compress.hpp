@@ -0,0 +1,214 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WOOKIE_COMPRESS_HPP
+#define __WOOKIE_COMPRESS_HPP
+
+#include <atomic>
+#include <string>
+
+#include <stdint.h>
+
+#include <lz4.h>
+#include <zstd.h>
+
+#include <elliptics/cppdef.h>
+
+namespace ioremap { namespace wookie { namespace compress {
+
+// codec IDs are stored in serialized documents, never reorder them
+enum codec {
+	none = 0,
+	lz4,		// fast, used for hot data
+	zstd,		// better ratio, used for cold data
+	zstd_dict,	// zstd with per-host trained dictionary, see wookie/dictionary.hpp
+	chunked,	// body is split into separately stored chunks, data is a manifest, see wookie/chunk.hpp
+};
+
+// bodies smaller than this are stored as is, codec overhead doesn't pay off
+static const size_t min_size = 128;
+
+static const int zstd_level = 9;
+
+static inline int codec_from_name(const std::string &name)
+{
+	if (name == "none")
+		return none;
+	if (name == "lz4")
+		return lz4;
+	if (name == "zstd")
+		return zstd;
+
+	ioremap::elliptics::throw_error(-EINVAL, "compress: unknown codec '%s'", name.c_str());
+	return none;
+}
+
+// compressed payload starts with 4-byte little-endian size of the original data
+// which is needed by lz4 block decoder, zstd uses it to preallocate output
+static inline void put_size(std::string &out, size_t size)
+{
+	for (int i = 0; i < 4; ++i)
+		out[i] = (char)((size >> (i * 8)) & 0xff);
+}
+
+static inline size_t get_size(const std::string &in)
+{
+	size_t size = 0;
+	for (int i = 0; i < 4; ++i)
+		size |= (size_t)(unsigned char)in[i] << (i * 8);
+
+	return size;
+}
+
+// lz4 block format can not expand data more than this number of times
+static const size_t lz4_max_ratio = 255;
+
+// size of the original data from @data header checked against what the payload can hold,
+// so that a corrupted object can not make reader allocate gigabytes: zstd frames carry
+// content size which has to match, lz4 payload is limited by the maximum ratio
+static inline size_t unpacked_size(int c, const std::string &data)
+{
+	if (data.size() < 4)
+		ioremap::elliptics::throw_error(-EPROTO, "compress: packed data is too small: %zd", data.size());
+
+	size_t size = get_size(data);
+
+	if (c == zstd || c == zstd_dict) {
+		unsigned long long frame_size = ZSTD_getFrameContentSize(data.data() + 4, data.size() - 4);
+		if (frame_size == ZSTD_CONTENTSIZE_ERROR || frame_size == ZSTD_CONTENTSIZE_UNKNOWN || frame_size != size)
+			ioremap::elliptics::throw_error(-EPROTO, "compress: zstd frame content size doesn't match "
+					"stored size %zd", size);
+	} else if (size > (data.size() - 4) * lz4_max_ratio) {
+		ioremap::elliptics::throw_error(-EPROTO, "compress: stored size %zd is too large for %zd packed bytes",
+				size, data.size());
+	}
+
+	return size;
+}
+
+// compresses @data with codec @c into @out
+// returns codec which was actually used: if data is too small or doesn't shrink,
+// @out is left empty and compress::none is returned, caller should store @data as is
+static inline int pack(int c, const std::string &data, std::string &out)
+{
+	out.clear();
+
+	if (c == none || data.size() < min_size || data.size() > UINT32_MAX)
+		return none;
+
+	size_t packed_size = 0;
+
+	if (c == lz4) {
+		out.resize(4 + LZ4_compressBound(data.size()));
+		int err = LZ4_compress_default(data.data(), &out[4], data.size(), out.size() - 4);
+		if (err <= 0)
+			ioremap::elliptics::throw_error(-EINVAL, "compress: lz4 failed to compress %zd bytes", data.size());
+
+		packed_size = err;
+	} else if (c == zstd) {
+		out.resize(4 + ZSTD_compressBound(data.size()));
+		size_t err = ZSTD_compress(&out[4], out.size() - 4, data.data(), data.size(), zstd_level);
+		if (ZSTD_isError(err))
+			ioremap::elliptics::throw_error(-EINVAL, "compress: zstd failed to compress %zd bytes: %s",
+					data.size(), ZSTD_getErrorName(err));
+
+		packed_size = err;
+	} else {
+		ioremap::elliptics::throw_error(-EINVAL, "compress: unsupported codec %d", c);
+	}
+
+	if (4 + packed_size >= data.size()) {
+		out.clear();
+		return none;
+	}
+
+	put_size(out, data.size());
+	out.resize(4 + packed_size);
+	return c;
+}
+
+static inline std::string unpack(int c, const std::string &data)
+{
+	if (c == none)
+		return data;
+
+	std::string out;
+	if (c == lz4 || c == zstd)
+		out.resize(unpacked_size(c, data));
+
+	if (c == lz4) {
+		int err = LZ4_decompress_safe(data.data() + 4, &out[0], data.size() - 4, out.size());
+		if (err < 0 || (size_t)err != out.size())
+			ioremap::elliptics::throw_error(-EPROTO, "compress: lz4 failed to decompress %zd bytes: %d",
+					data.size(), err);
+	} else if (c == zstd) {
+		size_t err = ZSTD_decompress(&out[0], out.size(), data.data() + 4, data.size() - 4);
+		if (ZSTD_isError(err) || err != out.size())
+			ioremap::elliptics::throw_error(-EPROTO, "compress: zstd failed to decompress %zd bytes: %s",
+					data.size(), ZSTD_isError(err) ? ZSTD_getErrorName(err) : "size mismatch");
+	} else if (c == zstd_dict) {
+		ioremap::elliptics::throw_error(-ENOENT, "compress: data is packed with zstd dictionary, "
+				"it has to be unpacked by storage which can fetch dictionaries");
+	} else if (c == chunked) {
+		ioremap::elliptics::throw_error(-EPROTO, "compress: data is a chunk manifest, "
+				"document body has to be read by storage");
+	} else {
+		ioremap::elliptics::throw_error(-EPROTO, "compress: unsupported codec %d", c);
+	}
+
+	return out;
+}
+
+// process-wide counters of document bodies passed through storage::pack_document()
+class stats {
+	public:
+		stats() : m_raw(0), m_packed(0) {}
+
+		void account(size_t raw, size_t packed) {
+			m_raw += raw;
+			m_packed += packed;
+		}
+
+		uint64_t raw_bytes() const {
+			return m_raw;
+		}
+
+		uint64_t packed_bytes() const {
+			return m_packed;
+		}
+
+		double ratio() const {
+			uint64_t packed = m_packed;
+			if (!packed)
+				return 1.0;
+
+			return (double)m_raw / (double)packed;
+		}
+
+	private:
+		std::atomic<uint64_t> m_raw;
+		std::atomic<uint64_t> m_packed;
+};
+
+inline stats &global_stats()
+{
+	static stats s;
+	return s;
+}
+
+}}} // namespace ioremap::wookie::compress
+
+#endif /* __WOOKIE_COMPRESS_HPP */
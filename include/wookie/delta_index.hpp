@@ -0,0 +1,195 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WOOKIE_DELTA_INDEX_HPP
+#define __WOOKIE_DELTA_INDEX_HPP
+
+#include "wookie/backend.hpp"
+#include "wookie/cache.hpp"
+#include "wookie/collection_stats.hpp"
+#include "wookie/query.hpp"
+#include "wookie/split.hpp"
+
+#include <elliptics/cppdef.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace ioremap { namespace wookie {
+
+class local_index;
+class storage;
+
+// freshly indexed document which is not yet in persistent index
+struct delta_document {
+	dnet_raw_id	id;
+	std::string	key;
+	dnet_time	ts;
+	mpos_t		pos;
+
+	// base (collection) index which lists all documents, empty if not used
+	std::string	collection;
+};
+
+// In-memory index of recently added documents.
+//
+// Documents become searchable as soon as add() returns. They are collected into batches
+// which are handed to the flush handler by background thread once batch has @batch_docs
+// documents or when its oldest document is @interval old. Batch stays searchable until
+// the handler returns, so that documents are always visible either here or in persistent
+// index.
+//
+// If handler throws, batch is flushed again with exponential back-off starting at @interval,
+// newer batches wait behind it. After @max_attempts failures it is moved aside, so that newer
+// batches are flushed, and is retried with the longest back-off. Documents of the batch put
+// aside which are flushed later by newer batches are dropped from it.
+// Sealed batches may hold at most @max_docs documents, add() waits for flushes beyond that.
+class delta_index {
+	public:
+		typedef std::function<void (const std::vector<delta_document> &docs)> flush_handler_t;
+
+		delta_index(const flush_handler_t &handler, size_t batch_docs = 1000,
+				std::chrono::milliseconds interval = std::chrono::milliseconds(1000),
+				size_t max_docs = 100000, int max_attempts = 5);
+
+		// flushes everything which is still in memory, documents which can not be flushed
+		// are saved into spill file if it is set, otherwise flush is retried until it succeeds
+		~delta_index();
+
+		delta_index(const delta_index &) = delete;
+		delta_index &operator =(const delta_index &) = delete;
+
+		// newer version of the document replaces older one, if there is no room for it,
+		// waits until flushes free some (not longer than the longest back-off) when @wait is set
+		// and throws -EAGAIN otherwise, completion handlers must not wait
+		void add(const delta_document &doc, bool wait = true);
+
+		// documents which were not flushed at exit are saved into @path,
+		// if it exists, saved documents are loaded and flushed before the newer ones
+		void set_spill_file(const std::string &path);
+
+		// every added document is accounted in @stats, which replaces previous version
+		// of reindexed document, empty pointer disables accounting
+		void set_stats(const std::shared_ptr<collection_stats> &stats);
+
+		// documents which contain all @terms, result entries are the same as local_index::find() returns,
+		// @documents receives sorted IDs of all documents held in memory at the time of the search,
+		// they replace whatever persistent index returns for them
+		find_result_t find(const std::vector<std::string> &terms, const std::vector<dnet_raw_id> &ids,
+				std::vector<dnet_raw_id> &documents, bool positions = true);
+
+		// documents matching boolean query @q, the same as local_index::find() for queries,
+		// @documents is filled as above
+		find_result_t find(const query::node &q, const std::vector<std::string> &terms,
+				const std::vector<dnet_raw_id> &ids, std::vector<dnet_raw_id> &documents,
+				bool positions = true);
+
+		// synchronously flushes all batches, throws if handler fails
+		void flush();
+
+		size_t docs_num();
+
+		// batches are written into new local index segments
+		static flush_handler_t local_index_handler(const std::shared_ptr<local_index> &index);
+
+		// batches are written into elliptics secondary indexes via storage::set_indexes(),
+		// the same way basic_elliptics_splitter prepares them
+		static flush_handler_t storage_handler(storage &st);
+
+	private:
+		struct batch {
+			std::vector<delta_document> docs;
+			// term to numbers of documents in @docs, numbers are increasing
+			std::unordered_map<std::string, std::vector<uint32_t>> terms;
+			// ID to the number of the current version of the document
+			std::unordered_map<dnet_raw_id, uint32_t, raw_id_hash, raw_id_equal> current;
+			std::chrono::steady_clock::time_point created;
+
+			// failed flushes and the time of the next one
+			int attempts;
+			std::chrono::steady_clock::time_point retry;
+			// batch has been loaded from the spill file, which is removed once it is flushed
+			bool spilled;
+
+			batch() : attempts(0), spilled(false) {}
+
+			void add(const delta_document &doc);
+			bool is_current(uint32_t doc) const;
+			bool contains(const dnet_raw_id &id) const;
+			// current versions of the documents
+			std::vector<delta_document> current_docs() const;
+		};
+
+		flush_handler_t m_handler;
+		std::shared_ptr<collection_stats> m_stats;
+		size_t m_batch_docs;
+		std::chrono::milliseconds m_interval;
+		size_t m_max_docs;
+		int m_max_attempts;
+		std::string m_spill_file;
+
+		std::mutex m_lock;
+		std::condition_variable m_cond;
+		// signalled when sealed batches are flushed
+		std::condition_variable m_flushed_cond;
+
+		std::shared_ptr<batch> m_active;
+		// batches which are being flushed, ordered from the oldest to the newest
+		std::list<std::shared_ptr<batch>> m_flushing;
+		// batches which have failed @m_max_attempts flushes, older than any in @m_flushing
+		std::list<std::shared_ptr<batch>> m_failed;
+		// documents in @m_flushing and @m_failed
+		size_t m_sealed_docs;
+
+		// serializes flushes, so that batches reach persistent index in order
+		std::mutex m_flush_lock;
+
+		bool m_need_exit;
+		std::thread m_flush_thread;
+
+		// fills sorted numbers of matched documents of the batch
+		typedef std::function<void (const batch &b, std::vector<uint32_t> &docs)> match_t;
+
+		// runs @match over all batches from the newest to the oldest and builds result entries
+		// for current versions of the documents, empty @match only collects @documents
+		find_result_t search(const match_t &match, const std::vector<std::string> &terms,
+				const std::vector<dnet_raw_id> &ids, std::vector<dnet_raw_id> &documents, bool positions);
+
+		// moves active batch to the flushing list if it is due, returns true if there is something to flush
+		bool seal(bool force);
+		// flushes sealed batches which are due (all of them if @force), failures are rescheduled
+		// with back-off, with @force the first failure is thrown
+		void flush_sealed(bool force);
+		// forgets @flushed batch and drops its documents from the older batches put aside
+		void drop_flushed(const std::shared_ptr<batch> &flushed);
+		// accounts batch which leaves memory
+		void release(const batch &b);
+		std::chrono::milliseconds backoff(int attempts) const;
+		void flush_worker();
+
+		void save_spill();
+		void load_spill();
+};
+
+}} // namespace ioremap::wookie
+
+#endif /* __WOOKIE_DELTA_INDEX_HPP */
@@ -0,0 +1,283 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WOOKIE_DICTIONARY_HPP
+#define __WOOKIE_DICTIONARY_HPP
+
+#include "wookie/compress.hpp"
+
+#include <zdict.h>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <time.h>
+
+namespace ioremap { namespace wookie { namespace compress {
+
+// zstd dictionary trained over documents of a single host
+// Dictionary ID (stored in every zstd frame header) is its version: every training
+// run produces new ID, so old documents are still readable after host dictionary is replaced
+class dictionary {
+	public:
+		dictionary(const std::string &content) : m_content(content), m_cdict(NULL), m_ddict(NULL) {
+			m_id = ZDICT_getDictID(m_content.data(), m_content.size());
+			if (!m_id)
+				ioremap::elliptics::throw_error(-EINVAL, "dictionary: %zd bytes is not a valid zstd dictionary",
+						m_content.size());
+
+			m_cdict = ZSTD_createCDict(m_content.data(), m_content.size(), zstd_level);
+			m_ddict = ZSTD_createDDict(m_content.data(), m_content.size());
+			if (!m_cdict || !m_ddict) {
+				ZSTD_freeCDict(m_cdict);
+				ZSTD_freeDDict(m_ddict);
+				ioremap::elliptics::throw_error(-ENOMEM, "dictionary: could not create zstd dictionary %u", m_id);
+			}
+		}
+
+		dictionary(const dictionary &) = delete;
+		dictionary &operator =(const dictionary &) = delete;
+
+		~dictionary() {
+			ZSTD_freeCDict(m_cdict);
+			ZSTD_freeDDict(m_ddict);
+		}
+
+		unsigned int id() const {
+			return m_id;
+		}
+
+		const std::string &content() const {
+			return m_content;
+		}
+
+		// the same semantics as compress::pack(): returns compress::none if data doesn't shrink
+		int pack(const std::string &data, std::string &out) const {
+			out.clear();
+
+			if (data.size() < min_size || data.size() > UINT32_MAX)
+				return none;
+
+			ZSTD_CCtx *ctx = ZSTD_createCCtx();
+			if (!ctx)
+				ioremap::elliptics::throw_error(-ENOMEM, "dictionary: could not create zstd context");
+
+			out.resize(4 + ZSTD_compressBound(data.size()));
+			size_t err = ZSTD_compress_usingCDict(ctx, &out[4], out.size() - 4, data.data(), data.size(), m_cdict);
+			ZSTD_freeCCtx(ctx);
+
+			if (ZSTD_isError(err))
+				ioremap::elliptics::throw_error(-EINVAL, "dictionary: zstd failed to compress %zd bytes "
+						"with dictionary %u: %s",
+						data.size(), m_id, ZSTD_getErrorName(err));
+
+			if (4 + err >= data.size()) {
+				out.clear();
+				return none;
+			}
+
+			put_size(out, data.size());
+			out.resize(4 + err);
+			return zstd_dict;
+		}
+
+		std::string unpack(const std::string &data) const {
+			std::string out;
+			out.resize(unpacked_size(zstd_dict, data));
+
+			ZSTD_DCtx *ctx = ZSTD_createDCtx();
+			if (!ctx)
+				ioremap::elliptics::throw_error(-ENOMEM, "dictionary: could not create zstd context");
+
+			size_t err = ZSTD_decompress_usingDDict(ctx, &out[0], out.size(), data.data() + 4, data.size() - 4, m_ddict);
+			ZSTD_freeDCtx(ctx);
+
+			if (ZSTD_isError(err) || err != out.size())
+				ioremap::elliptics::throw_error(-EPROTO, "dictionary: zstd failed to decompress %zd bytes "
+						"with dictionary %u: %s",
+						data.size(), m_id, ZSTD_isError(err) ? ZSTD_getErrorName(err) : "size mismatch");
+
+			return out;
+		}
+
+		// returns ID of the dictionary given zstd_dict payload was compressed with
+		static unsigned int packed_id(const std::string &data) {
+			if (data.size() < 4)
+				return 0;
+
+			return ZSTD_getDictID_fromFrame(data.data() + 4, data.size() - 4);
+		}
+
+		// trains new dictionary over @samples, returns its content
+		static std::string train(const std::vector<std::string> &samples, size_t max_size) {
+			std::string buffer;
+			std::vector<size_t> sizes;
+
+			sizes.reserve(samples.size());
+			for (auto & s : samples) {
+				buffer.append(s);
+				sizes.push_back(s.size());
+			}
+
+			std::string content;
+			content.resize(max_size);
+
+			size_t err = ZDICT_trainFromBuffer(&content[0], content.size(), buffer.data(), sizes.data(), sizes.size());
+			if (ZDICT_isError(err))
+				ioremap::elliptics::throw_error(-EINVAL, "dictionary: training over %zd samples failed: %s",
+						samples.size(), ZDICT_getErrorName(err));
+
+			content.resize(err);
+			return content;
+		}
+
+	private:
+		std::string m_content;
+		unsigned int m_id;
+		ZSTD_CDict *m_cdict;
+		ZSTD_DDict *m_ddict;
+};
+
+typedef std::shared_ptr<dictionary> shared_dictionary_t;
+
+// storage keys of dictionaries
+// dictionary content lives under versioned key, host key contains ID of the current dictionary
+static inline std::string dictionary_key(unsigned int id)
+{
+	std::ostringstream ss;
+	ss << "wookie.zstd.dictionary." << id;
+	return ss.str();
+}
+
+static inline std::string host_dictionary_key(const std::string &host)
+{
+	return "wookie.zstd.host." + host;
+}
+
+// Thread-safe cache of dictionaries by ID and current dictionary ID by host.
+// Missing entries are loaded using functors provided by the storage,
+// host lookups (including negative ones) are refreshed every @host_timeout seconds,
+// so newly trained dictionaries are picked up without restart.
+// Dictionaries which could not be loaded are not looked up again for @miss_timeout seconds,
+// so that every document packed with a lost dictionary does not cost a storage read.
+class dictionary_cache {
+	public:
+		typedef std::function<shared_dictionary_t (unsigned int id)> id_loader_t;
+		typedef std::function<unsigned int (const std::string &host)> host_loader_t;
+
+		dictionary_cache(const id_loader_t &id_loader, const host_loader_t &host_loader, long host_timeout = 600,
+				long miss_timeout = 10) :
+		m_id_loader(id_loader), m_host_loader(host_loader), m_host_timeout(host_timeout),
+		m_miss_timeout(miss_timeout) {
+		}
+
+		void insert(const shared_dictionary_t &dict) {
+			std::unique_lock<std::mutex> guard(m_lock);
+			m_dicts[dict->id()] = dict;
+			m_missing.erase(dict->id());
+		}
+
+		// remembers that dictionary @id could not be loaded
+		void set_missing(unsigned int id) {
+			std::unique_lock<std::mutex> guard(m_lock);
+			m_missing[id] = time(NULL);
+		}
+
+		// whether dictionary @id has failed to load within @miss_timeout seconds
+		bool missing(unsigned int id) {
+			std::unique_lock<std::mutex> guard(m_lock);
+			auto it = m_missing.find(id);
+			if (it == m_missing.end())
+				return false;
+
+			if (it->second + m_miss_timeout > time(NULL))
+				return true;
+
+			m_missing.erase(it);
+			return false;
+		}
+
+		// returns NULL if dictionary is not cached, never loads it
+		shared_dictionary_t find(unsigned int id) {
+			std::unique_lock<std::mutex> guard(m_lock);
+			auto it = m_dicts.find(id);
+			return it == m_dicts.end() ? shared_dictionary_t() : it->second;
+		}
+
+		// returns NULL if there is no such dictionary
+		shared_dictionary_t get(unsigned int id) {
+			shared_dictionary_t dict = find(id);
+			if (dict || missing(id))
+				return dict;
+
+			dict = m_id_loader(id);
+			if (dict)
+				insert(dict);
+			else
+				set_missing(id);
+
+			return dict;
+		}
+
+		// returns current dictionary of the host or NULL if it doesn't have one
+		shared_dictionary_t host(const std::string &host) {
+			time_t now = time(NULL);
+			unsigned int id = 0;
+			bool found = false;
+
+			{
+				std::unique_lock<std::mutex> guard(m_lock);
+				auto it = m_hosts.find(host);
+				if (it != m_hosts.end() && it->second.second + m_host_timeout > now) {
+					id = it->second.first;
+					found = true;
+				}
+			}
+
+			if (!found) {
+				id = m_host_loader(host);
+
+				std::unique_lock<std::mutex> guard(m_lock);
+				m_hosts[host] = std::make_pair(id, now);
+			}
+
+			if (!id)
+				return shared_dictionary_t();
+
+			return get(id);
+		}
+
+	private:
+		id_loader_t m_id_loader;
+		host_loader_t m_host_loader;
+		long m_host_timeout;
+		long m_miss_timeout;
+
+		std::mutex m_lock;
+		std::map<unsigned int, shared_dictionary_t> m_dicts;
+		// time of the failed load
+		std::map<unsigned int, time_t> m_missing;
+		std::map<std::string, std::pair<unsigned int, time_t>> m_hosts;
+};
+
+}}} // namespace ioremap::wookie::compress
+
+#endif /* __WOOKIE_DICTIONARY_HPP */
@@ -109,6 +109,17 @@ class dmanager {
 			m_downloaders[rand() % m_downloaders.size()].enqueue(std::move(request), handler);
 		}
 
+		void feed(const swarm::url &url, const document_meta &meta, const ioremap::swarm::simple_stream::handler_func &handler) {
+			ioremap::swarm::url_fetcher::request request;
+			request.set_follow_location(true);
+			request.set_url(url);
+			request.headers().set_if_modified_since(meta.ts.tsec);
+			if (meta.etag.size())
+				request.headers().set("If-None-Match", meta.etag);
+
+			m_downloaders[rand() % m_downloaders.size()].enqueue(std::move(request), handler);
+		}
+
 	private:
 		ev::default_loop m_loop;
 		ev::sig m_signal;
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WOOKIE_DOC_REGISTRY_HPP
+#define __WOOKIE_DOC_REGISTRY_HPP
+
+#include <elliptics/packet.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace ioremap { namespace wookie {
+
+// Assigns dense 32-bit numbers to documents, so that postings, bitmaps and per-document
+// arrays (lengths, scores) can work with small integers instead of 64-byte dnet_raw_id.
+//
+// Numbers are assigned in order starting from 0 and are never reused. Raw IDs are stored
+// once in an array indexed by number, lookup goes through open addressing table of numbers,
+// keys are kept in a single buffer, so the whole mapping costs about 80 bytes per document
+// plus the key itself.
+//
+// It is safe to use from multiple threads.
+class doc_registry {
+	public:
+		static const uint32_t invalid = ~0U;
+
+		doc_registry();
+
+		// returns number of the document, new number is assigned to unknown IDs,
+		// non-empty @key replaces previously stored one
+		uint32_t assign(const dnet_raw_id &id, const std::string &key = std::string());
+
+		// returns @invalid for unknown IDs
+		uint32_t lookup(const dnet_raw_id &id) const;
+
+		// these throw -ENOENT for unknown numbers
+		dnet_raw_id id(uint32_t doc) const;
+		std::string key(uint32_t doc) const;
+
+		size_t size() const;
+
+		// binary dump of the whole registry, it is written under temporary name and renamed
+		void save(const std::string &path) const;
+		// replaces current content
+		void load(const std::string &path);
+
+	private:
+		mutable std::mutex m_lock;
+
+		std::vector<dnet_raw_id> m_ids;
+
+		struct key_ref {
+			uint64_t	offset;
+			uint32_t	size;
+		} __attribute__ ((packed));
+
+		// location of the key of every document in @m_keys, replaced keys are appended,
+		// stale bytes are dropped by save()/load()
+		std::vector<key_ref> m_key_refs;
+		std::string m_keys;
+
+		// document numbers, table size is a power of 2
+		std::vector<uint32_t> m_table;
+
+		size_t slot(const dnet_raw_id &id) const;
+		uint32_t find(const dnet_raw_id &id) const;
+		void rehash(size_t size);
+};
+
+}} // namespace ioremap::wookie
+
+#endif /* __WOOKIE_DOC_REGISTRY_HPP */
@@ -26,6 +26,8 @@
 #include <elliptics/cppdef.h>
 #include <elliptics/debug.hpp>
 
+#include "wookie/hash.hpp"
+
 namespace ioremap { namespace wookie {
 
 struct document {
@@ -34,13 +36,44 @@ struct document {
 	std::string			key;
 	std::string			data;
 
+	// codec @data is compressed with in serialized form, see wookie/compress.hpp
+	// storage::unpack() always returns decompressed data with compress::none codec
+	// (except manifests of chunked documents), see storage::unpack_document() for dictionaries
+	int				codec;
+
+	enum {
+		version = 2,
+	};
+
+	document() : codec(0) {
+		dnet_current_time(&ts);
+	}
+};
+
+// small record stored next to every document, it allows to make crawl and
+// revalidation decisions without reading (and decompressing) the whole body
+// @size - length of the uncompressed body
+// @hash - murmur hash of the uncompressed body
+// @content_type, @etag - HTTP validators of the downloaded page, may be empty
+struct document_meta {
+	dnet_time			ts;
+	uint64_t			size;
+	uint64_t			hash;
+
+	std::string			content_type;
+	std::string			etag;
+
 	enum {
 		version = 1,
 	};
 
-	document() {
+	document_meta() : size(0), hash(0) {
 		dnet_current_time(&ts);
 	}
+
+	explicit document_meta(const document &doc) :
+	ts(doc.ts), size(doc.data.size()), hash(hash::murmur(doc.data, 0)) {
+	}
 };
 
 }}
@@ -73,22 +106,36 @@ inline msgpack::packer<Stream> &operator <<(msgpack::packer<Stream> &o, const dn
 
 static inline ioremap::wookie::document &operator >>(msgpack::object o, ioremap::wookie::document &d)
 {
-	if (o.type != msgpack::type::ARRAY || o.via.array.size != 4)
-		ioremap::elliptics::throw_error(-EPROTO, "msgpack: document array size mismatch: compiled: %d, unpacked: %d",
-				4, o.via.array.size);
+	if (o.type != msgpack::type::ARRAY || o.via.array.size < 1)
+		ioremap::elliptics::throw_error(-EPROTO, "msgpack: document is not an array");
 
 	object *p = o.via.array.ptr;
 
 	int version;
 	p[0].convert(&version);
 
-	if (version != ioremap::wookie::document::version)
+	// version 1 has no codec field, its data is always stored as is
+	size_t size = (version == 1) ? 4 : 5;
+
+	if (version != 1 && version != ioremap::wookie::document::version)
 		ioremap::elliptics::throw_error(-EPROTO, "msgpack: document version mismatch: compiled: %d, unpacked: %d",
 				ioremap::wookie::document::version, version);
 
+	if (o.via.array.size != size)
+		ioremap::elliptics::throw_error(-EPROTO, "msgpack: document array size mismatch: version: %d, "
+				"compiled: %zd, unpacked: %d",
+				version, size, o.via.array.size);
+
 	p[1].convert(&d.ts);
 	p[2].convert(&d.key);
-	p[3].convert(&d.data);
+
+	if (version == 1) {
+		d.codec = 0;
+		p[3].convert(&d.data);
+	} else {
+		p[3].convert(&d.codec);
+		p[4].convert(&d.data);
+	}
 
 	return d;
 }
@@ -96,15 +143,54 @@ static inline ioremap::wookie::document &operator >>(msgpack::object o, ioremap:
 template <typename Stream>
 static inline msgpack::packer<Stream> &operator <<(msgpack::packer<Stream> &o, const ioremap::wookie::document &d)
 {
-	o.pack_array(4);
+	o.pack_array(5);
 	o.pack(static_cast<int>(ioremap::wookie::document::version));
 	o.pack(d.ts);
 	o.pack(d.key);
+	o.pack(d.codec);
 	o.pack(d.data);
 
 	return o;
 }
 
+static inline ioremap::wookie::document_meta &operator >>(msgpack::object o, ioremap::wookie::document_meta &m)
+{
+	if (o.type != msgpack::type::ARRAY || o.via.array.size != 6)
+		ioremap::elliptics::throw_error(-EPROTO, "msgpack: document meta array size mismatch: compiled: %d, unpacked: %d",
+				6, o.via.array.size);
+
+	object *p = o.via.array.ptr;
+
+	int version;
+	p[0].convert(&version);
+
+	if (version != ioremap::wookie::document_meta::version)
+		ioremap::elliptics::throw_error(-EPROTO, "msgpack: document meta version mismatch: compiled: %d, unpacked: %d",
+				ioremap::wookie::document_meta::version, version);
+
+	p[1].convert(&m.ts);
+	p[2].convert(&m.size);
+	p[3].convert(&m.hash);
+	p[4].convert(&m.content_type);
+	p[5].convert(&m.etag);
+
+	return m;
+}
+
+template <typename Stream>
+static inline msgpack::packer<Stream> &operator <<(msgpack::packer<Stream> &o, const ioremap::wookie::document_meta &m)
+{
+	o.pack_array(6);
+	o.pack(static_cast<int>(ioremap::wookie::document_meta::version));
+	o.pack(m.ts);
+	o.pack(m.size);
+	o.pack(m.hash);
+	o.pack(m.content_type);
+	o.pack(m.etag);
+
+	return o;
+}
+
 } /* namespace msgpack */
 
 static inline std::ostream &operator <<(std::ostream &out, const ioremap::wookie::document &d)
@@ -114,4 +200,15 @@ static inline std::ostream &operator <<(std::ostream &out, const ioremap::wookie
 	return out;
 }
 
+static inline std::ostream &operator <<(std::ostream &out, const ioremap::wookie::document_meta &m)
+{
+	out << m.ts;
+	out << ": doc-size: " << m.size << ", hash: " << std::hex << m.hash << std::dec;
+	if (m.content_type.size())
+		out << ", content-type: '" << m.content_type << "'";
+	if (m.etag.size())
+		out << ", etag: '" << m.etag << "'";
+	return out;
+}
+
 #endif /* __WOOKIE_DOCUMENT_HPP */
@@ -38,11 +38,14 @@ typedef std::function<std::vector<std::string> (const swarm::url_fetcher::respon
 typedef std::function<bool (const swarm::url_fetcher::response &reply, const std::string &)> filter_functor;
 typedef std::function<bool (const swarm::url_fetcher::response &reply, const swarm::url &url)> url_filter_functor;
 typedef std::function<void (const swarm::url_fetcher::response &reply, const std::string &, document_type type)> process_functor;
+// receives absolute URL of the link target and the link text
+typedef std::function<void (const swarm::url_fetcher::response &reply, const std::string &url, const std::string &text)> link_functor;
 
 filter_functor create_text_filter();
 url_filter_functor create_domain_filter(const std::string &url);
 url_filter_functor create_port_filter(const std::vector<int> &ports);
-parser_functor create_href_parser();
+// @links is called for every http(s) link of the page, including the ones which are not crawled
+parser_functor create_href_parser(const link_functor &links = link_functor());
 
 class engine
 {
@@ -70,6 +73,7 @@ public:
 
 	void download(const swarm::url &url);
 	void found_in_page_cache(const std::string &url, const document &doc);
+	void found_in_page_cache(const std::string &url, const document_meta &meta);
 
 	int run();
 
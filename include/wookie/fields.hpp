@@ -0,0 +1,88 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WOOKIE_FIELDS_HPP
+#define __WOOKIE_FIELDS_HPP
+
+#include "wookie/split.hpp"
+
+#include <string>
+#include <vector>
+
+namespace ioremap { namespace wookie { namespace fields {
+
+// Parts of the document indexed separately.
+//
+// Every field has its own postings: its tokens are indexed with the field name
+// as a prefix ("title#cat", word tokenizer never keeps '#' inside tokens), body tokens
+// are indexed as is, so documents indexed without fields and queries which do not
+// mention fields work the same way.
+enum field_id {
+	body = 0,
+	title,
+	heading,
+	url,
+	anchor,		// text of the links pointing to the document
+	fields_num,
+};
+
+// "body", "title" and so on
+const char *name(field_id field);
+
+// returns false if @name is not a field name
+bool lookup(const std::string &name, field_id &field);
+
+// index token of @token in @field
+std::string token(field_id field, const std::string &token);
+
+// field of the index token, @plain receives the token without field prefix
+field_id parse(const std::string &token, std::string *plain = NULL);
+
+// query time weights of the fields
+struct boosts {
+	double weight[fields_num];
+
+	boosts();
+};
+
+// texts of the document fields, every field may consist of several parts
+struct document_fields {
+	std::vector<std::string> text[fields_num];
+};
+
+// @url with punctuation replaced by spaces, so that its host and path components
+// become separate tokens instead of a single "www.example.com" one
+std::string url_text(const std::string &url);
+
+// Token positions of all fields merged into one map.
+//
+// Body goes first, so its positions are the same as if it was split alone, every next
+// part starts after a gap, so that phrases and proximity windows never cross
+// field or part boundaries.
+mpos_t positions(split &spl, const document_fields &doc);
+
+// Replaces anchor field in @pos built by positions() with @anchors texts,
+// it is the last field, so positions of the other fields stay the same.
+void replace_anchors(split &spl, mpos_t &pos, const std::vector<std::string> &anchors);
+
+// Expands query @tokens into index tokens of every field with non-zero weight
+// in @b, @weights receive the weights of @terms.
+void expand(const std::vector<std::string> &tokens, const boosts &b,
+		std::vector<std::string> &terms, std::vector<double> &weights);
+
+}}} // namespace ioremap::wookie::fields
+
+#endif /* __WOOKIE_FIELDS_HPP */
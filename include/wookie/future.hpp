@@ -0,0 +1,213 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WOOKIE_FUTURE_HPP
+#define __WOOKIE_FUTURE_HPP
+
+#include <elliptics/error.hpp>
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace ioremap { namespace wookie {
+
+// converts exception into elliptics error, elliptics errors keep their codes
+inline elliptics::error_info exception_error(const std::exception_ptr &ptr) {
+	try {
+		std::rethrow_exception(ptr);
+	} catch (const elliptics::error &e) {
+		return elliptics::create_error(e.error_code(), "%s", e.what());
+	} catch (const std::exception &e) {
+		return elliptics::create_error(-EINVAL, "%s", e.what());
+	} catch (...) {
+		return elliptics::create_error(-EINVAL, "unknown exception");
+	}
+}
+
+// Result of an asynchronous storage operation.
+//
+// It is a shared handle: copies refer to the same state. Producer calls complete(),
+// consumers either block in wait()/get() or register continuations with connect()
+// and then(), which are invoked in the completing thread (or immediately
+// if the result is already there). Handlers follow elliptics convention and
+// receive value together with elliptics::error_info.
+template <typename T>
+class future {
+	public:
+		typedef std::function<void (const T &value, const elliptics::error_info &err)> handler_t;
+
+		future() : m_state(std::make_shared<state>()) {
+		}
+
+		void complete(const T &value) {
+			finish(value, elliptics::error_info());
+		}
+
+		void complete(const elliptics::error_info &err) {
+			finish(T(), err);
+		}
+
+		// runs @fn and completes future with its result, exceptions are converted into errors
+		void complete(const std::function<T ()> &fn) {
+			T value;
+			try {
+				value = fn();
+			} catch (...) {
+				complete(exception_error(std::current_exception()));
+				return;
+			}
+
+			complete(value);
+		}
+
+		void connect(const handler_t &handler) {
+			std::unique_lock<std::mutex> guard(m_state->lock);
+			if (!m_state->ready) {
+				m_state->handlers.push_back(handler);
+				return;
+			}
+			guard.unlock();
+
+			handler(m_state->value, m_state->error);
+		}
+
+		// returns future which is completed with @fn applied to this result,
+		// errors are propagated without calling @fn
+		template <typename U>
+		future<U> then(const std::function<U (const T &)> &fn) {
+			future<U> ret;
+			connect([ret, fn] (const T &value, const elliptics::error_info &err) mutable {
+				if (err) {
+					ret.complete(err);
+					return;
+				}
+
+				ret.complete(std::function<U ()>(std::bind(fn, std::cref(value))));
+			});
+
+			return ret;
+		}
+
+		void wait() {
+			std::unique_lock<std::mutex> guard(m_state->lock);
+			while (!m_state->ready)
+				m_state->cond.wait(guard);
+		}
+
+		bool ready() const {
+			std::unique_lock<std::mutex> guard(m_state->lock);
+			return m_state->ready;
+		}
+
+		// waits for completion, throws elliptics::error if operation has failed
+		const T &get() {
+			wait();
+			m_state->error.throw_error();
+			return m_state->value;
+		}
+
+		elliptics::error_info error() {
+			wait();
+			return m_state->error;
+		}
+
+	private:
+		struct state {
+			std::mutex lock;
+			std::condition_variable cond;
+			bool ready;
+
+			T value;
+			elliptics::error_info error;
+			std::vector<handler_t> handlers;
+
+			state() : ready(false) {}
+		};
+
+		std::shared_ptr<state> m_state;
+
+		void finish(const T &value, const elliptics::error_info &err) {
+			std::vector<handler_t> handlers;
+
+			{
+				std::unique_lock<std::mutex> guard(m_state->lock);
+				if (m_state->ready)
+					return;
+
+				m_state->value = value;
+				m_state->error = err;
+				m_state->ready = true;
+				m_state->handlers.swap(handlers);
+				m_state->cond.notify_all();
+			}
+
+			for (auto & h : handlers)
+				h(m_state->value, m_state->error);
+		}
+};
+
+// completes when all @futures are completed, with their values in the same order
+// or with the first error encountered
+template <typename T>
+future<std::vector<T>> when_all(const std::vector<future<T>> &futures)
+{
+	struct context {
+		std::mutex lock;
+		size_t left;
+		std::vector<T> values;
+		elliptics::error_info error;
+		future<std::vector<T>> ret;
+	};
+
+	auto ctx = std::make_shared<context>();
+	ctx->left = futures.size();
+	ctx->values.resize(futures.size());
+
+	if (futures.empty()) {
+		ctx->ret.complete(ctx->values);
+		return ctx->ret;
+	}
+
+	for (size_t i = 0; i < futures.size(); ++i) {
+		future<T> f = futures[i];
+		f.connect([ctx, i] (const T &value, const elliptics::error_info &err) {
+			std::unique_lock<std::mutex> guard(ctx->lock);
+			if (err && !ctx->error)
+				ctx->error = err;
+			else
+				ctx->values[i] = value;
+
+			if (--ctx->left)
+				return;
+
+			guard.unlock();
+			if (ctx->error)
+				ctx->ret.complete(ctx->error);
+			else
+				ctx->ret.complete(ctx->values);
+		});
+	}
+
+	return ctx->ret;
+}
+
+}} // namespace ioremap::wookie
+
+#endif /* __WOOKIE_FUTURE_HPP */
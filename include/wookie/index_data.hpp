@@ -18,6 +18,7 @@
 #define __INDEX_DATA_HPP
 
 #include "wookie/document.hpp"
+#include "wookie/varint.hpp"
 
 #include "elliptics/session.hpp"
 #include "elliptics/debug.hpp"
@@ -26,12 +27,18 @@
 
 #include <msgpack.hpp>
 
+#include <algorithm>
+
 namespace ioremap { namespace wookie {
 
 // index_data class stores additional info for every object (downloaded document) tagged by given index
 // @ts - document download/index update time
 // @key - index token name - it is stored in elliptics as 64-bit ID, this field allows to grab the name
-// @pos - array of token positions where given index token was found
+//	only version 2 records contain it, it is not written anymore and is empty for version 3 records
+// @pos - array of token positions where given index token was found, sorted
+//
+// Version 3 stores positions as varint-encoded gaps in a single raw field,
+// version 2 records (with the key and plain positions array) are still decoded.
 struct index_data {
 	dnet_time ts;
 	std::string key;
@@ -57,7 +64,8 @@ struct index_data {
 	}
 
 	enum {
-		version = 2,
+		version = 3,
+		version_with_key = 2,
 	};
 };
 
@@ -75,22 +83,40 @@ inline std::ostream &operator <<(std::ostream &out, const ioremap::wookie::index
 namespace msgpack {
 static inline ioremap::wookie::index_data &operator >>(msgpack::object o, ioremap::wookie::index_data &d)
 {
-	if (o.type != msgpack::type::ARRAY || o.via.array.size != 4)
-		ioremap::elliptics::throw_error(-EPROTO, "msgpack: index data array size mismatch: compiled: %d, unpacked: %d",
-				3, o.via.array.size);
+	if (o.type != msgpack::type::ARRAY || o.via.array.size < 1)
+		ioremap::elliptics::throw_error(-EPROTO, "msgpack: index data is not an array");
 
 	object *p = o.via.array.ptr;
 
 	int version;
 	p[0].convert(&version);
 
-	if (version != ioremap::wookie::index_data::version)
+	size_t size = (version == ioremap::wookie::index_data::version_with_key) ? 4 : 3;
+
+	if (version != ioremap::wookie::index_data::version && version != ioremap::wookie::index_data::version_with_key)
 		ioremap::elliptics::throw_error(-EPROTO, "msgpack: index data version mismatch: compiled: %d, unpacked: %d",
 				ioremap::wookie::index_data::version, version);
 
+	if (o.via.array.size != size)
+		ioremap::elliptics::throw_error(-EPROTO, "msgpack: index data array size mismatch: version: %d, "
+				"compiled: %zd, unpacked: %d",
+				version, size, o.via.array.size);
+
 	p[1].convert(&d.ts);
-	p[2].convert(&d.pos);
-	p[3].convert(&d.key);
+
+	d.pos.clear();
+	d.key.clear();
+
+	if (version == ioremap::wookie::index_data::version_with_key) {
+		p[2].convert(&d.pos);
+		p[3].convert(&d.key);
+	} else {
+		if (p[2].type != msgpack::type::RAW)
+			ioremap::elliptics::throw_error(-EPROTO, "msgpack: index data positions are not raw");
+
+		const char *ptr = p[2].via.raw.ptr;
+		ioremap::wookie::varint::get_deltas(ptr, ptr + p[2].via.raw.size, d.pos);
+	}
 
 	return d;
 }
@@ -98,11 +124,22 @@ static inline ioremap::wookie::index_data &operator >>(msgpack::object o, iorema
 template <typename Stream>
 inline msgpack::packer<Stream> &operator <<(msgpack::packer<Stream> &o, const ioremap::wookie::index_data &d)
 {
-	o.pack_array(4);
+	std::string pos;
+	pos.reserve(d.pos.size() * 2);
+
+	if (std::is_sorted(d.pos.begin(), d.pos.end())) {
+		ioremap::wookie::varint::put_deltas(pos, d.pos);
+	} else {
+		std::vector<int> sorted = d.pos;
+		std::sort(sorted.begin(), sorted.end());
+		ioremap::wookie::varint::put_deltas(pos, sorted);
+	}
+
+	o.pack_array(3);
 	o.pack(static_cast<int>(ioremap::wookie::index_data::version));
 	o.pack(d.ts);
-	o.pack(d.pos);
-	o.pack(d.key);
+	o.pack_raw(pos.size());
+	o.pack_raw_body(pos.data(), pos.size());
 
 	return o;
 }
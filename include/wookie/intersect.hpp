@@ -0,0 +1,63 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WOOKIE_INTERSECT_HPP
+#define __WOOKIE_INTERSECT_HPP
+
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace ioremap { namespace wookie { namespace intersect {
+
+// Intersection of sorted lists of unique 32-bit document numbers.
+//
+// Every kernel writes common values into @out and returns their number.
+// Vector kernels store whole registers, so @out must have room for
+// min(@a_size, @b_size) + @padding values and must not overlap inputs.
+static const size_t padding = 8;
+
+size_t scalar(const uint32_t *a, size_t a_size, const uint32_t *b, size_t b_size, uint32_t *out);
+
+// exponential search of every element of the smaller list @a in the larger list @b,
+// it wins when lists sizes differ by more than @galloping_ratio times
+static const size_t galloping_ratio = 64;
+size_t galloping(const uint32_t *a, size_t a_size, const uint32_t *b, size_t b_size, uint32_t *out);
+
+// block compare kernels, they fall back to scalar() if CPU does not support
+// the instruction set (see has_sse() and has_avx2()), wider avx2 blocks pay off
+// only for lists of about the same size, otherwise most compares are wasted
+size_t sse(const uint32_t *a, size_t a_size, const uint32_t *b, size_t b_size, uint32_t *out);
+size_t avx2(const uint32_t *a, size_t a_size, const uint32_t *b, size_t b_size, uint32_t *out);
+
+bool has_sse();
+bool has_avx2();
+
+// picks the best kernel for given sizes and CPU
+size_t pair(const uint32_t *a, size_t a_size, const uint32_t *b, size_t b_size, uint32_t *out);
+
+// values of @a which are not in @b (AND-NOT), @out may be the same as @a,
+// galloping search is used for @b much larger than @a
+size_t difference(const uint32_t *a, size_t a_size, const uint32_t *b, size_t b_size, uint32_t *out);
+
+// intersects @lists starting from the shortest ones, so that intermediate result
+// is never larger than the shortest list and skewed steps go to galloping search
+void all(const std::vector<const std::vector<uint32_t> *> &lists, std::vector<uint32_t> &result);
+
+}}} // namespace ioremap::wookie::intersect
+
+#endif /* __WOOKIE_INTERSECT_HPP */
@@ -0,0 +1,149 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WOOKIE_LATENCY_HPP
+#define __WOOKIE_LATENCY_HPP
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace ioremap { namespace wookie {
+
+// Tracks read latency of every replica group.
+// Exponentially weighted moving average is used to order groups (fastest first),
+// the last @window samples are kept to estimate 95th percentile which is used
+// as a delay before hedged request is sent to the next group.
+//
+// Failed and timed out requests are counted as requests which took @penalty msecs,
+// so that dead group moves to the end of the order instead of being tried first
+// forever, and gets back once it replies fast again.
+class group_latency {
+	public:
+		group_latency(size_t window = 128, double alpha = 0.1, long default_latency = 50, long penalty = 1000) :
+		m_window(window), m_alpha(alpha), m_default(default_latency), m_penalty(penalty) {
+		}
+
+		// latency assumed for groups without samples
+		void set_default(long msecs) {
+			std::unique_lock<std::mutex> guard(m_lock);
+			m_default = msecs;
+		}
+
+		void record(int group, long msecs) {
+			std::unique_lock<std::mutex> guard(m_lock);
+
+			stat &st = m_stats[group];
+			if (st.samples.empty())
+				st.ewma = msecs;
+			else
+				st.ewma = m_alpha * msecs + (1 - m_alpha) * st.ewma;
+
+			if (st.samples.size() < m_window) {
+				st.samples.push_back(msecs);
+			} else {
+				st.samples[st.pos] = msecs;
+				st.pos = (st.pos + 1) % m_window;
+			}
+		}
+
+		void record_failure(int group) {
+			long penalty;
+			{
+				std::unique_lock<std::mutex> guard(m_lock);
+				penalty = m_penalty;
+			}
+
+			record(group, penalty);
+		}
+
+		// returns @groups sorted by average latency
+		// groups without samples are ranked by the default latency, so that they are probed
+		// before slow groups, but do not stay ahead of failing ones
+		std::vector<int> order(const std::vector<int> &groups) {
+			std::vector<std::pair<double, int>> tmp;
+			tmp.reserve(groups.size());
+
+			{
+				std::unique_lock<std::mutex> guard(m_lock);
+				for (auto g : groups) {
+					auto it = m_stats.find(g);
+					tmp.push_back(std::make_pair(it == m_stats.end() ? (double)m_default : it->second.ewma, g));
+				}
+			}
+
+			std::stable_sort(tmp.begin(), tmp.end(),
+				[] (const std::pair<double, int> &a, const std::pair<double, int> &b) {
+					return a.first < b.first;
+				});
+
+			std::vector<int> ret;
+			ret.reserve(tmp.size());
+			for (auto & t : tmp)
+				ret.push_back(t.second);
+
+			return ret;
+		}
+
+		// 95th percentile of the recent latency samples, @def if there are not enough of them
+		long p95(int group, long def) {
+			std::vector<long> samples;
+
+			{
+				std::unique_lock<std::mutex> guard(m_lock);
+				auto it = m_stats.find(group);
+				if (it == m_stats.end() || it->second.samples.size() < 20)
+					return def;
+
+				samples = it->second.samples;
+			}
+
+			auto nth = samples.begin() + samples.size() * 95 / 100;
+			std::nth_element(samples.begin(), nth, samples.end());
+			return *nth;
+		}
+
+		double average(int group) {
+			std::unique_lock<std::mutex> guard(m_lock);
+			auto it = m_stats.find(group);
+			if (it == m_stats.end())
+				return 0;
+
+			return it->second.ewma;
+		}
+
+	private:
+		struct stat {
+			double ewma;
+			std::vector<long> samples;
+			size_t pos;
+
+			stat() : ewma(0), pos(0) {}
+		};
+
+		size_t m_window;
+		double m_alpha;
+		long m_default;
+		long m_penalty;
+
+		std::mutex m_lock;
+		std::map<int, stat> m_stats;
+};
+
+}} // namespace ioremap::wookie
+
+#endif /* __WOOKIE_LATENCY_HPP */
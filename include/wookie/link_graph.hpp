@@ -0,0 +1,119 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WOOKIE_LINK_GRAPH_HPP
+#define __WOOKIE_LINK_GRAPH_HPP
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <stdint.h>
+
+namespace ioremap { namespace wookie {
+
+// Outgoing links of the documents numbered by doc_registry, collected while crawling.
+//
+// Targets of every source are kept sorted and delta-encoded by varints, which takes
+// about a byte or two per link. Links added one by one go to a pending buffer first
+// and are merged into the encoded lists when there are @batch_links of them,
+// links of a recrawled page are merged with the old ones unless set_links() is used.
+class link_graph {
+	public:
+		explicit link_graph(size_t batch_links = 1000000);
+
+		// self links and duplicates are dropped
+		void add_link(uint32_t source, uint32_t target);
+
+		// replaces all outgoing links of @source
+		void set_links(uint32_t source, std::vector<uint32_t> targets);
+
+		// sorted targets of @source
+		std::vector<uint32_t> links(uint32_t source);
+
+		// number of documents (the largest number seen plus one) and links
+		uint32_t nodes_num();
+		uint64_t links_num();
+
+		// Writes the graph in the form mapped_link_graph reads: header, uint64_t offset
+		// of every node's list and the end of the last one, encoded lists.
+		// File is written under temporary name and renamed.
+		void save(const std::string &path);
+		// replaces current content
+		void load(const std::string &path);
+
+	private:
+		size_t m_batch_links;
+
+		std::mutex m_lock;
+		std::vector<std::string> m_links;
+		uint64_t m_links_num;
+
+		std::unordered_map<uint32_t, std::vector<uint32_t>> m_pending;
+		size_t m_pending_links;
+		uint32_t m_nodes_num;
+
+		void merge_pending();
+		void store(uint32_t source, const std::vector<uint32_t> &targets);
+};
+
+// Read-only link graph file mapped into memory.
+class mapped_link_graph {
+	public:
+		explicit mapped_link_graph(const std::string &path);
+		~mapped_link_graph();
+
+		mapped_link_graph(const mapped_link_graph &) = delete;
+		mapped_link_graph &operator =(const mapped_link_graph &) = delete;
+
+		uint32_t nodes_num() const;
+		uint64_t links_num() const;
+
+		uint32_t out_degree(uint32_t source) const;
+
+		// sorted targets of @source, appended to @targets
+		void links(uint32_t source, std::vector<uint32_t> &targets) const;
+
+	private:
+		int m_fd;
+		const char *m_data;
+		uint64_t m_size;
+		uint32_t m_nodes_num;
+		uint64_t m_links_num;
+		const uint64_t *m_offsets;
+		const char *m_lists;
+};
+
+struct pagerank_params {
+	double damping;
+	int iterations;		// upper limit
+	double epsilon;		// iterations stop when L1 norm of the change gets below it
+	int threads;		// 0 means number of CPUs
+
+	pagerank_params() : damping(0.85), iterations(50), epsilon(1e-6), threads(0) {}
+};
+
+// PageRank of every document of @graph, the ranks sum up to 1.
+//
+// Incoming links are built from the graph once, then every iteration pulls contributions
+// of the sources into disjoint ranges of targets, so threads never write to the same
+// memory and need no locks. Rank of documents without outgoing links is spread evenly.
+std::vector<float> pagerank(const mapped_link_graph &graph, const pagerank_params &params = pagerank_params());
+
+}} // namespace ioremap::wookie
+
+#endif /* __WOOKIE_LINK_GRAPH_HPP */
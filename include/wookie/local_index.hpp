@@ -0,0 +1,131 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WOOKIE_LOCAL_INDEX_HPP
+#define __WOOKIE_LOCAL_INDEX_HPP
+
+#include "wookie/backend.hpp"
+#include "wookie/query.hpp"
+#include "wookie/rank.hpp"
+#include "wookie/segment.hpp"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace ioremap { namespace wookie {
+
+// Inverted index kept in local immutable segments (see wookie/segment.hpp) in @dir.
+//
+// New segments are added by add_segment(), documents in newer segments hide
+// documents with the same key in older ones. Background thread merges runs of
+// adjacent segments of the same size tier (tier is log of documents number
+// with @merge_factor base) once there are @merge_factor of them, so the number
+// of segments grows logarithmically with the number of indexed documents.
+class local_index {
+	public:
+		local_index(const std::string &dir, size_t merge_factor = 4);
+		~local_index();
+
+		// writes @writer into a new segment and clears it
+		void add_segment(segment_writer &writer);
+
+		// query-independent document prior (link rank, freshness and so on), segments
+		// written by add_segment() and merges after the call are impact-ordered by it
+		// (see segment_writer::set_priors()), merges of impact-ordered segments keep
+		// their priors if it is not set
+		void set_prior(const std::function<float (const segment_document &doc)> &prior);
+
+		// prior of the document which is not written into segments yet (e.g. it is
+		// still in delta index), 0 if prior is not set
+		float prior(const segment_document &doc);
+
+		// documents which contain all @terms, @ids are index IDs of the terms which are
+		// put into result entries, so that the result is the same as elliptics find_all_indexes()
+		// would return for documents indexed with basic_elliptics_splitter
+		//
+		// positions are stored apart from document lists and are only read and decoded
+		// for the found documents if @positions is set, otherwise index data has none
+		find_result_t find(const std::vector<std::string> &terms, const std::vector<dnet_raw_id> &ids,
+				bool positions = true);
+
+		// documents matching boolean query @q, query plan is built for every segment
+		// using its document frequencies, @terms and @ids are used as above,
+		// index entries are added only for the terms present in the document
+		// (in the segment if @positions is not set)
+		find_result_t find(const query::node &q, const std::vector<std::string> &terms,
+				const std::vector<dnet_raw_id> &ids, bool positions = true);
+
+		// best @k documents containing any of @terms by BM25 score, statistics are summed over
+		// all segments (documents hidden by newer versions are counted too), every segment is
+		// evaluated with WAND pruning against the best scores found in newer segments,
+		// result entries are the same as find() returns
+		//
+		// @weights are query time boosts of @terms (see wookie/fields.hpp), scores of the terms
+		// are multiplied by them, empty array means 1 for all terms
+		//
+		// priors of documents multiplied by @prior are added to their scores, impact-ordered
+		// segments are then evaluated by growing ranges of documents from the best prior down,
+		// and evaluation of a segment stops as soon as the best score left in it can not get
+		// into the top, so head queries only decode the first blocks of their lists
+		//
+		// @stats (if set) receives statistics the scores have been computed with
+		rank::ranked_result_t top(const std::vector<std::string> &terms, const std::vector<dnet_raw_id> &ids,
+				size_t k, const rank::bm25 &params = rank::bm25(), bool positions = false,
+				const std::vector<double> &weights = std::vector<double>(), double prior = 0,
+				rank::stats *stats = NULL);
+
+		size_t segments_num();
+		size_t docs_num();
+
+		// blocks until there are no merges to run
+		void wait_merges();
+
+	private:
+		std::string m_dir;
+		size_t m_merge_factor;
+
+		struct entry {
+			uint64_t			generation;
+			std::shared_ptr<segment>	seg;
+		};
+
+		std::mutex m_lock;
+		std::condition_variable m_cond;
+		// ordered from the oldest to the newest
+		std::vector<entry> m_segments;
+		uint64_t m_generation;
+		bool m_merging;
+		bool m_merge_failed;
+		bool m_need_exit;
+		std::thread m_merge_thread;
+		std::function<float (const segment_document &doc)> m_prior;
+
+		std::string segment_path(uint64_t generation) const;
+		size_t tier(const segment &seg) const;
+
+		// returns index of the first segment of the run to merge or -1
+		ssize_t pick_merge();
+
+		// merged segment replaces the newest victim on disk
+		std::shared_ptr<segment> merge(const std::vector<entry> &victims);
+		void merge_worker();
+};
+
+}} // namespace ioremap::wookie
+
+#endif /* __WOOKIE_LOCAL_INDEX_HPP */
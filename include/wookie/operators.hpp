@@ -20,6 +20,7 @@
 #include <elliptics/session.hpp>
 
 #include "index_data.hpp"
+#include "query.hpp"
 #include "storage.hpp"
 #include "split.hpp"
 
@@ -28,16 +29,19 @@
 
 namespace ioremap { namespace wookie {
 
-class find_result {
+class find_result : public std::enable_shared_from_this<find_result> {
 	public:
 		typedef std::function<void (find_result &result, const elliptics::error_info &err)>
 			find_completion_callback_t;
 
-		find_result(storage &st, const std::string &text) :
-		m_ready(false), m_st(st) {
+		// @text is parsed by query::parse(), syntax errors are reported as -EINVAL
+		// token positions are returned in index data of the results only if @positions is set,
+		// otherwise local indexes do not read them
+		find_result(storage &st, const std::string &text, bool positions = false) :
+		m_ready(false), m_positions(positions), m_st(st) {
 			m_completion = std::bind(&find_result::on_wait_completion, this,
 					std::placeholders::_1, std::placeholders::_2);
-			find(text);
+			find(text, std::shared_ptr<find_result>());
 
 			std::unique_lock<std::mutex> guard(m_lock);
 			while (!m_ready)
@@ -46,15 +50,27 @@ class find_result {
 			m_error.throw_error();
 		}
 
-		find_result(storage &st, const std::string &text, const find_completion_callback_t &callback) :
-		m_ready(false), m_st(st), m_completion(callback) {
-			find(text);
+		// asynchronous search, it has to be started with start() once object is owned by shared pointer,
+		// pending request holds a reference, so caller doesn't have to keep the object until completion
+		find_result(storage &st, const find_completion_callback_t &callback, bool positions = false) :
+		m_ready(false), m_positions(positions), m_st(st), m_completion(callback) {
+		}
+
+		void start(const std::string &text) {
+			find(text, shared_from_this());
 		}
 
 		const std::vector<dnet_raw_id> &results_array() const {
 			return m_result_ids;
 		}
 
+		// dense numbers of the found documents in storage document registry,
+		// in the same order as results_array(), doc_registry::invalid for documents
+		// which have not been written through storage
+		const std::vector<uint32_t> &results_docs() const {
+			return m_result_docs;
+		}
+
 		const elliptics::sync_find_indexes_result &results_find_indexes_array() const {
 			return m_find_result;
 		}
@@ -65,6 +81,7 @@ class find_result {
 
 	private:
 		bool m_ready;
+		bool m_positions;
 		storage &m_st;
 		wookie::split m_spl;
 
@@ -75,106 +92,29 @@ class find_result {
 		elliptics::error_info m_error;
 		elliptics::sync_find_indexes_result m_find_result;
 		std::vector<dnet_raw_id> m_result_ids;
+		std::vector<uint32_t> m_result_docs;
 		elliptics::id_to_name_map_t m_map;
 
-		struct quote {
-			std::string 			text;
-			std::vector<std::string>	tokens;
-			std::vector<dnet_raw_id>	indexes;
-
-			quote(const std::string &txt) : text(txt) {}
-		};
-
-		struct find_request {
-			std::vector<quote> quotes;
-			std::string text;
-			std::vector<std::string> text_tokens;
-			elliptics::name_to_id_map_t mapper;
-		} m_request;
-
-		find_request prepare(const std::string &text) {
-			find_request res;
-			operators_found scope = std::for_each(text.begin(), text.end(), operators_found());
-
-			res.text = text;
-			for (auto op : scope.quotes) {
-				res.quotes.emplace_back(text.substr(op.first, op.second - op.first));
-				res.text.replace(op.first, op.second - op.first, "");
-			}
-			return res;
-		}
-
-		void prepare_indexes(const std::string &text, std::vector<std::string> &tokens) {
-			m_spl.feed(text, tokens);
-		}
-
-		struct operators_found {
-			int q1, q2, pos;
-			std::vector<std::pair<int, int>> quotes;
-			std::vector<int> negative;
-
-			operators_found() : q1(-1), q2(-1), pos(-1) {
-			}
-
-			operators_found(operators_found &&other) : operators_found() {
-				quotes.swap(other.quotes);
-				negative.swap(other.negative);
-			}
-
-			void operator() (char ch) {
-				++pos;
-
-				if (ch == '\"') {
-					if (q1 == -1) {
-						q1 = pos + 1;
-						return;
-					}
-
-					q2 = pos;
-					quotes.push_back(std::make_pair(q1, q2));
-
-					q1 = q2 = -1;
-					return;
-				}
-
-				if (ch == '-')
-					negative.push_back(pos);
-			}
-		};
-
-		void find(const std::string &text) {
-			m_request = prepare(text);
-			std::vector<std::string> str_indexes;
-
-			// run over all quoted strings
-			for (auto qit = m_request.quotes.begin(); qit != m_request.quotes.end(); ++qit) {
-				prepare_indexes(qit->text, qit->tokens);
-				str_indexes.insert(str_indexes.end(), qit->tokens.begin(), qit->tokens.end());
-
-				qit->indexes = m_st.transform_tokens(qit->tokens);
+		void find(const std::string &text, const std::shared_ptr<find_result> &self) {
+			query::node q;
+			try {
+				q = query::parse(text, m_spl);
+			} catch (const elliptics::error &e) {
+				m_completion(*this, elliptics::create_error(e.error_code(), "%s", e.what()));
+				return;
 			}
 
-			// grab tokens from the rest of request (unquoted text)
-			prepare_indexes(m_request.text, m_request.text_tokens);
-			str_indexes.insert(str_indexes.end(),
-					m_request.text_tokens.begin(), m_request.text_tokens.end());
-
-			std::sort(str_indexes.begin(), str_indexes.end());
-			str_indexes.erase(std::unique(str_indexes.begin(), str_indexes.end()), str_indexes.end());
+			std::vector<std::string> str_indexes = query::tokens(q);
+			std::vector<dnet_raw_id> raw_indexes = m_st.transform_tokens(str_indexes);
 
-			auto session = m_st.create_session();
-
-			for (auto it = str_indexes.begin(); it != str_indexes.end(); ++it) {
-				elliptics::key id(*it);
-				id.transform(session);
-
-				m_request.mapper[*it] = id.raw_id();
-				m_map[id.raw_id()] = *it;
-			}
+			for (size_t i = 0; i < str_indexes.size(); ++i)
+				m_map[raw_indexes[i]] = str_indexes[i];
 
-			session.find_all_indexes(str_indexes).connect(
-					std::bind(&find_result::on_result_ready,
-						this, std::placeholders::_1, std::placeholders::_2));
+			// phrases are checked by the query plan, positions are only needed by the caller
+			m_st.async_find(q, m_positions).connect(
+				[this, self] (const storage::find_result_t &result, const elliptics::error_info &err) {
+					on_result_ready(result, err);
+				});
 		}
 
 		void on_result_ready(const elliptics::sync_find_indexes_result &result,
@@ -187,76 +127,8 @@ class find_result {
 			m_find_result = result;
 
 			for (auto it = result.begin(); it != result.end(); ++it) {
-				const elliptics::find_indexes_result_entry &entry = *it;
-
-				// position to token ID (its pointer) map
-				std::map<int, const dnet_raw_id *> pos;
-
-				for (const auto & index : entry.indexes) {
-					// unpack index data - this will contain array of
-					// token positions in the document
-					index_data idata(index.data);
-
-					for (const auto & p : idata.pos)
-						pos.insert(std::make_pair(p, &index.index));
-				}
-
-				bool all_quotes_ok = true;
-
-				for (auto qit = m_request.quotes.begin(); qit != m_request.quotes.end(); ++qit) {
-					size_t state = 0;
-					int prev_pos = -1;
-					bool quote_ok = false;
-					for (auto p : pos) {
-#if 0
-						std::cout << "state: " << state <<
-							", prev-pos: " << prev_pos <<
-							", pos: " << p.first <<
-							", p-index: " << *p.second <<
-							", should-be: " << id_indexes[state] <<
-							std::endl;
-#endif
-						if (state < qit->tokens.size()) {
-							if (!memcmp(p.second, &qit->indexes[state],
-										sizeof(struct dnet_raw_id))) {
-								if (prev_pos == -1) {
-									prev_pos = p.first;
-									state++;
-								} else if (p.first == prev_pos + 1) {
-									state++;
-									prev_pos++;
-								} else {
-									prev_pos = -1;
-									state = 0;
-								}
-							} else {
-								prev_pos = -1;
-								state = 0;
-
-								// check again the first index in quote
-								if (!memcmp(p.second, &qit->indexes[state],
-										sizeof(struct dnet_raw_id))) {
-									prev_pos = p.first;
-									state++;
-								}
-							}
-						}
-
-						if (state == qit->tokens.size()) {
-							state = 0;
-							prev_pos = -1;
-
-							quote_ok = true;
-							//std::cout << "good document id: " << entry.id << std::endl;
-							break;
-						}
-					}
-
-					all_quotes_ok &= quote_ok;
-				}
-
-				if (all_quotes_ok)
-					m_result_ids.push_back(entry.id);
+				m_result_ids.push_back(it->id);
+				m_result_docs.push_back(m_st.get_doc_registry().lookup(it->id));
 			}
 
 			m_completion(*this, elliptics::error_info());
@@ -274,23 +146,27 @@ typedef std::shared_ptr<find_result> shared_find_t;
 
 class operators {
 	public:
-		operators(storage &st) :
-		m_st(st) {
+		// see find_result about @positions
+		operators(storage &st, bool positions = false) :
+		m_st(st), m_positions(positions) {
 		}
 
 		shared_find_t find(const std::string &text) {
-			shared_find_t fobj = std::make_shared<find_result>(m_st, text);
+			shared_find_t fobj = std::make_shared<find_result>(m_st, text, m_positions);
 			return fobj;
 		}
 
+		// returns immediately, @complete is called from the storage thread
 		shared_find_t find(const std::string &text,
 				const find_result::find_completion_callback_t &complete) {
-			shared_find_t fobj = std::make_shared<find_result>(m_st, text, complete);
+			shared_find_t fobj = std::make_shared<find_result>(m_st, complete, m_positions);
+			fobj->start(text);
 			return fobj;
 		}
 
 	private:
 		storage &m_st;
+		bool m_positions;
 };
 
 
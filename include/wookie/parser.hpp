@@ -122,10 +122,24 @@ class parser {
 			return m_urls;
 		}
 
+		// href values with the text of their <a> elements
+		const std::vector<std::pair<std::string, std::string>> &links(void) const {
+			return m_links;
+		}
+
 		const std::vector<std::string> &tokens(void) const {
 			return m_tokens;
 		}
 
+		// text of the <title> and <h1>..<h6> elements, it is present in tokens() too
+		const std::vector<std::string> &title(void) const {
+			return m_title;
+		}
+
+		const std::vector<std::string> &headings(void) const {
+			return m_headings;
+		}
+
 		std::string text(const char *join) const {
 			std::ostringstream ss;
 
@@ -212,7 +226,10 @@ class parser {
 
 	private:
 		std::vector<std::string> m_urls;
+		std::vector<std::pair<std::string, std::string>> m_links;
 		std::vector<std::string> m_tokens;
+		std::vector<std::string> m_title;
+		std::vector<std::string> m_headings;
 
 		warp::ngram::detector m_charset_detector;
 		boost::locale::generator m_gen;
@@ -223,17 +240,43 @@ class parser {
 
 		void reset(void) {
 			m_urls.clear();
+			m_links.clear();
 			m_tokens.clear();
+			m_title.clear();
+			m_headings.clear();
 		}
 
-		void traverse_tree(TidyDoc tdoc, TidyNode tnode) {
+		// @field is where text of the subtree goes besides m_tokens
+		void traverse_tree(TidyDoc tdoc, TidyNode tnode, std::vector<std::string> *field = NULL) {
 			TidyNode child;
 
 			for (child = tidyGetChild(tnode); child; child = tidyGetNext(child)) {
+				std::vector<std::string> *child_field = field;
+
+				switch (tidyNodeGetId(child)) {
+				case TidyTag_TITLE:
+					child_field = &m_title;
+					break;
+				case TidyTag_H1:
+				case TidyTag_H2:
+				case TidyTag_H3:
+				case TidyTag_H4:
+				case TidyTag_H5:
+				case TidyTag_H6:
+					child_field = &m_headings;
+					break;
+				default:
+					break;
+				}
+
+				// anchor text is collected from the text nodes added by the subtree
+				size_t anchor_start = ~(size_t)0;
+
 				if (tidyNodeGetId(child) == TidyTag_A) {
 					TidyAttr href = tidyAttrGetHREF(child);
 					if (tidyAttrValue(href)) {
 						m_urls.push_back(convert(tidyAttrValue(href)));
+						anchor_start = m_tokens.size();
 					}
 				}
 
@@ -250,12 +293,25 @@ class parser {
 						std::string text;
 						text.assign((char *)buf.bp, buf.size);
 						m_tokens.emplace_back(convert(text));
+						if (field)
+							field->push_back(m_tokens.back());
 
 						tidyBufFree(&buf);
 					}
 				}
 
-				traverse_tree(tdoc, child);
+				traverse_tree(tdoc, child, child_field);
+
+				if (anchor_start != ~(size_t)0) {
+					std::string text;
+					for (size_t i = anchor_start; i < m_tokens.size(); ++i) {
+						if (i != anchor_start)
+							text += " ";
+						text += m_tokens[i];
+					}
+
+					m_links.emplace_back(m_urls.back(), text);
+				}
 			}
 		}
 
@@ -0,0 +1,126 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WOOKIE_POSITIONS_HPP
+#define __WOOKIE_POSITIONS_HPP
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include <limits.h>
+#include <stddef.h>
+
+namespace ioremap { namespace wookie { namespace positions {
+
+// Checks whether document contains a phrase.
+// @terms are sorted positions of every phrase token in the document, in phrase order
+// (the same array may be used several times if token is repeated in the phrase).
+//
+// Positions of the rarest token are candidates: phrase starting at (pos - its offset)
+// is looked up in all other arrays by binary search, the first match finishes the check.
+static inline bool phrase(const std::vector<const std::vector<int> *> &terms)
+{
+	if (terms.empty())
+		return true;
+
+	size_t rare = 0;
+	for (size_t i = 0; i < terms.size(); ++i) {
+		if (terms[i]->empty())
+			return false;
+
+		if (terms[i]->size() < terms[rare]->size())
+			rare = i;
+	}
+
+	// lower bound of every array only grows, since candidates are increasing
+	std::vector<std::vector<int>::const_iterator> from(terms.size());
+	for (size_t i = 0; i < terms.size(); ++i)
+		from[i] = terms[i]->begin();
+
+	for (int pos : *terms[rare]) {
+		const int start = pos - (int)rare;
+		bool match = true;
+
+		for (size_t i = 0; match && i < terms.size(); ++i) {
+			if (i == rare)
+				continue;
+
+			const int want = start + (int)i;
+			from[i] = std::lower_bound(from[i], terms[i]->end(), want);
+			if (from[i] == terms[i]->end())
+				return false;
+
+			match = *from[i] == want;
+		}
+
+		if (match)
+			return true;
+	}
+
+	return false;
+}
+
+// Length of the shortest window (last position minus the first one) which contains
+// at least one position of every array of @terms, -1 if any of them is empty.
+// @terms are sorted positions of distinct tokens, the order does not matter.
+//
+// Arrays are merged by a min-heap of cursors: the current window spans from the smallest
+// current position to the largest one and only advancing the smallest one may shorten it,
+// so the sweep is linear in the total number of positions and stops when that array ends.
+static inline int window(const std::vector<const std::vector<int> *> &terms)
+{
+	typedef std::pair<int, size_t> cursor;
+
+	std::vector<cursor> heap;
+	std::vector<size_t> next(terms.size(), 1);
+	int last = INT_MIN;
+
+	for (size_t i = 0; i < terms.size(); ++i) {
+		if (terms[i]->empty())
+			return -1;
+
+		heap.emplace_back(terms[i]->front(), i);
+		last = std::max(last, terms[i]->front());
+	}
+
+	if (heap.empty())
+		return 0;
+
+	std::greater<cursor> greater;
+	std::make_heap(heap.begin(), heap.end(), greater);
+
+	int best = INT_MAX;
+	while (true) {
+		const cursor first = heap.front();
+		best = std::min(best, last - first.first);
+
+		const std::vector<int> &pos = *terms[first.second];
+		if (!best || next[first.second] == pos.size())
+			break;
+
+		std::pop_heap(heap.begin(), heap.end(), greater);
+		heap.back() = cursor(pos[next[first.second]++], first.second);
+		last = std::max(last, heap.back().first);
+		std::push_heap(heap.begin(), heap.end(), greater);
+	}
+
+	return best;
+}
+
+}}} // namespace ioremap::wookie::positions
+
+#endif /* __WOOKIE_POSITIONS_HPP */
@@ -0,0 +1,134 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WOOKIE_QUERY_HPP
+#define __WOOKIE_QUERY_HPP
+
+#include "wookie/split.hpp"
+
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace ioremap { namespace wookie { namespace query {
+
+// Boolean query tree.
+//
+// Syntax: words and "quoted phrases" next to each other are ANDed, 'OR' (or '|')
+// has lower priority than AND, parentheses group subexpressions, '-' before a word,
+// phrase or group negates it. AND is accepted as an explicit (no-op) operator.
+// 'NEAR/k' between words or phrases binds tighter than AND and requires all their
+// tokens to be found within a window of k positions (last minus the first one),
+// in any order; chained NEARs have to use the same k. A field name and ':' before
+// a word or phrase restricts it to that field (see wookie/fields.hpp).
+//
+//	cat (dog OR "guinea pig") -mouse
+//	cheese NEAR/5 mouse
+//	title:cat anchor:"guinea pig"
+//
+// Words are normalized by wookie::split, a word which splits into several tokens
+// becomes a phrase. Negation is only allowed inside AND with at least one positive
+// operand, since the set of all documents is never materialized.
+struct node {
+	enum node_type {
+		term = 0,
+		phrase,
+		op_and,
+		op_or,
+		op_not,
+		near,
+	};
+
+	node_type type;
+	std::vector<std::string> tokens;	// term: single token, phrase and near: tokens in order
+	std::vector<node> children;		// operands of AND, OR and NOT
+	int distance;				// near: maximal window length
+
+	node() : type(op_and), distance(0) {}
+	explicit node(node_type t) : type(t), distance(0) {}
+};
+
+// throws -EINVAL on syntax errors and queries which do not select anything positively
+node parse(const std::string &text, split &spl);
+
+// sorted unique tokens of the query, including negated ones
+std::vector<std::string> tokens(const node &root);
+
+// human-readable form, used in logs and errors
+std::string to_string(const node &root);
+
+// Posting lists the plan is evaluated over, documents are numbered by the source.
+class source {
+	public:
+		virtual ~source() {}
+
+		// number of documents containing @token, 0 if there are none
+		virtual size_t df(const std::string &token) = 0;
+
+		// sorted document numbers containing @token
+		virtual void postings(const std::string &token, std::vector<uint32_t> &docs) = 0;
+
+		// sorted positions of @token in @doc
+		virtual std::vector<int> positions(const std::string &token, uint32_t doc) = 0;
+};
+
+// Execution plan of the query.
+//
+// Cost of every node is an estimate of its result size derived from document frequencies:
+// the rarest operand for AND and phrases, the sum of operands for OR. Operands of AND are
+// evaluated from the cheapest one, negated operands go last and only shrink the result,
+// phrase and near positions are checked only for documents which contain all their tokens.
+// Evaluation stops as soon as AND gets an empty intermediate result, so the query runs
+// in time bounded by its rarest terms rather than by the total size of its lists.
+class plan {
+	public:
+		plan(const node &root, source &src);
+
+		// estimated number of found documents
+		size_t cost() const;
+
+		// sorted document numbers matching the query
+		void execute(std::vector<uint32_t> &docs);
+
+		std::string to_string() const;
+
+	private:
+		struct step {
+			node::node_type		type;
+			std::vector<std::string>	tokens;
+			std::vector<step>	children;
+			size_t			cost;
+			int			distance;
+		};
+
+		source &m_src;
+		step m_root;
+
+		step compile(const node &n);
+
+		// finds documents matching @s, if @restrict is set only documents
+		// already present in @docs are checked
+		void execute(const step &s, std::vector<uint32_t> &docs, bool restrict);
+		// phrase and near
+		void positional(const step &s, std::vector<uint32_t> &docs, bool restrict);
+		static void to_string(const step &s, std::string &out);
+};
+
+}}} // namespace ioremap::wookie::query
+
+#endif /* __WOOKIE_QUERY_HPP */
@@ -0,0 +1,155 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WOOKIE_RANK_HPP
+#define __WOOKIE_RANK_HPP
+
+#include "wookie/backend.hpp"
+
+#include <functional>
+#include <vector>
+
+#include <stdint.h>
+
+namespace ioremap { namespace wookie { namespace rank {
+
+// Okapi BM25 relevance function.
+struct bm25 {
+	double k1;
+	double b;
+
+	bm25(double k1_ = 1.2, double b_ = 0.75) : k1(k1_), b(b_) {}
+
+	// always positive, so that very common terms do not decrease the score
+	static double idf(uint64_t docs_num, uint64_t df);
+
+	// @norm is document length divided by the average length, 1 if lengths are unknown
+	double score(double idf, uint32_t tf, double norm) const;
+
+	// upper bound of score() over documents of any length with term frequency
+	// not greater than @max_tf, 0 means it is unknown
+	double max_score(double idf, uint32_t max_tf) const;
+};
+
+// collection statistics the scores are computed with
+struct stats {
+	uint64_t docs_num;
+	uint64_t tokens_num;		// 0 if document lengths are unknown
+	std::vector<uint64_t> df;	// document frequencies of the query terms
+
+	stats() : docs_num(0), tokens_num(0) {}
+
+	// document length divided by the average one
+	double norm(uint32_t length) const;
+};
+
+struct scored_doc {
+	uint64_t doc;
+	double score;
+};
+
+// Best @k documents seen so far, kept in a heap with the worst one on top.
+class top_k {
+	public:
+		explicit top_k(size_t k);
+
+		size_t k() const;
+
+		// score document has to exceed to get in, 0 until there are @k documents
+		double threshold() const;
+
+		// returns false if document is not good enough
+		bool push(uint64_t doc, double score);
+
+		// best first
+		std::vector<scored_doc> sorted() const;
+
+	private:
+		size_t m_k;
+		std::vector<scored_doc> m_heap;
+};
+
+// postings of a query term prepared for evaluation
+struct term_list {
+	std::vector<uint32_t> docs;
+	std::vector<uint32_t> tfs;
+	double idf;
+	double max_score;	// bm25::max_score() of the term
+};
+
+// Document-at-a-time evaluation of the disjunction of @lists with WAND pruning.
+//
+// Lists are ordered by their current documents, the first document whose preceding
+// lists have sum of @max_score above top_k::threshold() is the pivot: documents before
+// it can not get into @top and are skipped by galloping search, so only a small part
+// of the matches is scored once @top is full.
+//
+// @norm returns normalized length of the document (see stats::norm()), @accept may
+// reject documents which would get into @top (e.g. deleted ones), documents are pushed
+// into @top with @base added to their numbers.
+//
+// @prior is the query-independent part of the score, it has to be non-increasing
+// in document number (see segment::impact_ordered()), so that the prior of the current
+// document bounds priors of all the rest and evaluation stops once it is too low.
+void wand(const std::vector<term_list> &lists, const bm25 &params, top_k &top,
+		const std::function<double (uint32_t doc)> &norm,
+		const std::function<bool (uint32_t doc)> &accept, uint64_t base = 0,
+		const std::function<double (uint32_t doc)> &prior = std::function<double (uint32_t)>());
+
+struct ranked_entry {
+	elliptics::find_indexes_result_entry entry;
+	double score;
+};
+
+// best first
+typedef std::vector<ranked_entry> ranked_result_t;
+
+// exhaustive scoring of already found documents, term frequencies are taken from positions
+// stored in index data (results have to be searched with positions), @ids are index IDs
+// of the query terms in the same order as @st.df
+//
+// index data does not have document lengths, @length may provide them (0 if unknown),
+// otherwise all documents are treated as having average length, @weights are boosts
+// of the terms, empty array means 1 for all of them
+ranked_result_t score(const find_result_t &results, const std::vector<dnet_raw_id> &ids,
+		const stats &st, size_t k, const bm25 &params = bm25(),
+		const std::function<uint32_t (const dnet_raw_id &id)> &length =
+			std::function<uint32_t (const dnet_raw_id &id)>(),
+		const std::vector<double> &weights = std::vector<double>());
+
+// Proximity of the query terms in a document, @found distinct terms out of @terms_num
+// are present in it and positions::window() of their positions is @window.
+// It is 1 if all terms are adjacent and decreases with the window length and the number
+// of missing terms, documents with less than two of the terms get 0.
+double proximity(int window, size_t found, size_t terms_num);
+
+// second ranking stage, computing positions windows is too expensive for all matches
+struct proximity_params {
+	double weight;	// 0 disables the stage
+	size_t depth;	// number of the best first stage candidates which are reranked
+
+	proximity_params(double weight_ = 0, size_t depth_ = 100) : weight(weight_), depth(depth_) {}
+};
+
+// adds proximity() multiplied by @prox.weight to the scores of the best @prox.depth entries
+// of @result and sorts them again, the rest is left in place (it can not overtake them,
+// since scores only grow), positions are taken from the index data of the entries,
+// @ids are index IDs of distinct query terms
+void rerank(ranked_result_t &result, const std::vector<dnet_raw_id> &ids, const proximity_params &prox);
+
+}}} // namespace ioremap::wookie::rank
+
+#endif /* __WOOKIE_RANK_HPP */
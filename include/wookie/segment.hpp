@@ -0,0 +1,258 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WOOKIE_SEGMENT_HPP
+#define __WOOKIE_SEGMENT_HPP
+
+#include "wookie/split.hpp"
+
+#include <elliptics/cppdef.h>
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace ioremap { namespace wookie {
+
+// Immutable on-disk inverted index segment.
+//
+// Layout (fixed-size records are stored in host byte order):
+//	header		magic, counts and offsets of the sections below
+//	documents	fixed-size records: document ID, timestamp, key offset and size,
+//			length (number of tokens)
+//	keys		document keys referenced by document records
+//	key hashes	(murmur hash of the key, document number) pairs sorted by hash
+//	dictionary	terms sorted and split into blocks of @dict_block_size terms,
+//			every term is prefix-compressed against the previous one in its block
+//			and followed by varint document frequency, maximum term frequency,
+//			postings and positions offsets
+//	dict index	offset and the first (uncompressed) term of every dictionary block
+//	postings	per term: number of blocks, skip entry (last document, docs and positions
+//			sizes) for every block, then blocks of @postings_block_size
+//			varint-delta document numbers with term frequency
+//	positions	per term and document: varint-delta positions, their number is the frequency
+//	priors		impact-ordered segments only: float prior of every document
+//
+// Documents are numbered by the segment in the order they were added, unless the segment
+// is impact-ordered: then they are numbered in descending order of their query-independent
+// prior, so that every posting list starts with the best documents and top-k evaluation
+// may stop after the first blocks.
+//
+// Version 1 segments have neither document lengths nor maximum term frequencies,
+// they are read as zeroes. Headers of versions 1 and 2 end before flags.
+struct segment_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	docs_num;
+	uint32_t	terms_num;
+	uint32_t	dict_blocks_num;
+
+	uint64_t	docs_offset;
+	uint64_t	keys_offset;
+	uint64_t	hashes_offset;
+	uint64_t	dict_offset;
+	uint64_t	dict_index_offset;
+	uint64_t	postings_offset;
+	uint64_t	positions_offset;
+	uint64_t	size;
+
+	uint32_t	flags;
+	uint32_t	reserved;
+	uint64_t	priors_offset;
+} __attribute__ ((packed));
+
+enum segment_flags {
+	segment_impact_ordered = 1,
+};
+
+struct segment_doc {
+	dnet_raw_id	id;
+	uint64_t	tsec;
+	uint64_t	tnsec;
+	uint64_t	key_offset;
+	uint32_t	key_size;
+	uint32_t	length;
+} __attribute__ ((packed));
+
+struct segment_key_hash {
+	uint64_t	hash;
+	uint32_t	doc;
+	uint32_t	reserved;
+} __attribute__ ((packed));
+
+struct segment_dict_index {
+	uint64_t	block_offset;
+	uint64_t	term_offset;
+	uint32_t	term_size;
+	uint32_t	reserved;
+} __attribute__ ((packed));
+
+static const char segment_magic[8] = { 'W', 'O', 'O', 'K', 'S', 'E', 'G', '\0' };
+static const uint32_t segment_version = 3;
+static const size_t dict_block_size = 32;
+static const size_t postings_block_size = 128;
+
+// document stored in segment
+struct segment_document {
+	dnet_raw_id	id;
+	dnet_time	ts;
+	std::string	key;
+};
+
+// Builds segment in memory and writes it into a file.
+class segment_writer {
+	public:
+		// returns segment-local document number
+		uint32_t add(const dnet_raw_id &id, const std::string &key, const dnet_time &ts, const mpos_t &pos);
+
+		// low-level interface used by merges, documents have to be added first,
+		// postings of every term have to be added in increasing document order
+		uint32_t add_document(const dnet_raw_id &id, const std::string &key, const dnet_time &ts);
+		void add_posting(const std::string &term, uint32_t doc, const std::vector<int> &pos);
+
+		// segment with priors is impact-ordered: write() renumbers documents in descending
+		// order of their priors, documents without prior get 0
+		void set_prior(uint32_t doc, float prior);
+		// sets priors of all added documents
+		void set_priors(const std::function<float (const segment_document &doc)> &prior);
+
+		size_t docs_num() const;
+		bool empty() const;
+		void clear();
+
+		// file is written under temporary name and renamed, so readers never see partial segment
+		//
+		// older @version is written for readers which have not been upgraded yet (and to check
+		// that they are still read), it drops what the version has no place for: lengths and
+		// maximum term frequencies in version 1, priors in versions 1 and 2 (documents are
+		// still numbered in descending order of their priors)
+		void write(const std::string &path, uint32_t version = segment_version);
+
+	private:
+		struct posting {
+			uint32_t		doc;
+			std::vector<int>	pos;
+		};
+
+		std::vector<segment_document> m_docs;
+		std::map<std::string, std::vector<posting>> m_terms;
+		std::vector<float> m_priors;
+
+		void impact_order();
+};
+
+// Read-only segment mapped into memory.
+class segment {
+	public:
+		struct term_info {
+			uint32_t	df;
+			uint32_t	max_tf;		// 0 if unknown
+			uint64_t	postings;	// offsets within postings and positions sections
+			uint64_t	positions;
+			uint64_t	postings_size;	// up to the next term, including skip entries
+			uint64_t	positions_size;
+		};
+
+		explicit segment(const std::string &path);
+		~segment();
+
+		segment(const segment &) = delete;
+		segment &operator =(const segment &) = delete;
+
+		const std::string &path() const;
+		uint32_t docs_num() const;
+		uint32_t terms_num() const;
+		uint64_t size() const;
+
+		// number of tokens in the document and in the whole segment, 0 if unknown
+		uint32_t length(uint32_t doc) const;
+		uint64_t tokens_num() const;
+
+		segment_document document(uint32_t doc) const;
+		bool contains(const std::string &key) const;
+
+		bool lookup(const std::string &term, term_info &info) const;
+
+		// sorted document numbers containing the term
+		void postings(const term_info &info, std::vector<uint32_t> &docs) const;
+		// the same with term frequency of every document
+		void postings(const term_info &info, std::vector<uint32_t> &docs, std::vector<uint32_t> &tfs) const;
+
+		// postings of documents in [@first, @last) only, blocks outside of the range are skipped
+		void postings(const term_info &info, uint32_t first, uint32_t last,
+				std::vector<uint32_t> &docs, std::vector<uint32_t> &tfs) const;
+
+		// whether documents are numbered in descending order of their priors,
+		// prior() is 0 for other segments
+		bool impact_ordered() const;
+		float prior(uint32_t doc) const;
+
+		// positions of the term in @doc, empty if document does not contain it,
+		// only the block which hosts @doc is decoded
+		std::vector<int> positions(const term_info &info, uint32_t doc) const;
+
+		// all postings of the term with their positions
+		void for_each_posting(const term_info &info,
+				const std::function<void (uint32_t doc, const std::vector<int> &pos)> &fn) const;
+
+		void for_each_term(const std::function<void (const std::string &term, const term_info &info)> &fn) const;
+
+		// asks kernel to read postings (and positions if @positions is set) of the terms
+		// in the background, it is called before query evaluation, so that page faults
+		// do not happen one by one
+		void prefetch(const std::vector<term_info> &terms, bool positions = true) const;
+
+	private:
+		std::string m_path;
+		int m_fd;
+		const char *m_data;
+		uint64_t m_size;
+		const segment_header *m_header;
+		uint64_t m_tokens_num;
+		const float *m_priors;
+
+		struct block {
+			uint32_t	last_doc;
+			uint64_t	docs_size;
+			uint64_t	positions_size;
+		};
+
+		// checks the header and that sections, document records, key hashes and dictionary
+		// index entries lie within the file, varint-encoded data is checked when it is read
+		bool valid_layout() const;
+
+		// parses dictionary entry which follows the term
+		void read_term(const char *&ptr, const char *end, term_info &info) const;
+		// sets sizes of term @index from offsets of the next term, whose dictionary entry starts at @ptr
+		void read_extent(uint32_t index, const char *ptr, term_info &info) const;
+
+		// @tfs may be null
+		void decode_postings(const term_info &info, std::vector<uint32_t> &docs, std::vector<uint32_t> *tfs,
+				uint32_t first = 0, uint32_t last = ~0U) const;
+
+		// parses skip entries, @ptr is moved to the first block
+		void read_blocks(const term_info &info, std::vector<block> &blocks, const char *&ptr) const;
+
+		const char *section(uint64_t offset) const;
+		const char *end() const;
+};
+
+}} // namespace ioremap::wookie
+
+#endif /* __WOOKIE_SEGMENT_HPP */
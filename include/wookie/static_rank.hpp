@@ -0,0 +1,87 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WOOKIE_STATIC_RANK_HPP
+#define __WOOKIE_STATIC_RANK_HPP
+
+#include "wookie/doc_registry.hpp"
+#include "wookie/segment.hpp"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <time.h>
+
+namespace ioremap { namespace wookie {
+
+// Query-independent score of every document numbered by doc_registry, e.g. its PageRank.
+//
+// It is computed by offline jobs and then only read, so it is not synchronized.
+class static_rank {
+	public:
+		static_rank();
+		explicit static_rank(const std::vector<float> &values);
+
+		// 0 for unknown documents
+		float get(uint32_t doc) const;
+		void set(uint32_t doc, float value);
+
+		size_t size() const;
+		const std::vector<float> &values() const;
+
+		// binary dump, it is written under temporary name and renamed
+		void save(const std::string &path) const;
+		// replaces current content
+		void load(const std::string &path);
+
+	private:
+		std::vector<float> m_values;
+};
+
+struct prior_params {
+	double rank_weight;
+	double freshness_weight;
+	// seconds
+	double half_life;
+	// documents older than that have no freshness, it only keeps the values small
+	time_t epoch;
+
+	prior_params() : rank_weight(1), freshness_weight(0.5), half_life(30 * 24 * 3600),
+	epoch(1356998400) {}
+};
+
+// Document prior for impact-ordered segments (see local_index::set_prior()): static rank
+// of the document scaled by the largest one, so that it is within [0, 1], plus freshness.
+//
+// Priors are stored in segments and have to be comparable between segments written at
+// different times, so freshness does not depend on the current time: it is the number of
+// @half_life periods between @epoch and the document timestamp, i.e. log2 of the weight
+// which halves every @half_life seconds of the document age, shifted by a constant which
+// is the same for all documents at query time. Document which is newer by @half_life
+// gets @freshness_weight more.
+//
+// Documents are looked up in @registry by their IDs, unknown ones have no static rank.
+// The prior keeps both @ranks and @registry alive, so it stays valid after storage
+// gets another registry via storage::set_doc_registry().
+std::function<float (const segment_document &doc)> document_prior(const std::shared_ptr<static_rank> &ranks,
+		const std::shared_ptr<doc_registry> &registry, const prior_params &params = prior_params());
+
+}} // namespace ioremap::wookie
+
+#endif /* __WOOKIE_STATIC_RANK_HPP */
@@ -17,6 +17,19 @@
 #ifndef __WOOKIE_STORAGE_HPP
 #define __WOOKIE_STORAGE_HPP
 
+#include "backend.hpp"
+#include "cache.hpp"
+#include "chunk.hpp"
+#include "collection_stats.hpp"
+#include "compress.hpp"
+#include "delta_index.hpp"
+#include "dictionary.hpp"
+#include "doc_registry.hpp"
+#include "future.hpp"
+#include "latency.hpp"
+#include "local_index.hpp"
+#include "query.hpp"
+#include "rank.hpp"
 #include "split.hpp"
 #include "index_data.hpp"
 
@@ -26,34 +39,259 @@
 
 namespace ioremap { namespace wookie {
 
+// indexes document @key has to be added to, see storage::set_indexes()
+struct document_indexes {
+	std::string key;
+	std::vector<std::string> indexes;
+	std::vector<elliptics::data_pointer> datas;
+};
+
 class storage {
 	public:
+		// storage on top of elliptics cluster
 		explicit storage(elliptics::node &&node);
+		// storage on top of arbitrary backend, for example in-process wookie::memory_backend
+		explicit storage(const std::shared_ptr<wookie::backend> &b);
 
 		void set_groups(const std::vector<int> groups);
+
+		// reads are sent to the group with the lowest observed latency first,
+		// with hedged reads enabled, read_document() also sends the same request
+		// to the next group if the first one has not replied within its 95th
+		// latency percentile (or @default_delay msecs until there are enough samples),
+		// failed and timed out reads are charged to the group with a penalty latency,
+		// groups without samples are ranked by @default_delay
+		void set_hedged_reads(bool enable, long default_delay = 50);
+		double group_average_latency(int group);
         	void set_namespace(const std::string &ns);
 
-		std::vector<elliptics::find_indexes_result_entry> find(const std::vector<std::string> &indexes);
-		std::vector<elliptics::find_indexes_result_entry> find(const std::vector<dnet_raw_id> &indexes);
+		// codec used by write_document() and pack(), compress::lz4 by default
+		// if it is compress::zstd and document's host has trained dictionary, compress::zstd_dict is used
+		void set_codec(int codec);
+
+		// enables in-process cache of unpacked documents read by read_document()
+		// @size is a byte budget for document bodies, 0 disables the cache
+		// cached entry is dropped when document is written via write_document()
+		void set_cache_size(size_t size);
+		cache_stats get_cache_stats();
+
+		// documents larger than @size bytes are written by write_document() in chunks
+		// of that size (see wookie/chunk.hpp), 0 disables chunking
+		void set_chunk_size(size_t size);
+
+		typedef wookie::find_result_t find_result_t;
 
-		elliptics::async_write_result write_document(ioremap::wookie::document &d);
-		elliptics::async_read_result read_data(const elliptics::key &key);
+		// errors are not reported, empty result is returned instead
+		find_result_t find(const std::vector<std::string> &indexes);
+		find_result_t find(const std::vector<dnet_raw_id> &indexes);
+
+		// writes document body and its metadata record
+		future<int> write_document(ioremap::wookie::document &d);
+		future<int> write_document(ioremap::wookie::document &d, const document_meta &meta);
+
+		// raw object access within storage namespace
+		future<elliptics::data_pointer> read_data(const elliptics::key &key);
+		future<int> write_data(const elliptics::key &key, const elliptics::data_pointer &data);
 
 		document read_document(const elliptics::key &key);
 
-		static elliptics::data_pointer pack_document(const std::string &url, const std::string &data);
-		static elliptics::data_pointer pack_document(ioremap::wookie::document &doc);
+		// reads only metadata record of the document, falls back to reading
+		// the whole document if it was written without metadata
+		document_meta read_meta(const elliptics::key &key);
+
+		// non-blocking versions of the methods above, they use latency-ordered
+		// groups, but never send hedged requests
+		future<document> async_read_document(const elliptics::key &key);
+		future<document_meta> async_read_meta(const elliptics::key &key);
+
+		typedef std::function<void (const std::string &data)> chunk_handler_t;
+
+		// reads document body piece by piece, @handler is called for every chunk in order
+		// (once for documents which are not chunked), the next chunk is prefetched while
+		// handler processes current one, so at most two chunks are kept in memory
+		future<int> read_stream(const elliptics::key &key, const chunk_handler_t &handler);
+
+		// local and delta indexes do not read positions unless @positions is set,
+		// elliptics secondary indexes always return them
+		future<find_result_t> async_find(const std::vector<std::string> &indexes, bool positions = true);
+		future<find_result_t> async_find(const std::vector<dnet_raw_id> &indexes);
+
+		// documents matching boolean query, local and delta indexes plan it per segment/batch,
+		// with elliptics indexes positive terms and phrases of the top-level AND are searched
+		// at once, tokens of the other operands separately, and the plan runs over the fetched lists
+		future<find_result_t> async_find(const query::node &q, bool positions = true);
+
+		// best @k documents containing any of @indexes ranked by BM25 (see wookie/rank.hpp)
+		// local index evaluates it with WAND pruning; without local index all documents containing
+		// any of the tokens are fetched from elliptics and scored with lengths from collection
+		// statistics, elliptics index data always has positions
+		//
+		// documents which are still in delta index are scored exhaustively with the same statistics
+		// and lengths from collection statistics, and replace their persistent versions in the top
+		//
+		// if @prox is enabled, max(@k, @prox.depth) best documents are reranked by proximity
+		// of the body tokens (see rank::rerank()), their entries always have positions then
+		//
+		// @weights are boosts of @indexes, usually field tokens with field weights produced
+		// by fields::expand(), empty array means 1 for all of them
+		//
+		// @prior is weight of document priors of the local index (see local_index::top()),
+		// elliptics indexes have no priors
+		future<rank::ranked_result_t> async_top(const std::vector<std::string> &indexes, size_t k,
+				const rank::bm25 &params = rank::bm25(), bool positions = false,
+				const rank::proximity_params &prox = rank::proximity_params(),
+				const std::vector<double> &weights = std::vector<double>(), double prior = 0);
+
+		// searches by tokens go to @local index instead of elliptics secondary indexes,
+		// searches by raw index IDs are not affected, empty pointer disables local index
+		void set_local_index(const std::shared_ptr<local_index> &local);
+
+		// token searches also look into @delta index of freshly added documents,
+		// its results replace results of persistent index for the same documents,
+		// documents added to it are accounted in collection statistics
+		void set_delta_index(const std::shared_ptr<delta_index> &delta);
+
+		static elliptics::data_pointer pack_document(const std::string &url, const std::string &data,
+				int codec = compress::lz4);
+		static elliptics::data_pointer pack_document(const ioremap::wookie::document &doc,
+				int codec = compress::lz4);
+		// static unpacking has no access to zstd dictionaries, documents packed with
+		// compress::zstd_dict throw -ENOENT, they have to be unpacked with unpack() below
 		static document unpack_document(const elliptics::data_pointer &result);
 
+		// raw and packed sizes of all document bodies packed by this process
+		static const compress::stats &compression_stats();
+
+		// the same as static pack/unpack methods, but use configured codec and
+		// fetch per-host zstd dictionaries from the storage when needed
+		// chunked documents are unpacked into their manifest (compress::chunked codec),
+		// their body has to be read with read_document() or read_stream()
+		elliptics::data_pointer pack(const ioremap::wookie::document &doc);
+		document unpack(const elliptics::data_pointer &result);
+
+		// stores new dictionary and makes it current for given host
+		// returns dictionary ID
+		unsigned int write_dictionary(const std::string &host, const std::string &content);
+
+		// token to index ID transformation, results are cached (the cache is shared
+		// between indexing and search and is dropped when namespace changes)
+		dnet_raw_id transform_token(const std::string &token);
 		std::vector<dnet_raw_id> transform_tokens(const std::vector<std::string> &tokens);
+		void set_token_cache_size(size_t size);
+
+		// ID of the object @key points to within storage namespace
+		dnet_raw_id transform_key(const elliptics::key &key);
+
+		// adds object to indexes, index names are transformed using token cache
+		future<int> set_indexes(const elliptics::key &key,
+				const std::vector<std::string> &indexes, const std::vector<elliptics::data_pointer> &datas);
+		// the same for many documents at once via single backend batch, the first error is reported
+		future<int> set_indexes(const std::vector<document_indexes> &docs);
+
+		// dense numbers of documents written via write_document() or assigned by the caller
+		// (e.g. targets of crawled links), searches only look them up,
+		// the registry may be shared between storages or loaded from disk and installed here
+		doc_registry &get_doc_registry();
+		void set_doc_registry(const std::shared_ptr<doc_registry> &registry);
 
+		// statistics of the documents indexed via delta index, they are used by ranking
+		// when local index is not set, installed statistics replaces current one
+		// in delta index too
+		collection_stats &get_collection_stats();
+		void set_collection_stats(const std::shared_ptr<collection_stats> &stats);
+
+		wookie::backend &get_backend();
+
+		// direct elliptics access, these throw -ENOTSUP if storage is not backed by elliptics
 		elliptics::session create_session(void);
 		elliptics::node get_node();
 
 	private:
-		elliptics::node m_node;
-		elliptics::session m_sess;
+		friend class chunk_writer;
+
+		std::shared_ptr<wookie::backend> m_backend;
+		elliptics_backend *m_elliptics;
+
+		std::string m_namespace;
+		std::vector<int> m_groups;
+
+		bool m_hedged_reads;
+		long m_hedge_default_delay;
+		std::shared_ptr<group_latency> m_latency;
 		wookie::split m_spl;
+		int m_codec;
+		size_t m_chunk_size;
+		compress::dictionary_cache m_dicts;
+
+		typedef lru_cache<dnet_raw_id, std::shared_ptr<const document>, raw_id_hash, raw_id_equal> document_cache_t;
+		std::unique_ptr<document_cache_t> m_cache;
+
+		typedef lru_cache<std::string, dnet_raw_id> token_cache_t;
+		std::unique_ptr<token_cache_t> m_tokens;
+
+		std::shared_ptr<local_index> m_local;
+		std::shared_ptr<delta_index> m_delta;
+		std::shared_ptr<doc_registry> m_registry;
+		std::shared_ptr<collection_stats> m_stats;
+
+		// metadata records are stored under the same keys in a separate namespace
+		std::string meta_namespace() const;
+		std::string chunks_namespace() const;
+		dnet_raw_id transform_key(const elliptics::key &key, const std::string &ns);
+
+		// reads the whole object using latency-ordered (and hedged if enabled) groups
+		elliptics::data_pointer read_file(const dnet_raw_id &id, const std::string &name);
+		future<elliptics::data_pointer> async_read_file(const dnet_raw_id &id, const std::string &name);
+
+		// writes packed document body and its metadata
+		future<int> write_object(const std::string &key, const elliptics::data_pointer &body, const document_meta &meta);
+
+		// @version is version of the manifest
+		static std::string chunk_name(const std::string &key, const dnet_time &ts, int version, uint32_t n);
+		static chunk_manifest unpack_manifest(const document &doc);
+		future<int> write_chunk(const std::string &key, const dnet_time &ts, uint32_t n, const std::string &data);
+		future<document> async_read_chunk(const std::string &key, const dnet_time &ts, int version, uint32_t n);
+
+		// the same as unpack(), but dictionary which is not cached yet is read asynchronously,
+		// so it never blocks and may be called from backend completion handlers
+		future<document> async_unpack(const elliptics::data_pointer &result);
+		// reads and unpacks the object via async_unpack()
+		future<document> async_read_packed(const dnet_raw_id &id, const std::string &name);
+
+		std::vector<elliptics::index_entry> index_entries(const std::string &key,
+				const std::vector<std::string> &indexes, const std::vector<elliptics::data_pointer> &datas);
+
+		// currently stored version of the document before it is overwritten, its body is not
+		// unpacked (so no dictionaries are needed), only manifests of chunked documents are used
+		future<document> read_previous(const std::string &key);
+
+		// removes chunks of @previous document if it is chunked and is not the version @ts,
+		// failures are ignored, leftover chunks only waste space
+		future<int> remove_chunks(future<document> previous, const dnet_time &ts);
+
+		// elliptics indexes can only intersect, so every exclusion group is searched together
+		// with @indexes and documents found this way are removed from @found
+		future<find_result_t> exclude_found(future<find_result_t> found, const std::vector<std::string> &indexes,
+				const exclusion_t &exclude);
+
+		// elliptics part of the query search, negated terms and phrases of the top-level AND
+		// are applied by exclude_found() if it has positive operands
+		future<find_result_t> async_find_tokens(const query::node &q);
+
+		// returns @doc itself if it is not chunked, otherwise reads all its chunks
+		future<document> read_chunks(const document &doc);
+
+		struct stream_read;
+		void stream_chunks(const std::shared_ptr<stream_read> &ctx, uint32_t n, future<document> chunk);
+
+		static document_meta unpack_meta(const elliptics::data_pointer &result);
+
+		static elliptics::data_pointer pack_document(const ioremap::wookie::document &doc,
+				int codec, const std::string &packed);
+		static document unpack_document(const elliptics::data_pointer &result, compress::dictionary_cache *dicts);
+
+		compress::shared_dictionary_t load_dictionary(unsigned int id);
+		unsigned int load_host_dictionary(const std::string &host);
 };
 
 }}
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WOOKIE_VARINT_HPP
+#define __WOOKIE_VARINT_HPP
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include <elliptics/error.hpp>
+
+namespace ioremap { namespace wookie { namespace varint {
+
+// LEB128: 7 bits per byte, the highest bit is set in every byte but the last one
+static inline void put(std::string &out, uint64_t value)
+{
+	while (value >= 0x80) {
+		out.push_back((char)((value & 0x7f) | 0x80));
+		value >>= 7;
+	}
+
+	out.push_back((char)value);
+}
+
+// decodes one value and advances @ptr, throws -EPROTO on truncated input
+static inline uint64_t get(const char *&ptr, const char *end)
+{
+	uint64_t value = 0;
+
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (ptr >= end)
+			ioremap::elliptics::throw_error(-EPROTO, "varint: truncated input");
+
+		unsigned char byte = *ptr++;
+		value |= (uint64_t)(byte & 0x7f) << shift;
+
+		if (!(byte & 0x80))
+			return value;
+	}
+
+	ioremap::elliptics::throw_error(-EPROTO, "varint: value is too long");
+	return 0;
+}
+
+// sorted sequence is stored as the first value followed by gaps between neighbours
+static inline void put_deltas(std::string &out, const std::vector<int> &sorted)
+{
+	int prev = 0;
+	for (auto v : sorted) {
+		put(out, (uint32_t)(v - prev));
+		prev = v;
+	}
+}
+
+static inline void get_deltas(const char *ptr, const char *end, std::vector<int> &sorted)
+{
+	int prev = 0;
+	while (ptr < end) {
+		prev += (int)get(ptr, end);
+		sorted.push_back(prev);
+	}
+}
+
+}}} // namespace ioremap::wookie::varint
+
+#endif /* __WOOKIE_VARINT_HPP */
@@ -0,0 +1,331 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "wookie/anchor_index.hpp"
+#include "wookie/hash.hpp"
+
+#include <elliptics/error.hpp>
+
+#include <algorithm>
+#include <fstream>
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace ioremap { namespace wookie {
+
+namespace {
+	static const char anchors_magic[8] = { 'W', 'O', 'O', 'K', 'A', 'N', 'C', 'H' };
+	static const uint32_t anchors_version = 1;
+
+	// longer texts are cut, they are navigation blocks or images' alt text rather than anchors
+	static const size_t max_text_size = 256;
+
+	struct anchors_header {
+		char		magic[8];
+		uint32_t	version;
+		uint32_t	reserved;
+		uint64_t	targets_num;
+	} __attribute__ ((packed));
+
+	std::string normalize(const std::string &text) {
+		std::string ret;
+		bool space = false;
+
+		for (char ch : text) {
+			if (isspace((unsigned char)ch)) {
+				space = ret.size() != 0;
+				continue;
+			}
+
+			if (space)
+				ret.push_back(' ');
+			ret.push_back(ch);
+			space = false;
+
+			if (ret.size() >= max_text_size)
+				break;
+		}
+
+		return ret;
+	}
+
+	void write_string(std::string &out, const std::string &str) {
+		uint32_t size = str.size();
+		out.append((const char *)&size, sizeof(size));
+		out.append(str);
+	}
+
+	void read_string(std::istream &in, std::string &str) {
+		uint32_t size = 0;
+		in.read((char *)&size, sizeof(size));
+		if (!in || size > (1 << 20)) {
+			in.setstate(std::ios::failbit);
+			return;
+		}
+
+		str.resize(size);
+		in.read(&str[0], size);
+	}
+}
+
+anchor_index::anchor_index(size_t batch_links, size_t max_texts) :
+m_batch_links(batch_links), m_max_texts(max_texts)
+{
+}
+
+void anchor_index::add(const std::string &source, const std::string &target, const std::string &text)
+{
+	link l;
+	l.text = normalize(text);
+	if (l.text.empty() || target.empty())
+		return;
+
+	l.target = target;
+	l.seen = hash::murmur(source + '\0' + l.text, 0);
+
+	std::vector<link> batch;
+	{
+		std::unique_lock<std::mutex> guard(m_pending_lock);
+		m_pending.emplace_back(std::move(l));
+
+		if (m_pending.size() < m_batch_links)
+			return;
+
+		batch.swap(m_pending);
+	}
+
+	merge(batch);
+}
+
+std::vector<std::string> anchor_index::flush()
+{
+	merge_pending();
+
+	std::unique_lock<std::mutex> guard(m_lock);
+	std::vector<std::string> changed(m_changed.begin(), m_changed.end());
+	m_changed.clear();
+	return changed;
+}
+
+void anchor_index::merge_pending()
+{
+	std::vector<link> batch;
+	{
+		std::unique_lock<std::mutex> guard(m_pending_lock);
+		batch.swap(m_pending);
+	}
+
+	merge(batch);
+}
+
+void anchor_index::merge(std::vector<link> &links)
+{
+	if (links.empty())
+		return;
+
+	std::sort(links.begin(), links.end(), [] (const link &a, const link &b) {
+			int cmp = a.target.compare(b.target);
+			if (cmp)
+				return cmp < 0;
+			return a.seen < b.seen;
+		});
+
+	std::unique_lock<std::mutex> guard(m_lock);
+
+	for (size_t i = 0; i < links.size(); ) {
+		size_t end = i;
+		while (end < links.size() && links[end].target == links[i].target)
+			++end;
+
+		target_anchors &ta = m_targets[links[i].target];
+		std::vector<uint64_t> fresh;
+		bool updated = false;
+
+		for (size_t j = i; j < end; ++j) {
+			const link &l = links[j];
+			if ((j > i && l.seen == links[j - 1].seen) ||
+					std::binary_search(ta.seen.begin(), ta.seen.end(), l.seen))
+				continue;
+
+			auto it = std::find_if(ta.anchors.begin(), ta.anchors.end(),
+					[&] (const anchor &a) { return a.text == l.text; });
+			if (it != ta.anchors.end()) {
+				++it->sources;
+			} else if (ta.anchors.size() < m_max_texts) {
+				anchor a;
+				a.text = l.text;
+				a.sources = 1;
+				ta.anchors.emplace_back(std::move(a));
+			} else {
+				continue;
+			}
+
+			fresh.push_back(l.seen);
+			updated = true;
+		}
+
+		if (updated) {
+			std::vector<uint64_t> seen;
+			seen.reserve(ta.seen.size() + fresh.size());
+			std::merge(ta.seen.begin(), ta.seen.end(), fresh.begin(), fresh.end(), std::back_inserter(seen));
+			ta.seen.swap(seen);
+
+			m_changed.insert(links[i].target);
+		}
+
+		i = end;
+	}
+}
+
+std::vector<anchor_index::anchor> anchor_index::anchors(const std::string &target)
+{
+	merge_pending();
+
+	std::vector<anchor> ret;
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		auto it = m_targets.find(target);
+		if (it != m_targets.end())
+			ret = it->second.anchors;
+	}
+
+	std::stable_sort(ret.begin(), ret.end(), [] (const anchor &a, const anchor &b) {
+			return a.sources > b.sources;
+		});
+	return ret;
+}
+
+std::vector<std::string> anchor_index::texts(const std::string &target)
+{
+	std::vector<std::string> ret;
+	for (auto & a : anchors(target))
+		ret.emplace_back(std::move(a.text));
+	return ret;
+}
+
+size_t anchor_index::targets_num()
+{
+	std::unique_lock<std::mutex> guard(m_lock);
+	return m_targets.size();
+}
+
+// layout: header, then for every target: target, uint32_t anchors number,
+// anchors (text, uint32_t sources), uint32_t seen number, uint64_t seen hashes
+void anchor_index::save(const std::string &path)
+{
+	merge_pending();
+
+	std::string tmp = path + ".tmp";
+	std::ofstream out(tmp.c_str(), std::ios::binary | std::ios::trunc);
+	if (!out)
+		elliptics::throw_error(-errno, "anchor index: could not open %s", tmp.c_str());
+
+	std::string data;
+	anchors_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, anchors_magic, sizeof(header.magic));
+	header.version = anchors_version;
+
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		header.targets_num = m_targets.size();
+
+		for (auto & t : m_targets) {
+			write_string(data, t.first);
+
+			uint32_t num = t.second.anchors.size();
+			data.append((const char *)&num, sizeof(num));
+			for (auto & a : t.second.anchors) {
+				write_string(data, a.text);
+				data.append((const char *)&a.sources, sizeof(a.sources));
+			}
+
+			num = t.second.seen.size();
+			data.append((const char *)&num, sizeof(num));
+			data.append((const char *)t.second.seen.data(), num * sizeof(uint64_t));
+		}
+	}
+
+	out.write((const char *)&header, sizeof(header));
+	out.write(data.data(), data.size());
+
+	out.close();
+	if (!out) {
+		unlink(tmp.c_str());
+		elliptics::throw_error(-EIO, "anchor index: could not write %s", tmp.c_str());
+	}
+
+	if (rename(tmp.c_str(), path.c_str()) < 0) {
+		int err = -errno;
+		unlink(tmp.c_str());
+		elliptics::throw_error(err, "anchor index: could not rename %s to %s", tmp.c_str(), path.c_str());
+	}
+}
+
+void anchor_index::load(const std::string &path)
+{
+	std::ifstream in(path.c_str(), std::ios::binary);
+	if (!in)
+		elliptics::throw_error(-ENOENT, "anchor index: could not open %s", path.c_str());
+
+	anchors_header header;
+	in.read((char *)&header, sizeof(header));
+	if (!in || memcmp(header.magic, anchors_magic, sizeof(header.magic)) || header.version != anchors_version)
+		elliptics::throw_error(-EPROTO, "anchor index: %s: invalid header", path.c_str());
+
+	std::unordered_map<std::string, target_anchors> targets;
+
+	for (uint64_t i = 0; i < header.targets_num && in; ++i) {
+		std::string target;
+		read_string(in, target);
+
+		target_anchors &ta = targets[target];
+
+		uint64_t sources = 0;
+		uint32_t num = 0;
+		in.read((char *)&num, sizeof(num));
+		for (uint32_t j = 0; j < num && in; ++j) {
+			anchor a;
+			read_string(in, a.text);
+			in.read((char *)&a.sources, sizeof(a.sources));
+			sources += a.sources;
+			ta.anchors.emplace_back(std::move(a));
+		}
+
+		// every seen link has added a source to one of the anchors, so corrupted
+		// count is caught before it is allocated
+		num = 0;
+		in.read((char *)&num, sizeof(num));
+		if (!in || num != sources) {
+			in.setstate(std::ios::failbit);
+			break;
+		}
+
+		ta.seen.resize(num);
+		in.read((char *)ta.seen.data(), num * sizeof(uint64_t));
+	}
+
+	if (!in)
+		elliptics::throw_error(-EPROTO, "anchor index: %s: truncated file", path.c_str());
+
+	std::unique_lock<std::mutex> guard(m_lock);
+	m_targets.swap(targets);
+}
+
+}} // namespace ioremap::wookie
@@ -0,0 +1,378 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "wookie/backend.hpp"
+#include "wookie/hash.hpp"
+
+namespace ioremap { namespace wookie {
+
+future<int> backend::set_indexes_batch(const std::vector<object_indexes> &objects) {
+	std::vector<future<int>> res;
+	res.reserve(objects.size());
+
+	for (auto & obj : objects)
+		res.emplace_back(set_indexes(obj.id, obj.entries));
+
+	future<int> ret;
+	when_all(res).connect([ret] (const std::vector<int> &, const elliptics::error_info &err) mutable {
+		if (err)
+			ret.complete(err);
+		else
+			ret.complete(0);
+	});
+
+	return ret;
+}
+
+elliptics_backend::elliptics_backend(elliptics::node &&node) : m_node(node), m_sess(m_node) {
+	m_sess.set_exceptions_policy(elliptics::session::no_exceptions);
+	m_sess.set_ioflags(DNET_IO_FLAGS_CACHE);
+	m_sess.set_timeout(1000);
+}
+
+void elliptics_backend::set_groups(const std::vector<int> &groups) {
+	m_sess.set_groups(groups);
+}
+
+dnet_raw_id elliptics_backend::transform(const std::string &ns, const std::string &name) {
+	elliptics::session s = m_sess.clone();
+	if (ns.size())
+		s.set_namespace(ns.c_str(), ns.size());
+
+	dnet_raw_id id;
+	s.transform(name, id);
+	return id;
+}
+
+elliptics::session elliptics_backend::create_session(void) {
+	return m_sess.clone();
+}
+
+elliptics::session elliptics_backend::create_session(const std::vector<int> &groups) {
+	elliptics::session s = m_sess.clone();
+	if (groups.size())
+		s.set_groups(groups);
+
+	return s;
+}
+
+elliptics::node elliptics_backend::get_node() {
+	return m_sess.get_node();
+}
+
+future<read_reply> elliptics_backend::read(const dnet_raw_id &id, const std::vector<int> &groups) {
+	future<read_reply> ret;
+
+	create_session(groups).read_data(elliptics::key(id), 0, 0).connect(
+		[ret] (const elliptics::sync_read_result &result, const elliptics::error_info &err) mutable {
+			if (err) {
+				ret.complete(err);
+				return;
+			}
+
+			if (result.empty()) {
+				ret.complete(elliptics::create_error(-ENOENT, "empty read result"));
+				return;
+			}
+
+			read_reply reply;
+			reply.file = result[0].file();
+			reply.group = result[0].command()->id.group_id;
+			ret.complete(reply);
+		});
+
+	return ret;
+}
+
+future<int> elliptics_backend::write(const dnet_raw_id &id, const elliptics::data_pointer &data) {
+	future<int> ret;
+
+	create_session().write_data(elliptics::key(id), data, 0).connect(
+		[ret] (const elliptics::sync_write_result &, const elliptics::error_info &err) mutable {
+			if (err)
+				ret.complete(err);
+			else
+				ret.complete(0);
+		});
+
+	return ret;
+}
+
+future<int> elliptics_backend::remove(const dnet_raw_id &id) {
+	future<int> ret;
+
+	create_session().remove(elliptics::key(id)).connect(
+		[ret] (const elliptics::sync_remove_result &, const elliptics::error_info &err) mutable {
+			if (err)
+				ret.complete(err);
+			else
+				ret.complete(0);
+		});
+
+	return ret;
+}
+
+future<int> elliptics_backend::set_indexes(const dnet_raw_id &id, const std::vector<elliptics::index_entry> &entries) {
+	future<int> ret;
+
+	create_session().set_indexes(elliptics::key(id), entries).connect(
+		[ret] (const elliptics::sync_set_indexes_result &, const elliptics::error_info &err) mutable {
+			if (err)
+				ret.complete(err);
+			else
+				ret.complete(0);
+		});
+
+	return ret;
+}
+
+future<find_result_t> elliptics_backend::find(const std::vector<dnet_raw_id> &indexes, const std::vector<int> &groups) {
+	future<find_result_t> ret;
+
+	create_session(groups).find_all_indexes(indexes).connect(
+		[ret] (const elliptics::sync_find_indexes_result &result, const elliptics::error_info &err) mutable {
+			if (err)
+				ret.complete(err);
+			else
+				ret.complete(result);
+		});
+
+	return ret;
+}
+
+memory_backend::memory_backend(std::chrono::microseconds latency) :
+m_latency(latency), m_need_exit(false), m_thread(std::bind(&memory_backend::delayed_worker, this)) {
+}
+
+memory_backend::~memory_backend() {
+	{
+		std::unique_lock<std::mutex> guard(m_delayed_lock);
+		m_need_exit = true;
+		m_delayed_cond.notify_all();
+	}
+
+	m_thread.join();
+}
+
+dnet_raw_id memory_backend::transform(const std::string &ns, const std::string &name) {
+	// IDs only have to be stable within the process, so cheap murmur hashes
+	// with different seeds are used instead of elliptics' sha512
+	std::string full = ns + '\0' + name;
+
+	dnet_raw_id id;
+	for (size_t i = 0; i < sizeof(id.id) / sizeof(uint64_t); ++i) {
+		uint64_t h = hash::murmur(full, i + 1);
+		memcpy(id.id + i * sizeof(uint64_t), &h, sizeof(uint64_t));
+	}
+
+	return id;
+}
+
+future<read_reply> memory_backend::read(const dnet_raw_id &id, const std::vector<int> &groups) {
+	future<read_reply> ret;
+
+	read_reply reply;
+	reply.group = groups.empty() ? -1 : groups[0];
+
+	bool found = false;
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		auto it = m_objects.find(id);
+		if (it != m_objects.end()) {
+			reply.file = it->second;
+			found = true;
+		}
+	}
+
+	complete([ret, reply, found] () mutable {
+		if (found)
+			ret.complete(reply);
+		else
+			ret.complete(elliptics::create_error(-ENOENT, "memory backend: object not found"));
+	});
+
+	return ret;
+}
+
+future<int> memory_backend::write(const dnet_raw_id &id, const elliptics::data_pointer &data) {
+	future<int> ret;
+
+	elliptics::data_pointer copy = elliptics::data_pointer::copy(data.data(), data.size());
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		m_objects[id] = copy;
+	}
+
+	complete([ret] () mutable {
+		ret.complete(0);
+	});
+
+	return ret;
+}
+
+future<int> memory_backend::remove(const dnet_raw_id &id) {
+	future<int> ret;
+
+	bool found;
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		found = m_objects.erase(id) != 0;
+	}
+
+	complete([ret, found] () mutable {
+		if (found)
+			ret.complete(0);
+		else
+			ret.complete(elliptics::create_error(-ENOENT, "memory backend: object not found"));
+	});
+
+	return ret;
+}
+
+future<int> memory_backend::set_indexes(const dnet_raw_id &id, const std::vector<elliptics::index_entry> &entries) {
+	future<int> ret;
+
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		for (auto & e : entries)
+			m_indexes[e.index][id] = elliptics::data_pointer::copy(e.data.data(), e.data.size());
+	}
+
+	complete([ret] () mutable {
+		ret.complete(0);
+	});
+
+	return ret;
+}
+
+future<int> memory_backend::set_indexes_batch(const std::vector<object_indexes> &objects) {
+	future<int> ret;
+
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		for (auto & obj : objects) {
+			for (auto & e : obj.entries)
+				m_indexes[e.index][obj.id] = elliptics::data_pointer::copy(e.data.data(), e.data.size());
+		}
+	}
+
+	complete([ret] () mutable {
+		ret.complete(0);
+	});
+
+	return ret;
+}
+
+future<find_result_t> memory_backend::find(const std::vector<dnet_raw_id> &indexes, const std::vector<int> &) {
+	future<find_result_t> ret;
+	find_result_t result;
+
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+
+		std::vector<const index_t *> lists;
+		for (auto & idx : indexes) {
+			auto it = m_indexes.find(idx);
+			if (it == m_indexes.end()) {
+				lists.clear();
+				break;
+			}
+
+			lists.push_back(&it->second);
+		}
+
+		if (lists.size()) {
+			// run over the shortest index and check every object in the rest of them
+			size_t shortest = 0;
+			for (size_t i = 1; i < lists.size(); ++i) {
+				if (lists[i]->size() < lists[shortest]->size())
+					shortest = i;
+			}
+
+			for (auto & obj : *lists[shortest]) {
+				elliptics::find_indexes_result_entry entry;
+				entry.id = obj.first;
+
+				for (size_t i = 0; i < lists.size(); ++i) {
+					auto it = lists[i]->find(obj.first);
+					if (it == lists[i]->end())
+						break;
+
+					elliptics::index_entry ie;
+					ie.index = indexes[i];
+					ie.data = it->second;
+					entry.indexes.push_back(ie);
+				}
+
+				if (entry.indexes.size() == lists.size())
+					result.emplace_back(entry);
+			}
+		}
+	}
+
+	complete([ret, result] () mutable {
+		ret.complete(result);
+	});
+
+	return ret;
+}
+
+size_t memory_backend::objects_num() {
+	std::unique_lock<std::mutex> guard(m_lock);
+	return m_objects.size();
+}
+
+size_t memory_backend::indexes_num() {
+	std::unique_lock<std::mutex> guard(m_lock);
+	return m_indexes.size();
+}
+
+void memory_backend::complete(const std::function<void ()> &fn) {
+	if (m_latency.count() == 0) {
+		fn();
+		return;
+	}
+
+	std::unique_lock<std::mutex> guard(m_delayed_lock);
+	m_delayed.insert(std::make_pair(clock::now() + m_latency, fn));
+	m_delayed_cond.notify_all();
+}
+
+void memory_backend::delayed_worker() {
+	std::unique_lock<std::mutex> guard(m_delayed_lock);
+
+	while (!m_need_exit) {
+		if (m_delayed.empty()) {
+			m_delayed_cond.wait(guard);
+			continue;
+		}
+
+		auto first = m_delayed.begin();
+		if (first->first > clock::now()) {
+			m_delayed_cond.wait_until(guard, first->first);
+			continue;
+		}
+
+		std::function<void ()> fn = first->second;
+		m_delayed.erase(first);
+
+		guard.unlock();
+		fn();
+		guard.lock();
+	}
+}
+
+}} // namespace ioremap::wookie
@@ -24,17 +24,28 @@ void basic_elliptics_splitter::prepare_indexes(const std::string &key, const std
 		const dnet_time &ts, const std::string &base_index,
 		std::vector<std::string> &ids, std::vector<elliptics::data_pointer> &objs)
 {
-	// each reverse index contains wookie::index_data object for every key stored
+	wookie::mpos_t pos;
+
 	if (content.size()) {
 		std::vector<std::string> tokens;
-		wookie::mpos_t pos = m_splitter.feed(content, tokens);
+		pos = m_splitter.feed(content, tokens);
 
 		std::cout << "split: key: " << key << ", tokens: " << tokens.size() << ", positions: " << pos.size() << std::endl;
+	}
+
+	prepare_indexes(key, pos, ts, base_index, ids, objs);
+}
+
+void basic_elliptics_splitter::prepare_indexes(const std::string &key, const mpos_t &pos,
+		const dnet_time &ts, const std::string &base_index,
+		std::vector<std::string> &ids, std::vector<elliptics::data_pointer> &objs)
+{
+	// each reverse index contains wookie::index_data object for every key stored
+	for (auto && p : pos) {
+		std::vector<int> positions = p.second;
 
-		for (auto && p : pos) {
-			ids.emplace_back(std::move(p.first));
-			objs.emplace_back(wookie::index_data(ts, p.first, p.second).convert());
-		}
+		ids.emplace_back(p.first);
+		objs.emplace_back(wookie::index_data(ts, p.first, positions).convert());
 	}
 
 	// base index contains wookie::document object for every key stored
@@ -45,7 +56,7 @@ void basic_elliptics_splitter::prepare_indexes(const std::string &key, const std
 		tmp.data = key;
 
 		ids.push_back(base_index);
-		objs.emplace_back(std::move(storage::pack_document(tmp)));
+		objs.emplace_back(std::move(storage::pack_document(tmp, compress::none)));
 	}
 }
 
@@ -54,3 +65,19 @@ void basic_elliptics_splitter::prepare_indexes(const wookie::document &doc, cons
 {
 	prepare_indexes(doc.key, doc.data, doc.ts, base_index, ids, objs);
 }
+
+mpos_t basic_elliptics_splitter::positions(const std::string &content)
+{
+	std::vector<std::string> tokens;
+	return m_splitter.feed(content, tokens);
+}
+
+mpos_t basic_elliptics_splitter::positions(const fields::document_fields &doc)
+{
+	return fields::positions(m_splitter, doc);
+}
+
+void basic_elliptics_splitter::replace_anchors(mpos_t &pos, const std::vector<std::string> &anchors)
+{
+	fields::replace_anchors(m_splitter, pos, anchors);
+}
@@ -0,0 +1,150 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "wookie/chunk.hpp"
+#include "wookie/storage.hpp"
+
+#include <algorithm>
+
+namespace ioremap { namespace wookie {
+
+chunk_writer::chunk_writer(storage &st, const std::string &key, const dnet_time &ts, size_t max_inflight) :
+m_st(st), m_key(key), m_ts(ts), m_max_inflight(max_inflight ? max_inflight : 1), m_hash(0)
+{
+	m_manifest.chunk_size = st.m_chunk_size ? st.m_chunk_size : default_chunk_size;
+	m_buffer.reserve(m_manifest.chunk_size);
+
+	if (m_st.m_cache)
+		m_st.m_cache->erase(m_st.transform_key(key));
+
+	// chunks have versioned names, so the previous manifest can be read while new chunks are written
+	m_previous = m_st.read_previous(key);
+}
+
+void chunk_writer::write(const char *data, size_t size) {
+	while (size) {
+		size_t sz = std::min(size, m_manifest.chunk_size - m_buffer.size());
+
+		m_buffer.append(data, sz);
+		m_manifest.size += sz;
+		data += sz;
+		size -= sz;
+
+		if (m_buffer.size() == m_manifest.chunk_size)
+			flush();
+	}
+}
+
+void chunk_writer::write(const std::string &data) {
+	write(data.data(), data.size());
+}
+
+uint64_t chunk_writer::size() const {
+	return m_manifest.size;
+}
+
+void chunk_writer::wait_inflight(size_t limit) {
+	while (m_inflight.size() > limit) {
+		future<int> f = m_inflight.front();
+		m_inflight.pop_front();
+
+		elliptics::error_info err = f.error();
+		if (err && !m_error)
+			m_error = err;
+	}
+}
+
+void chunk_writer::flush() {
+	if (m_buffer.empty())
+		return;
+
+	wait_inflight(m_max_inflight - 1);
+
+	m_hash = hash::murmur(m_buffer, m_hash);
+
+	// there is no point in sending the rest of chunks, commit() will fail anyway
+	if (!m_error)
+		m_inflight.push_back(m_st.write_chunk(m_key, m_ts, m_manifest.chunks_num, m_buffer));
+
+	m_manifest.chunks_num++;
+	m_buffer.clear();
+}
+
+future<int> chunk_writer::commit() {
+	flush();
+
+	document_meta meta;
+	meta.ts = m_ts;
+	meta.size = m_manifest.size;
+	meta.hash = m_hash;
+
+	return commit(meta);
+}
+
+future<int> chunk_writer::commit(const document_meta &meta) {
+	flush();
+
+	future<int> ret;
+	if (m_error) {
+		ret.complete(m_error);
+		return ret;
+	}
+
+	std::vector<future<int>> chunks(m_inflight.begin(), m_inflight.end());
+	m_inflight.clear();
+
+	msgpack::sbuffer buffer;
+	msgpack::pack(&buffer, m_manifest);
+
+	document manifest;
+	manifest.ts = m_ts;
+	manifest.key = m_key;
+
+	std::string packed(buffer.data(), buffer.size());
+	storage *st = &m_st;
+	future<document> previous = m_previous;
+
+	// manifest is written last, readers either see previous version or all chunks of the new one,
+	// the previous version has to be read before the new manifest replaces it
+	when_all(chunks).connect(
+		[ret, st, manifest, packed, meta, previous] (const std::vector<int> &, const elliptics::error_info &err) mutable {
+			if (err) {
+				ret.complete(err);
+				return;
+			}
+
+			previous.connect([ret, st, manifest, packed, meta, previous] (const document &,
+						const elliptics::error_info &) mutable {
+				elliptics::data_pointer body = storage::pack_document(manifest, compress::chunked, packed);
+				st->write_object(manifest.key, body, meta).connect(
+					[ret, st, manifest, previous] (const int &, const elliptics::error_info &err) mutable {
+						if (err) {
+							ret.complete(err);
+							return;
+						}
+
+						st->remove_chunks(previous, manifest.ts).connect(
+							[ret] (const int &, const elliptics::error_info &) mutable {
+								ret.complete(0);
+							});
+					});
+			});
+		});
+
+	return ret;
+}
+
+}} // namespace ioremap::wookie
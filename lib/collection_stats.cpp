@@ -0,0 +1,317 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "wookie/collection_stats.hpp"
+#include "wookie/hash.hpp"
+
+#include <elliptics/error.hpp>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace ioremap { namespace wookie {
+
+namespace {
+	static const char stats_magic[8] = { 'W', 'O', 'O', 'K', 'S', 'T', 'A', 'T' };
+	static const uint32_t stats_version = 2;
+	// version 1 keeps terms as strings and has no terms of the documents
+	static const uint32_t stats_version_strings = 1;
+
+	struct stats_header {
+		char		magic[8];
+		uint32_t	version;
+		uint32_t	reserved;
+		uint64_t	terms_num;
+		uint64_t	docs_num;
+	} __attribute__ ((packed));
+
+	uint32_t doc_length(const mpos_t &pos) {
+		uint32_t len = 0;
+		for (auto & p : pos)
+			len += p.second.size();
+		return len;
+	}
+}
+
+collection_stats::collection_stats(int shards_num) :
+m_terms(std::max(shards_num, 1)), m_docs(std::max(shards_num, 1))
+{
+}
+
+uint64_t collection_stats::term_hash(const std::string &term) {
+	return hash::murmur(term, 0);
+}
+
+collection_stats::term_shard &collection_stats::shard(uint64_t term) {
+	return m_terms[term % m_terms.size()];
+}
+
+const collection_stats::term_shard &collection_stats::shard(uint64_t term) const {
+	return m_terms[term % m_terms.size()];
+}
+
+collection_stats::doc_shard &collection_stats::shard(const dnet_raw_id &id) {
+	return m_docs[raw_id_hash()(id) % m_docs.size()];
+}
+
+const collection_stats::doc_shard &collection_stats::shard(const dnet_raw_id &id) const {
+	return m_docs[raw_id_hash()(id) % m_docs.size()];
+}
+
+void collection_stats::add(const dnet_raw_id &id, const mpos_t &pos) {
+	std::vector<uint64_t> terms;
+	for (auto & p : pos)
+		terms.push_back(term_hash(p.first));
+
+	std::sort(terms.begin(), terms.end());
+	terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+
+	// terms of the previous version are swapped out under the document lock,
+	// so concurrent reindexing of the same document subtracts every version once
+	std::vector<uint64_t> old = terms;
+	{
+		doc_shard &sh = shard(id);
+		std::unique_lock<std::mutex> guard(sh.lock);
+
+		doc_entry &e = sh.docs[id];
+		sh.tokens_num -= e.length;
+		e.length = doc_length(pos);
+		sh.tokens_num += e.length;
+
+		e.terms.swap(old);
+	}
+
+	// changes of document frequencies grouped by shard, so that every shard is locked once
+	std::vector<std::vector<std::pair<uint64_t, int>>> changes(m_terms.size());
+
+	std::vector<uint64_t> diff;
+	std::set_difference(terms.begin(), terms.end(), old.begin(), old.end(), std::back_inserter(diff));
+	for (auto t : diff)
+		changes[t % m_terms.size()].emplace_back(t, 1);
+
+	diff.clear();
+	std::set_difference(old.begin(), old.end(), terms.begin(), terms.end(), std::back_inserter(diff));
+	for (auto t : diff)
+		changes[t % m_terms.size()].emplace_back(t, -1);
+
+	for (size_t i = 0; i < changes.size(); ++i) {
+		if (changes[i].empty())
+			continue;
+
+		std::unique_lock<std::mutex> guard(m_terms[i].lock);
+		for (auto & c : changes[i]) {
+			if (c.second > 0) {
+				++m_terms[i].df[c.first];
+				continue;
+			}
+
+			auto it = m_terms[i].df.find(c.first);
+			if (it != m_terms[i].df.end() && --it->second == 0)
+				m_terms[i].df.erase(it);
+		}
+	}
+}
+
+uint64_t collection_stats::df(const std::string &term) const {
+	const uint64_t h = term_hash(term);
+	const term_shard &sh = shard(h);
+	std::unique_lock<std::mutex> guard(sh.lock);
+
+	auto it = sh.df.find(h);
+	return it == sh.df.end() ? 0 : it->second;
+}
+
+uint32_t collection_stats::length(const dnet_raw_id &id) const {
+	const doc_shard &sh = shard(id);
+	std::unique_lock<std::mutex> guard(sh.lock);
+
+	auto it = sh.docs.find(id);
+	return it == sh.docs.end() ? 0 : it->second.length;
+}
+
+uint64_t collection_stats::docs_num() const {
+	uint64_t num = 0;
+	for (auto & sh : m_docs) {
+		std::unique_lock<std::mutex> guard(sh.lock);
+		num += sh.docs.size();
+	}
+
+	return num;
+}
+
+uint64_t collection_stats::tokens_num() const {
+	uint64_t num = 0;
+	for (auto & sh : m_docs) {
+		std::unique_lock<std::mutex> guard(sh.lock);
+		num += sh.tokens_num;
+	}
+
+	return num;
+}
+
+rank::stats collection_stats::get(const std::vector<std::string> &terms) const {
+	rank::stats st;
+
+	for (auto & sh : m_docs) {
+		std::unique_lock<std::mutex> guard(sh.lock);
+		st.docs_num += sh.docs.size();
+		st.tokens_num += sh.tokens_num;
+	}
+
+	for (auto & t : terms)
+		st.df.push_back(df(t));
+
+	return st;
+}
+
+// layout: header, terms (uint64_t term hash, uint64_t df),
+// documents (raw ID, uint32_t length, uint32_t number of terms, uint64_t term hashes)
+void collection_stats::save(const std::string &path) const {
+	std::string tmp = path + ".tmp";
+	std::ofstream out(tmp.c_str(), std::ios::binary | std::ios::trunc);
+	if (!out)
+		elliptics::throw_error(-errno, "collection stats: could not open %s", tmp.c_str());
+
+	// shards are locked one by one, so the dump is consistent per shard only
+	std::string terms, docs;
+	uint64_t terms_num = 0, docs_num = 0;
+
+	for (auto & sh : m_terms) {
+		std::unique_lock<std::mutex> guard(sh.lock);
+		for (auto & t : sh.df) {
+			terms.append((const char *)&t.first, sizeof(t.first));
+			terms.append((const char *)&t.second, sizeof(t.second));
+		}
+		terms_num += sh.df.size();
+	}
+
+	for (auto & sh : m_docs) {
+		std::unique_lock<std::mutex> guard(sh.lock);
+		for (auto & d : sh.docs) {
+			uint32_t num = d.second.terms.size();
+
+			docs.append((const char *)&d.first, sizeof(d.first));
+			docs.append((const char *)&d.second.length, sizeof(d.second.length));
+			docs.append((const char *)&num, sizeof(num));
+			docs.append((const char *)d.second.terms.data(), num * sizeof(uint64_t));
+		}
+		docs_num += sh.docs.size();
+	}
+
+	stats_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, stats_magic, sizeof(header.magic));
+	header.version = stats_version;
+	header.terms_num = terms_num;
+	header.docs_num = docs_num;
+
+	out.write((const char *)&header, sizeof(header));
+	out.write(terms.data(), terms.size());
+	out.write(docs.data(), docs.size());
+
+	out.close();
+	if (!out) {
+		unlink(tmp.c_str());
+		elliptics::throw_error(-EIO, "collection stats: could not write %s", tmp.c_str());
+	}
+
+	if (rename(tmp.c_str(), path.c_str()) < 0) {
+		int err = -errno;
+		unlink(tmp.c_str());
+		elliptics::throw_error(err, "collection stats: could not rename %s to %s", tmp.c_str(), path.c_str());
+	}
+}
+
+void collection_stats::load(const std::string &path) {
+	std::ifstream in(path.c_str(), std::ios::binary);
+	if (!in)
+		elliptics::throw_error(-ENOENT, "collection stats: could not open %s", path.c_str());
+
+	stats_header header;
+	in.read((char *)&header, sizeof(header));
+	if (!in || memcmp(header.magic, stats_magic, sizeof(header.magic)) ||
+			(header.version != stats_version && header.version != stats_version_strings))
+		elliptics::throw_error(-EPROTO, "collection stats: %s: invalid header", path.c_str());
+
+	std::vector<term_shard> terms(m_terms.size());
+	std::vector<doc_shard> docs(m_docs.size());
+
+	for (uint64_t i = 0; i < header.terms_num && in; ++i) {
+		uint64_t h = 0;
+
+		if (header.version == stats_version_strings) {
+			uint32_t size = 0;
+			in.read((char *)&size, sizeof(size));
+
+			std::string term(size, '\0');
+			in.read(&term[0], size);
+
+			h = term_hash(term);
+		} else {
+			in.read((char *)&h, sizeof(h));
+		}
+
+		uint64_t df = 0;
+		in.read((char *)&df, sizeof(df));
+
+		terms[h % terms.size()].df[h] = df;
+	}
+
+	for (uint64_t i = 0; i < header.docs_num && in; ++i) {
+		dnet_raw_id id;
+		doc_entry e;
+		in.read((char *)&id, sizeof(id));
+		in.read((char *)&e.length, sizeof(e.length));
+
+		if (header.version != stats_version_strings) {
+			uint32_t num = 0;
+			in.read((char *)&num, sizeof(num));
+
+			// document can not have more distinct terms than tokens
+			if (!in || num > e.length)
+				elliptics::throw_error(-EPROTO, "collection stats: %s: document has %u terms and %u tokens",
+						path.c_str(), num, e.length);
+
+			e.terms.resize(num);
+			in.read((char *)e.terms.data(), num * sizeof(uint64_t));
+		}
+
+		doc_shard &sh = docs[raw_id_hash()(id) % docs.size()];
+		sh.tokens_num += e.length;
+		sh.docs[id] = e;
+	}
+
+	if (!in)
+		elliptics::throw_error(-EPROTO, "collection stats: %s: truncated file", path.c_str());
+
+	for (size_t i = 0; i < m_terms.size(); ++i) {
+		std::unique_lock<std::mutex> guard(m_terms[i].lock);
+		m_terms[i].df.swap(terms[i].df);
+	}
+
+	for (size_t i = 0; i < m_docs.size(); ++i) {
+		std::unique_lock<std::mutex> guard(m_docs[i].lock);
+		m_docs[i].docs.swap(docs[i].docs);
+		m_docs[i].tokens_num = docs[i].tokens_num;
+	}
+}
+
+}} // namespace ioremap::wookie
@@ -0,0 +1,630 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "wookie/delta_index.hpp"
+#include "wookie/basic_elliptics_splitter.hpp"
+#include "wookie/index_data.hpp"
+#include "wookie/intersect.hpp"
+#include "wookie/local_index.hpp"
+#include "wookie/storage.hpp"
+
+#include <elliptics/error.hpp>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace ioremap { namespace wookie {
+
+namespace {
+	static const char spill_magic[8] = { 'W', 'O', 'O', 'K', 'D', 'E', 'L', 'T' };
+	static const uint32_t spill_version = 1;
+
+	struct spill_header {
+		char		magic[8];
+		uint32_t	version;
+		uint32_t	reserved;
+		uint64_t	docs_num;
+	} __attribute__ ((packed));
+
+	void write_string(std::string &out, const std::string &str) {
+		uint32_t size = str.size();
+		out.append((const char *)&size, sizeof(size));
+		out.append(str);
+	}
+
+	std::string read_string(std::istream &in) {
+		uint32_t size = 0;
+		in.read((char *)&size, sizeof(size));
+
+		std::string str(in ? size : 0, '\0');
+		in.read(&str[0], str.size());
+		return str;
+	}
+}
+
+void delta_index::batch::add(const delta_document &doc) {
+	if (docs.empty())
+		created = std::chrono::steady_clock::now();
+
+	uint32_t num = docs.size();
+	docs.push_back(doc);
+	current[doc.id] = num;
+
+	for (auto & p : doc.pos)
+		terms[p.first].push_back(num);
+}
+
+bool delta_index::batch::is_current(uint32_t doc) const {
+	auto it = current.find(docs[doc].id);
+	return it != current.end() && it->second == doc;
+}
+
+bool delta_index::batch::contains(const dnet_raw_id &id) const {
+	return current.find(id) != current.end();
+}
+
+std::vector<delta_document> delta_index::batch::current_docs() const {
+	std::vector<delta_document> ret;
+	ret.reserve(current.size());
+
+	for (size_t i = 0; i < docs.size(); ++i) {
+		if (is_current(i))
+			ret.push_back(docs[i]);
+	}
+
+	return ret;
+}
+
+delta_index::delta_index(const flush_handler_t &handler, size_t batch_docs, std::chrono::milliseconds interval,
+		size_t max_docs, int max_attempts) :
+m_handler(handler), m_batch_docs(std::max<size_t>(batch_docs, 1)), m_interval(interval),
+m_max_docs(std::max(max_docs, m_batch_docs)), m_max_attempts(std::max(max_attempts, 1)),
+m_active(std::make_shared<batch>()), m_sealed_docs(0), m_need_exit(false)
+{
+	m_flush_thread = std::thread(std::bind(&delta_index::flush_worker, this));
+}
+
+delta_index::~delta_index() {
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		m_need_exit = true;
+		m_cond.notify_all();
+	}
+
+	m_flush_thread.join();
+}
+
+void delta_index::add(const delta_document &doc, bool wait) {
+	std::unique_lock<std::mutex> guard(m_lock);
+
+	// back-pressure: documents which are not flushed yet are held in memory
+	auto has_room = [this] () {
+		return m_sealed_docs + m_active->docs.size() < m_max_docs || m_need_exit;
+	};
+
+	if (!has_room()) {
+		m_cond.notify_all();
+		if (!wait || !m_flushed_cond.wait_for(guard, backoff(m_max_attempts), has_room))
+			elliptics::throw_error(-EAGAIN, "delta index: %zd documents are waiting for flush",
+					m_sealed_docs + m_active->docs.size());
+	}
+
+	if (m_stats)
+		m_stats->add(doc.id, doc.pos);
+
+	m_active->add(doc);
+
+	if (m_active->docs.size() >= m_batch_docs)
+		m_cond.notify_all();
+}
+
+void delta_index::set_stats(const std::shared_ptr<collection_stats> &stats) {
+	std::unique_lock<std::mutex> guard(m_lock);
+	m_stats = stats;
+}
+
+namespace {
+
+// query plan source over in-memory batch
+class batch_source : public query::source {
+	public:
+		batch_source(const std::unordered_map<std::string, std::vector<uint32_t>> &terms,
+				const std::vector<delta_document> &docs) : m_terms(terms), m_docs(docs) {
+		}
+
+		virtual size_t df(const std::string &token) {
+			auto it = m_terms.find(token);
+			return it == m_terms.end() ? 0 : it->second.size();
+		}
+
+		virtual void postings(const std::string &token, std::vector<uint32_t> &docs) {
+			auto it = m_terms.find(token);
+			if (it == m_terms.end())
+				docs.clear();
+			else
+				docs = it->second;
+		}
+
+		virtual std::vector<int> positions(const std::string &token, uint32_t doc) {
+			auto it = m_docs[doc].pos.find(token);
+			return it == m_docs[doc].pos.end() ? std::vector<int>() : it->second;
+		}
+
+	private:
+		const std::unordered_map<std::string, std::vector<uint32_t>> &m_terms;
+		const std::vector<delta_document> &m_docs;
+};
+
+}
+
+find_result_t delta_index::find(const std::vector<std::string> &terms, const std::vector<dnet_raw_id> &ids,
+		std::vector<dnet_raw_id> &documents, bool positions) {
+	if (terms.empty() || terms.size() != ids.size())
+		return search(match_t(), terms, ids, documents, positions);
+
+	return search([&] (const batch &b, std::vector<uint32_t> &docs) {
+			std::vector<const std::vector<uint32_t> *> lists;
+			for (auto & t : terms) {
+				auto it = b.terms.find(t);
+				if (it == b.terms.end())
+					return;
+
+				lists.push_back(&it->second);
+			}
+
+			intersect::all(lists, docs);
+		}, terms, ids, documents, positions);
+}
+
+find_result_t delta_index::find(const query::node &q, const std::vector<std::string> &terms,
+		const std::vector<dnet_raw_id> &ids, std::vector<dnet_raw_id> &documents, bool positions) {
+	if (terms.size() != ids.size())
+		return search(match_t(), terms, ids, documents, positions);
+
+	return search([&] (const batch &b, std::vector<uint32_t> &docs) {
+			batch_source src(b.terms, b.docs);
+
+			query::plan plan(q, src);
+			plan.execute(docs);
+		}, terms, ids, documents, positions);
+}
+
+find_result_t delta_index::search(const match_t &match, const std::vector<std::string> &terms,
+		const std::vector<dnet_raw_id> &ids, std::vector<dnet_raw_id> &documents, bool positions) {
+	find_result_t result;
+
+	std::unique_lock<std::mutex> guard(m_lock);
+
+	// from the newest to the oldest
+	std::vector<const batch *> batches;
+	batches.push_back(m_active.get());
+	for (auto it = m_flushing.rbegin(); it != m_flushing.rend(); ++it)
+		batches.push_back(it->get());
+	for (auto it = m_failed.rbegin(); it != m_failed.rend(); ++it)
+		batches.push_back(it->get());
+
+	for (size_t i = 0; i < batches.size(); ++i) {
+		const batch &b = *batches[i];
+
+		for (auto & c : b.current)
+			documents.push_back(c.first);
+
+		if (!match)
+			continue;
+
+		std::vector<uint32_t> docs;
+		match(b, docs);
+
+		for (auto doc : docs) {
+			const delta_document &d = b.docs[doc];
+
+			if (!b.is_current(doc))
+				continue;
+
+			bool hidden = false;
+			for (size_t n = 0; !hidden && n < i; ++n)
+				hidden = batches[n]->contains(d.id);
+
+			if (hidden)
+				continue;
+
+			elliptics::find_indexes_result_entry entry;
+			entry.id = d.id;
+
+			for (size_t j = 0; j < terms.size(); ++j) {
+				auto pit = d.pos.find(terms[j]);
+				if (pit == d.pos.end())
+					continue;
+
+				std::vector<int> pos;
+				if (positions)
+					pos = pit->second;
+
+				elliptics::index_entry ie;
+				ie.index = ids[j];
+				ie.data = index_data(d.ts, terms[j], pos).convert();
+				entry.indexes.emplace_back(ie);
+			}
+
+			result.emplace_back(entry);
+		}
+	}
+
+	guard.unlock();
+
+	std::sort(documents.begin(), documents.end(), raw_id_less());
+	documents.erase(std::unique(documents.begin(), documents.end(), raw_id_equal()), documents.end());
+
+	return result;
+}
+
+size_t delta_index::docs_num() {
+	std::unique_lock<std::mutex> guard(m_lock);
+
+	size_t num = m_active->current.size();
+	for (auto & b : m_flushing)
+		num += b->current.size();
+	for (auto & b : m_failed)
+		num += b->current.size();
+
+	return num;
+}
+
+bool delta_index::seal(bool force) {
+	const batch &b = *m_active;
+
+	if (!b.docs.empty() && (force || b.docs.size() >= m_batch_docs ||
+				std::chrono::steady_clock::now() - b.created >= m_interval)) {
+		m_sealed_docs += b.docs.size();
+		m_flushing.push_back(m_active);
+		m_active = std::make_shared<batch>();
+	}
+
+	return !m_flushing.empty() || !m_failed.empty();
+}
+
+std::chrono::milliseconds delta_index::backoff(int attempts) const {
+	int shift = std::min(std::max(attempts, 1), m_max_attempts) - 1;
+	return m_interval * (1 << std::min(shift, 16));
+}
+
+void delta_index::drop_flushed(const std::shared_ptr<batch> &flushed) {
+	for (auto it = m_failed.begin(); it != m_failed.end();) {
+		// newer batches put aside keep their versions
+		if (*it == flushed) {
+			m_failed.erase(it);
+			break;
+		}
+
+		batch &b = **it;
+		for (auto & c : flushed->current)
+			b.current.erase(c.first);
+
+		if (b.current.empty()) {
+			release(b);
+			it = m_failed.erase(it);
+		} else {
+			++it;
+		}
+	}
+
+	release(*flushed);
+	m_flushed_cond.notify_all();
+}
+
+void delta_index::release(const batch &b) {
+	m_sealed_docs -= b.docs.size();
+	if (b.spilled)
+		unlink(m_spill_file.c_str());
+}
+
+void delta_index::flush_sealed(bool force) {
+	std::unique_lock<std::mutex> flush_guard(m_flush_lock);
+
+	// sealed batches are only modified under both locks, so they are read here without @m_lock
+
+	// batches put aside are older than the rest, but they do not hold the rest back anymore
+	std::list<std::shared_ptr<batch>> failed;
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		failed = m_failed;
+	}
+
+	for (auto & b : failed) {
+		if (!force && std::chrono::steady_clock::now() < b->retry)
+			continue;
+
+		try {
+			m_handler(b->current_docs());
+		} catch (const std::exception &e) {
+			std::unique_lock<std::mutex> guard(m_lock);
+			b->attempts++;
+			b->retry = std::chrono::steady_clock::now() + backoff(b->attempts);
+
+			if (force)
+				throw;
+
+			std::cerr << "delta index: flush of " << b->current.size() <<
+				" documents put aside failed: " << e.what() << std::endl;
+			continue;
+		}
+
+		std::unique_lock<std::mutex> guard(m_lock);
+		drop_flushed(b);
+	}
+
+	while (true) {
+		std::shared_ptr<batch> b;
+		{
+			std::unique_lock<std::mutex> guard(m_lock);
+			if (m_flushing.empty())
+				break;
+
+			b = m_flushing.front();
+		}
+
+		if (!force && std::chrono::steady_clock::now() < b->retry)
+			break;
+
+		try {
+			m_handler(b->current_docs());
+		} catch (const std::exception &e) {
+			std::unique_lock<std::mutex> guard(m_lock);
+			b->attempts++;
+			b->retry = std::chrono::steady_clock::now() + backoff(b->attempts);
+
+			bool put_aside = b->attempts >= m_max_attempts;
+			if (put_aside) {
+				m_flushing.pop_front();
+				m_failed.push_back(b);
+			}
+
+			if (force)
+				throw;
+
+			std::cerr << "delta index: flush of " << b->current.size() << " documents failed " <<
+				b->attempts << " times" << (put_aside ? ", batch is put aside: " : ": ") <<
+				e.what() << std::endl;
+
+			if (put_aside)
+				continue;
+			break;
+		}
+
+		std::unique_lock<std::mutex> guard(m_lock);
+		m_flushing.pop_front();
+		drop_flushed(b);
+	}
+}
+
+void delta_index::flush() {
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		seal(true);
+	}
+
+	flush_sealed(true);
+}
+
+void delta_index::flush_worker() {
+	std::unique_lock<std::mutex> guard(m_lock);
+
+	while (!m_need_exit) {
+		m_cond.wait_for(guard, m_interval);
+		if (m_need_exit || !seal(false))
+			continue;
+
+		guard.unlock();
+		flush_sealed(false);
+		guard.lock();
+	}
+
+	// documents have already been acknowledged to the clients, so they are either flushed,
+	// or saved into the spill file, or flush is retried until it succeeds
+	seal(true);
+	guard.unlock();
+
+	while (true) {
+		try {
+			flush_sealed(true);
+
+			// everything is flushed, including what might have been saved before
+			if (m_spill_file.size())
+				unlink(m_spill_file.c_str());
+			break;
+		} catch (const std::exception &e) {
+			std::cerr << "delta index: flush at exit failed: " << e.what() << std::endl;
+		}
+
+		if (m_spill_file.size()) {
+			try {
+				save_spill();
+				break;
+			} catch (const std::exception &e) {
+				std::cerr << "delta index: could not save not flushed documents: " << e.what() << std::endl;
+			}
+		}
+
+		std::this_thread::sleep_for(backoff(m_max_attempts));
+	}
+}
+
+void delta_index::set_spill_file(const std::string &path) {
+	std::unique_lock<std::mutex> flush_guard(m_flush_lock);
+	std::unique_lock<std::mutex> guard(m_lock);
+
+	m_spill_file = path;
+	if (access(path.c_str(), F_OK) == 0)
+		load_spill();
+}
+
+void delta_index::save_spill() {
+	std::unique_lock<std::mutex> guard(m_lock);
+
+	// from the oldest to the newest, so that loading keeps the newest versions
+	std::vector<const batch *> batches;
+	for (auto & b : m_failed)
+		batches.push_back(b.get());
+	for (auto & b : m_flushing)
+		batches.push_back(b.get());
+
+	std::string data;
+	uint64_t docs_num = 0;
+
+	for (auto b : batches) {
+		for (auto & d : b->current_docs()) {
+			data.append((const char *)&d.id, sizeof(d.id));
+			data.append((const char *)&d.ts, sizeof(d.ts));
+			write_string(data, d.key);
+			write_string(data, d.collection);
+
+			uint32_t terms_num = d.pos.size();
+			data.append((const char *)&terms_num, sizeof(terms_num));
+
+			for (auto & p : d.pos) {
+				write_string(data, p.first);
+
+				uint32_t num = p.second.size();
+				data.append((const char *)&num, sizeof(num));
+				data.append((const char *)p.second.data(), num * sizeof(int));
+			}
+
+			++docs_num;
+		}
+	}
+
+	guard.unlock();
+
+	std::string tmp = m_spill_file + ".tmp";
+	std::ofstream out(tmp.c_str(), std::ios::binary | std::ios::trunc);
+	if (!out)
+		elliptics::throw_error(-errno, "delta index: could not open %s", tmp.c_str());
+
+	spill_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, spill_magic, sizeof(header.magic));
+	header.version = spill_version;
+	header.docs_num = docs_num;
+
+	out.write((const char *)&header, sizeof(header));
+	out.write(data.data(), data.size());
+
+	out.close();
+	if (!out) {
+		unlink(tmp.c_str());
+		elliptics::throw_error(-EIO, "delta index: could not write %s", tmp.c_str());
+	}
+
+	if (rename(tmp.c_str(), m_spill_file.c_str()) < 0) {
+		int err = -errno;
+		unlink(tmp.c_str());
+		elliptics::throw_error(err, "delta index: could not rename %s to %s", tmp.c_str(), m_spill_file.c_str());
+	}
+
+	std::cerr << "delta index: " << docs_num << " not flushed documents are saved into " <<
+		m_spill_file << std::endl;
+}
+
+void delta_index::load_spill() {
+	std::ifstream in(m_spill_file.c_str(), std::ios::binary);
+	if (!in)
+		elliptics::throw_error(-ENOENT, "delta index: could not open %s", m_spill_file.c_str());
+
+	spill_header header;
+	in.read((char *)&header, sizeof(header));
+	if (!in || memcmp(header.magic, spill_magic, sizeof(header.magic)) || header.version != spill_version)
+		elliptics::throw_error(-EPROTO, "delta index: %s: invalid header", m_spill_file.c_str());
+
+	auto b = std::make_shared<batch>();
+	b->spilled = true;
+
+	for (uint64_t i = 0; i < header.docs_num; ++i) {
+		delta_document d;
+		in.read((char *)&d.id, sizeof(d.id));
+		in.read((char *)&d.ts, sizeof(d.ts));
+		d.key = read_string(in);
+		d.collection = read_string(in);
+
+		uint32_t terms_num = 0;
+		in.read((char *)&terms_num, sizeof(terms_num));
+
+		for (uint32_t j = 0; j < terms_num && in; ++j) {
+			std::vector<int> &pos = d.pos[read_string(in)];
+
+			uint32_t num = 0;
+			in.read((char *)&num, sizeof(num));
+			if (!in)
+				break;
+
+			pos.resize(num);
+			in.read((char *)pos.data(), num * sizeof(int));
+		}
+
+		if (!in)
+			elliptics::throw_error(-EPROTO, "delta index: %s: truncated at document %llu",
+					m_spill_file.c_str(), (unsigned long long)i);
+
+		b->add(d);
+	}
+
+	if (b->docs.empty()) {
+		unlink(m_spill_file.c_str());
+		return;
+	}
+
+	// saved documents are older than anything added since start
+	m_sealed_docs += b->docs.size();
+	m_flushing.push_front(b);
+	m_cond.notify_all();
+}
+
+delta_index::flush_handler_t delta_index::local_index_handler(const std::shared_ptr<local_index> &index) {
+	return [index] (const std::vector<delta_document> &docs) {
+		segment_writer writer;
+
+		for (auto & d : docs)
+			writer.add(d.id, d.key, d.ts, d.pos);
+
+		index->add_segment(writer);
+	};
+}
+
+delta_index::flush_handler_t delta_index::storage_handler(storage &st) {
+	return [&st] (const std::vector<delta_document> &docs) {
+		basic_elliptics_splitter splitter;
+		std::vector<document_indexes> batch;
+		batch.reserve(docs.size());
+
+		for (auto & d : docs) {
+			document_indexes di;
+			di.key = d.key;
+
+			splitter.prepare_indexes(d.key, d.pos, d.ts, d.collection, di.indexes, di.datas);
+			if (di.indexes.size())
+				batch.emplace_back(std::move(di));
+		}
+
+		// the first error is reported, the whole batch is indexed again on retry
+		st.set_indexes(batch).get();
+	};
+}
+
+}} // namespace ioremap::wookie
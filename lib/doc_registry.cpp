@@ -0,0 +1,230 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "wookie/doc_registry.hpp"
+#include "wookie/cache.hpp"
+
+#include <elliptics/error.hpp>
+
+#include <fstream>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace ioremap { namespace wookie {
+
+namespace {
+	static const char registry_magic[8] = { 'W', 'O', 'O', 'K', 'R', 'E', 'G', '\0' };
+	static const uint32_t registry_version = 1;
+
+	struct registry_header {
+		char		magic[8];
+		uint32_t	version;
+		uint32_t	docs_num;
+	} __attribute__ ((packed));
+}
+
+const uint32_t doc_registry::invalid;
+
+doc_registry::doc_registry() : m_table(1024, invalid)
+{
+}
+
+size_t doc_registry::slot(const dnet_raw_id &id) const
+{
+	return raw_id_hash()(id) & (m_table.size() - 1);
+}
+
+uint32_t doc_registry::find(const dnet_raw_id &id) const
+{
+	for (size_t pos = slot(id); ; pos = (pos + 1) & (m_table.size() - 1)) {
+		uint32_t doc = m_table[pos];
+		if (doc == invalid)
+			return invalid;
+
+		if (!memcmp(m_ids[doc].id, id.id, sizeof(id.id)))
+			return doc;
+	}
+}
+
+void doc_registry::rehash(size_t size)
+{
+	m_table.assign(size, invalid);
+
+	for (uint32_t doc = 0; doc < m_ids.size(); ++doc) {
+		size_t pos = slot(m_ids[doc]);
+		while (m_table[pos] != invalid)
+			pos = (pos + 1) & (m_table.size() - 1);
+
+		m_table[pos] = doc;
+	}
+}
+
+uint32_t doc_registry::assign(const dnet_raw_id &id, const std::string &key)
+{
+	std::unique_lock<std::mutex> guard(m_lock);
+
+	uint32_t doc = find(id);
+	if (doc == invalid) {
+		if (m_ids.size() >= invalid - 1)
+			elliptics::throw_error(-ENOSPC, "doc registry: too many documents");
+
+		doc = m_ids.size();
+		m_ids.push_back(id);
+
+		key_ref ref = { m_keys.size(), 0 };
+		m_key_refs.push_back(ref);
+
+		// load factor is kept below 0.75
+		if ((m_ids.size() + 1) * 4 > m_table.size() * 3) {
+			rehash(m_table.size() * 2);
+		} else {
+			size_t pos = slot(id);
+			while (m_table[pos] != invalid)
+				pos = (pos + 1) & (m_table.size() - 1);
+
+			m_table[pos] = doc;
+		}
+	}
+
+	key_ref &ref = m_key_refs[doc];
+	if (key.size() && (ref.size != key.size() || m_keys.compare(ref.offset, ref.size, key))) {
+		ref.offset = m_keys.size();
+		ref.size = key.size();
+		m_keys.append(key);
+	}
+
+	return doc;
+}
+
+uint32_t doc_registry::lookup(const dnet_raw_id &id) const
+{
+	std::unique_lock<std::mutex> guard(m_lock);
+	return find(id);
+}
+
+dnet_raw_id doc_registry::id(uint32_t doc) const
+{
+	std::unique_lock<std::mutex> guard(m_lock);
+
+	if (doc >= m_ids.size())
+		elliptics::throw_error(-ENOENT, "doc registry: document %u is not registered", doc);
+
+	return m_ids[doc];
+}
+
+std::string doc_registry::key(uint32_t doc) const
+{
+	std::unique_lock<std::mutex> guard(m_lock);
+
+	if (doc >= m_ids.size())
+		elliptics::throw_error(-ENOENT, "doc registry: document %u is not registered", doc);
+
+	const key_ref &ref = m_key_refs[doc];
+	return m_keys.substr(ref.offset, ref.size);
+}
+
+size_t doc_registry::size() const
+{
+	std::unique_lock<std::mutex> guard(m_lock);
+	return m_ids.size();
+}
+
+// layout: header, raw IDs, key sizes (uint32_t), keys one after another
+void doc_registry::save(const std::string &path) const
+{
+	std::unique_lock<std::mutex> guard(m_lock);
+
+	std::string tmp = path + ".tmp";
+	std::ofstream out(tmp.c_str(), std::ios::binary | std::ios::trunc);
+	if (!out)
+		elliptics::throw_error(-errno, "doc registry: could not open %s", tmp.c_str());
+
+	registry_header header;
+	memcpy(header.magic, registry_magic, sizeof(header.magic));
+	header.version = registry_version;
+	header.docs_num = m_ids.size();
+
+	out.write((const char *)&header, sizeof(header));
+	out.write((const char *)m_ids.data(), m_ids.size() * sizeof(dnet_raw_id));
+
+	for (auto & ref : m_key_refs) {
+		uint32_t size = ref.size;
+		out.write((const char *)&size, sizeof(size));
+	}
+
+	for (auto & ref : m_key_refs)
+		out.write(m_keys.data() + ref.offset, ref.size);
+
+	out.close();
+	if (!out) {
+		unlink(tmp.c_str());
+		elliptics::throw_error(-EIO, "doc registry: could not write %s", tmp.c_str());
+	}
+
+	if (rename(tmp.c_str(), path.c_str()) < 0) {
+		int err = -errno;
+		unlink(tmp.c_str());
+		elliptics::throw_error(err, "doc registry: could not rename %s to %s", tmp.c_str(), path.c_str());
+	}
+}
+
+void doc_registry::load(const std::string &path)
+{
+	std::ifstream in(path.c_str(), std::ios::binary);
+	if (!in)
+		elliptics::throw_error(-ENOENT, "doc registry: could not open %s", path.c_str());
+
+	registry_header header;
+	in.read((char *)&header, sizeof(header));
+	if (!in || memcmp(header.magic, registry_magic, sizeof(header.magic)) || header.version != registry_version)
+		elliptics::throw_error(-EPROTO, "doc registry: %s: invalid header", path.c_str());
+
+	std::vector<dnet_raw_id> ids(header.docs_num);
+	in.read((char *)ids.data(), ids.size() * sizeof(dnet_raw_id));
+
+	std::vector<key_ref> refs(header.docs_num);
+	uint64_t offset = 0;
+	for (auto & ref : refs) {
+		uint32_t size = 0;
+		in.read((char *)&size, sizeof(size));
+
+		ref.offset = offset;
+		ref.size = size;
+		offset += size;
+	}
+
+	std::string keys(offset, '\0');
+	in.read(&keys[0], keys.size());
+
+	if (!in)
+		elliptics::throw_error(-EPROTO, "doc registry: %s: truncated file", path.c_str());
+
+	std::unique_lock<std::mutex> guard(m_lock);
+
+	m_ids.swap(ids);
+	m_key_refs.swap(refs);
+	m_keys.swap(keys);
+
+	size_t size = 1024;
+	while ((m_ids.size() + 1) * 4 > size * 3)
+		size *= 2;
+
+	rehash(size);
+}
+
+}} // namespace ioremap::wookie
@@ -91,22 +91,41 @@ url_filter_functor create_port_filter(const std::vector<int> &ports)
 	return std::bind(&filter::check, std::make_shared<filter>(ports), std::placeholders::_2);
 }
 
-parser_functor create_href_parser()
+parser_functor create_href_parser(const link_functor &links)
 {
 	struct parser
 	{
+		link_functor links;
+
 		std::vector<std::string> operator() (const swarm::url_fetcher::response &reply, const std::string &data)
 		{
-			(void) reply;
-
 			wookie::parser p;
 			p.feed_text(data);
 
+			if (links) {
+				const swarm::url &base_url = reply.url();
+
+				for (auto & l : p.links()) {
+					swarm::url relative_url = l.first;
+					if (!relative_url.is_valid())
+						continue;
+
+					swarm::url target = base_url.resolved(relative_url);
+					if (!target.is_valid() || target.host().empty() ||
+							(target.scheme() != "https" && target.scheme() != "http"))
+						continue;
+
+					links(reply, target.to_string(), l.second);
+				}
+			}
+
 			return p.urls();
 		}
 	};
 
-	return parser();
+	parser ret;
+	ret.links = links;
+	return ret;
 }
 
 class engine_data
@@ -123,7 +142,7 @@ public:
 	boost::program_options::options_description command_line_options;
 
 	std::mutex inflight_lock;
-	std::map<std::string, document> inflight;
+	std::map<std::string, document_meta> inflight;
 
 	std::atomic_long total;
 	wookie::magic magic;
@@ -140,46 +159,45 @@ public:
 		downloader->feed(url, std::bind(&engine_data::process_url, this, _1, _2, _3));
 	}
 
-	void found_in_page_cache(const swarm::url &url, const document &doc) {
-		std::cout << "Downloading (if-modified-since " << doc.ts << ") ... " << url.to_string() << std::endl;
-		inflight_insert(url, doc);
+	void found_in_page_cache(const swarm::url &url, const document_meta &meta) {
+		std::cout << "Downloading (if-modified-since " << meta.ts << ") ... " << url.to_string() << std::endl;
+		inflight_insert(url, meta);
 		using namespace std::placeholders;
-		downloader->feed(url, doc, std::bind(&engine_data::process_url, this, _1, _2, _3));
+		downloader->feed(url, meta, std::bind(&engine_data::process_url, this, _1, _2, _3));
 	}
 
-	bool inflight_insert(const swarm::url &url, const document &doc) {
+	bool inflight_insert(const swarm::url &url, const document_meta &meta) {
 		const std::string url_string = url.to_string();
 
 		std::unique_lock<std::mutex> guard(inflight_lock);
-		return inflight.insert(std::make_pair(url_string, doc)).second;
+		return inflight.insert(std::make_pair(url_string, meta)).second;
 	}
 
 	bool inflight_insert(const swarm::url &url) {
-		return inflight_insert(url, document());
+		return inflight_insert(url, document_meta());
 	}
 
-	document inflight_erase(const swarm::url &url) {
-		document d;
-
+	void inflight_erase(const swarm::url &url) {
 		const std::string url_string = url.to_string();
 
 		std::unique_lock<std::mutex> guard(inflight_lock);
-		auto check = inflight.find(url_string);
-		if (check != inflight.end()) {
-			d = check->second;
-			inflight.erase(check);
-		}
-
-		return d;
+		inflight.erase(url_string);
 	}
 
-	ioremap::elliptics::async_write_result store_document(const swarm::url &url, const std::string &content, const dnet_time &ts) {
+	future<int> store_document(const swarm::url &url, const std::string &content,
+			const dnet_time &ts, const swarm::url_fetcher::response &reply) {
 		wookie::document d;
 		d.ts = ts;
 		d.key = url.to_string();
 		d.data = content;
 
-		return storage->write_document(d);
+		document_meta meta(d);
+		if (auto content_type = reply.headers().content_type())
+			meta.content_type = *content_type;
+		if (auto etag = reply.headers().get("ETag"))
+			meta.etag = *etag;
+
+		return storage->write_document(d, meta);
 	}
 
 	void process_reply(const swarm::url_fetcher::response &reply, const std::string &data) {
@@ -191,6 +209,7 @@ public:
 			     ", total-urls: " << total <<
 			     ", data-size: " << data.size() <<
 			     ", headers: " << reply.headers().all().size() <<
+			     ", compression-ratio: " << storage::compression_stats().ratio() <<
 			     std::endl;
 
 		bool accepted_by_filters = true;
@@ -199,16 +218,16 @@ public:
 		}
 
 		++total;
-		std::list<ioremap::elliptics::async_write_result> res;
+		std::list<future<int>> res;
 
 		struct dnet_time ts;
 		dnet_current_time(&ts);
 
-		res.emplace_back(store_document(reply.url(), data, ts));
+		res.emplace_back(store_document(reply.url(), data, ts, reply));
 
 		// if original URL redirected to other location, store object by original URL too
 		if (reply.url().to_string() != reply.request().url().to_string())
-			res.emplace_back(store_document(reply.request().url(), data, ts));
+			res.emplace_back(store_document(reply.request().url(), data, ts, reply));
 
 		if (accepted_by_filters) {
 			if (reply.code() != ioremap::swarm::url_fetcher::response::not_modified) {
@@ -258,27 +277,29 @@ public:
 					if (!inflight_insert(request_url))
 						continue;
 
-					auto rres = storage->read_data(request_url.to_string());
-					rres.wait();
-					if (rres.error().code()) {
+					document_meta meta;
+					try {
+						// only metadata is needed to decide whether page has to be revalidated
+						meta = storage->read_meta(request_url.to_string());
+					} catch (const std::exception &e) {
 						std::cout << "Page cache error (download from internet): url: " << request_url.to_string() <<
-							", error: " << rres.error().message() << std::endl;
+							", error: " << e.what() << std::endl;
 						download(request_url);
-					} else {
-						document doc = storage::unpack_document(rres.get_one().file());
-						// document was stored before we started this update generation, process it again
-						int will_process = dnet_time_before(&doc.ts, &generation_time);
-						std::cout << "Url has been found in page cache: url: " << request_url.to_string() <<
-							", will process (document was saved before current engine started): " << will_process <<
-							std::endl;
-
-						if (will_process) {
-							found_in_page_cache(request_url, doc);
-
-							if (reply.code() != ioremap::swarm::url_fetcher::response::not_modified) {
-								for (auto it = processors.begin(); it != processors.end(); ++it)
-									(*it)(reply, data, document_cache);
-							}
+						continue;
+					}
+
+					// document was stored before we started this update generation, process it again
+					int will_process = dnet_time_before(&meta.ts, &generation_time);
+					std::cout << "Url has been found in page cache: url: " << request_url.to_string() <<
+						", will process (document was saved before current engine started): " << will_process <<
+						std::endl;
+
+					if (will_process) {
+						found_in_page_cache(request_url, meta);
+
+						if (reply.code() != ioremap::swarm::url_fetcher::response::not_modified) {
+							for (auto it = processors.begin(); it != processors.end(); ++it)
+								(*it)(reply, data, document_cache);
 						}
 					}
 				}
@@ -297,7 +318,7 @@ public:
 	}
 
 	void process_url(const swarm::url_fetcher::response &reply, const std::string &data, const boost::system::error_code &error) {
-		document old_doc = inflight_erase(reply.request().url());
+		inflight_erase(reply.request().url());
 
 		if (error) {
 			std::cout << "Error  ... " << reply.request().url().to_string();
@@ -310,6 +331,17 @@ public:
 		if (reply.code() != ioremap::swarm::url_fetcher::response::not_modified) {
 			process_reply(reply, data);
 		} else {
+			// page has not been modified, its body is only read when it is really needed
+			document old_doc;
+			try {
+				old_doc = storage->read_document(reply.request().url().to_string());
+			} catch (const std::exception &e) {
+				std::cout << "Page cache error (not modified page is missing): url: " <<
+					reply.request().url().to_string() << ", error: " << e.what() << std::endl;
+				download(reply.request().url());
+				return;
+			}
+
 			process_reply(reply, old_doc.data);
 		}
 	}
@@ -381,7 +413,12 @@ int engine::parse_command_line(int argc, char **argv, boost::program_options::va
 	std::string log_file;
 	int log_level;
 	std::string remote;
+	std::string backend;
+	long backend_latency;
 	std::string ns;
+	std::string codec;
+	size_t cache_size;
+	size_t chunk_size;
 	int url_threads_count;
 
 	general_options.add_options()
@@ -391,8 +428,20 @@ int engine::parse_command_line(int argc, char **argv, boost::program_options::va
 			("groups", value<std::string>(&group_string), "Groups which will host indexes and data, format: 1:2:3")
 			("uthreads", value<int>(&url_threads_count)->default_value(3), "Number of URL downloading and processing threads")
 			("namespace", value<std::string>(&ns), "Namespace for urls and indexes")
+			("codec", value<std::string>(&codec)->default_value("lz4"),
+			 "Document body compression: none, lz4 (fast, hot data) or zstd (better ratio, cold data)")
+			("cache-size", value<size_t>(&cache_size)->default_value(0),
+			 "Size of the in-process document cache in megabytes, 0 disables it")
+			("chunk-size", value<size_t>(&chunk_size)->default_value(default_chunk_size / 1024),
+			 "Documents larger than this number of kilobytes are stored in separate chunks, 0 disables chunking")
+			("hedged-reads", "Send document read to the next replica group if the fastest one "
+			 "has not replied within its 95th latency percentile")
 			("remote", value<std::string>(&remote),
 			 "Remote node to connect, format: address:port:family (IPv4 - 2, IPv6 - 10)")
+			("backend", value<std::string>(&backend)->default_value("elliptics"),
+			 "Storage backend: elliptics or memory (in-process, for benchmarking without a cluster)")
+			("backend-latency", value<long>(&backend_latency)->default_value(0),
+			 "Emulated round trip of the memory backend in microseconds")
 			;
 
 	m_data->command_line_options.add(general_options);
@@ -402,7 +451,12 @@ int engine::parse_command_line(int argc, char **argv, boost::program_options::va
 	store(boost::program_options::parse_command_line(argc, argv, m_data->command_line_options), vm);
 	notify(vm);
 
-	if (vm.count("help") || !vm.count("remote")) {
+	if (backend != "elliptics" && backend != "memory") {
+		std::cerr << "Invalid backend: " << backend << std::endl;
+		return -1;
+	}
+
+	if (vm.count("help") || (backend == "elliptics" && !vm.count("remote"))) {
 		std::cerr << general_options << std::endl;
 		for (auto it = m_data->options.begin(); it != m_data->options.end(); ++it)
 			std::cerr << *it << std::endl;
@@ -425,20 +479,37 @@ int engine::parse_command_line(int argc, char **argv, boost::program_options::va
 		std::transform(gr.begin(), gr.end(), std::back_inserter<std::vector<int>>(groups), digitizer());
 	}
 
-	elliptics::file_logger log(log_file.c_str(), log_level);
-	m_data->storage.reset(new wookie::storage(elliptics::node(log)));
+	if (backend == "memory") {
+		m_data->storage.reset(new wookie::storage(
+			std::make_shared<memory_backend>(std::chrono::microseconds(backend_latency))));
+	} else {
+		elliptics::file_logger log(log_file.c_str(), log_level);
+		m_data->storage.reset(new wookie::storage(elliptics::node(log)));
+	}
 
 	if (ns.size())
 		m_data->storage->set_namespace(ns);
 
 	try {
-		m_data->storage->get_node().add_remote(remote.c_str());
+		m_data->storage->set_codec(compress::codec_from_name(codec));
+	} catch (const elliptics::error &e) {
+		std::cerr << "Invalid codec: " << e.what() << std::endl;
+		return -1;
+	}
+
+	m_data->storage->set_cache_size(cache_size * 1024 * 1024);
+	m_data->storage->set_chunk_size(chunk_size * 1024);
+
+	try {
+		if (backend == "elliptics")
+			m_data->storage->get_node().add_remote(remote.c_str());
 	} catch (const elliptics::error &e) {
 		std::cerr << "Could not connect to " << remote << ": " << e.what() << std::endl;
 		return -1;
 	}
 
 	m_data->storage->set_groups(groups);
+	m_data->storage->set_hedged_reads(vm.count("hedged-reads") != 0);
 
 	m_data->downloader.reset(new wookie::dmanager(url_threads_count));
 
@@ -458,7 +529,12 @@ int engine::run()
 
 void engine::found_in_page_cache(const std::string &url, const document &doc)
 {
-	m_data->found_in_page_cache(url, doc);
+	m_data->found_in_page_cache(url, document_meta(doc));
+}
+
+void engine::found_in_page_cache(const std::string &url, const document_meta &meta)
+{
+	m_data->found_in_page_cache(url, meta);
 }
 
 }}
@@ -0,0 +1,160 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "wookie/fields.hpp"
+
+#include <ctype.h>
+#include <string.h>
+
+namespace ioremap { namespace wookie { namespace fields {
+
+namespace {
+	static const char *field_names[fields_num] = { "body", "title", "heading", "url", "anchor" };
+
+	static const char separator = '#';
+
+	// positions of the next part start this far after the end of the previous one
+	static const int part_gap = 100;
+}
+
+const char *name(field_id field)
+{
+	return field < fields_num ? field_names[field] : "unknown";
+}
+
+bool lookup(const std::string &name, field_id &field)
+{
+	for (int i = 0; i < fields_num; ++i) {
+		if (name == field_names[i]) {
+			field = (field_id)i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+std::string token(field_id field, const std::string &token)
+{
+	if (field == body || field >= fields_num)
+		return token;
+
+	return std::string(field_names[field]) + separator + token;
+}
+
+field_id parse(const std::string &token, std::string *plain)
+{
+	size_t sep = token.find(separator);
+
+	field_id field = body;
+	if (sep == std::string::npos || !lookup(token.substr(0, sep), field) || field == body) {
+		if (plain)
+			*plain = token;
+		return body;
+	}
+
+	if (plain)
+		*plain = token.substr(sep + 1);
+	return field;
+}
+
+boosts::boosts()
+{
+	weight[body] = 1;
+	weight[title] = 3;
+	weight[heading] = 2;
+	weight[url] = 1.5;
+	weight[anchor] = 2;
+}
+
+std::string url_text(const std::string &url)
+{
+	std::string ret(url);
+	for (auto & ch : ret) {
+		if (ispunct((unsigned char)ch))
+			ch = ' ';
+	}
+
+	return ret;
+}
+
+mpos_t positions(split &spl, const document_fields &doc)
+{
+	mpos_t ret;
+	int offset = 0;
+
+	for (int f = 0; f < fields_num; ++f) {
+		for (auto & text : doc.text[f]) {
+			std::vector<std::string> tokens;
+			mpos_t part = spl.feed(text, tokens);
+			if (part.empty())
+				continue;
+
+			int end = offset;
+			for (auto & p : part) {
+				std::vector<int> &pos = ret[token((field_id)f, p.first)];
+				for (int position : p.second) {
+					pos.push_back(offset + position);
+					end = std::max(end, offset + position + 1);
+				}
+			}
+
+			offset = end + part_gap;
+		}
+	}
+
+	return ret;
+}
+
+void replace_anchors(split &spl, mpos_t &pos, const std::vector<std::string> &anchors)
+{
+	int offset = 0;
+	for (auto it = pos.begin(); it != pos.end(); ) {
+		if (parse(it->first) == anchor) {
+			it = pos.erase(it);
+			continue;
+		}
+
+		for (int position : it->second)
+			offset = std::max(offset, position + 1 + part_gap);
+		++it;
+	}
+
+	document_fields doc;
+	doc.text[anchor] = anchors;
+
+	for (auto & p : positions(spl, doc)) {
+		std::vector<int> &dst = pos[p.first];
+		for (int position : p.second)
+			dst.push_back(offset + position);
+	}
+}
+
+void expand(const std::vector<std::string> &tokens, const boosts &b,
+		std::vector<std::string> &terms, std::vector<double> &weights)
+{
+	for (int f = 0; f < fields_num; ++f) {
+		if (b.weight[f] <= 0)
+			continue;
+
+		for (auto & t : tokens) {
+			terms.push_back(token((field_id)f, t));
+			weights.push_back(b.weight[f]);
+		}
+	}
+}
+
+}}} // namespace ioremap::wookie::fields
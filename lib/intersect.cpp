@@ -0,0 +1,327 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "wookie/intersect.hpp"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define WOOKIE_INTERSECT_X86
+#include <immintrin.h>
+#endif
+
+namespace ioremap { namespace wookie { namespace intersect {
+
+size_t scalar(const uint32_t *a, size_t a_size, const uint32_t *b, size_t b_size, uint32_t *out)
+{
+	size_t i = 0, j = 0, k = 0;
+
+	while (i < a_size && j < b_size) {
+		if (a[i] < b[j]) {
+			++i;
+		} else if (b[j] < a[i]) {
+			++j;
+		} else {
+			out[k++] = a[i];
+			++i;
+			++j;
+		}
+	}
+
+	return k;
+}
+
+size_t galloping(const uint32_t *a, size_t a_size, const uint32_t *b, size_t b_size, uint32_t *out)
+{
+	size_t j = 0, k = 0;
+
+	for (size_t i = 0; i < a_size && j < b_size; ++i) {
+		const uint32_t value = a[i];
+
+		// find range (j + step / 2, j + step] which hosts the value
+		size_t step = 1;
+		while (j + step < b_size && b[j + step] < value)
+			step <<= 1;
+
+		const uint32_t *end = b + std::min(j + step + 1, b_size);
+		const uint32_t *pos = std::lower_bound(b + j + step / 2, end, value);
+
+		j = pos - b;
+		if (j < b_size && b[j] == value)
+			out[k++] = value;
+	}
+
+	return k;
+}
+
+#ifdef WOOKIE_INTERSECT_X86
+
+namespace {
+
+// for every mask of matched lanes: indexes of the matched lanes moved to the beginning
+struct shuffle_tables {
+	uint8_t sse[16][16];
+	uint32_t avx2[256][8];
+
+	shuffle_tables() {
+		for (int mask = 0; mask < 16; ++mask) {
+			int pos = 0;
+			for (int lane = 0; lane < 4; ++lane) {
+				if (mask & (1 << lane)) {
+					for (int byte = 0; byte < 4; ++byte)
+						sse[mask][pos * 4 + byte] = lane * 4 + byte;
+					++pos;
+				}
+			}
+
+			for (; pos < 4; ++pos) {
+				for (int byte = 0; byte < 4; ++byte)
+					sse[mask][pos * 4 + byte] = 0x80;
+			}
+		}
+
+		for (int mask = 0; mask < 256; ++mask) {
+			int pos = 0;
+			for (int lane = 0; lane < 8; ++lane) {
+				if (mask & (1 << lane))
+					avx2[mask][pos++] = lane;
+			}
+
+			for (; pos < 8; ++pos)
+				avx2[mask][pos] = 0;
+		}
+	}
+};
+
+static const shuffle_tables tables;
+
+struct cpu_features {
+	bool sse;
+	bool avx2;
+
+	cpu_features() {
+		__builtin_cpu_init();
+		sse = __builtin_cpu_supports("sse4.2");
+		avx2 = __builtin_cpu_supports("avx2");
+	}
+};
+
+static const cpu_features features;
+
+// all-pairs compare of 4-element blocks: every rotation of @b block is compared
+// with @a block, matched @a lanes are packed to the output with one shuffle
+__attribute__ ((target("sse4.2")))
+size_t sse_kernel(const uint32_t *a, size_t a_size, const uint32_t *b, size_t b_size, uint32_t *out)
+{
+	size_t i = 0, j = 0, k = 0;
+	const size_t a_end = a_size & ~(size_t)3;
+	const size_t b_end = b_size & ~(size_t)3;
+
+	while (i < a_end && j < b_end) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + j));
+
+		__m128i cmp = _mm_cmpeq_epi32(va, vb);
+		cmp = _mm_or_si128(cmp, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1))));
+		cmp = _mm_or_si128(cmp, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))));
+		cmp = _mm_or_si128(cmp, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3))));
+
+		int mask = _mm_movemask_ps(_mm_castsi128_ps(cmp));
+		if (mask) {
+			__m128i shuffle = _mm_loadu_si128((const __m128i *)tables.sse[mask]);
+			_mm_storeu_si128((__m128i *)(out + k), _mm_shuffle_epi8(va, shuffle));
+			k += __builtin_popcount(mask);
+		}
+
+		const uint32_t a_max = a[i + 3];
+		const uint32_t b_max = b[j + 3];
+		if (a_max <= b_max)
+			i += 4;
+		if (b_max <= a_max)
+			j += 4;
+	}
+
+	return k + scalar(a + i, a_size - i, b + j, b_size - j, out + k);
+}
+
+__attribute__ ((target("avx2")))
+size_t avx2_kernel(const uint32_t *a, size_t a_size, const uint32_t *b, size_t b_size, uint32_t *out)
+{
+	size_t i = 0, j = 0, k = 0;
+	const size_t a_end = a_size & ~(size_t)7;
+	const size_t b_end = b_size & ~(size_t)7;
+
+	const __m256i rotate = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+
+	while (i < a_end && j < b_end) {
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b + j));
+
+		__m256i cmp = _mm256_cmpeq_epi32(va, vb);
+		for (int r = 1; r < 8; ++r) {
+			vb = _mm256_permutevar8x32_epi32(vb, rotate);
+			cmp = _mm256_or_si256(cmp, _mm256_cmpeq_epi32(va, vb));
+		}
+
+		int mask = _mm256_movemask_ps(_mm256_castsi256_ps(cmp));
+		if (mask) {
+			__m256i shuffle = _mm256_loadu_si256((const __m256i *)tables.avx2[mask]);
+			_mm256_storeu_si256((__m256i *)(out + k), _mm256_permutevar8x32_epi32(va, shuffle));
+			k += __builtin_popcount(mask);
+		}
+
+		const uint32_t a_max = a[i + 7];
+		const uint32_t b_max = b[j + 7];
+		if (a_max <= b_max)
+			i += 8;
+		if (b_max <= a_max)
+			j += 8;
+	}
+
+	return k + scalar(a + i, a_size - i, b + j, b_size - j, out + k);
+}
+
+} // namespace
+
+bool has_sse()
+{
+	return features.sse;
+}
+
+bool has_avx2()
+{
+	return features.avx2;
+}
+
+size_t sse(const uint32_t *a, size_t a_size, const uint32_t *b, size_t b_size, uint32_t *out)
+{
+	if (!features.sse)
+		return scalar(a, a_size, b, b_size, out);
+
+	return sse_kernel(a, a_size, b, b_size, out);
+}
+
+size_t avx2(const uint32_t *a, size_t a_size, const uint32_t *b, size_t b_size, uint32_t *out)
+{
+	if (!features.avx2)
+		return sse(a, a_size, b, b_size, out);
+
+	return avx2_kernel(a, a_size, b, b_size, out);
+}
+
+#else
+
+bool has_sse()
+{
+	return false;
+}
+
+bool has_avx2()
+{
+	return false;
+}
+
+size_t sse(const uint32_t *a, size_t a_size, const uint32_t *b, size_t b_size, uint32_t *out)
+{
+	return scalar(a, a_size, b, b_size, out);
+}
+
+size_t avx2(const uint32_t *a, size_t a_size, const uint32_t *b, size_t b_size, uint32_t *out)
+{
+	return scalar(a, a_size, b, b_size, out);
+}
+
+#endif
+
+size_t pair(const uint32_t *a, size_t a_size, const uint32_t *b, size_t b_size, uint32_t *out)
+{
+	if (a_size > b_size) {
+		std::swap(a, b);
+		std::swap(a_size, b_size);
+	}
+
+	if (a_size == 0)
+		return 0;
+
+	if (b_size / a_size >= galloping_ratio)
+		return galloping(a, a_size, b, b_size, out);
+
+	if (b_size / a_size < 2)
+		return avx2(a, a_size, b, b_size, out);
+
+	return sse(a, a_size, b, b_size, out);
+}
+
+size_t difference(const uint32_t *a, size_t a_size, const uint32_t *b, size_t b_size, uint32_t *out)
+{
+	size_t j = 0, k = 0;
+	const bool gallop = a_size && b_size / a_size >= galloping_ratio;
+
+	for (size_t i = 0; i < a_size; ++i) {
+		const uint32_t value = a[i];
+
+		if (gallop) {
+			size_t step = 1;
+			while (j + step < b_size && b[j + step] < value)
+				step <<= 1;
+
+			const uint32_t *end = b + std::min(j + step + 1, b_size);
+			j = std::lower_bound(b + std::min(j + step / 2, b_size), end, value) - b;
+		} else {
+			while (j < b_size && b[j] < value)
+				++j;
+		}
+
+		if (j == b_size || b[j] != value)
+			out[k++] = value;
+	}
+
+	return k;
+}
+
+void all(const std::vector<const std::vector<uint32_t> *> &lists, std::vector<uint32_t> &result)
+{
+	result.clear();
+
+	if (lists.empty())
+		return;
+
+	std::vector<const std::vector<uint32_t> *> sorted(lists);
+	std::sort(sorted.begin(), sorted.end(),
+		[] (const std::vector<uint32_t> *a, const std::vector<uint32_t> *b) {
+			return a->size() < b->size();
+		});
+
+	if (sorted.size() == 1) {
+		result = *sorted[0];
+		return;
+	}
+
+	std::vector<uint32_t> tmp;
+
+	result.resize(sorted[0]->size() + padding);
+	size_t size = pair(sorted[0]->data(), sorted[0]->size(), sorted[1]->data(), sorted[1]->size(), result.data());
+
+	for (size_t i = 2; i < sorted.size() && size; ++i) {
+		tmp.resize(size + padding);
+		size = pair(result.data(), size, sorted[i]->data(), sorted[i]->size(), tmp.data());
+		result.swap(tmp);
+	}
+
+	result.resize(size);
+}
+
+}}} // namespace ioremap::wookie::intersect
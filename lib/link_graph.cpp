@@ -0,0 +1,433 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "wookie/link_graph.hpp"
+#include "wookie/varint.hpp"
+
+#include <elliptics/error.hpp>
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <thread>
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ioremap { namespace wookie {
+
+namespace {
+	static const char graph_magic[8] = { 'W', 'O', 'O', 'K', 'L', 'I', 'N', 'K' };
+	static const uint32_t graph_version = 1;
+
+	struct graph_header {
+		char		magic[8];
+		uint32_t	version;
+		uint32_t	nodes_num;
+		uint64_t	links_num;
+		uint64_t	size;
+	} __attribute__ ((packed));
+
+	// list is the number of targets followed by the first target and gaps between the next ones
+	void decode(const char *ptr, const char *end, std::vector<uint32_t> &targets) {
+		uint64_t num = varint::get(ptr, end);
+		uint32_t prev = 0;
+
+		for (uint64_t i = 0; i < num; ++i) {
+			prev += varint::get(ptr, end);
+			targets.push_back(prev);
+		}
+	}
+
+	// runs @fn(begin, end, thread) over @threads parts of [0, @num)
+	void parallel(int threads, uint32_t num, const std::function<void (uint32_t, uint32_t, int)> &fn) {
+		std::vector<std::thread> workers;
+		const uint32_t part = (num + threads - 1) / threads;
+
+		for (int t = 0; t < threads; ++t) {
+			uint32_t begin = std::min<uint64_t>((uint64_t)t * part, num);
+			uint32_t end = std::min<uint64_t>((uint64_t)begin + part, num);
+			workers.emplace_back(fn, begin, end, t);
+		}
+
+		for (auto & w : workers)
+			w.join();
+	}
+}
+
+link_graph::link_graph(size_t batch_links) :
+m_batch_links(batch_links), m_links_num(0), m_pending_links(0), m_nodes_num(0)
+{
+}
+
+void link_graph::add_link(uint32_t source, uint32_t target)
+{
+	if (source == target)
+		return;
+
+	std::unique_lock<std::mutex> guard(m_lock);
+
+	m_pending[source].push_back(target);
+	m_nodes_num = std::max(m_nodes_num, std::max(source, target) + 1);
+
+	if (++m_pending_links >= m_batch_links)
+		merge_pending();
+}
+
+void link_graph::set_links(uint32_t source, std::vector<uint32_t> targets)
+{
+	std::sort(targets.begin(), targets.end());
+	targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+	targets.erase(std::remove(targets.begin(), targets.end(), source), targets.end());
+
+	std::unique_lock<std::mutex> guard(m_lock);
+
+	auto it = m_pending.find(source);
+	if (it != m_pending.end()) {
+		m_pending_links -= it->second.size();
+		m_pending.erase(it);
+	}
+
+	m_nodes_num = std::max(m_nodes_num, source + 1);
+	if (targets.size())
+		m_nodes_num = std::max(m_nodes_num, targets.back() + 1);
+
+	store(source, targets);
+}
+
+std::vector<uint32_t> link_graph::links(uint32_t source)
+{
+	std::unique_lock<std::mutex> guard(m_lock);
+	merge_pending();
+
+	std::vector<uint32_t> ret;
+	if (source < m_links.size() && m_links[source].size())
+		decode(m_links[source].data(), m_links[source].data() + m_links[source].size(), ret);
+	return ret;
+}
+
+uint32_t link_graph::nodes_num()
+{
+	std::unique_lock<std::mutex> guard(m_lock);
+	return m_nodes_num;
+}
+
+uint64_t link_graph::links_num()
+{
+	std::unique_lock<std::mutex> guard(m_lock);
+	merge_pending();
+	return m_links_num;
+}
+
+void link_graph::merge_pending()
+{
+	for (auto & p : m_pending) {
+		std::vector<uint32_t> &targets = p.second;
+
+		if (p.first < m_links.size() && m_links[p.first].size()) {
+			const std::string &list = m_links[p.first];
+			decode(list.data(), list.data() + list.size(), targets);
+		}
+
+		std::sort(targets.begin(), targets.end());
+		targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+
+		store(p.first, targets);
+	}
+
+	m_pending.clear();
+	m_pending_links = 0;
+}
+
+void link_graph::store(uint32_t source, const std::vector<uint32_t> &targets)
+{
+	if (source >= m_links.size())
+		m_links.resize(source + 1);
+
+	std::string &list = m_links[source];
+	if (list.size()) {
+		const char *ptr = list.data();
+		m_links_num -= varint::get(ptr, ptr + list.size());
+	}
+
+	list.clear();
+	if (targets.empty())
+		return;
+
+	varint::put(list, targets.size());
+
+	uint32_t prev = 0;
+	for (auto t : targets) {
+		varint::put(list, t - prev);
+		prev = t;
+	}
+
+	list.shrink_to_fit();
+	m_links_num += targets.size();
+}
+
+void link_graph::save(const std::string &path)
+{
+	std::unique_lock<std::mutex> guard(m_lock);
+	merge_pending();
+
+	std::vector<uint64_t> offsets;
+	offsets.reserve(m_nodes_num + 1);
+
+	uint64_t offset = 0;
+	for (uint32_t n = 0; n < m_nodes_num; ++n) {
+		offsets.push_back(offset);
+		if (n < m_links.size())
+			offset += m_links[n].size();
+	}
+	offsets.push_back(offset);
+
+	graph_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, graph_magic, sizeof(header.magic));
+	header.version = graph_version;
+	header.nodes_num = m_nodes_num;
+	header.links_num = m_links_num;
+	header.size = sizeof(header) + offsets.size() * sizeof(uint64_t) + offset;
+
+	std::string tmp = path + ".tmp";
+	std::ofstream out(tmp.c_str(), std::ios::binary | std::ios::trunc);
+	if (!out)
+		elliptics::throw_error(-errno, "link graph: could not open %s", tmp.c_str());
+
+	out.write((const char *)&header, sizeof(header));
+	out.write((const char *)offsets.data(), offsets.size() * sizeof(uint64_t));
+	for (uint32_t n = 0; n < m_nodes_num && n < m_links.size(); ++n)
+		out.write(m_links[n].data(), m_links[n].size());
+
+	out.close();
+	if (!out) {
+		unlink(tmp.c_str());
+		elliptics::throw_error(-EIO, "link graph: could not write %s", tmp.c_str());
+	}
+
+	if (rename(tmp.c_str(), path.c_str()) < 0) {
+		int err = -errno;
+		unlink(tmp.c_str());
+		elliptics::throw_error(err, "link graph: could not rename %s to %s", tmp.c_str(), path.c_str());
+	}
+}
+
+void link_graph::load(const std::string &path)
+{
+	mapped_link_graph graph(path);
+
+	std::vector<std::string> links(graph.nodes_num());
+	std::vector<uint32_t> targets;
+	for (uint32_t n = 0; n < graph.nodes_num(); ++n) {
+		targets.clear();
+		graph.links(n, targets);
+		if (targets.empty())
+			continue;
+
+		varint::put(links[n], targets.size());
+
+		uint32_t prev = 0;
+		for (auto t : targets) {
+			varint::put(links[n], t - prev);
+			prev = t;
+		}
+	}
+
+	std::unique_lock<std::mutex> guard(m_lock);
+	m_links.swap(links);
+	m_links_num = graph.links_num();
+	m_nodes_num = graph.nodes_num();
+	m_pending.clear();
+	m_pending_links = 0;
+}
+
+mapped_link_graph::mapped_link_graph(const std::string &path) : m_fd(-1), m_data(NULL), m_size(0)
+{
+	m_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (m_fd < 0) {
+		int err = -errno;
+		elliptics::throw_error(err, "link graph: could not open %s: %s", path.c_str(), strerror(-err));
+	}
+
+	struct stat st;
+	if (fstat(m_fd, &st) < 0) {
+		int err = -errno;
+		close(m_fd);
+		elliptics::throw_error(err, "link graph: could not stat %s: %s", path.c_str(), strerror(-err));
+	}
+
+	m_size = st.st_size;
+	if (m_size < sizeof(graph_header)) {
+		close(m_fd);
+		elliptics::throw_error(-EPROTO, "link graph: %s is too small: %llu", path.c_str(), (unsigned long long)m_size);
+	}
+
+	void *data = mmap(NULL, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+	if (data == MAP_FAILED) {
+		int err = -errno;
+		close(m_fd);
+		elliptics::throw_error(err, "link graph: could not map %s: %s", path.c_str(), strerror(-err));
+	}
+
+	m_data = (const char *)data;
+	const graph_header *header = (const graph_header *)m_data;
+
+	const uint64_t lists = sizeof(graph_header) + ((uint64_t)header->nodes_num + 1) * sizeof(uint64_t);
+	if (memcmp(header->magic, graph_magic, sizeof(graph_magic)) || header->version != graph_version ||
+			header->size != m_size || lists > m_size ||
+			((const uint64_t *)(m_data + sizeof(graph_header)))[header->nodes_num] != m_size - lists) {
+		munmap(data, m_size);
+		close(m_fd);
+		elliptics::throw_error(-EPROTO, "link graph: %s is corrupted or has unsupported version", path.c_str());
+	}
+
+	m_nodes_num = header->nodes_num;
+	m_links_num = header->links_num;
+	m_offsets = (const uint64_t *)(m_data + sizeof(graph_header));
+	m_lists = m_data + lists;
+
+	// lists are read sequentially by the whole graph jobs
+	madvise(data, m_size, MADV_SEQUENTIAL);
+}
+
+mapped_link_graph::~mapped_link_graph()
+{
+	munmap((void *)m_data, m_size);
+	close(m_fd);
+}
+
+uint32_t mapped_link_graph::nodes_num() const
+{
+	return m_nodes_num;
+}
+
+uint64_t mapped_link_graph::links_num() const
+{
+	return m_links_num;
+}
+
+uint32_t mapped_link_graph::out_degree(uint32_t source) const
+{
+	if (source >= m_nodes_num || m_offsets[source] == m_offsets[source + 1])
+		return 0;
+
+	const char *ptr = m_lists + m_offsets[source];
+	return varint::get(ptr, m_lists + m_offsets[source + 1]);
+}
+
+void mapped_link_graph::links(uint32_t source, std::vector<uint32_t> &targets) const
+{
+	if (source >= m_nodes_num || m_offsets[source] >= m_offsets[source + 1])
+		return;
+
+	if (m_offsets[source + 1] > m_offsets[m_nodes_num])
+		elliptics::throw_error(-EPROTO, "link graph: invalid offset of node %u", source);
+
+	decode(m_lists + m_offsets[source], m_lists + m_offsets[source + 1], targets);
+}
+
+std::vector<float> pagerank(const mapped_link_graph &graph, const pagerank_params &params)
+{
+	const uint32_t n = graph.nodes_num();
+	if (!n)
+		return std::vector<float>();
+
+	int threads = params.threads > 0 ? params.threads : std::thread::hardware_concurrency();
+	threads = std::max(1, std::min<int>(threads, n));
+
+	// incoming links in the same offsets + array form
+	std::vector<uint32_t> out_degree(n);
+	std::vector<uint64_t> in_offsets(n + 1, 0);
+	std::vector<uint32_t> targets;
+
+	for (uint32_t u = 0; u < n; ++u) {
+		targets.clear();
+		graph.links(u, targets);
+		out_degree[u] = targets.size();
+
+		for (auto v : targets) {
+			if (v >= n)
+				elliptics::throw_error(-EPROTO, "link graph: link %u -> %u is out of range", u, v);
+			++in_offsets[v + 1];
+		}
+	}
+
+	for (uint32_t v = 0; v < n; ++v)
+		in_offsets[v + 1] += in_offsets[v];
+
+	std::vector<uint32_t> in_links(in_offsets[n]);
+	{
+		std::vector<uint64_t> pos(in_offsets.begin(), in_offsets.end() - 1);
+		for (uint32_t u = 0; u < n; ++u) {
+			targets.clear();
+			graph.links(u, targets);
+			for (auto v : targets)
+				in_links[pos[v]++] = u;
+		}
+	}
+
+	std::vector<double> rank(n, 1.0 / n), next(n), contrib(n);
+	const double d = params.damping;
+
+	for (int it = 0; it < params.iterations; ++it) {
+		std::vector<double> dangling(threads, 0), diff(threads, 0);
+
+		parallel(threads, n, [&] (uint32_t begin, uint32_t end, int t) {
+				for (uint32_t u = begin; u < end; ++u) {
+					if (out_degree[u]) {
+						contrib[u] = rank[u] / out_degree[u];
+					} else {
+						contrib[u] = 0;
+						dangling[t] += rank[u];
+					}
+				}
+			});
+
+		double base = 0;
+		for (auto r : dangling)
+			base += r;
+		base = (1 - d) / n + d * base / n;
+
+		parallel(threads, n, [&] (uint32_t begin, uint32_t end, int t) {
+				for (uint32_t v = begin; v < end; ++v) {
+					double sum = 0;
+					for (uint64_t i = in_offsets[v]; i < in_offsets[v + 1]; ++i)
+						sum += contrib[in_links[i]];
+
+					next[v] = base + d * sum;
+					diff[t] += fabs(next[v] - rank[v]);
+				}
+			});
+
+		rank.swap(next);
+
+		double change = 0;
+		for (auto c : diff)
+			change += c;
+		if (change < params.epsilon)
+			break;
+	}
+
+	return std::vector<float>(rank.begin(), rank.end());
+}
+
+}} // namespace ioremap::wookie
@@ -0,0 +1,593 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "wookie/local_index.hpp"
+#include "wookie/dir.hpp"
+#include "wookie/index_data.hpp"
+#include "wookie/intersect.hpp"
+#include "wookie/query.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+#include <stdio.h>
+
+namespace ioremap { namespace wookie {
+
+// the first range of documents evaluated in impact-ordered segments, the following ones
+// are twice as large each, so that the tail of a segment is not split into too many pieces
+static const uint32_t impact_range = 1024;
+
+local_index::local_index(const std::string &dir, size_t merge_factor) :
+m_dir(dir), m_merge_factor(std::max<size_t>(merge_factor, 2)), m_generation(0),
+m_merging(false), m_merge_failed(false), m_need_exit(false)
+{
+	if (mkdir(m_dir.c_str(), 0755) < 0 && errno != EEXIST) {
+		int err = -errno;
+		elliptics::throw_error(err, "local index: could not create directory %s: %s",
+				m_dir.c_str(), strerror(-err));
+	}
+
+	iterate_directory(m_dir, [this] (const char *path, const char *name) -> bool {
+		size_t len = strlen(name);
+
+		// leftovers of interrupted segment writes
+		if (len > 4 && !strcmp(name + len - 4, ".tmp")) {
+			unlink(path);
+			return true;
+		}
+
+		if (len <= 4 || strcmp(name + len - 4, ".seg"))
+			return true;
+
+		entry e;
+		e.generation = strtoull(name, NULL, 10);
+		e.seg = std::make_shared<segment>(path);
+
+		m_segments.emplace_back(e);
+		m_generation = std::max(m_generation, e.generation + 1);
+		return true;
+	});
+
+	std::sort(m_segments.begin(), m_segments.end(),
+		[] (const entry &a, const entry &b) {
+			return a.generation < b.generation;
+		});
+
+	m_merge_thread = std::thread(std::bind(&local_index::merge_worker, this));
+}
+
+local_index::~local_index() {
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		m_need_exit = true;
+		m_cond.notify_all();
+	}
+
+	m_merge_thread.join();
+}
+
+std::string local_index::segment_path(uint64_t generation) const {
+	char name[64];
+	snprintf(name, sizeof(name), "/%020llu.seg", (unsigned long long)generation);
+
+	return m_dir + name;
+}
+
+size_t local_index::tier(const segment &seg) const {
+	size_t t = 0;
+	for (size_t docs = seg.docs_num(); docs >= m_merge_factor; docs /= m_merge_factor)
+		++t;
+
+	return t;
+}
+
+void local_index::set_prior(const std::function<float (const segment_document &doc)> &prior) {
+	std::unique_lock<std::mutex> guard(m_lock);
+	m_prior = prior;
+}
+
+float local_index::prior(const segment_document &doc) {
+	std::function<float (const segment_document &doc)> prior;
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		prior = m_prior;
+	}
+
+	return prior ? prior(doc) : 0;
+}
+
+void local_index::add_segment(segment_writer &writer) {
+	if (writer.empty())
+		return;
+
+	entry e;
+	std::function<float (const segment_document &doc)> prior;
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		e.generation = m_generation++;
+		prior = m_prior;
+	}
+
+	if (prior)
+		writer.set_priors(prior);
+
+	std::string path = segment_path(e.generation);
+	writer.write(path);
+	e.seg = std::make_shared<segment>(path);
+	writer.clear();
+
+	std::unique_lock<std::mutex> guard(m_lock);
+
+	auto it = std::upper_bound(m_segments.begin(), m_segments.end(), e,
+		[] (const entry &a, const entry &b) {
+			return a.generation < b.generation;
+		});
+	m_segments.insert(it, e);
+
+	m_merge_failed = false;
+	m_cond.notify_all();
+}
+
+size_t local_index::segments_num() {
+	std::unique_lock<std::mutex> guard(m_lock);
+	return m_segments.size();
+}
+
+size_t local_index::docs_num() {
+	std::unique_lock<std::mutex> guard(m_lock);
+
+	size_t num = 0;
+	for (auto & e : m_segments)
+		num += e.seg->docs_num();
+
+	return num;
+}
+
+// appends found @docs of segment @i to @result, documents which have been reindexed
+// into newer segments are skipped, index entries are added for @terms present
+// in the segment (@infos of the others are null), and if positions are read,
+// only for terms present in the document
+static void add_results(const std::vector<std::shared_ptr<segment>> &segments, size_t i,
+		const std::vector<uint32_t> &docs, const std::vector<std::string> &terms,
+		const std::vector<dnet_raw_id> &ids, const std::vector<const segment::term_info *> &infos,
+		bool positions, find_result_t &result)
+{
+	const segment &seg = *segments[i];
+
+	for (auto doc : docs) {
+		segment_document d = seg.document(doc);
+
+		// document has been reindexed, newer segment hosts its current version
+		bool hidden = false;
+		for (size_t n = i + 1; !hidden && n < segments.size(); ++n)
+			hidden = segments[n]->contains(d.key);
+
+		if (hidden)
+			continue;
+
+		elliptics::find_indexes_result_entry entry;
+		entry.id = d.id;
+
+		for (size_t j = 0; j < terms.size(); ++j) {
+			if (!infos[j])
+				continue;
+
+			std::vector<int> pos;
+			if (positions) {
+				pos = seg.positions(*infos[j], doc);
+				if (pos.empty())
+					continue;
+			}
+
+			elliptics::index_entry ie;
+			ie.index = ids[j];
+			ie.data = index_data(d.ts, terms[j], pos).convert();
+			entry.indexes.emplace_back(ie);
+		}
+
+		result.emplace_back(entry);
+	}
+}
+
+namespace {
+
+// query plan source over a single segment, dictionary lookups are cached
+class segment_source : public query::source {
+	public:
+		explicit segment_source(const segment &seg) : m_seg(seg) {}
+
+		const segment::term_info *info(const std::string &token) {
+			auto it = m_infos.find(token);
+			if (it == m_infos.end()) {
+				std::pair<bool, segment::term_info> &e = m_infos[token];
+				e.first = m_seg.lookup(token, e.second);
+				return e.first ? &e.second : NULL;
+			}
+
+			return it->second.first ? &it->second.second : NULL;
+		}
+
+		virtual size_t df(const std::string &token) {
+			const segment::term_info *ti = info(token);
+			return ti ? ti->df : 0;
+		}
+
+		virtual void postings(const std::string &token, std::vector<uint32_t> &docs) {
+			docs.clear();
+
+			const segment::term_info *ti = info(token);
+			if (ti)
+				m_seg.postings(*ti, docs);
+		}
+
+		virtual std::vector<int> positions(const std::string &token, uint32_t doc) {
+			const segment::term_info *ti = info(token);
+			return ti ? m_seg.positions(*ti, doc) : std::vector<int>();
+		}
+
+	private:
+		const segment &m_seg;
+		std::map<std::string, std::pair<bool, segment::term_info>> m_infos;
+};
+
+}
+
+find_result_t local_index::find(const query::node &q, const std::vector<std::string> &terms,
+		const std::vector<dnet_raw_id> &ids, bool positions) {
+	find_result_t result;
+
+	if (terms.size() != ids.size())
+		return result;
+
+	std::vector<std::shared_ptr<segment>> segments;
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		for (auto & e : m_segments)
+			segments.push_back(e.seg);
+	}
+
+	for (ssize_t i = segments.size() - 1; i >= 0; --i) {
+		segment_source src(*segments[i]);
+
+		query::plan plan(q, src);
+		if (!plan.cost())
+			continue;
+
+		std::vector<const segment::term_info *> infos;
+		std::vector<segment::term_info> found;
+		for (auto & t : terms) {
+			infos.push_back(src.info(t));
+			if (infos.back())
+				found.push_back(*infos.back());
+		}
+
+		segments[i]->prefetch(found, positions);
+
+		std::vector<uint32_t> docs;
+		plan.execute(docs);
+
+		add_results(segments, i, docs, terms, ids, infos, positions, result);
+	}
+
+	return result;
+}
+
+find_result_t local_index::find(const std::vector<std::string> &terms, const std::vector<dnet_raw_id> &ids,
+		bool positions) {
+	find_result_t result;
+
+	if (terms.empty() || terms.size() != ids.size())
+		return result;
+
+	std::vector<std::shared_ptr<segment>> segments;
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		for (auto & e : m_segments)
+			segments.push_back(e.seg);
+	}
+
+	for (ssize_t i = segments.size() - 1; i >= 0; --i) {
+		const segment &seg = *segments[i];
+
+		std::vector<segment::term_info> infos(terms.size());
+
+		bool found = true;
+		for (size_t j = 0; found && j < terms.size(); ++j)
+			found = seg.lookup(terms[j], infos[j]);
+
+		if (!found)
+			continue;
+
+		seg.prefetch(infos, positions);
+
+		std::vector<std::vector<uint32_t>> lists(terms.size());
+		std::vector<const std::vector<uint32_t> *> ptrs;
+		for (size_t j = 0; j < terms.size(); ++j) {
+			seg.postings(infos[j], lists[j]);
+			ptrs.push_back(&lists[j]);
+		}
+
+		std::vector<uint32_t> docs;
+		intersect::all(ptrs, docs);
+
+		std::vector<const segment::term_info *> info_ptrs;
+		for (auto & info : infos)
+			info_ptrs.push_back(&info);
+
+		add_results(segments, i, docs, terms, ids, info_ptrs, positions, result);
+	}
+
+	return result;
+}
+
+rank::ranked_result_t local_index::top(const std::vector<std::string> &terms, const std::vector<dnet_raw_id> &ids,
+		size_t k, const rank::bm25 &params, bool positions, const std::vector<double> &weights,
+		double prior, rank::stats *stats) {
+	rank::ranked_result_t result;
+
+	if (terms.empty() || terms.size() != ids.size() || !k)
+		return result;
+
+	std::vector<std::shared_ptr<segment>> segments;
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		for (auto & e : m_segments)
+			segments.push_back(e.seg);
+	}
+
+	// term_info of every term in every segment, df of absent terms is 0
+	std::vector<std::vector<segment::term_info>> infos(segments.size(),
+			std::vector<segment::term_info>(terms.size()));
+
+	rank::stats st;
+	st.df.assign(terms.size(), 0);
+	for (size_t i = 0; i < segments.size(); ++i) {
+		st.docs_num += segments[i]->docs_num();
+		st.tokens_num += segments[i]->tokens_num();
+
+		for (size_t j = 0; j < terms.size(); ++j) {
+			if (!segments[i]->lookup(terms[j], infos[i][j]))
+				infos[i][j].df = 0;
+
+			st.df[j] += infos[i][j].df;
+		}
+	}
+
+	// lengths are unknown if any of the segments has old format
+	for (auto & seg : segments) {
+		if (seg->docs_num() && !seg->tokens_num())
+			st.tokens_num = 0;
+	}
+
+	if (stats)
+		*stats = st;
+
+	// BM25 is linear in idf, so boosted idf boosts both the score and its upper bound,
+	// lists of small boosted fields get high bounds and fill the top first
+	std::vector<double> idf;
+	for (size_t j = 0; j < terms.size(); ++j)
+		idf.push_back(rank::bm25::idf(st.docs_num, st.df[j]) * (j < weights.size() ? weights[j] : 1));
+
+	// the newest segments go first, so that hidden documents are rejected by a single check
+	rank::top_k top(k);
+	for (ssize_t i = segments.size() - 1; i >= 0; --i) {
+		const segment &seg = *segments[i];
+
+		auto norm = [&] (uint32_t doc) {
+			return st.norm(seg.length(doc));
+		};
+		auto accept = [&] (uint32_t doc) {
+			std::string key = seg.document(doc).key;
+			for (size_t n = i + 1; n < segments.size(); ++n) {
+				if (segments[n]->contains(key))
+					return false;
+			}
+			return true;
+		};
+
+		std::function<double (uint32_t doc)> doc_prior;
+		if (prior > 0 && seg.impact_ordered()) {
+			doc_prior = [&] (uint32_t doc) {
+				return prior * seg.prior(doc);
+			};
+		}
+
+		std::vector<rank::term_list> lists(terms.size());
+		double bound = 0;
+		for (size_t j = 0; j < terms.size(); ++j) {
+			if (!infos[i][j].df)
+				continue;
+
+			lists[j].idf = idf[j];
+			lists[j].max_score = params.max_score(idf[j], infos[i][j].max_tf);
+			bound += lists[j].max_score;
+		}
+
+		if (!doc_prior) {
+			for (size_t j = 0; j < terms.size(); ++j) {
+				if (infos[i][j].df)
+					seg.postings(infos[i][j], lists[j].docs, lists[j].tfs);
+			}
+
+			rank::wand(lists, params, top, norm, accept, (uint64_t)i << 32);
+			continue;
+		}
+
+		// documents are numbered in descending order of priors, so the prior of the first
+		// document of the range bounds the score of any document left in the segment
+		uint64_t range = impact_range;
+		for (uint64_t first = 0, last; first < seg.docs_num(); first = last, range *= 2) {
+			if (bound + doc_prior(first) <= top.threshold())
+				break;
+
+			last = std::min<uint64_t>(first + range, seg.docs_num());
+
+			for (size_t j = 0; j < terms.size(); ++j) {
+				lists[j].docs.clear();
+				lists[j].tfs.clear();
+
+				if (infos[i][j].df)
+					seg.postings(infos[i][j], first, last, lists[j].docs, lists[j].tfs);
+			}
+
+			rank::wand(lists, params, top, norm, accept, (uint64_t)i << 32, doc_prior);
+		}
+	}
+
+	for (auto & sd : top.sorted()) {
+		const size_t i = sd.doc >> 32;
+		const uint32_t doc = sd.doc & 0xffffffff;
+
+		std::vector<const segment::term_info *> term_infos;
+		for (auto & info : infos[i])
+			term_infos.push_back(info.df ? &info : NULL);
+
+		find_result_t entries;
+		add_results(segments, i, std::vector<uint32_t>(1, doc), terms, ids, term_infos, positions, entries);
+
+		for (auto & entry : entries) {
+			rank::ranked_entry re;
+			re.entry = entry;
+			re.score = sd.score;
+			result.emplace_back(re);
+		}
+	}
+
+	return result;
+}
+
+ssize_t local_index::pick_merge() {
+	size_t run = 0;
+
+	for (size_t i = 0; i < m_segments.size(); ++i) {
+		if (i && tier(*m_segments[i].seg) == tier(*m_segments[i - 1].seg))
+			++run;
+		else
+			run = 1;
+
+		if (run == m_merge_factor)
+			return i + 1 - run;
+	}
+
+	return -1;
+}
+
+std::shared_ptr<segment> local_index::merge(const std::vector<entry> &victims) {
+	segment_writer writer;
+
+	std::function<float (const segment_document &doc)> prior;
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		prior = m_prior;
+	}
+
+	// segment-local document number to the number in merged segment, -1 if document
+	// has newer version in one of the following victims
+	std::vector<std::vector<int64_t>> remap(victims.size());
+
+	for (size_t v = 0; v < victims.size(); ++v) {
+		const segment &seg = *victims[v].seg;
+		remap[v].assign(seg.docs_num(), -1);
+
+		for (uint32_t doc = 0; doc < seg.docs_num(); ++doc) {
+			segment_document d = seg.document(doc);
+
+			bool hidden = false;
+			for (size_t n = v + 1; !hidden && n < victims.size(); ++n)
+				hidden = victims[n].seg->contains(d.key);
+
+			if (hidden)
+				continue;
+
+			remap[v][doc] = writer.add_document(d.id, d.key, d.ts);
+			if (!prior && seg.impact_ordered())
+				writer.set_prior(remap[v][doc], seg.prior(doc));
+		}
+	}
+
+	if (prior)
+		writer.set_priors(prior);
+
+	// documents of every victim get larger numbers than documents of previous ones,
+	// so postings are appended in increasing order
+	for (size_t v = 0; v < victims.size(); ++v) {
+		const segment &seg = *victims[v].seg;
+		const std::vector<int64_t> &map = remap[v];
+
+		seg.for_each_term([&] (const std::string &term, const segment::term_info &info) {
+			seg.for_each_posting(info, [&] (uint32_t doc, const std::vector<int> &pos) {
+				if (map[doc] >= 0)
+					writer.add_posting(term, map[doc], pos);
+			});
+		});
+	}
+
+	std::string path = segment_path(victims.back().generation);
+	writer.write(path);
+
+	return std::make_shared<segment>(path);
+}
+
+void local_index::merge_worker() {
+	std::unique_lock<std::mutex> guard(m_lock);
+
+	while (!m_need_exit) {
+		ssize_t start = m_merge_failed ? -1 : pick_merge();
+		if (start < 0) {
+			m_cond.wait(guard);
+			continue;
+		}
+
+		std::vector<entry> victims(m_segments.begin() + start, m_segments.begin() + start + m_merge_factor);
+		m_merging = true;
+		guard.unlock();
+
+		std::shared_ptr<segment> merged;
+		try {
+			merged = merge(victims);
+		} catch (const std::exception &e) {
+			std::cerr << "local index: merge of " << victims.size() << " segments starting with " <<
+				victims.front().seg->path() << " failed: " << e.what() << std::endl;
+		}
+
+		guard.lock();
+		m_merging = false;
+
+		if (merged) {
+			// new segments are only appended, so the run is still in place
+			m_segments.erase(m_segments.begin() + start + 1, m_segments.begin() + start + victims.size());
+			m_segments[start].generation = victims.back().generation;
+			m_segments[start].seg = merged;
+
+			// the newest victim has been replaced by the merged segment
+			for (size_t v = 0; v + 1 < victims.size(); ++v)
+				unlink(victims[v].seg->path().c_str());
+		} else {
+			m_merge_failed = true;
+		}
+
+		m_cond.notify_all();
+	}
+}
+
+void local_index::wait_merges() {
+	std::unique_lock<std::mutex> guard(m_lock);
+	while (m_merging || (!m_merge_failed && pick_merge() >= 0))
+		m_cond.wait(guard);
+}
+
+}} // namespace ioremap::wookie
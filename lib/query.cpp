@@ -0,0 +1,677 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "wookie/query.hpp"
+#include "wookie/fields.hpp"
+#include "wookie/intersect.hpp"
+#include "wookie/positions.hpp"
+
+#include <elliptics/error.hpp>
+
+#include <algorithm>
+#include <iterator>
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace ioremap { namespace wookie { namespace query {
+
+namespace {
+
+struct lexeme {
+	enum lexeme_type {
+		end = 0,
+		word,
+		quote,
+		minus,
+		lparen,
+		rparen,
+		op_or,
+		op_and,
+		near,
+	};
+
+	lexeme_type type;
+	std::string text;
+};
+
+class lexer {
+	public:
+		explicit lexer(const std::string &text) : m_text(text), m_pos(0) {
+			next();
+		}
+
+		const lexeme &current() const {
+			return m_cur;
+		}
+
+		void next() {
+			while (m_pos < m_text.size() && isspace((unsigned char)m_text[m_pos]))
+				++m_pos;
+
+			m_cur.text.clear();
+
+			if (m_pos == m_text.size()) {
+				m_cur.type = lexeme::end;
+				return;
+			}
+
+			const char ch = m_text[m_pos];
+
+			if (ch == '(' || ch == ')' || ch == '|') {
+				m_cur.type = ch == '(' ? lexeme::lparen : ch == ')' ? lexeme::rparen : lexeme::op_or;
+				m_cur.text.assign(1, ch);
+				++m_pos;
+				return;
+			}
+
+			if (ch == '\"') {
+				size_t end = m_text.find('\"', m_pos + 1);
+				if (end == std::string::npos)
+					elliptics::throw_error(-EINVAL, "query: unterminated quote at %zd", m_pos);
+
+				m_cur.type = lexeme::quote;
+				m_cur.text = m_text.substr(m_pos + 1, end - m_pos - 1);
+				m_pos = end + 1;
+				return;
+			}
+
+			// minus negates only something which follows it immediately
+			if (ch == '-' && m_pos + 1 < m_text.size() && !isspace((unsigned char)m_text[m_pos + 1])) {
+				m_cur.type = lexeme::minus;
+				m_cur.text.assign(1, ch);
+				++m_pos;
+				return;
+			}
+
+			size_t end = m_pos;
+			while (end < m_text.size() && !isspace((unsigned char)m_text[end]) &&
+					m_text[end] != '(' && m_text[end] != ')' && m_text[end] != '\"' && m_text[end] != '|')
+				++end;
+
+			m_cur.text = m_text.substr(m_pos, end - m_pos);
+			m_pos = end;
+
+			if (m_cur.text == "OR")
+				m_cur.type = lexeme::op_or;
+			else if (m_cur.text == "AND")
+				m_cur.type = lexeme::op_and;
+			else if (is_near(m_cur.text))
+				m_cur.type = lexeme::near;
+			else
+				m_cur.type = lexeme::word;
+		}
+
+		size_t pos() const {
+			return m_pos;
+		}
+
+	private:
+		const std::string &m_text;
+		size_t m_pos;
+		lexeme m_cur;
+
+		// NEAR/<digits>
+		static bool is_near(const std::string &text) {
+			if (text.size() <= 5 || text.compare(0, 5, "NEAR/"))
+				return false;
+
+			for (size_t i = 5; i < text.size(); ++i) {
+				if (!isdigit((unsigned char)text[i]))
+					return false;
+			}
+
+			return true;
+		}
+};
+
+// Recursive descent over
+//	or	:= and ('OR' and)*
+//	and	:= near ('AND'? near)*
+//	near	:= unary ('NEAR/k' unary)*
+//	unary	:= '-' primary | primary
+//	primary	:= word | field':'word | field':'quote | quote | '(' or ')'
+//
+// Operands without tokens (punctuation only words or quotes, empty groups)
+// are dropped, functions return false for them.
+class parser {
+	public:
+		parser(const std::string &text, split &spl) : m_lex(text), m_spl(spl) {
+		}
+
+		bool parse(node &root) {
+			bool ret = parse_or(root);
+			if (m_lex.current().type != lexeme::end)
+				elliptics::throw_error(-EINVAL, "query: unexpected '%s' at %zd",
+						m_lex.current().text.c_str(), m_lex.pos());
+
+			return ret;
+		}
+
+	private:
+		lexer m_lex;
+		split &m_spl;
+
+		bool parse_or(node &ret) {
+			node n(node::op_or);
+
+			while (true) {
+				node child;
+				if (parse_and(child))
+					add(n, child);
+
+				if (m_lex.current().type != lexeme::op_or)
+					break;
+
+				m_lex.next();
+			}
+
+			return finish(n, ret);
+		}
+
+		bool parse_and(node &ret) {
+			node n(node::op_and);
+
+			while (true) {
+				lexeme::lexeme_type type = m_lex.current().type;
+				if (type == lexeme::end || type == lexeme::rparen || type == lexeme::op_or)
+					break;
+
+				if (type == lexeme::op_and) {
+					m_lex.next();
+					continue;
+				}
+
+				node child;
+				if (parse_near(child))
+					add(n, child);
+			}
+
+			return finish(n, ret);
+		}
+
+		bool parse_near(node &ret) {
+			bool found = parse_unary(ret);
+			if (m_lex.current().type != lexeme::near)
+				return found;
+
+			node n(node::near);
+			n.distance = -1;
+			near_operand(found, ret, n);
+
+			while (m_lex.current().type == lexeme::near) {
+				const lexeme cur = m_lex.current();
+				const long distance = strtol(cur.text.c_str() + 5, NULL, 10);
+				if (distance > 0xffffff || (n.distance >= 0 && distance != n.distance))
+					elliptics::throw_error(-EINVAL, "query: invalid '%s' at %zd", cur.text.c_str(), m_lex.pos());
+
+				n.distance = distance;
+				m_lex.next();
+
+				node child;
+				found = parse_unary(child);
+				near_operand(found, child, n);
+			}
+
+			ret = std::move(n);
+			return true;
+		}
+
+		void near_operand(bool found, const node &operand, node &n) {
+			if (!found || (operand.type != node::term && operand.type != node::phrase))
+				elliptics::throw_error(-EINVAL, "query: operands of NEAR have to be words or phrases, at %zd",
+						m_lex.pos());
+
+			n.tokens.insert(n.tokens.end(), operand.tokens.begin(), operand.tokens.end());
+		}
+
+		bool parse_unary(node &ret) {
+			if (m_lex.current().type != lexeme::minus)
+				return parse_primary(ret);
+
+			m_lex.next();
+
+			node child;
+			if (!parse_primary(child))
+				return false;
+
+			ret = node(node::op_not);
+			ret.children.emplace_back(child);
+			return true;
+		}
+
+		bool parse_primary(node &ret) {
+			lexeme cur = m_lex.current();
+
+			switch (cur.type) {
+			case lexeme::word: {
+				m_lex.next();
+
+				fields::field_id field = fields::body;
+				size_t colon = cur.text.find(':');
+				if (colon == std::string::npos || !fields::lookup(cur.text.substr(0, colon), field))
+					return leaf(cur.text, fields::body, ret);
+
+				// field:"quoted phrase" is split by the lexer
+				if (colon + 1 == cur.text.size() && m_lex.current().type == lexeme::quote) {
+					cur = m_lex.current();
+					m_lex.next();
+					return leaf(cur.text, field, ret);
+				}
+
+				return leaf(cur.text.substr(colon + 1), field, ret);
+			}
+			case lexeme::quote:
+				m_lex.next();
+				return leaf(cur.text, fields::body, ret);
+			case lexeme::lparen: {
+				m_lex.next();
+				bool found = parse_or(ret);
+				if (m_lex.current().type != lexeme::rparen)
+					elliptics::throw_error(-EINVAL, "query: missing ')' at %zd", m_lex.pos());
+
+				m_lex.next();
+				return found;
+			}
+			default:
+				elliptics::throw_error(-EINVAL, "query: unexpected '%s' at %zd", cur.text.c_str(), m_lex.pos());
+			}
+
+			return false;
+		}
+
+		// tokens are ordered by their positions in the text, repeated ones are kept
+		bool leaf(const std::string &text, fields::field_id field, node &ret) {
+			std::vector<std::string> unique;
+			mpos_t mpos = m_spl.feed(text, unique);
+
+			std::vector<std::pair<int, const std::string *>> order;
+			for (auto & m : mpos) {
+				for (int pos : m.second)
+					order.emplace_back(pos, &m.first);
+			}
+
+			if (order.empty())
+				return false;
+
+			std::sort(order.begin(), order.end());
+
+			ret = node(order.size() == 1 ? node::term : node::phrase);
+			for (auto & o : order)
+				ret.tokens.push_back(fields::token(field, *o.second));
+
+			return true;
+		}
+
+		// nested operations of the same type are flattened
+		static void add(node &parent, node &child) {
+			if (child.type == parent.type) {
+				for (auto & c : child.children)
+					parent.children.emplace_back(std::move(c));
+			} else {
+				parent.children.emplace_back(std::move(child));
+			}
+		}
+
+		static bool finish(node &n, node &ret) {
+			if (n.children.empty())
+				return false;
+
+			if (n.children.size() == 1) {
+				node child = std::move(n.children[0]);
+				ret = std::move(child);
+			} else {
+				ret = std::move(n);
+			}
+
+			return true;
+		}
+};
+
+// negation is only allowed as an operand of AND which has positive operands too
+void check(const node &n, bool negation_allowed)
+{
+	if (n.type == node::op_not && !negation_allowed)
+		elliptics::throw_error(-EINVAL, "query: negation '%s' has no positive counterpart",
+				to_string(n).c_str());
+
+	bool positive = false;
+	if (n.type == node::op_and) {
+		for (auto & c : n.children)
+			positive |= c.type != node::op_not;
+	}
+
+	for (auto & c : n.children)
+		check(c, positive);
+}
+
+void collect(const node &n, std::vector<std::string> &out)
+{
+	out.insert(out.end(), n.tokens.begin(), n.tokens.end());
+	for (auto & c : n.children)
+		collect(c, out);
+}
+
+} // namespace
+
+node parse(const std::string &text, split &spl)
+{
+	node root;
+	if (!parser(text, spl).parse(root))
+		elliptics::throw_error(-EINVAL, "query: '%s' does not contain any searchable token", text.c_str());
+
+	check(root, false);
+	return root;
+}
+
+std::vector<std::string> tokens(const node &root)
+{
+	std::vector<std::string> ret;
+	collect(root, ret);
+
+	std::sort(ret.begin(), ret.end());
+	ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+	return ret;
+}
+
+std::string to_string(const node &n)
+{
+	std::string ret;
+
+	switch (n.type) {
+	case node::term:
+		return n.tokens[0];
+	case node::phrase:
+		ret = "\"";
+		for (size_t i = 0; i < n.tokens.size(); ++i) {
+			if (i)
+				ret += " ";
+			ret += n.tokens[i];
+		}
+		return ret + "\"";
+	case node::op_not:
+		return "-" + to_string(n.children[0]);
+	case node::near: {
+		char op[32];
+		snprintf(op, sizeof(op), " NEAR/%d ", n.distance);
+
+		ret = "(";
+		for (size_t i = 0; i < n.tokens.size(); ++i) {
+			if (i)
+				ret += op;
+			ret += n.tokens[i];
+		}
+		return ret + ")";
+	}
+	case node::op_and:
+	case node::op_or:
+		ret = "(";
+		for (size_t i = 0; i < n.children.size(); ++i) {
+			if (i)
+				ret += n.type == node::op_and ? " AND " : " OR ";
+			ret += to_string(n.children[i]);
+		}
+		return ret + ")";
+	}
+
+	return ret;
+}
+
+plan::plan(const node &root, source &src) : m_src(src)
+{
+	m_root = compile(root);
+}
+
+size_t plan::cost() const
+{
+	return m_root.cost;
+}
+
+plan::step plan::compile(const node &n)
+{
+	step s;
+	s.type = n.type;
+	s.tokens = n.tokens;
+	s.cost = 0;
+	s.distance = n.distance;
+
+	switch (n.type) {
+	case node::term:
+	case node::phrase:
+	case node::near:
+		s.cost = ~(size_t)0;
+		for (auto & t : n.tokens)
+			s.cost = std::min(s.cost, m_src.df(t));
+		break;
+	case node::op_not:
+		s.children.emplace_back(compile(n.children[0]));
+		s.cost = s.children[0].cost;
+		break;
+	case node::op_or:
+		for (auto & c : n.children) {
+			s.children.emplace_back(compile(c));
+			s.cost += s.children.back().cost;
+		}
+		break;
+	case node::op_and:
+		s.cost = ~(size_t)0;
+		for (auto & c : n.children) {
+			s.children.emplace_back(compile(c));
+			if (c.type != node::op_not)
+				s.cost = std::min(s.cost, s.children.back().cost);
+		}
+
+		// the rarest positive operand goes first, negations are applied to the result
+		std::stable_sort(s.children.begin(), s.children.end(), [] (const step &a, const step &b) {
+				const bool a_not = a.type == node::op_not;
+				const bool b_not = b.type == node::op_not;
+				if (a_not != b_not)
+					return b_not;
+
+				return !a_not && a.cost < b.cost;
+			});
+		break;
+	}
+
+	return s;
+}
+
+void plan::execute(std::vector<uint32_t> &docs)
+{
+	docs.clear();
+	if (m_root.cost)
+		execute(m_root, docs, false);
+}
+
+void plan::execute(const step &s, std::vector<uint32_t> &docs, bool restrict)
+{
+	switch (s.type) {
+	case node::term: {
+		std::vector<uint32_t> list;
+		m_src.postings(s.tokens[0], list);
+
+		if (!restrict) {
+			docs.swap(list);
+			break;
+		}
+
+		std::vector<const std::vector<uint32_t> *> lists;
+		lists.push_back(&docs);
+		lists.push_back(&list);
+
+		std::vector<uint32_t> common;
+		intersect::all(lists, common);
+		docs.swap(common);
+		break;
+	}
+	case node::phrase:
+	case node::near:
+		positional(s, docs, restrict);
+		break;
+	case node::op_and:
+		for (size_t i = 0; i < s.children.size(); ++i) {
+			if ((restrict || i) && docs.empty())
+				break;
+
+			execute(s.children[i], docs, restrict || i);
+		}
+		break;
+	case node::op_or: {
+		std::vector<uint32_t> ret;
+		for (auto & c : s.children) {
+			if (!c.cost)
+				continue;
+
+			std::vector<uint32_t> part, merged;
+			if (restrict)
+				part = docs;
+			execute(c, part, restrict);
+
+			std::set_union(ret.begin(), ret.end(), part.begin(), part.end(), std::back_inserter(merged));
+			ret.swap(merged);
+		}
+		docs.swap(ret);
+		break;
+	}
+	case node::op_not: {
+		// parse() does not let negation to be the first operand
+		if (!restrict)
+			elliptics::throw_error(-EINVAL, "query: negation '%s' has no positive counterpart",
+					to_string().c_str());
+
+		// operand which is not in the source excludes nothing
+		if (!s.cost)
+			break;
+
+		std::vector<uint32_t> excluded(docs);
+		execute(s.children[0], excluded, true);
+
+		docs.resize(intersect::difference(docs.data(), docs.size(),
+					excluded.data(), excluded.size(), docs.data()));
+		break;
+	}
+	}
+}
+
+void plan::positional(const step &s, std::vector<uint32_t> &docs, bool restrict)
+{
+	std::vector<std::string> unique(s.tokens);
+	std::sort(unique.begin(), unique.end());
+	unique.erase(std::unique(unique.begin(), unique.end()), unique.end());
+
+	std::vector<std::vector<uint32_t>> lists(unique.size());
+	std::vector<const std::vector<uint32_t> *> ptrs;
+	if (restrict)
+		ptrs.push_back(&docs);
+
+	for (size_t i = 0; i < unique.size(); ++i) {
+		m_src.postings(unique[i], lists[i]);
+		ptrs.push_back(&lists[i]);
+	}
+
+	std::vector<uint32_t> common;
+	intersect::all(ptrs, common);
+
+	if (unique.size() == 1 && (s.type == node::near || s.tokens.size() == 1)) {
+		docs.swap(common);
+		return;
+	}
+
+	docs.clear();
+	for (auto doc : common) {
+		std::vector<std::vector<int>> pos(unique.size());
+		for (size_t i = 0; i < unique.size(); ++i)
+			pos[i] = m_src.positions(unique[i], doc);
+
+		std::vector<const std::vector<int> *> terms;
+		if (s.type == node::near) {
+			for (auto & p : pos)
+				terms.push_back(&p);
+
+			const int window = positions::window(terms);
+			if (window >= 0 && window <= s.distance)
+				docs.push_back(doc);
+			continue;
+		}
+
+		for (auto & t : s.tokens) {
+			size_t i = std::lower_bound(unique.begin(), unique.end(), t) - unique.begin();
+			terms.push_back(&pos[i]);
+		}
+
+		if (positions::phrase(terms))
+			docs.push_back(doc);
+	}
+}
+
+std::string plan::to_string() const
+{
+	std::string ret;
+	to_string(m_root, ret);
+	return ret;
+}
+
+void plan::to_string(const step &s, std::string &out)
+{
+	char cost[32];
+	snprintf(cost, sizeof(cost), "[%zd]", s.cost);
+
+	switch (s.type) {
+	case node::term:
+		out += s.tokens[0];
+		break;
+	case node::phrase:
+		out += "\"";
+		for (size_t i = 0; i < s.tokens.size(); ++i) {
+			if (i)
+				out += " ";
+			out += s.tokens[i];
+		}
+		out += "\"";
+		break;
+	case node::near:
+		out += "(";
+		for (size_t i = 0; i < s.tokens.size(); ++i) {
+			if (i) {
+				char op[32];
+				snprintf(op, sizeof(op), " NEAR/%d ", s.distance);
+				out += op;
+			}
+			out += s.tokens[i];
+		}
+		out += ")";
+		break;
+	case node::op_not:
+		out += "-";
+		to_string(s.children[0], out);
+		return;
+	case node::op_and:
+	case node::op_or:
+		out += "(";
+		for (size_t i = 0; i < s.children.size(); ++i) {
+			if (i)
+				out += s.type == node::op_and ? " AND " : " OR ";
+			to_string(s.children[i], out);
+		}
+		out += ")";
+		break;
+	}
+
+	out += cost;
+}
+
+}}} // namespace ioremap::wookie::query
@@ -0,0 +1,291 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "wookie/rank.hpp"
+#include "wookie/index_data.hpp"
+#include "wookie/positions.hpp"
+
+#include <algorithm>
+
+#include <math.h>
+#include <string.h>
+
+namespace ioremap { namespace wookie { namespace rank {
+
+double bm25::idf(uint64_t docs_num, uint64_t df)
+{
+	if (df > docs_num)
+		docs_num = df;
+
+	return log(1.0 + (docs_num - df + 0.5) / (df + 0.5));
+}
+
+double bm25::score(double idf, uint32_t tf, double norm) const
+{
+	return idf * tf * (k1 + 1) / (tf + k1 * (1 - b + b * norm));
+}
+
+double bm25::max_score(double idf, uint32_t max_tf) const
+{
+	// score grows with term frequency and decreases with length, the shortest
+	// document has zero length, unknown frequency gives the saturation limit
+	if (!max_tf)
+		return idf * (k1 + 1);
+
+	return score(idf, max_tf, 0);
+}
+
+double stats::norm(uint32_t length) const
+{
+	if (!tokens_num || !docs_num)
+		return 1;
+
+	return length * (double)docs_num / tokens_num;
+}
+
+namespace {
+	// heap with the worst document on top, among equal scores larger numbers are worse
+	bool better(const scored_doc &a, const scored_doc &b) {
+		return a.score > b.score || (a.score == b.score && a.doc < b.doc);
+	}
+}
+
+top_k::top_k(size_t k) : m_k(k)
+{
+	m_heap.reserve(k);
+}
+
+size_t top_k::k() const
+{
+	return m_k;
+}
+
+double top_k::threshold() const
+{
+	if (m_heap.size() < m_k)
+		return 0;
+
+	return m_heap.front().score;
+}
+
+bool top_k::push(uint64_t doc, double score)
+{
+	if (!m_k)
+		return false;
+
+	scored_doc sd;
+	sd.doc = doc;
+	sd.score = score;
+
+	if (m_heap.size() < m_k) {
+		m_heap.push_back(sd);
+		std::push_heap(m_heap.begin(), m_heap.end(), better);
+		return true;
+	}
+
+	if (!better(sd, m_heap.front()))
+		return false;
+
+	std::pop_heap(m_heap.begin(), m_heap.end(), better);
+	m_heap.back() = sd;
+	std::push_heap(m_heap.begin(), m_heap.end(), better);
+	return true;
+}
+
+std::vector<scored_doc> top_k::sorted() const
+{
+	std::vector<scored_doc> ret(m_heap);
+	std::sort(ret.begin(), ret.end(), better);
+	return ret;
+}
+
+namespace {
+	struct cursor {
+		const term_list *list;
+		size_t pos;
+
+		uint32_t doc() const {
+			return list->docs[pos];
+		}
+
+		bool end() const {
+			return pos >= list->docs.size();
+		}
+
+		// moves to the first document not less than @doc
+		void advance(uint32_t doc) {
+			const std::vector<uint32_t> &docs = list->docs;
+
+			size_t step = 1;
+			while (pos + step < docs.size() && docs[pos + step] < doc)
+				step <<= 1;
+
+			auto end = docs.begin() + std::min(pos + step + 1, docs.size());
+			pos = std::lower_bound(docs.begin() + pos + step / 2, end, doc) - docs.begin();
+		}
+	};
+}
+
+void wand(const std::vector<term_list> &lists, const bm25 &params, top_k &top,
+		const std::function<double (uint32_t doc)> &norm,
+		const std::function<bool (uint32_t doc)> &accept, uint64_t base,
+		const std::function<double (uint32_t doc)> &prior)
+{
+	std::vector<cursor> cursors;
+	for (auto & l : lists) {
+		if (l.docs.size()) {
+			cursor c = { &l, 0 };
+			cursors.push_back(c);
+		}
+	}
+
+	while (true) {
+		cursors.erase(std::remove_if(cursors.begin(), cursors.end(),
+				[] (const cursor &c) { return c.end(); }), cursors.end());
+		if (cursors.empty())
+			break;
+
+		std::sort(cursors.begin(), cursors.end(), [] (const cursor &a, const cursor &b) {
+				return a.doc() < b.doc();
+			});
+
+		const double threshold = top.threshold();
+
+		size_t pivot = cursors.size();
+		double bound = prior ? prior(cursors[0].doc()) : 0;
+		for (size_t i = 0; i < cursors.size(); ++i) {
+			bound += cursors[i].list->max_score;
+			if (bound > threshold) {
+				pivot = i;
+				break;
+			}
+		}
+
+		// even all lists together can not beat the worst of the best documents
+		if (pivot == cursors.size())
+			break;
+
+		const uint32_t doc = cursors[pivot].doc();
+
+		if (cursors[0].doc() != doc) {
+			for (size_t i = 0; i < pivot; ++i)
+				cursors[i].advance(doc);
+			continue;
+		}
+
+		const double n = norm ? norm(doc) : 1;
+		double score = prior ? prior(doc) : 0;
+		for (auto & c : cursors) {
+			if (c.doc() != doc)
+				break;
+
+			score += params.score(c.list->idf, c.list->tfs[c.pos], n);
+			++c.pos;
+		}
+
+		// scores are positive, so everything gets in until @top is full
+		if (score > threshold && (!accept || accept(doc)))
+			top.push(base + doc, score);
+	}
+}
+
+ranked_result_t score(const find_result_t &results, const std::vector<dnet_raw_id> &ids,
+		const stats &st, size_t k, const bm25 &params,
+		const std::function<uint32_t (const dnet_raw_id &id)> &length,
+		const std::vector<double> &weights)
+{
+	std::vector<double> idf;
+	for (size_t i = 0; i < ids.size(); ++i) {
+		idf.push_back(bm25::idf(st.docs_num, i < st.df.size() ? st.df[i] : 0) *
+				(i < weights.size() ? weights[i] : 1));
+	}
+
+	top_k top(k);
+	for (size_t n = 0; n < results.size(); ++n) {
+		double score = 0;
+
+		uint32_t len = length ? length(results[n].id) : 0;
+		const double norm = len ? st.norm(len) : 1;
+
+		for (auto & ie : results[n].indexes) {
+			for (size_t i = 0; i < ids.size(); ++i) {
+				if (memcmp(&ie.index, &ids[i], sizeof(struct dnet_raw_id)))
+					continue;
+
+				index_data idata(ie.data);
+				score += params.score(idf[i], idata.pos.size(), norm);
+				break;
+			}
+		}
+
+		top.push(n, score);
+	}
+
+	ranked_result_t ret;
+	for (auto & sd : top.sorted()) {
+		ranked_entry re;
+		re.entry = results[sd.doc];
+		re.score = sd.score;
+		ret.emplace_back(re);
+	}
+
+	return ret;
+}
+
+double proximity(int window, size_t found, size_t terms_num)
+{
+	if (found < 2 || window < 0 || !terms_num)
+		return 0;
+
+	// the shortest window of @found distinct positions is @found - 1
+	return (double)found / (window + 1) * found / terms_num;
+}
+
+void rerank(ranked_result_t &result, const std::vector<dnet_raw_id> &ids, const proximity_params &prox)
+{
+	if (prox.weight <= 0 || ids.size() < 2)
+		return;
+
+	const size_t depth = std::min(prox.depth, result.size());
+
+	for (size_t n = 0; n < depth; ++n) {
+		std::vector<std::vector<int>> pos;
+
+		for (auto & id : ids) {
+			for (auto & ie : result[n].entry.indexes) {
+				if (memcmp(&ie.index, &id, sizeof(struct dnet_raw_id)))
+					continue;
+
+				index_data idata(ie.data);
+				if (idata.pos.size())
+					pos.emplace_back(std::move(idata.pos));
+				break;
+			}
+		}
+
+		std::vector<const std::vector<int> *> terms;
+		for (auto & p : pos)
+			terms.push_back(&p);
+
+		result[n].score += prox.weight * proximity(positions::window(terms), terms.size(), ids.size());
+	}
+
+	std::stable_sort(result.begin(), result.begin() + depth, [] (const ranked_entry &a, const ranked_entry &b) {
+			return a.score > b.score;
+		});
+}
+
+}}} // namespace ioremap::wookie::rank
@@ -0,0 +1,845 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "wookie/segment.hpp"
+#include "wookie/hash.hpp"
+#include "wookie/varint.hpp"
+
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace ioremap { namespace wookie {
+
+namespace {
+	template <typename T>
+	void append(std::string &out, const T &record) {
+		out.append((const char *)&record, sizeof(T));
+	}
+
+	void write_all(int fd, const std::string &path, const std::string &data) {
+		const char *ptr = data.data();
+		size_t size = data.size();
+
+		while (size) {
+			ssize_t err = ::write(fd, ptr, size);
+			if (err < 0) {
+				if (errno == EINTR)
+					continue;
+
+				int e = -errno;
+				elliptics::throw_error(e, "segment: could not write %s: %s", path.c_str(), strerror(-e));
+			}
+
+			ptr += err;
+			size -= err;
+		}
+	}
+
+	int compare(const char *data, size_t size, const std::string &str) {
+		int cmp = memcmp(data, str.data(), std::min(size, str.size()));
+		if (cmp)
+			return cmp;
+
+		if (size == str.size())
+			return 0;
+
+		return size < str.size() ? -1 : 1;
+	}
+}
+
+uint32_t segment_writer::add_document(const dnet_raw_id &id, const std::string &key, const dnet_time &ts) {
+	segment_document doc;
+	doc.id = id;
+	doc.ts = ts;
+	doc.key = key;
+
+	m_docs.emplace_back(doc);
+	return m_docs.size() - 1;
+}
+
+void segment_writer::add_posting(const std::string &term, uint32_t doc, const std::vector<int> &pos) {
+	posting p;
+	p.doc = doc;
+	p.pos = pos;
+
+	if (!std::is_sorted(p.pos.begin(), p.pos.end()))
+		std::sort(p.pos.begin(), p.pos.end());
+
+	m_terms[term].emplace_back(p);
+}
+
+uint32_t segment_writer::add(const dnet_raw_id &id, const std::string &key, const dnet_time &ts, const mpos_t &pos) {
+	uint32_t doc = add_document(id, key, ts);
+
+	for (auto & p : pos)
+		add_posting(p.first, doc, p.second);
+
+	return doc;
+}
+
+void segment_writer::set_prior(uint32_t doc, float prior) {
+	if (doc >= m_docs.size())
+		elliptics::throw_error(-ERANGE, "segment: document %u is out of range, documents: %zd",
+				doc, m_docs.size());
+
+	m_priors.resize(m_docs.size(), 0);
+	m_priors[doc] = prior;
+}
+
+void segment_writer::set_priors(const std::function<float (const segment_document &doc)> &prior) {
+	m_priors.resize(m_docs.size(), 0);
+	for (size_t i = 0; i < m_docs.size(); ++i)
+		m_priors[i] = prior(m_docs[i]);
+}
+
+// renumbers documents in descending order of priors, equal ones keep their order
+void segment_writer::impact_order() {
+	m_priors.resize(m_docs.size(), 0);
+
+	std::vector<uint32_t> order(m_docs.size());
+	for (size_t i = 0; i < order.size(); ++i)
+		order[i] = i;
+
+	std::stable_sort(order.begin(), order.end(), [&] (uint32_t a, uint32_t b) {
+			return m_priors[a] > m_priors[b];
+		});
+
+	std::vector<uint32_t> remap(order.size());
+	std::vector<segment_document> docs;
+	std::vector<float> priors;
+	docs.reserve(order.size());
+	priors.reserve(order.size());
+
+	for (size_t i = 0; i < order.size(); ++i) {
+		remap[order[i]] = i;
+		docs.emplace_back(std::move(m_docs[order[i]]));
+		priors.push_back(m_priors[order[i]]);
+	}
+
+	m_docs.swap(docs);
+	m_priors.swap(priors);
+
+	for (auto & t : m_terms) {
+		for (auto & p : t.second)
+			p.doc = remap[p.doc];
+
+		std::sort(t.second.begin(), t.second.end(), [] (const posting &a, const posting &b) {
+				return a.doc < b.doc;
+			});
+	}
+}
+
+size_t segment_writer::docs_num() const {
+	return m_docs.size();
+}
+
+bool segment_writer::empty() const {
+	return m_docs.empty();
+}
+
+void segment_writer::clear() {
+	m_docs.clear();
+	m_terms.clear();
+	m_priors.clear();
+}
+
+void segment_writer::write(const std::string &path, uint32_t version) {
+	if (version == 0 || version > segment_version)
+		elliptics::throw_error(-EINVAL, "segment: could not write %s: unsupported version %u",
+				path.c_str(), version);
+
+	if (!m_priors.empty())
+		impact_order();
+
+	segment_header header;
+	memset(&header, 0, sizeof(segment_header));
+	memcpy(header.magic, segment_magic, sizeof(header.magic));
+	header.version = version;
+	header.docs_num = m_docs.size();
+	header.terms_num = m_terms.size();
+	header.dict_blocks_num = (m_terms.size() + dict_block_size - 1) / dict_block_size;
+
+	std::string docs, keys, hashes, dict, dict_index, dict_terms, postings, positions;
+
+	std::vector<segment_key_hash> key_hashes;
+	key_hashes.reserve(m_docs.size());
+
+	std::vector<uint32_t> lengths(m_docs.size());
+	for (auto & t : m_terms) {
+		for (auto & p : t.second)
+			lengths[p.doc] += p.pos.size();
+	}
+
+	for (size_t i = 0; i < m_docs.size(); ++i) {
+		const segment_document &doc = m_docs[i];
+
+		segment_doc d;
+		memset(&d, 0, sizeof(segment_doc));
+		d.id = doc.id;
+		d.tsec = doc.ts.tsec;
+		d.tnsec = doc.ts.tnsec;
+		d.key_offset = keys.size();
+		d.key_size = doc.key.size();
+		d.length = version < 2 ? 0 : lengths[i];
+
+		append(docs, d);
+		keys.append(doc.key);
+
+		segment_key_hash h;
+		memset(&h, 0, sizeof(segment_key_hash));
+		h.hash = hash::murmur(doc.key, 0);
+		h.doc = i;
+		key_hashes.push_back(h);
+	}
+
+	std::sort(key_hashes.begin(), key_hashes.end(),
+		[] (const segment_key_hash &a, const segment_key_hash &b) {
+			return a.hash < b.hash || (a.hash == b.hash && a.doc < b.doc);
+		});
+	for (auto & h : key_hashes)
+		append(hashes, h);
+
+	size_t term_idx = 0;
+	std::string prev;
+
+	for (auto & t : m_terms) {
+		const std::string &term = t.first;
+		const std::vector<posting> &list = t.second;
+
+		if (term_idx % dict_block_size == 0) {
+			segment_dict_index idx;
+			memset(&idx, 0, sizeof(segment_dict_index));
+			idx.block_offset = dict.size();
+			idx.term_offset = dict_terms.size();
+			idx.term_size = term.size();
+
+			append(dict_index, idx);
+			dict_terms.append(term);
+			prev.clear();
+		}
+
+		size_t prefix = 0;
+		while (prefix < prev.size() && prefix < term.size() && prev[prefix] == term[prefix])
+			++prefix;
+
+		varint::put(dict, prefix);
+		varint::put(dict, term.size() - prefix);
+		dict.append(term, prefix, std::string::npos);
+		size_t max_tf = 0;
+		for (auto & p : list)
+			max_tf = std::max(max_tf, p.pos.size());
+
+		varint::put(dict, list.size());
+		if (version >= 2)
+			varint::put(dict, max_tf);
+		varint::put(dict, postings.size());
+		varint::put(dict, positions.size());
+
+		size_t blocks_num = (list.size() + postings_block_size - 1) / postings_block_size;
+		std::string skip, blocks;
+
+		varint::put(skip, blocks_num);
+
+		uint32_t prev_doc = 0;
+		for (size_t b = 0; b < blocks_num; ++b) {
+			size_t docs_start = blocks.size();
+			size_t positions_start = positions.size();
+
+			size_t last = std::min(list.size(), (b + 1) * postings_block_size);
+			for (size_t i = b * postings_block_size; i < last; ++i) {
+				const posting &p = list[i];
+
+				varint::put(blocks, p.doc - prev_doc);
+				varint::put(blocks, p.pos.size());
+				varint::put_deltas(positions, p.pos);
+
+				prev_doc = p.doc;
+			}
+
+			varint::put(skip, prev_doc);
+			varint::put(skip, blocks.size() - docs_start);
+			varint::put(skip, positions.size() - positions_start);
+		}
+
+		postings.append(skip);
+		postings.append(blocks);
+
+		prev = term;
+		++term_idx;
+	}
+
+	dict_index.append(dict_terms);
+
+	// headers of older versions end before flags
+	const size_t header_size = version < 3 ? offsetof(segment_header, flags) : sizeof(segment_header);
+
+	header.docs_offset = header_size;
+	header.keys_offset = header.docs_offset + docs.size();
+	header.hashes_offset = header.keys_offset + keys.size();
+	header.dict_offset = header.hashes_offset + hashes.size();
+	header.dict_index_offset = header.dict_offset + dict.size();
+	header.postings_offset = header.dict_index_offset + dict_index.size();
+	header.positions_offset = header.postings_offset + postings.size();
+	header.size = header.positions_offset + positions.size();
+
+	std::string priors;
+	if (!m_priors.empty() && version >= 3) {
+		priors.assign((const char *)m_priors.data(), m_priors.size() * sizeof(float));
+
+		header.flags |= segment_impact_ordered;
+		header.priors_offset = header.size;
+		header.size += priors.size();
+	}
+
+	std::string tmp_path = path + ".tmp";
+
+	int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		int err = -errno;
+		elliptics::throw_error(err, "segment: could not create %s: %s", tmp_path.c_str(), strerror(-err));
+	}
+
+	try {
+		std::string hdr;
+		append(hdr, header);
+		hdr.resize(header_size);
+
+		write_all(fd, tmp_path, hdr);
+		write_all(fd, tmp_path, docs);
+		write_all(fd, tmp_path, keys);
+		write_all(fd, tmp_path, hashes);
+		write_all(fd, tmp_path, dict);
+		write_all(fd, tmp_path, dict_index);
+		write_all(fd, tmp_path, postings);
+		write_all(fd, tmp_path, positions);
+		write_all(fd, tmp_path, priors);
+
+		if (fsync(fd) < 0) {
+			int err = -errno;
+			elliptics::throw_error(err, "segment: could not sync %s: %s", tmp_path.c_str(), strerror(-err));
+		}
+	} catch (...) {
+		close(fd);
+		unlink(tmp_path.c_str());
+		throw;
+	}
+
+	close(fd);
+
+	if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+		int err = -errno;
+		unlink(tmp_path.c_str());
+		elliptics::throw_error(err, "segment: could not rename %s -> %s: %s",
+				tmp_path.c_str(), path.c_str(), strerror(-err));
+	}
+}
+
+segment::segment(const std::string &path) :
+m_path(path), m_fd(-1), m_data(NULL), m_size(0), m_header(NULL), m_tokens_num(0), m_priors(NULL) {
+	m_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (m_fd < 0) {
+		int err = -errno;
+		elliptics::throw_error(err, "segment: could not open %s: %s", path.c_str(), strerror(-err));
+	}
+
+	struct stat st;
+	if (fstat(m_fd, &st) < 0) {
+		int err = -errno;
+		close(m_fd);
+		elliptics::throw_error(err, "segment: could not stat %s: %s", path.c_str(), strerror(-err));
+	}
+
+	m_size = st.st_size;
+	if (m_size < offsetof(segment_header, flags)) {
+		close(m_fd);
+		elliptics::throw_error(-EPROTO, "segment: %s is too small: %llu", path.c_str(), (unsigned long long)m_size);
+	}
+
+	void *data = mmap(NULL, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+	if (data == MAP_FAILED) {
+		int err = -errno;
+		close(m_fd);
+		elliptics::throw_error(err, "segment: could not map %s: %s", path.c_str(), strerror(-err));
+	}
+
+	m_data = (const char *)data;
+	m_header = (const segment_header *)m_data;
+
+	if (!valid_layout()) {
+		munmap(data, m_size);
+		close(m_fd);
+		elliptics::throw_error(-EPROTO, "segment: %s is corrupted or has unsupported version", path.c_str());
+	}
+
+	if (m_header->version >= 3 && (m_header->flags & segment_impact_ordered))
+		m_priors = (const float *)(m_data + m_header->priors_offset);
+
+	// postings are accessed randomly and are explicitly prefetched per query,
+	// dictionary is touched by every lookup and should stay resident
+	madvise(data, m_size, MADV_RANDOM);
+
+	long page = sysconf(_SC_PAGESIZE);
+	uint64_t dict_start = m_header->dict_offset & ~(page - 1);
+	madvise((char *)data + dict_start, m_header->postings_offset - dict_start, MADV_WILLNEED);
+
+	for (uint32_t doc = 0; doc < m_header->docs_num; ++doc)
+		m_tokens_num += length(doc);
+}
+
+bool segment::valid_layout() const {
+	const segment_header &h = *m_header;
+
+	if (memcmp(h.magic, segment_magic, sizeof(segment_magic)) || h.version == 0 || h.version > segment_version)
+		return false;
+
+	// headers of older versions end before flags
+	const uint64_t header_size = h.version < 3 ? offsetof(segment_header, flags) : sizeof(segment_header);
+	if (m_size < header_size || h.size != m_size)
+		return false;
+
+	bool impact = h.version >= 3 && (h.flags & segment_impact_ordered);
+
+	// sections follow each other in this order
+	const uint64_t offsets[] = {
+		header_size, h.docs_offset, h.keys_offset, h.hashes_offset, h.dict_offset, h.dict_index_offset,
+		h.postings_offset, h.positions_offset, impact ? h.priors_offset : m_size, m_size,
+	};
+	for (size_t i = 1; i < sizeof(offsets) / sizeof(offsets[0]); ++i) {
+		if (offsets[i] < offsets[i - 1])
+			return false;
+	}
+
+	// counts are 32-bit, so the products do not overflow
+	if (h.keys_offset - h.docs_offset < (uint64_t)h.docs_num * sizeof(segment_doc) ||
+			h.dict_offset - h.hashes_offset < (uint64_t)h.docs_num * sizeof(segment_key_hash) ||
+			h.postings_offset - h.dict_index_offset < (uint64_t)h.dict_blocks_num * sizeof(segment_dict_index) ||
+			h.dict_blocks_num != (h.terms_num + dict_block_size - 1) / dict_block_size ||
+			(impact && m_size - h.priors_offset < (uint64_t)h.docs_num * sizeof(float)))
+		return false;
+
+	const uint64_t keys_size = h.hashes_offset - h.keys_offset;
+	const segment_doc *docs = (const segment_doc *)section(h.docs_offset);
+	const segment_key_hash *hashes = (const segment_key_hash *)section(h.hashes_offset);
+
+	for (uint32_t i = 0; i < h.docs_num; ++i) {
+		if (docs[i].key_offset > keys_size || docs[i].key_size > keys_size - docs[i].key_offset ||
+				hashes[i].doc >= h.docs_num)
+			return false;
+	}
+
+	const uint64_t dict_size = h.dict_index_offset - h.dict_offset;
+	const uint64_t terms_size = h.postings_offset - h.dict_index_offset -
+		h.dict_blocks_num * sizeof(segment_dict_index);
+	const segment_dict_index *index = (const segment_dict_index *)section(h.dict_index_offset);
+
+	for (uint32_t i = 0; i < h.dict_blocks_num; ++i) {
+		if (index[i].block_offset >= dict_size || index[i].term_offset > terms_size ||
+				index[i].term_size > terms_size - index[i].term_offset)
+			return false;
+	}
+
+	return true;
+}
+
+segment::~segment() {
+	munmap((void *)m_data, m_size);
+	close(m_fd);
+}
+
+const std::string &segment::path() const {
+	return m_path;
+}
+
+uint32_t segment::docs_num() const {
+	return m_header->docs_num;
+}
+
+uint32_t segment::terms_num() const {
+	return m_header->terms_num;
+}
+
+uint64_t segment::size() const {
+	return m_size;
+}
+
+uint32_t segment::length(uint32_t doc) const {
+	if (m_header->version < 2 || doc >= m_header->docs_num)
+		return 0;
+
+	const segment_doc *d = (const segment_doc *)section(m_header->docs_offset) + doc;
+	return d->length;
+}
+
+uint64_t segment::tokens_num() const {
+	return m_tokens_num;
+}
+
+const char *segment::section(uint64_t offset) const {
+	return m_data + offset;
+}
+
+const char *segment::end() const {
+	return m_data + m_size;
+}
+
+segment_document segment::document(uint32_t doc) const {
+	if (doc >= m_header->docs_num)
+		elliptics::throw_error(-ERANGE, "segment: %s: document %u is out of range, documents: %u",
+				m_path.c_str(), doc, m_header->docs_num);
+
+	segment_doc d;
+	memcpy(&d, section(m_header->docs_offset) + doc * sizeof(segment_doc), sizeof(segment_doc));
+
+	segment_document ret;
+	ret.id = d.id;
+	ret.ts.tsec = d.tsec;
+	ret.ts.tnsec = d.tnsec;
+	ret.key.assign(section(m_header->keys_offset) + d.key_offset, d.key_size);
+	return ret;
+}
+
+bool segment::contains(const std::string &key) const {
+	uint64_t h = hash::murmur(key, 0);
+
+	const segment_key_hash *hashes = (const segment_key_hash *)section(m_header->hashes_offset);
+	const segment_key_hash *hend = hashes + m_header->docs_num;
+
+	const segment_key_hash *it = std::lower_bound(hashes, hend, h,
+		[] (const segment_key_hash &a, uint64_t h) {
+			return a.hash < h;
+		});
+
+	for (; it != hend && it->hash == h; ++it) {
+		const segment_doc *d = (const segment_doc *)section(m_header->docs_offset) + it->doc;
+		if (!compare(section(m_header->keys_offset) + d->key_offset, d->key_size, key))
+			return true;
+	}
+
+	return false;
+}
+
+bool segment::lookup(const std::string &term, term_info &info) const {
+	const segment_dict_index *index = (const segment_dict_index *)section(m_header->dict_index_offset);
+	const char *terms = section(m_header->dict_index_offset) + m_header->dict_blocks_num * sizeof(segment_dict_index);
+
+	// the last block whose first term is not greater than @term
+	uint32_t lo = 0, hi = m_header->dict_blocks_num;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (compare(terms + index[mid].term_offset, index[mid].term_size, term) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == 0)
+		return false;
+
+	uint32_t block = lo - 1;
+	const char *ptr = section(m_header->dict_offset) + index[block].block_offset;
+	const char *dend = section(m_header->dict_index_offset);
+
+	size_t num = std::min<size_t>(dict_block_size, m_header->terms_num - block * dict_block_size);
+	std::string cur;
+
+	for (size_t i = 0; i < num; ++i) {
+		size_t prefix = varint::get(ptr, dend);
+		size_t suffix = varint::get(ptr, dend);
+		if (prefix > cur.size() || ptr + suffix > dend)
+			elliptics::throw_error(-EPROTO, "segment: %s: corrupted dictionary block %u", m_path.c_str(), block);
+
+		cur.resize(prefix);
+		cur.append(ptr, suffix);
+		ptr += suffix;
+
+		read_term(ptr, dend, info);
+
+		int cmp = cur.compare(term);
+		if (cmp == 0) {
+			read_extent(block * dict_block_size + i, ptr, info);
+			return true;
+		}
+		if (cmp > 0)
+			return false;
+	}
+
+	return false;
+}
+
+void segment::for_each_term(const std::function<void (const std::string &term, const term_info &info)> &fn) const {
+	const char *ptr = section(m_header->dict_offset);
+	const char *dend = section(m_header->dict_index_offset);
+
+	std::string cur;
+	for (uint32_t i = 0; i < m_header->terms_num; ++i) {
+		if (i % dict_block_size == 0)
+			cur.clear();
+
+		size_t prefix = varint::get(ptr, dend);
+		size_t suffix = varint::get(ptr, dend);
+		if (prefix > cur.size() || ptr + suffix > dend)
+			elliptics::throw_error(-EPROTO, "segment: %s: corrupted dictionary", m_path.c_str());
+
+		cur.resize(prefix);
+		cur.append(ptr, suffix);
+		ptr += suffix;
+
+		term_info info;
+		read_term(ptr, dend, info);
+		read_extent(i, ptr, info);
+
+		fn(cur, info);
+	}
+}
+
+void segment::read_term(const char *&ptr, const char *end, term_info &info) const {
+	info.df = varint::get(ptr, end);
+	info.max_tf = m_header->version < 2 ? 0 : varint::get(ptr, end);
+	info.postings = varint::get(ptr, end);
+	info.positions = varint::get(ptr, end);
+}
+
+void segment::read_extent(uint32_t index, const char *ptr, term_info &info) const {
+	const char *dend = section(m_header->dict_index_offset);
+	term_info next;
+
+	if (index + 1 >= m_header->terms_num) {
+		next.postings = m_header->positions_offset - m_header->postings_offset;
+		next.positions = (m_priors ? m_header->priors_offset : m_header->size) - m_header->positions_offset;
+	} else {
+		// dictionary blocks are contiguous, so the next entry may be the first one of the next block
+		varint::get(ptr, dend);
+		size_t suffix = varint::get(ptr, dend);
+		if (ptr + suffix > dend)
+			elliptics::throw_error(-EPROTO, "segment: %s: corrupted dictionary", m_path.c_str());
+
+		ptr += suffix;
+		read_term(ptr, dend, next);
+	}
+
+	if (next.postings < info.postings || next.positions < info.positions ||
+			next.postings > m_header->positions_offset - m_header->postings_offset ||
+			next.positions > (m_priors ? m_header->priors_offset : m_header->size) - m_header->positions_offset)
+		elliptics::throw_error(-EPROTO, "segment: %s: corrupted dictionary", m_path.c_str());
+
+	info.postings_size = next.postings - info.postings;
+	info.positions_size = next.positions - info.positions;
+}
+
+void segment::read_blocks(const term_info &info, std::vector<block> &blocks, const char *&ptr) const {
+	ptr = section(m_header->postings_offset) + info.postings;
+	const char *pend = section(m_header->positions_offset);
+
+	// every skip entry takes at least three bytes
+	size_t num = varint::get(ptr, pend);
+	if (num > info.postings_size / 3)
+		elliptics::throw_error(-EPROTO, "segment: %s: corrupted postings", m_path.c_str());
+
+	blocks.resize(num);
+
+	for (auto & b : blocks) {
+		b.last_doc = varint::get(ptr, pend);
+		b.docs_size = varint::get(ptr, pend);
+		b.positions_size = varint::get(ptr, pend);
+	}
+}
+
+void segment::postings(const term_info &info, std::vector<uint32_t> &docs) const {
+	decode_postings(info, docs, NULL);
+}
+
+void segment::postings(const term_info &info, std::vector<uint32_t> &docs, std::vector<uint32_t> &tfs) const {
+	decode_postings(info, docs, &tfs);
+}
+
+void segment::postings(const term_info &info, uint32_t first, uint32_t last,
+		std::vector<uint32_t> &docs, std::vector<uint32_t> &tfs) const {
+	decode_postings(info, docs, &tfs, first, last);
+}
+
+bool segment::impact_ordered() const {
+	return m_priors != NULL;
+}
+
+float segment::prior(uint32_t doc) const {
+	if (!m_priors || doc >= m_header->docs_num)
+		return 0;
+
+	float ret;
+	memcpy(&ret, m_priors + doc, sizeof(float));
+	return ret;
+}
+
+void segment::decode_postings(const term_info &info, std::vector<uint32_t> &docs, std::vector<uint32_t> *tfs,
+		uint32_t first, uint32_t last) const {
+	std::vector<block> blocks;
+	const char *ptr;
+
+	read_blocks(info, blocks, ptr);
+	if (first == 0 && last == ~0U) {
+		docs.reserve(docs.size() + info.df);
+		if (tfs)
+			tfs->reserve(tfs->size() + info.df);
+	}
+
+	const char *pend = section(m_header->positions_offset);
+	uint32_t doc = 0;
+
+	for (auto & b : blocks) {
+		const char *bend = ptr + b.docs_size;
+		if (bend > pend)
+			elliptics::throw_error(-EPROTO, "segment: %s: corrupted postings", m_path.c_str());
+
+		// skip entries tell whether the block has anything in the range without decoding it
+		if (b.last_doc < first) {
+			ptr = bend;
+			doc = b.last_doc;
+			continue;
+		}
+
+		while (ptr < bend) {
+			doc += varint::get(ptr, bend);
+			size_t tf = varint::get(ptr, bend);
+
+			if (doc >= last)
+				return;
+			if (doc < first)
+				continue;
+
+			docs.push_back(doc);
+			if (tfs)
+				tfs->push_back(tf);
+		}
+	}
+}
+
+std::vector<int> segment::positions(const term_info &info, uint32_t doc) const {
+	std::vector<block> blocks;
+	const char *ptr;
+
+	read_blocks(info, blocks, ptr);
+
+	auto it = std::lower_bound(blocks.begin(), blocks.end(), doc,
+		[] (const block &b, uint32_t doc) {
+			return b.last_doc < doc;
+		});
+	if (it == blocks.end())
+		return std::vector<int>();
+
+	uint32_t cur = 0;
+	const char *pos = section(m_header->positions_offset) + info.positions;
+
+	for (auto b = blocks.begin(); b != it; ++b) {
+		ptr += b->docs_size;
+		pos += b->positions_size;
+		cur = b->last_doc;
+	}
+
+	const char *bend = ptr + it->docs_size;
+	const char *pend = pos + it->positions_size;
+	if (bend > section(m_header->positions_offset) || pend > end())
+		elliptics::throw_error(-EPROTO, "segment: %s: corrupted postings", m_path.c_str());
+
+	while (ptr < bend) {
+		cur += varint::get(ptr, bend);
+		size_t tf = varint::get(ptr, bend);
+
+		if (cur > doc)
+			break;
+
+		if (cur == doc) {
+			std::vector<int> ret;
+			ret.reserve(tf);
+
+			int p = 0;
+			for (size_t i = 0; i < tf; ++i) {
+				p += varint::get(pos, pend);
+				ret.push_back(p);
+			}
+
+			return ret;
+		}
+
+		for (size_t i = 0; i < tf; ++i)
+			varint::get(pos, pend);
+	}
+
+	return std::vector<int>();
+}
+
+void segment::for_each_posting(const term_info &info,
+		const std::function<void (uint32_t doc, const std::vector<int> &pos)> &fn) const {
+	std::vector<block> blocks;
+	const char *ptr;
+
+	read_blocks(info, blocks, ptr);
+
+	const char *pos = section(m_header->positions_offset) + info.positions;
+	uint32_t doc = 0;
+	std::vector<int> positions;
+
+	for (auto & b : blocks) {
+		const char *bend = ptr + b.docs_size;
+		const char *pend = pos + b.positions_size;
+		if (bend > section(m_header->positions_offset) || pend > end())
+			elliptics::throw_error(-EPROTO, "segment: %s: corrupted postings", m_path.c_str());
+
+		while (ptr < bend) {
+			doc += varint::get(ptr, bend);
+			size_t tf = varint::get(ptr, bend);
+
+			positions.clear();
+			int p = 0;
+			for (size_t i = 0; i < tf; ++i) {
+				p += varint::get(pos, pend);
+				positions.push_back(p);
+			}
+
+			fn(doc, positions);
+		}
+	}
+}
+
+void segment::prefetch(const std::vector<term_info> &terms, bool positions) const {
+	long page = sysconf(_SC_PAGESIZE);
+
+	auto advise = [this, page] (uint64_t offset, uint64_t size) {
+		uint64_t start = offset & ~(page - 1);
+		madvise((void *)(m_data + start), offset + size - start, MADV_WILLNEED);
+	};
+
+	// extents come from the dictionary, postings themselves are not touched here,
+	// otherwise query thread would stall on their page faults
+	for (auto & info : terms) {
+		if (!info.df)
+			continue;
+
+		advise(m_header->postings_offset + info.postings, info.postings_size);
+		if (positions)
+			advise(m_header->positions_offset + info.positions, info.positions_size);
+	}
+}
+
+}} // namespace ioremap::wookie
@@ -0,0 +1,149 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "wookie/static_rank.hpp"
+
+#include <elliptics/error.hpp>
+
+#include <algorithm>
+#include <fstream>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace ioremap { namespace wookie {
+
+namespace {
+	static const char rank_magic[8] = { 'W', 'O', 'O', 'K', 'R', 'A', 'N', 'K' };
+	static const uint32_t rank_version = 1;
+
+	struct rank_header {
+		char		magic[8];
+		uint32_t	version;
+		uint32_t	docs_num;
+	} __attribute__ ((packed));
+}
+
+static_rank::static_rank()
+{
+}
+
+static_rank::static_rank(const std::vector<float> &values) : m_values(values)
+{
+}
+
+float static_rank::get(uint32_t doc) const
+{
+	return doc < m_values.size() ? m_values[doc] : 0;
+}
+
+void static_rank::set(uint32_t doc, float value)
+{
+	if (doc >= m_values.size())
+		m_values.resize(doc + 1, 0);
+
+	m_values[doc] = value;
+}
+
+size_t static_rank::size() const
+{
+	return m_values.size();
+}
+
+const std::vector<float> &static_rank::values() const
+{
+	return m_values;
+}
+
+void static_rank::save(const std::string &path) const
+{
+	std::string tmp = path + ".tmp";
+	std::ofstream out(tmp.c_str(), std::ios::binary | std::ios::trunc);
+	if (!out)
+		elliptics::throw_error(-errno, "static rank: could not open %s", tmp.c_str());
+
+	rank_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, rank_magic, sizeof(header.magic));
+	header.version = rank_version;
+	header.docs_num = m_values.size();
+
+	out.write((const char *)&header, sizeof(header));
+	out.write((const char *)m_values.data(), m_values.size() * sizeof(float));
+
+	out.close();
+	if (!out) {
+		unlink(tmp.c_str());
+		elliptics::throw_error(-EIO, "static rank: could not write %s", tmp.c_str());
+	}
+
+	if (rename(tmp.c_str(), path.c_str()) < 0) {
+		int err = -errno;
+		unlink(tmp.c_str());
+		elliptics::throw_error(err, "static rank: could not rename %s to %s", tmp.c_str(), path.c_str());
+	}
+}
+
+void static_rank::load(const std::string &path)
+{
+	std::ifstream in(path.c_str(), std::ios::binary);
+	if (!in)
+		elliptics::throw_error(-ENOENT, "static rank: could not open %s", path.c_str());
+
+	rank_header header;
+	in.read((char *)&header, sizeof(header));
+	if (!in || memcmp(header.magic, rank_magic, sizeof(header.magic)) || header.version != rank_version)
+		elliptics::throw_error(-EPROTO, "static rank: %s: invalid header", path.c_str());
+
+	std::vector<float> values(header.docs_num);
+	in.read((char *)values.data(), values.size() * sizeof(float));
+	if (!in)
+		elliptics::throw_error(-EPROTO, "static rank: %s: truncated file", path.c_str());
+
+	m_values.swap(values);
+}
+
+std::function<float (const segment_document &doc)> document_prior(const std::shared_ptr<static_rank> &ranks,
+		const std::shared_ptr<doc_registry> &registry, const prior_params &params)
+{
+	float max_rank = 0;
+	if (ranks) {
+		for (float r : ranks->values())
+			max_rank = std::max(max_rank, r);
+	}
+
+	return [ranks, registry, params, max_rank] (const segment_document &doc) -> float {
+		double prior = 0;
+
+		if (max_rank > 0 && registry) {
+			uint32_t num = registry->lookup(doc.id);
+			if (num != doc_registry::invalid)
+				prior += params.rank_weight * ranks->get(num) / max_rank;
+		}
+
+		// WAND bounds scores by the prior of the first document of the range,
+		// so priors must not be negative
+		if (params.freshness_weight > 0 && params.half_life > 0) {
+			double since = std::max<double>(0, (double)doc.ts.tsec - params.epoch);
+			prior += params.freshness_weight * since / params.half_life;
+		}
+
+		return prior;
+	};
+}
+
+}} // namespace ioremap::wookie
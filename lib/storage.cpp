@@ -16,100 +16,1509 @@
 
 #include "wookie/storage.hpp"
 
+#include "wookie/chunk.hpp"
+#include "wookie/fields.hpp"
+#include "wookie/lexical_cast.hpp"
+#include "wookie/positions.hpp"
+#include "wookie/timer.hpp"
+
+#include <swarm/url.hpp>
+
+#include <condition_variable>
+
 namespace ioremap { namespace wookie {
 
-storage::storage(elliptics::node &&node) : m_node(node), m_sess(m_node) {
-	m_sess.set_exceptions_policy(elliptics::session::no_exceptions);
-	m_sess.set_ioflags(DNET_IO_FLAGS_CACHE);
-	m_sess.set_timeout(1000);
+namespace {
+	// stored document with still packed body
+	document decode_document(const elliptics::data_pointer &result) {
+		msgpack::unpacked msg;
+		msgpack::unpack(&msg, result.data<char>(), result.size());
+
+		document doc;
+		msg.get().convert(&doc);
+		return doc;
+	}
+
+	// unpacks body of decoded @doc, zstd_dict bodies need their @dict
+	void unpack_body(document &doc, const compress::shared_dictionary_t &dict) {
+		if (doc.codec == compress::zstd_dict) {
+			if (!dict)
+				elliptics::throw_error(-ENOENT, "Could not unpack url %s: there is no zstd dictionary %u",
+						doc.key.c_str(), compress::dictionary::packed_id(doc.data));
+
+			doc.data = dict->unpack(doc.data);
+			doc.codec = compress::none;
+		} else if (doc.codec != compress::none && doc.codec != compress::chunked) {
+			doc.data = compress::unpack(doc.codec, doc.data);
+			doc.codec = compress::none;
+		}
+	}
+
+	// checks that tokens of @phrase follow each other in the document using positions
+	// stored in its index data
+	bool contains_phrase(const elliptics::find_indexes_result_entry &entry, const std::vector<dnet_raw_id> &phrase) {
+		std::vector<std::vector<int>> pos(phrase.size());
+		std::vector<const std::vector<int> *> terms;
+
+		for (size_t i = 0; i < phrase.size(); ++i) {
+			auto it = std::find_if(entry.indexes.begin(), entry.indexes.end(),
+				[&] (const elliptics::index_entry &index) {
+					return !memcmp(&index.index, &phrase[i], sizeof(struct dnet_raw_id));
+				});
+
+			if (it == entry.indexes.end())
+				return false;
+
+			index_data idata(it->data);
+			pos[i].swap(idata.pos);
+			if (!std::is_sorted(pos[i].begin(), pos[i].end()))
+				std::sort(pos[i].begin(), pos[i].end());
+
+			terms.push_back(&pos[i]);
+		}
+
+		return positions::phrase(terms);
+	}
+
+	// query plan source over per-token elliptics find results, documents are numbered
+	// in the order they are met
+	class results_source : public query::source {
+		public:
+			results_source(const std::vector<std::string> &tokens, const std::vector<find_result_t> &results) :
+			m_tokens(tokens), m_results(results), m_postings(tokens.size()) {
+				for (size_t i = 0; i < results.size(); ++i) {
+					for (size_t n = 0; n < results[i].size(); ++n) {
+						auto it = m_numbers.insert(std::make_pair(results[i][n].id, (uint32_t)m_ids.size()));
+						if (it.second)
+							m_ids.push_back(results[i][n].id);
+
+						m_postings[i].emplace_back(it.first->second, n);
+					}
+
+					std::sort(m_postings[i].begin(), m_postings[i].end());
+				}
+			}
+
+			virtual size_t df(const std::string &token) {
+				ssize_t i = index(token);
+				return i < 0 ? 0 : m_postings[i].size();
+			}
+
+			virtual void postings(const std::string &token, std::vector<uint32_t> &docs) {
+				docs.clear();
+
+				ssize_t i = index(token);
+				if (i < 0)
+					return;
+
+				for (auto & p : m_postings[i])
+					docs.push_back(p.first);
+			}
+
+			virtual std::vector<int> positions(const std::string &token, uint32_t doc) {
+				const elliptics::find_indexes_result_entry *entry = find(index(token), doc);
+				if (!entry || entry->indexes.empty())
+					return std::vector<int>();
+
+				index_data idata(entry->indexes.front().data);
+				if (!std::is_sorted(idata.pos.begin(), idata.pos.end()))
+					std::sort(idata.pos.begin(), idata.pos.end());
+
+				return idata.pos;
+			}
+
+			// entry of @doc with index entries of all tokens it has been found by
+			elliptics::find_indexes_result_entry entry(uint32_t doc) {
+				elliptics::find_indexes_result_entry ret;
+				ret.id = m_ids[doc];
+
+				for (size_t i = 0; i < m_tokens.size(); ++i) {
+					const elliptics::find_indexes_result_entry *e = find(i, doc);
+					if (e)
+						ret.indexes.insert(ret.indexes.end(), e->indexes.begin(), e->indexes.end());
+				}
+
+				return ret;
+			}
+
+		private:
+			const std::vector<std::string> &m_tokens;
+			const std::vector<find_result_t> &m_results;
+
+			std::unordered_map<dnet_raw_id, uint32_t, raw_id_hash, raw_id_equal> m_numbers;
+			std::vector<dnet_raw_id> m_ids;
+			// document number and its entry in the results of the token
+			std::vector<std::vector<std::pair<uint32_t, size_t>>> m_postings;
+
+			ssize_t index(const std::string &token) const {
+				auto it = std::lower_bound(m_tokens.begin(), m_tokens.end(), token);
+				if (it == m_tokens.end() || *it != token)
+					return -1;
+
+				return it - m_tokens.begin();
+			}
+
+			const elliptics::find_indexes_result_entry *find(ssize_t i, uint32_t doc) const {
+				if (i < 0)
+					return NULL;
+
+				auto it = std::lower_bound(m_postings[i].begin(), m_postings[i].end(),
+						std::make_pair(doc, (size_t)0));
+				if (it == m_postings[i].end() || it->first != doc)
+					return NULL;
+
+				return &m_results[i][it->second];
+			}
+	};
+
+	// results of delta index replace whatever persistent index has found for @documents
+	future<find_result_t> merge_fresh(future<find_result_t> persistent,
+			const std::shared_ptr<find_result_t> &fresh,
+			const std::shared_ptr<std::vector<dnet_raw_id>> &documents) {
+		return persistent.then<find_result_t>(std::function<find_result_t (const find_result_t &)>(
+			[fresh, documents] (const find_result_t &result) {
+				find_result_t ret = *fresh;
+
+				for (auto & entry : result) {
+					if (!std::binary_search(documents->begin(), documents->end(), entry.id, raw_id_less()))
+						ret.push_back(entry);
+				}
+
+				return ret;
+			}));
+	}
+}
+
+storage::storage(elliptics::node &&node) :
+storage(std::make_shared<elliptics_backend>(std::move(node)))
+{
+}
+
+storage::storage(const std::shared_ptr<wookie::backend> &b) :
+m_backend(b), m_elliptics(dynamic_cast<elliptics_backend *>(b.get())),
+m_hedged_reads(false), m_hedge_default_delay(50), m_latency(std::make_shared<group_latency>()),
+m_codec(compress::lz4), m_chunk_size(default_chunk_size),
+m_dicts(std::bind(&storage::load_dictionary, this, std::placeholders::_1),
+	std::bind(&storage::load_host_dictionary, this, std::placeholders::_1)),
+m_tokens(new token_cache_t(16 * 1024 * 1024)),
+m_registry(std::make_shared<doc_registry>()),
+m_stats(std::make_shared<collection_stats>())
+{
 }
 
 void storage::set_groups(const std::vector<int> groups) {
-	m_sess.set_groups(groups);
+	m_groups = groups;
+
+	if (m_elliptics)
+		m_elliptics->set_groups(groups);
+}
+
+void storage::set_hedged_reads(bool enable, long default_delay) {
+	m_hedged_reads = enable;
+	m_hedge_default_delay = default_delay;
+	m_latency->set_default(default_delay);
+}
+
+double storage::group_average_latency(int group) {
+	return m_latency->average(group);
 }
 
 void storage::set_namespace(const std::string &ns) {
-	m_sess.set_namespace(ns.c_str(), ns.size());
+	m_namespace = ns;
+
+	// index IDs depend on namespace
+	if (m_tokens)
+		m_tokens->clear();
+}
+
+void storage::set_codec(int codec) {
+	m_codec = codec;
 }
 
-std::vector<elliptics::find_indexes_result_entry> storage::find(const std::vector<std::string> &indexes) {
-	return std::move(create_session().find_all_indexes(indexes));
+void storage::set_cache_size(size_t size) {
+	if (size)
+		m_cache.reset(new document_cache_t(size));
+	else
+		m_cache.reset();
 }
 
-std::vector<elliptics::find_indexes_result_entry> storage::find(const std::vector<dnet_raw_id> &indexes) {
-	return std::move(create_session().find_all_indexes(indexes));
+void storage::set_chunk_size(size_t size) {
+	m_chunk_size = size;
+}
+
+cache_stats storage::get_cache_stats() {
+	if (m_cache)
+		return m_cache->stats();
+
+	cache_stats st;
+	memset(&st, 0, sizeof(cache_stats));
+	return st;
 }
 
-elliptics::async_write_result storage::write_document(ioremap::wookie::document &d) {
+std::string storage::meta_namespace() const {
+	return m_namespace + ".meta";
+}
+
+std::string storage::chunks_namespace() const {
+	return m_namespace + ".chunks";
+}
+
+dnet_raw_id storage::transform_key(const elliptics::key &key, const std::string &ns) {
+	if (key.by_id())
+		return key.raw_id();
+
+	return m_backend->transform(ns, key.remote());
+}
+
+dnet_raw_id storage::transform_key(const elliptics::key &key) {
+	return transform_key(key, m_namespace);
+}
+
+storage::find_result_t storage::find(const std::vector<std::string> &indexes) {
+	future<find_result_t> ret = async_find(indexes);
+	if (ret.error())
+		return find_result_t();
+
+	return ret.get();
+}
+
+storage::find_result_t storage::find(const std::vector<dnet_raw_id> &indexes) {
+	future<find_result_t> ret = async_find(indexes);
+	if (ret.error())
+		return find_result_t();
+
+	return ret.get();
+}
+
+future<storage::find_result_t> storage::async_find(const std::vector<std::string> &indexes, bool positions) {
+	std::vector<dnet_raw_id> ids = transform_tokens(indexes);
+
+	std::shared_ptr<local_index> local = m_local;
+	std::shared_ptr<delta_index> delta = m_delta;
+
+	// delta index is searched before persistent one, so that documents which are flushed
+	// in between are found at least once, results for them are taken from delta index
+	auto fresh = std::make_shared<find_result_t>();
+	auto documents = std::make_shared<std::vector<dnet_raw_id>>();
+	if (delta) {
+		try {
+			*fresh = delta->find(indexes, ids, *documents, positions);
+		} catch (...) {
+			future<find_result_t> ret;
+			ret.complete(exception_error(std::current_exception()));
+			return ret;
+		}
+	}
+
+	future<find_result_t> persistent;
+	if (local) {
+		persistent.complete(std::function<find_result_t ()>([local, &indexes, &ids, positions] () {
+			return local->find(indexes, ids, positions);
+		}));
+	} else {
+		persistent = async_find(ids);
+	}
+
+	if (!delta)
+		return persistent;
+
+	return merge_fresh(persistent, fresh, documents);
+}
+
+future<storage::find_result_t> storage::async_find(const query::node &q, bool positions) {
+	std::vector<std::string> tokens = query::tokens(q);
+	std::vector<dnet_raw_id> ids = transform_tokens(tokens);
+
+	std::shared_ptr<local_index> local = m_local;
+	std::shared_ptr<delta_index> delta = m_delta;
+
+	auto fresh = std::make_shared<find_result_t>();
+	auto documents = std::make_shared<std::vector<dnet_raw_id>>();
+	if (delta) {
+		try {
+			*fresh = delta->find(q, tokens, ids, *documents, positions);
+		} catch (...) {
+			future<find_result_t> ret;
+			ret.complete(exception_error(std::current_exception()));
+			return ret;
+		}
+	}
+
+	future<find_result_t> persistent;
+	if (local) {
+		persistent.complete(std::function<find_result_t ()>([local, &q, &tokens, &ids, positions] () {
+			return local->find(q, tokens, ids, positions);
+		}));
+	} else {
+		persistent = async_find_tokens(q);
+	}
+
+	if (!delta)
+		return persistent;
+
+	return merge_fresh(persistent, fresh, documents);
+}
+
+future<rank::ranked_result_t> storage::async_top(const std::vector<std::string> &indexes, size_t k,
+		const rank::bm25 &params, bool positions, const rank::proximity_params &prox,
+		const std::vector<double> &weights, double prior) {
+	// tokens of the same document are counted once, with the largest of their weights
+	std::map<std::string, double> weighted;
+	for (size_t i = 0; i < indexes.size(); ++i) {
+		const double w = i < weights.size() ? weights[i] : 1;
+		auto it = weighted.insert(std::make_pair(indexes[i], w));
+		it.first->second = std::max(it.first->second, w);
+	}
+
+	std::vector<std::string> tokens;
+	std::vector<double> token_weights;
+	for (auto & w : weighted) {
+		tokens.push_back(w.first);
+		token_weights.push_back(w.second);
+	}
+
+	// first stage collects candidates for the proximity reranking
+	const size_t candidates = prox.weight > 0 ? std::max(k, prox.depth) : k;
+	if (prox.weight > 0)
+		positions = true;
+
+	std::shared_ptr<local_index> local = m_local;
+	std::shared_ptr<delta_index> delta = m_delta;
+	std::shared_ptr<collection_stats> stats = m_stats;
+
+	std::vector<dnet_raw_id> token_ids = transform_tokens(tokens);
+
+	// documents which are in memory are searched before the persistent ones, so that
+	// documents flushed in between are found at least once, they are scored later
+	// with the same statistics as the persistent part of the collection
+	auto documents = std::make_shared<std::vector<dnet_raw_id>>();
+	auto fresh = std::make_shared<find_result_t>();
+	if (delta) {
+		query::node any(query::node::op_or);
+		for (auto & t : tokens) {
+			query::node term(query::node::term);
+			term.tokens.push_back(t);
+			any.children.push_back(term);
+		}
+
+		try {
+			*fresh = delta->find(any, tokens, token_ids, *documents, true);
+		} catch (...) {
+			future<rank::ranked_result_t> ret;
+			ret.complete(exception_error(std::current_exception()));
+			return ret;
+		}
+	}
+
+	// persistent versions of the documents which are in memory are outdated and are replaced
+	// by the fresh ones, the rest goes through the second stage, windows of the field tokens
+	// would cross field boundaries, so only body tokens are taken into account
+	std::vector<std::string> body;
+	for (auto & t : tokens) {
+		if (fields::parse(t) == fields::body)
+			body.push_back(t);
+	}
+
+	std::vector<dnet_raw_id> body_ids = transform_tokens(body);
+	auto finish = [documents, fresh, token_ids, token_weights, body_ids, candidates, k, params, prox, prior,
+			local, stats] (const rank::ranked_result_t &result, const rank::stats &st) {
+		rank::ranked_result_t ret;
+		for (auto & re : result) {
+			if (!std::binary_search(documents->begin(), documents->end(), re.entry.id, raw_id_less()))
+				ret.push_back(re);
+		}
+
+		// delta index does not keep lengths, but they are accounted in collection statistics
+		// once documents are added, priors are the same the local index will assign them
+		rank::ranked_result_t scored = rank::score(*fresh, token_ids, st, fresh->size(), params,
+			[&] (const dnet_raw_id &id) {
+				return stats->length(id);
+			}, token_weights);
+
+		for (auto & re : scored) {
+			if (local && prior > 0 && re.entry.indexes.size()) {
+				segment_document doc;
+				doc.id = re.entry.id;
+				doc.ts = index_data(re.entry.indexes.front().data).ts;
+				re.score += prior * local->prior(doc);
+			}
+
+			ret.push_back(re);
+		}
+
+		std::stable_sort(ret.begin(), ret.end(), [] (const rank::ranked_entry &a, const rank::ranked_entry &b) {
+				return a.score > b.score;
+			});
+		if (ret.size() > candidates)
+			ret.resize(candidates);
+
+		rank::rerank(ret, body_ids, prox);
+		if (ret.size() > k)
+			ret.resize(k);
+		return ret;
+	};
+
+	future<rank::ranked_result_t> ret;
+
+	if (local) {
+		ret.complete(std::function<rank::ranked_result_t ()>([&] () {
+			rank::stats st;
+			rank::ranked_result_t result = local->top(tokens, token_ids, candidates, params, positions,
+					token_weights, prior, &st);
+			return finish(result, st);
+		}));
+		return ret;
+	}
+
+	std::vector<future<find_result_t>> lists;
+	for (auto & id : token_ids)
+		lists.emplace_back(async_find(std::vector<dnet_raw_id>(1, id)));
+
+	// document frequencies are exact sizes of the lists, collection size and document
+	// lengths are taken from collection statistics if they are maintained
+	when_all(lists).connect([token_ids, token_weights, stats, candidates, params, finish, ret]
+			(const std::vector<find_result_t> &results, const elliptics::error_info &err) mutable {
+		if (err) {
+			ret.complete(err);
+			return;
+		}
+
+		ret.complete(std::function<rank::ranked_result_t ()>([&] () {
+			rank::stats st = stats->get(std::vector<std::string>());
+			for (auto & r : results)
+				st.df.push_back(r.size());
+
+			// union of the lists with index entries of all tokens document has been found by
+			std::unordered_map<dnet_raw_id, size_t, raw_id_hash, raw_id_equal> numbers;
+			find_result_t all;
+			for (auto & r : results) {
+				for (auto & entry : r) {
+					auto it = numbers.insert(std::make_pair(entry.id, all.size()));
+					if (it.second)
+						all.push_back(entry);
+					else
+						all[it.first->second].indexes.insert(all[it.first->second].indexes.end(),
+								entry.indexes.begin(), entry.indexes.end());
+				}
+			}
+
+			if (st.docs_num < all.size()) {
+				st.docs_num = all.size();
+				st.tokens_num = 0;
+			}
+
+			return finish(rank::score(all, token_ids, st, candidates, params,
+				[&] (const dnet_raw_id &id) {
+					return stats->length(id);
+				}, token_weights), st);
+		}));
+	});
+
+	return ret;
+}
+
+future<storage::find_result_t> storage::async_find_tokens(const query::node &q) {
+	std::vector<const query::node *> operands;
+	if (q.type == query::node::op_and) {
+		for (auto & c : q.children)
+			operands.push_back(&c);
+	} else {
+		operands.push_back(&q);
+	}
+
+	// elliptics intersects indexes itself, so tokens of the positive terms, phrases and nears
+	// of the top-level AND are searched by a single find_all_indexes(), the plan still runs
+	// over them to check positions
+	std::vector<std::string> required;
+	for (auto op : operands) {
+		if (op->type == query::node::term || op->type == query::node::phrase || op->type == query::node::near)
+			required.insert(required.end(), op->tokens.begin(), op->tokens.end());
+	}
+
+	std::sort(required.begin(), required.end());
+	required.erase(std::unique(required.begin(), required.end()), required.end());
+
+	// negated terms and phrases are removed from the result by exclude_found(),
+	// the rest of operands (OR groups and complex negations) is evaluated by the plan
+	// over the lists of their tokens, which are fetched separately
+	exclusion_t exclude;
+	query::node rest(query::node::op_and);
+	for (auto op : operands) {
+		if (required.size() && op->type == query::node::op_not &&
+				(op->children[0].type == query::node::term || op->children[0].type == query::node::phrase))
+			exclude.push_back(op->children[0].tokens);
+		else
+			rest.children.push_back(*op);
+	}
+
+	if (rest.children.size() == 1) {
+		query::node child = rest.children[0];
+		rest = child;
+	}
+
+	std::vector<std::string> all = query::tokens(rest);
+	std::vector<std::string> separate;
+	std::set_difference(all.begin(), all.end(), required.begin(), required.end(), std::back_inserter(separate));
+
+	std::vector<future<find_result_t>> lists;
+	for (auto & id : transform_tokens(separate))
+		lists.emplace_back(async_find(std::vector<dnet_raw_id>(1, id)));
+
+	std::vector<dnet_raw_id> required_ids = transform_tokens(required);
+	if (required.size())
+		lists.emplace_back(async_find(required_ids));
+
+	future<find_result_t> ret;
+	when_all(lists).connect([rest, required, required_ids, separate, ret] (const std::vector<find_result_t> &results,
+				const elliptics::error_info &err) mutable {
+		if (err) {
+			ret.complete(err);
+			return;
+		}
+
+		ret.complete(std::function<find_result_t ()>([&] () {
+			// every document found by all required tokens at once gets an entry
+			// in the list of each of them, as if they were searched one by one
+			std::vector<find_result_t> conjunct(required.size());
+			if (required.size()) {
+				for (auto & entry : results.back()) {
+					for (auto & index : entry.indexes) {
+						for (size_t i = 0; i < required_ids.size(); ++i) {
+							if (memcmp(&index.index, &required_ids[i], sizeof(struct dnet_raw_id)))
+								continue;
+
+							elliptics::find_indexes_result_entry e;
+							e.id = entry.id;
+							e.indexes.push_back(index);
+							conjunct[i].emplace_back(e);
+						}
+					}
+				}
+			}
+
+			// source wants sorted tokens, required and separate ones never intersect
+			std::vector<std::string> tokens;
+			std::vector<find_result_t> token_results;
+			for (size_t r = 0, s = 0; r < required.size() || s < separate.size();) {
+				if (s == separate.size() || (r < required.size() && required[r] < separate[s])) {
+					tokens.push_back(required[r]);
+					token_results.emplace_back(std::move(conjunct[r]));
+					++r;
+				} else {
+					tokens.push_back(separate[s]);
+					token_results.push_back(results[s]);
+					++s;
+				}
+			}
+
+			results_source src(tokens, token_results);
+
+			std::vector<uint32_t> docs;
+			query::plan plan(rest, src);
+			plan.execute(docs);
+
+			find_result_t found;
+			for (auto doc : docs)
+				found.emplace_back(src.entry(doc));
+
+			return found;
+		}));
+	});
+
+	if (exclude.empty())
+		return ret;
+
+	return exclude_found(ret, required, exclude);
+}
+
+future<storage::find_result_t> storage::exclude_found(future<find_result_t> found,
+		const std::vector<std::string> &indexes, const exclusion_t &exclude) {
+	std::vector<std::vector<dnet_raw_id>> phrases;
+	for (auto & group : exclude)
+		phrases.emplace_back(transform_tokens(group));
+
+	future<find_result_t> ret;
+	found.connect([this, indexes, exclude, phrases, ret] (const find_result_t &result,
+				const elliptics::error_info &err) mutable {
+		if (err || result.empty()) {
+			if (err)
+				ret.complete(err);
+			else
+				ret.complete(result);
+			return;
+		}
+
+		std::vector<future<find_result_t>> excluded;
+		for (auto & group : exclude) {
+			std::vector<std::string> tokens(indexes);
+			tokens.insert(tokens.end(), group.begin(), group.end());
+
+			std::sort(tokens.begin(), tokens.end());
+			tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+
+			excluded.emplace_back(async_find(transform_tokens(tokens)));
+		}
+
+		when_all(excluded).connect([result, phrases, ret] (const std::vector<find_result_t> &groups,
+					const elliptics::error_info &err) mutable {
+			if (err) {
+				ret.complete(err);
+				return;
+			}
+
+			std::vector<dnet_raw_id> drop;
+			for (size_t i = 0; i < groups.size(); ++i) {
+				for (auto & entry : groups[i]) {
+					if (phrases[i].size() == 1 || contains_phrase(entry, phrases[i]))
+						drop.push_back(entry.id);
+				}
+			}
+
+			std::sort(drop.begin(), drop.end(), raw_id_less());
+
+			find_result_t filtered;
+			for (auto & entry : result) {
+				if (!std::binary_search(drop.begin(), drop.end(), entry.id, raw_id_less()))
+					filtered.push_back(entry);
+			}
+
+			ret.complete(filtered);
+		});
+	});
+
+	return ret;
+}
+
+void storage::set_local_index(const std::shared_ptr<local_index> &local) {
+	m_local = local;
+}
+
+void storage::set_delta_index(const std::shared_ptr<delta_index> &delta) {
+	m_delta = delta;
+	if (m_delta)
+		m_delta->set_stats(m_stats);
+}
+
+doc_registry &storage::get_doc_registry() {
+	return *m_registry;
+}
+
+void storage::set_doc_registry(const std::shared_ptr<doc_registry> &registry) {
+	m_registry = registry;
+}
+
+collection_stats &storage::get_collection_stats() {
+	return *m_stats;
+}
+
+void storage::set_collection_stats(const std::shared_ptr<collection_stats> &stats) {
+	m_stats = stats;
+	if (m_delta)
+		m_delta->set_stats(m_stats);
+}
+
+future<storage::find_result_t> storage::async_find(const std::vector<dnet_raw_id> &indexes) {
+	return m_backend->find(indexes, m_latency->order(m_groups));
+}
+
+future<int> storage::write_document(ioremap::wookie::document &d) {
+	return write_document(d, document_meta(d));
+}
+
+future<int> storage::write_document(ioremap::wookie::document &d, const document_meta &meta) {
+	m_registry->assign(transform_key(d.key), d.key);
+
+	if (m_chunk_size && d.data.size() > m_chunk_size) {
+		chunk_writer writer(*this, d.key, d.ts);
+		writer.write(d.data);
+		return writer.commit(meta);
+	}
+
+	if (m_cache)
+		m_cache->erase(transform_key(d.key));
+
+	// previous version could have been chunked, it has to be read before it is replaced,
+	// its chunks are removed after the new body is written
+	elliptics::data_pointer body = pack(d);
+	std::string key = d.key;
+	dnet_time ts = d.ts;
+	future<document> previous = read_previous(key);
+
+	future<int> ret;
+	previous.connect([this, ret, key, ts, body, meta, previous] (const document &,
+				const elliptics::error_info &) mutable {
+		write_object(key, body, meta).connect(
+			[this, ret, ts, previous] (const int &, const elliptics::error_info &err) mutable {
+				if (err) {
+					ret.complete(err);
+					return;
+				}
+
+				remove_chunks(previous, ts).connect(
+					[ret] (const int &, const elliptics::error_info &) mutable {
+						ret.complete(0);
+					});
+			});
+	});
+
+	return ret;
+}
+
+future<int> storage::write_object(const std::string &key, const elliptics::data_pointer &body, const document_meta &meta) {
 	msgpack::sbuffer buffer;
-	msgpack::pack(&buffer, d);
+	msgpack::pack(&buffer, meta);
+
+	dnet_raw_id id = transform_key(key);
+
+	std::vector<future<int>> res;
+	res.emplace_back(m_backend->write(id, body));
+	res.emplace_back(m_backend->write(transform_key(key, meta_namespace()),
+				elliptics::data_pointer::copy(buffer.data(), buffer.size())));
+
+	// reads which have started before the write and finished after the invalidation done by
+	// the caller could have cached previous version, so the cache is invalidated again,
+	// this also makes their inserts fail because of changed cache generation
+	future<int> ret;
+	when_all(res).connect([this, ret, id] (const std::vector<int> &, const elliptics::error_info &err) mutable {
+			if (m_cache)
+				m_cache->erase(id);
+
+			if (err)
+				ret.complete(err);
+			else
+				ret.complete(0);
+		});
+
+	return ret;
+}
+
+std::string storage::chunk_name(const std::string &key, const dnet_time &ts, int version, uint32_t n) {
+	if (version < 2)
+		return key + "." + lexical_cast(n);
+
+	return key + "." + lexical_cast(ts.tsec) + "." + lexical_cast(ts.tnsec) + "." + lexical_cast(n);
+}
+
+chunk_manifest storage::unpack_manifest(const document &doc) {
+	msgpack::unpacked msg;
+	msgpack::unpack(&msg, doc.data.data(), doc.data.size());
 
-	return create_session().write_data(d.key, elliptics::data_pointer::copy(buffer.data(), buffer.size()), 0);
+	chunk_manifest manifest;
+	msg.get().convert(&manifest);
+	return manifest;
 }
 
-elliptics::data_pointer storage::pack_document(ioremap::wookie::document &doc) {
+future<int> storage::write_chunk(const std::string &key, const dnet_time &ts, uint32_t n, const std::string &data) {
+	document chunk;
+	chunk.ts = ts;
+	chunk.key = key;
+	chunk.data = data;
+
+	return m_backend->write(m_backend->transform(chunks_namespace(),
+				chunk_name(key, ts, chunk_manifest::current_version, n)), pack(chunk));
+}
+
+future<document> storage::async_read_chunk(const std::string &key, const dnet_time &ts, int version, uint32_t n) {
+	std::string name = chunk_name(key, ts, version, n);
+
+	return async_read_packed(m_backend->transform(chunks_namespace(), name), name).then<document>(
+		[ts, name] (const document &chunk) -> document {
+			// names of version 1 chunks have no timestamp, they are overwritten by rewrites
+			if (chunk.ts.tsec != ts.tsec || chunk.ts.tnsec != ts.tnsec)
+				elliptics::throw_error(-EAGAIN, "Chunk %s belongs to another version of the document",
+						name.c_str());
+
+			return chunk;
+		});
+}
+
+future<document> storage::read_previous(const std::string &key) {
+	return async_read_file(transform_key(key), key).then<document>(decode_document);
+}
+
+future<int> storage::remove_chunks(future<document> previous, const dnet_time &ts) {
+	future<int> ret;
+
+	previous.connect([this, ret, ts] (const document &doc, const elliptics::error_info &err) mutable {
+		if (err || doc.codec != compress::chunked || (doc.ts.tsec == ts.tsec && doc.ts.tnsec == ts.tnsec)) {
+			ret.complete(0);
+			return;
+		}
+
+		std::vector<future<int>> res;
+		try {
+			chunk_manifest manifest = unpack_manifest(doc);
+			for (uint32_t i = 0; i < manifest.chunks_num; ++i) {
+				res.emplace_back(m_backend->remove(m_backend->transform(chunks_namespace(),
+							chunk_name(doc.key, doc.ts, manifest.version, i))));
+			}
+		} catch (...) {
+		}
+
+		when_all(res).connect([ret] (const std::vector<int> &, const elliptics::error_info &) mutable {
+				ret.complete(0);
+			});
+	});
+
+	return ret;
+}
+
+future<document> storage::read_chunks(const document &doc) {
+	if (doc.codec != compress::chunked) {
+		future<document> ret;
+		ret.complete(doc);
+		return ret;
+	}
+
+	chunk_manifest manifest;
+	try {
+		manifest = unpack_manifest(doc);
+	} catch (...) {
+		future<document> ret;
+		ret.complete(exception_error(std::current_exception()));
+		return ret;
+	}
+
+	std::vector<future<document>> chunks;
+	chunks.reserve(manifest.chunks_num);
+	for (uint32_t i = 0; i < manifest.chunks_num; ++i)
+		chunks.emplace_back(async_read_chunk(doc.key, doc.ts, manifest.version, i));
+
+	document header;
+	header.ts = doc.ts;
+	header.key = doc.key;
+
+	return when_all(chunks).then<document>(
+		[header, manifest] (const std::vector<document> &chunks) -> document {
+			document ret = header;
+			ret.data.reserve(manifest.size);
+
+			for (auto & c : chunks)
+				ret.data.append(c.data);
+
+			if (ret.data.size() != manifest.size)
+				elliptics::throw_error(-EPROTO, "Chunked document %s size mismatch: manifest: %llu, read: %zd",
+						ret.key.c_str(), (unsigned long long)manifest.size, ret.data.size());
+
+			return ret;
+		});
+}
+
+elliptics::data_pointer storage::pack_document(const ioremap::wookie::document &doc,
+		int codec, const std::string &packed) {
 	msgpack::sbuffer buffer;
-	msgpack::pack(&buffer, doc);
+
+	if (codec == compress::none) {
+		compress::global_stats().account(doc.data.size(), doc.data.size());
+
+		if (doc.codec == compress::none) {
+			msgpack::pack(&buffer, doc);
+		} else {
+			ioremap::wookie::document tmp = doc;
+			tmp.codec = compress::none;
+			msgpack::pack(&buffer, tmp);
+		}
+	} else {
+		compress::global_stats().account(doc.data.size(), packed.size());
+
+		ioremap::wookie::document tmp;
+		tmp.ts = doc.ts;
+		tmp.key = doc.key;
+		tmp.codec = codec;
+		tmp.data = packed;
+
+		msgpack::pack(&buffer, tmp);
+	}
 
 	return elliptics::data_pointer::copy(buffer.data(), buffer.size());
 }
 
-elliptics::data_pointer storage::pack_document(const std::string &url, const std::string &data) {
+elliptics::data_pointer storage::pack_document(const ioremap::wookie::document &doc, int codec) {
+	std::string packed;
+	codec = compress::pack(codec, doc.data, packed);
+
+	return pack_document(doc, codec, packed);
+}
+
+elliptics::data_pointer storage::pack_document(const std::string &url, const std::string &data, int codec) {
 	ioremap::wookie::document doc;
 	doc.key = url;
 	doc.data = data;
 	dnet_current_time(&doc.ts);
 
-	return pack_document(doc);
+	return pack_document(doc, codec);
+}
+
+elliptics::data_pointer storage::pack(const ioremap::wookie::document &doc) {
+	if (m_codec == compress::zstd && doc.data.size() >= compress::min_size) {
+		swarm::url url(doc.key);
+
+		if (url.is_valid() && !url.host().empty()) {
+			compress::shared_dictionary_t dict = m_dicts.host(url.host());
+			if (dict) {
+				std::string packed;
+				int codec = dict->pack(doc.data, packed);
+
+				return pack_document(doc, codec, packed);
+			}
+		}
+	}
+
+	return pack_document(doc, m_codec);
+}
+
+document storage::unpack_document(const elliptics::data_pointer &result, compress::dictionary_cache *dicts) {
+	document doc = decode_document(result);
+
+	compress::shared_dictionary_t dict;
+	if (doc.codec == compress::zstd_dict && dicts)
+		dict = dicts->get(compress::dictionary::packed_id(doc.data));
+
+	unpack_body(doc, dict);
+	return doc;
 }
 
 document storage::unpack_document(const elliptics::data_pointer &result) {
-	msgpack::unpacked msg;
-	msgpack::unpack(&msg, result.data<char>(), result.size());
+	return unpack_document(result, NULL);
+}
+
+document storage::unpack(const elliptics::data_pointer &result) {
+	return unpack_document(result, &m_dicts);
+}
+
+future<document> storage::async_unpack(const elliptics::data_pointer &result) {
+	future<document> ret;
 
 	document doc;
-	msg.get().convert(&doc);
+	try {
+		doc = decode_document(result);
+	} catch (...) {
+		ret.complete(exception_error(std::current_exception()));
+		return ret;
+	}
 
-	return doc;
+	compress::shared_dictionary_t dict;
+	unsigned int id = 0;
+	if (doc.codec == compress::zstd_dict) {
+		id = compress::dictionary::packed_id(doc.data);
+		dict = m_dicts.find(id);
+	}
+
+	if (!id || dict || m_dicts.missing(id)) {
+		ret.complete(std::function<document ()>([&] () {
+			unpack_body(doc, dict);
+			return doc;
+		}));
+		return ret;
+	}
+
+	read_data(compress::dictionary_key(id)).connect(
+		[this, ret, doc, id] (const elliptics::data_pointer &content, const elliptics::error_info &err) mutable {
+			ret.complete(std::function<document ()>([&] () {
+				compress::shared_dictionary_t dict;
+				if (!err) {
+					dict = std::make_shared<compress::dictionary>(content.to_string());
+					m_dicts.insert(dict);
+				} else {
+					m_dicts.set_missing(id);
+				}
+
+				unpack_body(doc, dict);
+				return doc;
+			}));
+		});
+
+	return ret;
+}
+
+future<document> storage::async_read_packed(const dnet_raw_id &id, const std::string &name) {
+	future<document> ret;
+
+	async_read_file(id, name).connect(
+		[this, ret] (const elliptics::data_pointer &file, const elliptics::error_info &err) mutable {
+			if (err) {
+				ret.complete(err);
+				return;
+			}
+
+			async_unpack(file).connect(
+				[ret] (const document &doc, const elliptics::error_info &err) mutable {
+					if (err)
+						ret.complete(err);
+					else
+						ret.complete(doc);
+				});
+		});
+
+	return ret;
+}
+
+unsigned int storage::write_dictionary(const std::string &host, const std::string &content) {
+	compress::shared_dictionary_t dict = std::make_shared<compress::dictionary>(content);
+
+	auto ret = write_data(compress::dictionary_key(dict->id()), elliptics::data_pointer::copy(content.data(), content.size()));
+	if (ret.error())
+		elliptics::throw_error(ret.error().code(), "Could not write dictionary %u for host %s: %s",
+				dict->id(), host.c_str(), ret.error().message().c_str());
+
+	// host key is updated only after dictionary itself has been written,
+	// otherwise readers could find a reference to nonexistent dictionary
+	std::string id_str = lexical_cast(dict->id());
+
+	ret = write_data(compress::host_dictionary_key(host), elliptics::data_pointer::copy(id_str.data(), id_str.size()));
+	if (ret.error())
+		elliptics::throw_error(ret.error().code(), "Could not update current dictionary of host %s to %u: %s",
+				host.c_str(), dict->id(), ret.error().message().c_str());
+
+	m_dicts.insert(dict);
+	return dict->id();
+}
+
+compress::shared_dictionary_t storage::load_dictionary(unsigned int id) {
+	auto ret = read_data(compress::dictionary_key(id));
+	if (ret.error())
+		return compress::shared_dictionary_t();
+
+	return std::make_shared<compress::dictionary>(ret.get().to_string());
+}
+
+unsigned int storage::load_host_dictionary(const std::string &host) {
+	auto ret = read_data(compress::host_dictionary_key(host));
+	if (ret.error())
+		return 0;
+
+	return strtoul(ret.get().to_string().c_str(), NULL, 0);
+}
+
+const compress::stats &storage::compression_stats() {
+	return compress::global_stats();
+}
+
+future<elliptics::data_pointer> storage::read_data(const elliptics::key &key) {
+	return async_read_file(transform_key(key), key.to_string());
+}
+
+future<int> storage::write_data(const elliptics::key &key, const elliptics::data_pointer &data) {
+	return m_backend->write(transform_key(key), data);
+}
+
+namespace {
+	struct hedged_read {
+		std::mutex lock;
+		std::condition_variable cond;
+
+		int inflight;
+		bool done;
+		elliptics::data_pointer file;
+		elliptics::error_info error;
+
+		hedged_read() : inflight(0), done(false) {}
+
+		bool finished() const {
+			return done || !inflight;
+		}
+	};
+
+	// latency is charged to the group read has been sent to first: reply from another group
+	// means it has failed and the elapsed time includes the failover, missing objects
+	// are not failures of the group
+	void record_read(group_latency &latency, const std::vector<int> &groups, const timer &t,
+			const read_reply &reply, const elliptics::error_info &err) {
+		if (groups.empty())
+			return;
+
+		if (err) {
+			if (err.code() != -ENOENT)
+				latency.record_failure(groups[0]);
+			return;
+		}
+
+		if (reply.group == -1)
+			return;
+
+		if (reply.group == groups[0])
+			latency.record(reply.group, t.elapsed());
+		else
+			latency.record_failure(groups[0]);
+	}
+
+	void hedged_read_complete(const std::shared_ptr<hedged_read> &state, const std::shared_ptr<group_latency> &latency,
+			const std::vector<int> &groups, const timer &t, const read_reply &reply, const elliptics::error_info &err) {
+		record_read(*latency, groups, t, reply, err);
+
+		std::unique_lock<std::mutex> guard(state->lock);
+		--state->inflight;
+
+		if (!state->done) {
+			if (!err) {
+				state->done = true;
+				state->file = reply.file;
+			} else {
+				state->error = err;
+			}
+		}
+
+		state->cond.notify_all();
+	}
 }
 
-elliptics::async_read_result storage::read_data(const elliptics::key &key) {
-	return create_session().read_data(key, 0, 0);
+elliptics::data_pointer storage::read_file(const dnet_raw_id &id, const std::string &name) {
+	std::vector<int> groups = m_latency->order(m_groups);
+
+	auto state = std::make_shared<hedged_read>();
+	using namespace std::placeholders;
+
+	// the lock is taken after the first request has been sent, since backend may complete it in this thread
+	state->inflight = 1;
+	m_backend->read(id, groups).connect(std::bind(&hedged_read_complete, state, m_latency, groups, timer(), _1, _2));
+
+	std::unique_lock<std::mutex> guard(state->lock);
+
+	if (m_hedged_reads && groups.size() > 1) {
+		long delay = m_latency->p95(groups[0], m_hedge_default_delay);
+
+		if (!state->cond.wait_for(guard, std::chrono::milliseconds(delay),
+					std::bind(&hedged_read::finished, state.get()))) {
+			// the first group is slow, the same request is sent to the rest of groups
+			// starting with the next fastest one, whichever replies first wins
+			m_latency->record_failure(groups[0]);
+			std::rotate(groups.begin(), groups.begin() + 1, groups.end());
+
+			state->inflight++;
+			guard.unlock();
+			m_backend->read(id, groups).connect(std::bind(&hedged_read_complete, state, m_latency, groups, timer(), _1, _2));
+			guard.lock();
+		}
+	}
+
+	state->cond.wait(guard, std::bind(&hedged_read::finished, state.get()));
+
+	if (!state->done)
+		elliptics::throw_error(state->error.code(), "Could not read url %s: %s",
+				name.c_str(), state->error.message().c_str());
+
+	return state->file;
 }
 
 document storage::read_document(const elliptics::key &key) {
-	auto ret = read_data(key);
-	ret.wait();
+	if (!m_hedged_reads)
+		return async_read_document(key).get();
 
-	if (ret.error().code())
-		elliptics::throw_error(ret.error().code(), "Could not read url %s", key.to_string().c_str());
+	dnet_raw_id id = transform_key(key);
+
+	if (m_cache) {
+		std::shared_ptr<const document> cached;
+
+		if (m_cache->get(id, cached))
+			return *cached;
+	}
 
-	const elliptics::data_pointer &result = ret.get_one().file();
-	return unpack_document(result);
+	// document written while it is being read is not cached, see write_object()
+	uint64_t generation = m_cache ? m_cache->generation(id) : 0;
+
+	document doc = unpack(read_file(id, key.to_string()));
+	if (doc.codec == compress::chunked)
+		doc = read_chunks(doc).get();
+
+	if (m_cache)
+		m_cache->insert(id, std::make_shared<const document>(doc), doc.key.size() + doc.data.size(), generation);
+
+	return doc;
+}
+
+document_meta storage::unpack_meta(const elliptics::data_pointer &result) {
+	msgpack::unpacked msg;
+	msgpack::unpack(&msg, result.data<char>(), result.size());
+
+	document_meta meta;
+	msg.get().convert(&meta);
+	return meta;
+}
+
+document_meta storage::read_meta(const elliptics::key &key) {
+	if (!m_hedged_reads)
+		return async_read_meta(key).get();
+
+	// metadata namespace is only applied to string keys, raw IDs would point to the body itself
+	if (!key.by_id()) {
+		try {
+			return unpack_meta(read_file(transform_key(key, meta_namespace()), key.to_string()));
+		} catch (const elliptics::error &e) {
+			if (e.error_code() != -ENOENT)
+				throw;
+		}
+	}
+
+	return document_meta(read_document(key));
+}
+
+future<elliptics::data_pointer> storage::async_read_file(const dnet_raw_id &id, const std::string &name) {
+	future<elliptics::data_pointer> ret;
+	std::shared_ptr<group_latency> latency = m_latency;
+	timer t;
+
+	std::vector<int> groups = m_latency->order(m_groups);
+
+	m_backend->read(id, groups).connect(
+		[ret, latency, groups, name, t] (const read_reply &reply, const elliptics::error_info &err) mutable {
+			record_read(*latency, groups, t, reply, err);
+
+			if (err) {
+				ret.complete(elliptics::create_error(err.code(), "Could not read url %s: %s",
+							name.c_str(), err.message().c_str()));
+				return;
+			}
+
+			ret.complete(reply.file);
+		});
+
+	return ret;
+}
+
+future<document> storage::async_read_document(const elliptics::key &key) {
+	future<document> ret;
+
+	dnet_raw_id id = transform_key(key);
+
+	if (m_cache) {
+		std::shared_ptr<const document> cached;
+
+		if (m_cache->get(id, cached)) {
+			ret.complete(*cached);
+			return ret;
+		}
+	}
+
+	using namespace std::placeholders;
+
+	uint64_t generation = m_cache ? m_cache->generation(id) : 0;
+
+	async_read_packed(id, key.to_string()).connect(
+		[this, ret, id, generation] (const document &doc, const elliptics::error_info &err) mutable {
+			if (err) {
+				ret.complete(err);
+				return;
+			}
+
+			read_chunks(doc).connect(
+				[this, ret, id, generation] (const document &doc, const elliptics::error_info &err) mutable {
+					if (err) {
+						ret.complete(err);
+						return;
+					}
+
+					if (m_cache)
+						m_cache->insert(id, std::make_shared<const document>(doc),
+								doc.key.size() + doc.data.size(), generation);
+
+					ret.complete(doc);
+				});
+		});
+
+	return ret;
+}
+
+struct storage::stream_read {
+	std::string key;
+	dnet_time ts;
+	int version;
+	uint32_t chunks_num;
+	chunk_handler_t handler;
+	future<int> ret;
+};
+
+future<int> storage::read_stream(const elliptics::key &key, const chunk_handler_t &handler) {
+	using namespace std::placeholders;
+
+	auto ctx = std::make_shared<stream_read>();
+	ctx->handler = handler;
+
+	async_read_packed(transform_key(key), key.to_string()).connect(
+		[this, ctx] (const document &doc, const elliptics::error_info &err) {
+			if (err) {
+				ctx->ret.complete(err);
+				return;
+			}
+
+			try {
+				if (doc.codec != compress::chunked) {
+					ctx->handler(doc.data);
+					ctx->ret.complete(0);
+					return;
+				}
+
+				ctx->key = doc.key;
+				ctx->ts = doc.ts;
+				chunk_manifest manifest = unpack_manifest(doc);
+				ctx->version = manifest.version;
+				ctx->chunks_num = manifest.chunks_num;
+			} catch (...) {
+				ctx->ret.complete(exception_error(std::current_exception()));
+				return;
+			}
+
+			if (!ctx->chunks_num) {
+				ctx->ret.complete(0);
+				return;
+			}
+
+			stream_chunks(ctx, 0, async_read_chunk(ctx->key, ctx->ts, ctx->version, 0));
+		});
+
+	return ctx->ret;
+}
+
+void storage::stream_chunks(const std::shared_ptr<stream_read> &ctx, uint32_t n, future<document> chunk) {
+	chunk.connect([this, ctx, n] (const document &doc, const elliptics::error_info &err) {
+		if (err) {
+			ctx->ret.complete(err);
+			return;
+		}
+
+		future<document> next;
+		if (n + 1 < ctx->chunks_num)
+			next = async_read_chunk(ctx->key, ctx->ts, ctx->version, n + 1);
+
+		try {
+			ctx->handler(doc.data);
+		} catch (...) {
+			ctx->ret.complete(exception_error(std::current_exception()));
+			return;
+		}
+
+		if (n + 1 == ctx->chunks_num) {
+			ctx->ret.complete(0);
+			return;
+		}
+
+		stream_chunks(ctx, n + 1, next);
+	});
+}
+
+future<document_meta> storage::async_read_meta(const elliptics::key &key) {
+	future<document_meta> ret;
+
+	auto from_document = [ret] (const document &doc, const elliptics::error_info &err) mutable {
+		if (err)
+			ret.complete(err);
+		else
+			ret.complete(document_meta(doc));
+	};
+
+	// metadata namespace is only applied to string keys, raw IDs would point to the body itself
+	if (key.by_id()) {
+		async_read_document(key).connect(from_document);
+		return ret;
+	}
+
+	async_read_file(transform_key(key, meta_namespace()), key.to_string()).connect(
+		[this, ret, key, from_document] (const elliptics::data_pointer &file, const elliptics::error_info &err) mutable {
+			if (err.code() == -ENOENT) {
+				async_read_document(key).connect(from_document);
+				return;
+			}
+
+			if (err) {
+				ret.complete(err);
+				return;
+			}
+
+			ret.complete(std::bind(&storage::unpack_meta, std::cref(file)));
+		});
+
+	return ret;
+}
+
+void storage::set_token_cache_size(size_t size) {
+	if (size)
+		m_tokens.reset(new token_cache_t(size));
+	else
+		m_tokens.reset();
+}
+
+dnet_raw_id storage::transform_token(const std::string &token) {
+	dnet_raw_id id;
+
+	if (m_tokens && m_tokens->get(token, id))
+		return id;
+
+	id = m_backend->transform(m_namespace, token);
+
+	if (m_tokens)
+		m_tokens->insert(token, id, token.size() + sizeof(dnet_raw_id));
+
+	return id;
 }
 
 std::vector<dnet_raw_id> storage::transform_tokens(const std::vector<std::string> &tokens) {
-	elliptics::session s = create_session();
 	std::vector<dnet_raw_id> results;
-
 	results.reserve(tokens.size());
-	dnet_raw_id id;
 
-	for (auto t : tokens) {
-		s.transform(t, id);
-		results.emplace_back(id);
-	}
+	for (auto & t : tokens)
+		results.emplace_back(transform_token(t));
 
 	return std::move(results);
 }
 
+std::vector<elliptics::index_entry> storage::index_entries(const std::string &key,
+		const std::vector<std::string> &indexes, const std::vector<elliptics::data_pointer> &datas) {
+	if (indexes.size() != datas.size())
+		elliptics::throw_error(-EINVAL, "Could not update indexes of %s: indexes: %zd, datas: %zd",
+				key.c_str(), indexes.size(), datas.size());
+
+	std::vector<elliptics::index_entry> entries;
+	entries.reserve(indexes.size());
+
+	for (size_t i = 0; i < indexes.size(); ++i) {
+		elliptics::index_entry entry;
+		entry.index = transform_token(indexes[i]);
+		entry.data = datas[i];
+
+		entries.emplace_back(entry);
+	}
+
+	return entries;
+}
+
+future<int> storage::set_indexes(const elliptics::key &key,
+		const std::vector<std::string> &indexes, const std::vector<elliptics::data_pointer> &datas) {
+	return m_backend->set_indexes(transform_key(key), index_entries(key.to_string(), indexes, datas));
+}
+
+future<int> storage::set_indexes(const std::vector<document_indexes> &docs) {
+	std::vector<object_indexes> objects;
+	objects.reserve(docs.size());
+
+	for (auto & d : docs) {
+		object_indexes obj;
+		obj.id = transform_key(d.key);
+		obj.entries = index_entries(d.key, d.indexes, d.datas);
+
+		objects.emplace_back(std::move(obj));
+	}
+
+	return m_backend->set_indexes_batch(objects);
+}
+
+wookie::backend &storage::get_backend() {
+	return *m_backend;
+}
+
 elliptics::session storage::create_session(void) {
-	return m_sess.clone();
+	if (!m_elliptics)
+		elliptics::throw_error(-ENOTSUP, "Storage is not backed by elliptics, there is no session to create");
+
+	elliptics::session s = m_elliptics->create_session();
+	s.set_namespace(m_namespace.c_str(), m_namespace.size());
+	return s;
 }
 
 elliptics::node storage::get_node()
 {
-	return m_sess.get_node();
+	if (!m_elliptics)
+		elliptics::throw_error(-ENOTSUP, "Storage is not backed by elliptics, there is no node");
+
+	return m_elliptics->get_node();
 }
 
 }}
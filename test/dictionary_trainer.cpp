@@ -0,0 +1,115 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "wookie/storage.hpp"
+#include "wookie/engine.hpp"
+#include "wookie/document.hpp"
+#include "wookie/dictionary.hpp"
+
+#include <boost/program_options.hpp>
+
+#include <algorithm>
+#include <iostream>
+
+using namespace ioremap;
+
+int main(int argc, char *argv[])
+{
+	using namespace boost::program_options;
+
+	std::string host;
+	size_t samples_num;
+	size_t dict_size;
+	variables_map vm;
+
+	wookie::engine engine;
+
+	engine.add_options("Dictionary trainer options")
+		("host", value<std::string>(&host), "Train zstd dictionary over documents of this host "
+		 	"(documents are listed using ${host}.collection base index)")
+		("samples", value<size_t>(&samples_num)->default_value(1000), "Maximum number of sampled documents")
+		("dict-size", value<size_t>(&dict_size)->default_value(112640), "Maximum dictionary size")
+	;
+
+	try {
+		int err = engine.parse_command_line(argc, argv, vm);
+		if (err < 0)
+			return err;
+	} catch (const std::exception &e) {
+		std::cerr << "Command line parsing failed: " << e.what() << std::endl;
+		engine.show_help_message(std::cerr);
+		return -1;
+	}
+
+	if (host.size() == 0) {
+		std::cerr << "You must provide host" << std::endl;
+		engine.show_help_message(std::cerr);
+		return -1;
+	}
+
+	try {
+		wookie::storage *st = engine.get_storage();
+
+		std::vector<std::string> index;
+		index.push_back(host + ".collection");
+
+		std::vector<std::string> urls;
+		for (auto r : st->find(index)) {
+			for (auto idx : r.indexes) {
+				wookie::document doc = st->unpack(idx.data);
+				urls.push_back(doc.key);
+			}
+		}
+
+		if (urls.size() > samples_num) {
+			std::random_shuffle(urls.begin(), urls.end());
+			urls.resize(samples_num);
+		}
+
+		std::vector<std::string> samples;
+		samples.reserve(urls.size());
+
+		elliptics::async_read_result bres = st->create_session().bulk_read(urls);
+		for (const auto &b : bres) {
+			try {
+				wookie::document doc = st->unpack(b.file());
+				if (doc.data.size())
+					samples.emplace_back(std::move(doc.data));
+			} catch (const std::exception &e) {
+				std::cerr << "Skipping sample: " << e.what() << std::endl;
+			}
+		}
+
+		std::cout << "Training dictionary: host: " << host <<
+			", documents: " << urls.size() <<
+			", samples: " << samples.size() <<
+			std::endl;
+
+		std::string content = wookie::compress::dictionary::train(samples, dict_size);
+		unsigned int id = st->write_dictionary(host, content);
+
+		std::cout << "Dictionary has been stored: host: " << host <<
+			", id: " << id <<
+			", size: " << content.size() <<
+			", key: " << wookie::compress::dictionary_key(id) <<
+			std::endl;
+	} catch (const std::exception &e) {
+		std::cerr << "Caught exception: " << e.what() << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
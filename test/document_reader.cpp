@@ -32,12 +32,14 @@ int main(int argc, char *argv[])
 	std::string doc_out;
 	std::string id;
 	bool iterate = false;
+	bool meta = false;
 	variables_map vm;
 
 	wookie::engine engine;
 
 	engine.add_options("Document reader options")
 		("iterate", "Iterate over documents in given collection or just download")
+		("meta", "Only read document metadata (timestamp, size, hash, validators), not the whole body")
 		("url", value<std::string>(&url), "Fetch object from storage by URL")
 		("id", value<std::string>(&id), "Fetch object from storage by ID")
 		("document-output", value<std::string>(&doc_out), "Put object into this file")
@@ -54,6 +56,7 @@ int main(int argc, char *argv[])
 	}
 
 	iterate = vm.count("iterate") != 0;
+	meta = vm.count("meta") != 0;
 
 	if (url.size() == 0 && id.size() == 0) {
 		std::cerr << "You must provide either URL or ID" << std::endl;
@@ -72,7 +75,10 @@ int main(int argc, char *argv[])
 	}
 
 	try {
-		if (!iterate) {
+		if (!iterate && meta) {
+			wookie::document_meta m = engine.get_storage()->read_meta(k);
+			std::cout << m << std::endl;
+		} else if (!iterate) {
 			wookie::document doc = engine.get_storage()->read_document(k);
 			std::cout << doc << std::endl;
 
@@ -93,8 +99,18 @@ int main(int argc, char *argv[])
 
 			for (auto r : results) {
 				for (auto idx : r.indexes) {
-					wookie::document doc = wookie::storage::unpack_document(idx.data);
-					std::cout << doc << std::endl;
+					wookie::document doc = engine.get_storage()->unpack(idx.data);
+					std::cout << doc;
+
+					if (meta) {
+						try {
+							std::cout << ", meta: " << engine.get_storage()->read_meta(doc.key);
+						} catch (const std::exception &e) {
+							std::cout << ", meta: " << e.what();
+						}
+					}
+
+					std::cout << std::endl;
 				}
 			}
 		}
@@ -0,0 +1,144 @@
+/*
+ * Copyright 2013+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "wookie/intersect.hpp"
+
+#include <boost/program_options.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <set>
+
+using namespace ioremap::wookie;
+
+static std::vector<uint32_t> generate(std::mt19937 &gen, size_t size, uint32_t universe)
+{
+	std::uniform_int_distribution<uint32_t> dist(0, universe - 1);
+	std::set<uint32_t> values;
+
+	while (values.size() < size)
+		values.insert(dist(gen));
+
+	return std::vector<uint32_t>(values.begin(), values.end());
+}
+
+typedef std::function<size_t (const uint32_t *, size_t, const uint32_t *, size_t, uint32_t *)> kernel_t;
+
+int main(int argc, char *argv[])
+{
+	namespace bpo = boost::program_options;
+
+	bpo::options_description generic("Posting list intersection benchmark options");
+
+	size_t small_size, large_size, lists_num, iterations;
+	uint32_t universe;
+	generic.add_options()
+		("help", "This help message")
+		("small", bpo::value<size_t>(&small_size)->default_value(10000), "Size of the shortest list")
+		("large", bpo::value<size_t>(&large_size)->default_value(100000), "Size of the other lists")
+		("lists", bpo::value<size_t>(&lists_num)->default_value(2), "Number of lists for k-way intersection")
+		("universe", bpo::value<uint32_t>(&universe)->default_value(1000000), "Document numbers are taken from [0, universe)")
+		("iterations", bpo::value<size_t>(&iterations)->default_value(1000), "Number of runs of every kernel")
+		;
+
+	bpo::variables_map vm;
+
+	try {
+		bpo::store(bpo::command_line_parser(argc, argv).options(generic).run(), vm);
+
+		if (vm.count("help")) {
+			std::cout << generic << std::endl;
+			return 0;
+		}
+
+		bpo::notify(vm);
+	} catch (const std::exception &e) {
+		std::cerr << "Invalid options: " << e.what() << "\n" << generic << std::endl;
+		return -1;
+	}
+
+	if (small_size > universe || large_size > universe || lists_num < 2) {
+		std::cerr << "Lists must fit into universe and there must be at least 2 of them\n" << generic << std::endl;
+		return -1;
+	}
+
+	std::mt19937 gen(0);
+
+	std::vector<std::vector<uint32_t>> lists;
+	lists.emplace_back(generate(gen, small_size, universe));
+	for (size_t i = 1; i < lists_num; ++i)
+		lists.emplace_back(generate(gen, large_size, universe));
+
+	const std::vector<uint32_t> &a = lists[0];
+	const std::vector<uint32_t> &b = lists[1];
+
+	std::cout << "sse4.2: " << intersect::has_sse() << ", avx2: " << intersect::has_avx2() << std::endl;
+
+	std::vector<uint32_t> expected(a.size());
+	expected.resize(intersect::scalar(a.data(), a.size(), b.data(), b.size(), expected.data()));
+
+	std::vector<std::pair<std::string, kernel_t>> kernels = {
+		{ "scalar", intersect::scalar },
+		{ "galloping", intersect::galloping },
+		{ "sse", intersect::sse },
+		{ "avx2", intersect::avx2 },
+		{ "pair", intersect::pair },
+	};
+
+	std::vector<uint32_t> out(a.size() + intersect::padding);
+
+	for (auto & k : kernels) {
+		size_t size = 0;
+
+		auto start = std::chrono::high_resolution_clock::now();
+		for (size_t i = 0; i < iterations; ++i)
+			size = k.second(a.data(), a.size(), b.data(), b.size(), out.data());
+		auto end = std::chrono::high_resolution_clock::now();
+
+		bool ok = size == expected.size() && std::equal(expected.begin(), expected.end(), out.begin());
+
+		double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / (double)iterations;
+		std::cout << k.first << ": " << a.size() << " x " << b.size() << " -> " << size <<
+			": " << ns / 1000.0 << " usecs, " <<
+			(a.size() + b.size()) / ns * 1000.0 << " M elements/s" <<
+			(ok ? "" : ", RESULT MISMATCH") << std::endl;
+
+		if (!ok)
+			return -1;
+	}
+
+	if (lists.size() > 2) {
+		std::vector<const std::vector<uint32_t> *> ptrs;
+		for (auto & l : lists)
+			ptrs.push_back(&l);
+
+		std::vector<uint32_t> result;
+
+		auto start = std::chrono::high_resolution_clock::now();
+		for (size_t i = 0; i < iterations; ++i)
+			intersect::all(ptrs, result);
+		auto end = std::chrono::high_resolution_clock::now();
+
+		double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / (double)iterations;
+		std::cout << "all: " << lists.size() << " lists -> " << result.size() << ": " <<
+			ns / 1000.0 << " usecs" << std::endl;
+	}
+
+	return 0;
+}
@@ -83,7 +83,7 @@ int main(int argc, char *argv[])
 		std::vector<std::string> urls;
 		for (auto r : results) {
 			for (auto idx : r.indexes) {
-				wookie::document doc = wookie::storage::unpack_document(idx.data);
+				wookie::document doc = engine.get_storage()->unpack(idx.data);
 				urls.push_back(doc.key);
 			}
 		}
@@ -92,7 +92,7 @@ int main(int argc, char *argv[])
 
 		if (!msgin.size() || !gram.size()) {
 			for (const auto &b : bres) {
-				wookie::document doc = wookie::storage::unpack_document(b.file());
+				wookie::document doc = engine.get_storage()->unpack(b.file());
 				std::cout << doc << std::endl;
 			}
 
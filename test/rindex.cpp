@@ -15,6 +15,7 @@
  */
 
 #include "wookie/parser.hpp"
+#include "wookie/anchor_index.hpp"
 #include "wookie/storage.hpp"
 #include "wookie/operators.hpp"
 #include "wookie/url.hpp"
@@ -22,38 +23,90 @@
 #include "wookie/engine.hpp"
 #include "wookie/index_data.hpp"
 #include "wookie/basic_elliptics_splitter.hpp"
+#include "wookie/delta_index.hpp"
+#include "wookie/fields.hpp"
+#include "wookie/lexical_cast.hpp"
+#include "wookie/link_graph.hpp"
+#include "wookie/local_index.hpp"
+#include "wookie/query.hpp"
+#include "wookie/static_rank.hpp"
 
 #include <boost/program_options.hpp>
 
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+#include <unistd.h>
+
 #include <rift/jsonvalue.hpp>
 #include <rift/index.hpp>
 
 using namespace ioremap;
 using namespace ioremap::wookie;
 
+// documents indexed in this run, links found later change their anchor field
+struct indexed_docs
+{
+	std::mutex lock;
+	std::unordered_map<std::string, delta_document> docs;
+};
+
 struct rindex_processor
 {
 	wookie::engine &engine;
 	std::string base;
 	bool fallback;
+	std::shared_ptr<delta_index> delta;
+	std::shared_ptr<anchor_index> anchors;
+	std::shared_ptr<indexed_docs> indexed;
 
 	basic_elliptics_splitter m_splitter;
 
-	rindex_processor(wookie::engine &engine, const std::string &base, bool fallback)
-		: engine(engine), base(base), fallback(fallback) {
+	rindex_processor(wookie::engine &engine, const std::string &base, bool fallback,
+			const std::shared_ptr<delta_index> &delta, const std::shared_ptr<anchor_index> &anchors,
+			const std::shared_ptr<indexed_docs> &indexed)
+		: engine(engine), base(base), fallback(fallback), delta(delta), anchors(anchors), indexed(indexed) {
 	}
 
-	void process(const std::string &url, const std::string &content,
-			const dnet_time &ts, const std::string &base_index) {
-		std::vector<std::string> ids;
-		std::vector<elliptics::data_pointer> objs;
+	// indexes again documents whose anchors have changed, only anchor field is rebuilt,
+	// targets which are not indexed yet get their anchors when they are downloaded
+	static void update_anchors(basic_elliptics_splitter &splitter, delta_index &delta,
+			anchor_index &anchors, indexed_docs &indexed) {
+		for (auto & target : anchors.flush()) {
+			delta_document d;
+			{
+				std::unique_lock<std::mutex> guard(indexed.lock);
+				auto it = indexed.docs.find(target);
+				if (it == indexed.docs.end())
+					continue;
+
+				splitter.replace_anchors(it->second.pos, anchors.texts(target));
+				dnet_current_time(&it->second.ts);
+				d = it->second;
+			}
 
-		m_splitter.prepare_indexes(url, content, ts, base_index, ids, objs);
+			std::cout << "Rindex anchors update ... url: " << target << std::endl;
+			delta.add(d);
+		}
+	}
 
-		if (ids.size()) {
-			std::cout << "Rindex update ... url: " << url << ": indexes: " << ids.size() << std::endl;
-			engine.get_storage()->create_session().set_indexes(url, ids, objs).wait();
-			std::cout << "Rindex update finished" << std::endl;
+	void process(const std::string &url, const std::string &content, const fields::document_fields &fields,
+			const dnet_time &ts, const std::string &base_index) {
+		// indexes are written by delta index in batches
+		delta_document d;
+		d.id = engine.get_storage()->transform_key(url);
+		d.key = url;
+		d.ts = ts;
+		d.pos = m_splitter.positions(fields);
+		d.collection = base_index;
+
+		std::cout << "Rindex update ... url: " << url << ": indexes: " << d.pos.size() + 1 << std::endl;
+		delta->add(d);
+
+		{
+			std::unique_lock<std::mutex> guard(indexed->lock);
+			indexed->docs[url] = d;
 		}
 
 		document doc;
@@ -62,7 +115,7 @@ struct rindex_processor
 		doc.key = url;
 		doc.data = content;
 
-		elliptics::data_pointer ptr = storage::pack_document(doc);
+		elliptics::data_pointer ptr = engine.get_storage()->pack(doc);
 
 		elliptics::session sess = engine.get_storage()->create_session();
 
@@ -82,15 +135,28 @@ struct rindex_processor
 		if (!fallback)
 			p.feed_text(data);
 
+		const std::string url = reply.url().to_string();
+
+		fields::document_fields fields;
+		fields.text[fields::body].push_back(p.text(" "));
+		fields.text[fields::title] = p.title();
+		fields.text[fields::heading] = p.headings();
+		fields.text[fields::url].push_back(fields::url_text(url));
+		// pages are usually linked before they are downloaded
+		fields.text[fields::anchor] = anchors->texts(url);
+
 		try {
-			process(reply.url().to_string(), p.text(" "), ts, base + ".collection");
+			process(url, fields.text[fields::body][0], fields, ts, base + ".collection");
+			update_anchors(m_splitter, *delta, *anchors, *indexed);
 		} catch (const std::exception &e) {
-			std::cerr << reply.url().to_string() << ": index processing exception: " << e.what() << std::endl;
+			std::cerr << url << ": index processing exception: " << e.what() << std::endl;
 			engine.download(reply.request().url());
 		}
 	}
 
-	static process_functor create(wookie::engine &engine, const std::string &url, bool fallback) {
+	static process_functor create(wookie::engine &engine, const std::string &url, bool fallback,
+			const std::shared_ptr<delta_index> &delta, const std::shared_ptr<anchor_index> &anchors,
+			const std::shared_ptr<indexed_docs> &indexed) {
 		ioremap::swarm::url base_url = url;
 		if (!base_url.is_valid())
 			ioremap::elliptics::throw_error(-EINVAL, "Invalid URL '%s': set-base failed", url.c_str());
@@ -100,13 +166,478 @@ struct rindex_processor
 			ioremap::elliptics::throw_error(-EINVAL, "Invalid URL '%s': base is empty", url.c_str());
 
 		return std::bind(&rindex_processor::process_text,
-			std::make_shared<rindex_processor>(engine, base, fallback),
+			std::make_shared<rindex_processor>(engine, base, fallback, delta, anchors, indexed),
 			std::placeholders::_1,
 			std::placeholders::_2,
 			std::placeholders::_3);
 	}
 };
 
+// Every on-disk format is written into a directory and read back.
+class format_checker {
+	public:
+		format_checker(const std::string &dir) : m_dir(dir), m_failed(0) {
+			for (int i = 0; i < 300; ++i) {
+				doc d;
+				d.key = "http://check/" + lexical_cast(i);
+				memset(&d.id, 0, sizeof(d.id));
+				memcpy(d.id.id, &i, sizeof(i));
+				d.ts.tsec = 1000 + i;
+				d.ts.tnsec = i;
+				d.prior = i % 7;
+
+				// "common" is in every document, so its postings take several blocks
+				d.pos["common"].push_back(0);
+				for (int j = 1; j < 5 + i % 11; ++j)
+					d.pos["t" + lexical_cast(i * j % 17)].push_back(j);
+
+				m_docs.emplace_back(d);
+			}
+		}
+
+		int run() {
+			for (uint32_t version = 1; version <= segment_version; ++version)
+				check_segment(version);
+
+			check_index_data();
+			check_queries();
+			check_stats();
+			check_anchors();
+			check_links();
+
+			return m_failed ? -1 : 0;
+		}
+
+	private:
+		struct doc {
+			std::string key;
+			dnet_raw_id id;
+			dnet_time ts;
+			mpos_t pos;
+			float prior;
+		};
+
+		std::string m_dir;
+		std::vector<doc> m_docs;
+		int m_failed;
+
+		void check(const std::string &name, bool ok) {
+			std::cout << name << ": " << (ok ? "ok" : "MISMATCH") << std::endl;
+			if (!ok)
+				++m_failed;
+		}
+
+		std::string path(const std::string &name) const {
+			return m_dir + "/" + name;
+		}
+
+		void check_segment(uint32_t version) {
+			segment_writer writer;
+			for (auto & d : m_docs)
+				writer.add(d.id, d.key, d.ts, d.pos);
+			writer.set_priors([] (const segment_document &sd) -> float {
+					int i;
+					memcpy(&i, sd.id.id, sizeof(i));
+					return i % 7;
+				});
+
+			std::string name = "segment v" + lexical_cast(version);
+			writer.write(path("check.seg"), version);
+			segment seg(path("check.seg"));
+
+			// documents are renumbered by priors, so they are matched by keys
+			std::map<std::string, uint32_t> numbers;
+			bool docs_ok = seg.docs_num() == m_docs.size();
+			for (uint32_t i = 0; docs_ok && i < seg.docs_num(); ++i) {
+				segment_document sd = seg.document(i);
+				numbers[sd.key] = i;
+
+				int n;
+				memcpy(&n, sd.id.id, sizeof(n));
+				docs_ok = n >= 0 && n < (int)m_docs.size() && m_docs[n].key == sd.key &&
+					m_docs[n].ts.tsec == sd.ts.tsec && m_docs[n].ts.tnsec == sd.ts.tnsec && seg.contains(sd.key);
+			}
+			check(name + " documents", docs_ok && numbers.size() == m_docs.size());
+			if (!docs_ok)
+				return;
+
+			std::vector<mpos_t> pos(seg.docs_num());
+			std::vector<segment::term_info> infos;
+			bool terms_ok = true;
+
+			seg.for_each_term([&] (const std::string &term, const segment::term_info &info) {
+				segment::term_info found;
+				terms_ok = terms_ok && seg.lookup(term, found) && found.df == info.df &&
+					found.postings_size == info.postings_size && found.positions_size == info.positions_size;
+				infos.push_back(info);
+
+				std::vector<uint32_t> docs, tfs;
+				seg.postings(info, docs, tfs);
+
+				size_t n = 0;
+				uint32_t max_tf = 0;
+				seg.for_each_posting(info, [&] (uint32_t d, const std::vector<int> &p) {
+					terms_ok = terms_ok && n < docs.size() && docs[n] == d && tfs[n] == p.size() &&
+						seg.positions(info, d) == p;
+					max_tf = std::max<uint32_t>(max_tf, p.size());
+					pos[d][term] = p;
+					++n;
+				});
+				terms_ok = terms_ok && n == info.df && info.max_tf == (version < 2 ? 0 : max_tf);
+
+				// the range splits blocks of "common" in the middle
+				std::vector<uint32_t> range_docs, range_tfs;
+				seg.postings(info, 100, 200, range_docs, range_tfs);
+				std::vector<uint32_t> expected;
+				std::copy_if(docs.begin(), docs.end(), std::back_inserter(expected),
+						[] (uint32_t d) { return d >= 100 && d < 200; });
+				terms_ok = terms_ok && range_docs == expected;
+			});
+			seg.prefetch(infos);
+
+			for (auto & d : m_docs) {
+				uint32_t n = numbers[d.key];
+
+				uint32_t length = 0;
+				for (auto & p : d.pos)
+					length += p.second.size();
+
+				terms_ok = terms_ok && pos[n] == d.pos && seg.length(n) == (version < 2 ? 0 : length);
+			}
+			check(name + " terms", terms_ok && seg.terms_num() == infos.size());
+
+			bool priors_ok = seg.impact_ordered() == (version >= 3);
+			float prev = m_docs.front().prior;
+			for (uint32_t i = 0; priors_ok && i < seg.docs_num(); ++i) {
+				int n;
+				memcpy(&n, seg.document(i).id.id, sizeof(n));
+
+				// documents are ordered by priors even if they are not stored
+				priors_ok = seg.prior(i) == (version >= 3 ? m_docs[n].prior : 0) && (i == 0 || m_docs[n].prior <= prev);
+				prev = m_docs[n].prior;
+			}
+			check(name + " priors", priors_ok);
+
+			// damaged copies are rejected when they are opened, not when they are read
+			std::ifstream in(path("check.seg").c_str(), std::ios::binary);
+			std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+			const segment_header header = *(const segment_header *)data.data();
+
+			auto rejected = [&] (const std::string &bad) {
+				std::ofstream out(path("check.bad.seg").c_str(), std::ios::binary | std::ios::trunc);
+				out.write(bad.data(), bad.size());
+				out.close();
+
+				try {
+					segment damaged(path("check.bad.seg"));
+					return false;
+				} catch (const elliptics::error &e) {
+					return e.error_code() == -EPROTO;
+				}
+			};
+			auto patched = [&] (uint64_t offset, uint64_t value) {
+				std::string bad = data;
+				memcpy(&bad[offset], &value, sizeof(value));
+				return bad;
+			};
+
+			bool damaged_ok = rejected(data.substr(0, offsetof(segment_header, flags) - 1)) &&
+				rejected(data.substr(0, data.size() / 2)) &&
+				rejected(patched(offsetof(segment_header, dict_offset), header.size + 1)) &&
+				rejected(patched(header.docs_offset + offsetof(segment_doc, key_offset), header.size)) &&
+				rejected(patched(header.dict_index_offset + offsetof(segment_dict_index, term_offset), header.size));
+			if (version >= 3)
+				damaged_ok = damaged_ok && rejected(data.substr(0, sizeof(segment_header) - 1));
+			check(name + " damaged", damaged_ok);
+
+			unlink(path("check.bad.seg").c_str());
+			unlink(path("check.seg").c_str());
+		}
+
+		void check_index_data() {
+			const doc &d = m_docs[42];
+			std::vector<int> pos = d.pos.begin()->second;
+
+			index_data data(d.ts, std::string(), pos);
+			index_data read(data.convert());
+			check("index_data v3", read.pos == pos && read.key.empty() &&
+					read.ts.tsec == d.ts.tsec && read.ts.tnsec == d.ts.tnsec);
+
+			// version 2 records are written by older indexers only
+			msgpack::sbuffer buffer;
+			msgpack::packer<msgpack::sbuffer> packer(&buffer);
+			packer.pack_array(4);
+			packer.pack((int)index_data::version_with_key);
+			packer.pack(d.ts);
+			packer.pack(pos);
+			packer.pack(d.key);
+
+			index_data old(elliptics::data_pointer::copy(buffer.data(), buffer.size()));
+			check("index_data v2", old.pos == pos && old.key == d.key && old.ts.tsec == d.ts.tsec);
+		}
+
+		// query plan over the checked documents, numbered as in m_docs
+		class docs_source : public query::source {
+			public:
+				docs_source(const std::vector<doc> &docs) : m_docs(docs) {}
+
+				virtual size_t df(const std::string &token) {
+					std::vector<uint32_t> docs;
+					postings(token, docs);
+					return docs.size();
+				}
+
+				virtual void postings(const std::string &token, std::vector<uint32_t> &docs) {
+					docs.clear();
+					for (size_t i = 0; i < m_docs.size(); ++i) {
+						if (m_docs[i].pos.count(token))
+							docs.push_back(i);
+					}
+				}
+
+				virtual std::vector<int> positions(const std::string &token, uint32_t doc) {
+					auto it = m_docs[doc].pos.find(token);
+					return it == m_docs[doc].pos.end() ? std::vector<int>() : it->second;
+				}
+
+			private:
+				const std::vector<doc> &m_docs;
+		};
+
+		static bool has_position(const doc &d, const std::string &token, int first, int last) {
+			auto it = d.pos.find(token);
+			if (it == d.pos.end())
+				return false;
+
+			for (int p : it->second) {
+				if (p >= first && p <= last)
+					return true;
+			}
+			return false;
+		}
+
+		// straightforward evaluation of @q over a single document
+		static bool matches(const query::node &q, const doc &d) {
+			switch (q.type) {
+			case query::node::term:
+				return d.pos.count(q.tokens[0]) != 0;
+			case query::node::phrase: {
+				auto it = d.pos.find(q.tokens[0]);
+				if (it == d.pos.end())
+					return false;
+
+				for (int p : it->second) {
+					bool ok = true;
+					for (size_t i = 1; ok && i < q.tokens.size(); ++i)
+						ok = has_position(d, q.tokens[i], p + i, p + i);
+					if (ok)
+						return true;
+				}
+				return false;
+			}
+			case query::node::near:
+				// the shortest window starts at one of the positions
+				for (auto & t : q.tokens) {
+					auto it = d.pos.find(t);
+					if (it == d.pos.end())
+						return false;
+
+					for (int p : it->second) {
+						bool ok = true;
+						for (size_t i = 0; ok && i < q.tokens.size(); ++i)
+							ok = has_position(d, q.tokens[i], p, p + q.distance);
+						if (ok)
+							return true;
+					}
+				}
+				return false;
+			case query::node::op_and:
+				for (auto & c : q.children) {
+					if (!matches(c, d))
+						return false;
+				}
+				return true;
+			case query::node::op_or:
+				for (auto & c : q.children) {
+					if (matches(c, d))
+						return true;
+				}
+				return false;
+			case query::node::op_not:
+				return !matches(q.children[0], d);
+			}
+
+			return false;
+		}
+
+		static query::node make(query::node::node_type type, const std::vector<std::string> &tokens,
+				int distance = 0) {
+			query::node n(type);
+			n.tokens = tokens;
+			n.distance = distance;
+			return n;
+		}
+
+		static query::node make(query::node::node_type type, const std::vector<query::node> &children) {
+			query::node n(type);
+			n.children = children;
+			return n;
+		}
+
+		void check_queries() {
+			typedef query::node node;
+			typedef std::vector<std::string> tokens;
+
+			node common = make(node::term, tokens(1, "common"));
+			node t1 = make(node::term, tokens(1, "t1"));
+			node t2 = make(node::term, tokens(1, "t2"));
+			node t5 = make(node::term, tokens(1, "t5"));
+			node absent = make(node::term, tokens(1, "absent"));
+
+			std::vector<std::pair<std::string, node>> queries;
+			queries.emplace_back("not absent", make(node::op_and, { common, make(node::op_not, { absent }) }));
+			queries.emplace_back("not absent phrase", make(node::op_and,
+					{ common, make(node::op_not, { make(node::phrase, tokens({ "t1", "absent" })) }) }));
+			queries.emplace_back("not present", make(node::op_and, { common, make(node::op_not, { t5 }) }));
+			queries.emplace_back("phrase", make(node::phrase, tokens({ "common", "t3" })));
+			queries.emplace_back("near", make(node::near, tokens({ "t1", "t2" }), 3));
+			queries.emplace_back("or under and", make(node::op_and, {
+					common, make(node::op_or, { t1, t2, absent }), make(node::op_not, { t5 }) }));
+			queries.emplace_back("not or", make(node::op_and, {
+					t1, make(node::op_not, { make(node::op_or, { t2, absent }) }) }));
+
+			docs_source src(m_docs);
+			for (auto & q : queries) {
+				std::vector<uint32_t> docs;
+				query::plan plan(q.second, src);
+				plan.execute(docs);
+
+				std::vector<uint32_t> expected;
+				for (size_t i = 0; i < m_docs.size(); ++i) {
+					if (matches(q.second, m_docs[i]))
+						expected.push_back(i);
+				}
+
+				check("query " + q.first + ": " + query::to_string(q.second), docs == expected);
+			}
+		}
+
+		void check_stats() {
+			collection_stats stats;
+			for (auto & d : m_docs)
+				stats.add(d.id, d.pos);
+			stats.save(path("check.stats"));
+
+			collection_stats read;
+			read.load(path("check.stats"));
+
+			// reindexing loaded documents replaces their previous versions
+			for (auto & d : m_docs)
+				read.add(d.id, d.pos);
+
+			bool ok = read.docs_num() == stats.docs_num() && read.tokens_num() == stats.tokens_num();
+			for (auto & d : m_docs) {
+				ok = ok && read.length(d.id) == stats.length(d.id);
+				for (auto & p : d.pos)
+					ok = ok && read.df(p.first) == stats.df(p.first);
+			}
+			check("collection stats", ok);
+
+			unlink(path("check.stats").c_str());
+		}
+
+		void check_anchors() {
+			anchor_index anchors;
+			for (size_t i = 0; i < m_docs.size(); ++i)
+				anchors.add(m_docs[i].key, m_docs[(i * 7) % 11].key, "anchor " + lexical_cast(i % 3));
+			anchors.save(path("check.anchors"));
+
+			anchor_index read;
+			read.load(path("check.anchors"));
+
+			bool ok = read.targets_num() == anchors.targets_num();
+			for (auto & d : m_docs) {
+				auto expected = anchors.anchors(d.key);
+				auto found = read.anchors(d.key);
+
+				ok = ok && expected.size() == found.size();
+				for (size_t i = 0; ok && i < found.size(); ++i)
+					ok = found[i].text == expected[i].text && found[i].sources == expected[i].sources;
+			}
+			check("anchors", ok);
+
+			unlink(path("check.anchors").c_str());
+
+			// merges made by add() and anchors() are reported by the next flush() once
+			ok = anchors.flush().size() == anchors.targets_num() && anchors.flush().empty();
+			anchors.add("fresh source", m_docs[0].key, "fresh anchor");
+			auto changed = anchors.flush();
+			ok = ok && changed.size() == 1 && changed[0] == m_docs[0].key;
+			check("anchor changes", ok);
+
+			// rebuilt anchor field is the same as if all fields were split again
+			basic_elliptics_splitter splitter;
+			fields::document_fields doc;
+			doc.text[fields::body].push_back("body text of the page");
+			doc.text[fields::title].push_back("page title");
+			doc.text[fields::anchor].push_back("old anchor");
+
+			mpos_t pos = splitter.positions(doc);
+			doc.text[fields::anchor] = anchors.texts(m_docs[0].key);
+			splitter.replace_anchors(pos, doc.text[fields::anchor]);
+			check("anchor field update", pos == splitter.positions(doc));
+		}
+
+		void check_links() {
+			doc_registry registry;
+			link_graph graph;
+			std::vector<float> ranks;
+
+			for (size_t i = 0; i < m_docs.size(); ++i) {
+				uint32_t source = registry.assign(m_docs[i].id, m_docs[i].key);
+				for (size_t j = 1; j < 1 + i % 5; ++j)
+					graph.add_link(source, registry.assign(m_docs[(i * j) % m_docs.size()].id));
+
+				ranks.push_back(m_docs[i].prior);
+			}
+
+			registry.save(path("check.registry"));
+			graph.save(path("check.links"));
+			static_rank(ranks).save(path("check.rank"));
+
+			doc_registry read_registry;
+			read_registry.load(path("check.registry"));
+
+			bool ok = read_registry.size() == registry.size();
+			for (uint32_t i = 0; ok && i < registry.size(); ++i) {
+				ok = read_registry.lookup(registry.id(i)) == i && read_registry.key(i) == registry.key(i);
+			}
+			check("document registry", ok);
+
+			link_graph read_graph;
+			read_graph.load(path("check.links"));
+			mapped_link_graph mapped(path("check.links"));
+
+			ok = read_graph.nodes_num() == graph.nodes_num() && read_graph.links_num() == graph.links_num() &&
+				mapped.nodes_num() == graph.nodes_num() && mapped.links_num() == graph.links_num();
+			for (uint32_t i = 0; ok && i < graph.nodes_num(); ++i) {
+				std::vector<uint32_t> links = graph.links(i), mapped_links;
+				mapped.links(i, mapped_links);
+
+				ok = read_graph.links(i) == links && mapped_links == links && mapped.out_degree(i) == links.size();
+			}
+			check("link graph", ok);
+
+			static_rank read_ranks;
+			read_ranks.load(path("check.rank"));
+			check("static rank", read_ranks.values() == ranks);
+
+			unlink(path("check.registry").c_str());
+			unlink(path("check.links").c_str());
+			unlink(path("check.rank").c_str());
+		}
+};
+
 url_filter_functor create_words_filter(const std::vector<std::string> &forbidden_words)
 {
 	struct filter
@@ -138,14 +669,38 @@ int main(int argc, char *argv[])
 
 	std::string find;
 	std::string url;
+	std::string segment_dir;
+	std::string check_dir;
+	size_t batch_docs;
+	size_t top;
+	double proximity;
+	double prior;
+	int pagerank_threads;
 	variables_map vm;
 	wookie::engine engine;
 
 	engine.add_options("RIndex options")
 		("find", value<std::string>(&find),
-		 	"Find pages containing all tokens (space separated, supports quotes for exact match)")
+		 	"Find pages matching query (supports quotes for exact match, OR, -negation, NEAR/k, title:word)")
 		("url", value<std::string>(&url), "Url to download")
 		("json", "Output json with pages content which contain requested tokens")
+		("top", value<size_t>(&top),
+			"Output this number of pages containing any of FIND tokens ranked by BM25 with their scores")
+		("proximity", value<double>(&proximity)->default_value(0),
+			"Weight of the FIND tokens proximity used to rerank the best pages found by BM25")
+		("prior", value<double>(&prior)->default_value(0),
+			"Weight of the page prior (PageRank and freshness) added to BM25 scores, segments are "
+			"ordered by it, so that the best pages are found without evaluating whole postings")
+		("segment-dir", value<std::string>(&segment_dir),
+			"Keep inverted index in local segments in this directory instead of elliptics secondary indexes")
+		("batch-docs", value<size_t>(&batch_docs)->default_value(1000),
+			"Number of documents collected in memory before their indexes are written in one batch")
+		("pagerank", value<int>(&pagerank_threads)->implicit_value(0),
+			"Compute PageRank of the crawled link graph in this number of threads (all CPUs by default) "
+			"and store it as static rank in SEGMENT-DIR")
+		("check-formats", value<std::string>(&check_dir),
+			"Write every on-disk format (segments, index data, statistics, anchors, link graph, "
+			"registry, static rank) into this directory, read it back and compare")
 	;
 
 	try {
@@ -158,15 +713,73 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
+	if (check_dir.size()) {
+		try {
+			return format_checker(check_dir).run();
+		} catch (const std::exception &e) {
+			std::cerr << "Format check failed: " << e.what() << std::endl;
+			return -1;
+		}
+	}
+
 	if (!vm.count("find") && !vm.count("url")) {
 		std::cerr << "You must provide either URL or FIND option" << std::endl;
 		engine.show_help_message(std::cerr);
 		return -1;
 	}
 
+	if (vm.count("pagerank") && segment_dir.empty()) {
+		std::cerr << "PAGERANK option requires SEGMENT-DIR, where link graph is stored" << std::endl;
+		engine.show_help_message(std::cerr);
+		return -1;
+	}
+
 	try {
-		if (find.size()) {
-			operators op(*engine.get_storage());
+		std::shared_ptr<local_index> index;
+		if (segment_dir.size()) {
+			index = std::make_shared<local_index>(segment_dir);
+			engine.get_storage()->set_local_index(index);
+
+			if (access((segment_dir + "/stats").c_str(), F_OK) == 0)
+				engine.get_storage()->get_collection_stats().load(segment_dir + "/stats");
+
+			// static rank of the previous crawl orders new segments and merges,
+			// it is numbered by the registry which storage and the prior share
+			auto registry = std::make_shared<doc_registry>();
+			auto ranks = std::make_shared<static_rank>();
+			if (access((segment_dir + "/static_rank").c_str(), F_OK) == 0) {
+				registry->load(segment_dir + "/registry");
+				ranks->load(segment_dir + "/static_rank");
+			}
+
+			engine.get_storage()->set_doc_registry(registry);
+			index->set_prior(document_prior(ranks, registry));
+		}
+
+		if (find.size() && vm.count("top")) {
+			wookie::split spl;
+			std::vector<std::string> tokens;
+			spl.feed(find, tokens);
+
+			std::vector<std::string> terms;
+			std::vector<double> weights;
+			fields::expand(tokens, fields::boosts(), terms, weights);
+
+			rank::ranked_result_t ranked = engine.get_storage()->async_top(terms, top,
+					rank::bm25(), false, rank::proximity_params(proximity), weights, prior).get();
+
+			std::cout << "Found " << ranked.size() << " best documents for request: " << find << std::endl;
+			if (!ranked.size())
+				return -ENOENT;
+
+			char tmp_str[DNET_ID_SIZE * 2 + 1];
+			for (auto & re : ranked) {
+				std::cout << dnet_dump_id_len_raw(re.entry.id.id, DNET_ID_SIZE, tmp_str) <<
+					" " << re.score << std::endl;
+			}
+		} else if (find.size()) {
+			// json output includes token positions
+			operators op(*engine.get_storage(), vm.count("json") != 0);
 			auto find_result = op.find(find);
 
 			const std::vector<dnet_raw_id> &ids = find_result->results_array();
@@ -189,9 +802,12 @@ int main(int argc, char *argv[])
 				std::copy(ids.begin(), ids.end(), std::back_inserter(keys));
 				auto read_results = sess.bulk_read(keys).get();
 
+				// storage instance unpacks bodies compressed with zstd dictionaries too
 				struct document_unpacker {
+					storage *st;
+
 					const std::string operator () (const elliptics::data_pointer &data) {
-						document doc = storage::unpack_document(data);
+						document doc = st->unpack(data);
 						return doc.key;
 					}
 				};
@@ -209,7 +825,7 @@ int main(int argc, char *argv[])
 
 				rift::JsonValue result_object;
 				rift::index::find_serializer::pack_indexes_json(
-					result_object, read_results, document_unpacker(),
+					result_object, read_results, document_unpacker{engine.get_storage()},
 					find_result->results_find_indexes_array(),
 					index_unpacker(), find_result->index_map());
 
@@ -225,13 +841,71 @@ int main(int argc, char *argv[])
 			engine.add_url_filter(create_domain_filter(url));
 			engine.add_url_filter(create_words_filter(forbidden_words));
 			engine.add_url_filter(create_port_filter(allowed_ports));
-			engine.add_parser(create_href_parser());
-			engine.add_processor(rindex_processor::create(engine, url, false));
-			engine.add_fallback_processor(rindex_processor::create(engine, url, true));
+			auto anchors = std::make_shared<anchor_index>();
+			if (segment_dir.size() && access((segment_dir + "/anchors").c_str(), F_OK) == 0)
+				anchors->load(segment_dir + "/anchors");
+
+			// link graph uses document numbers, so registry is kept together with it
+			storage *st = engine.get_storage();
+			auto graph = std::make_shared<link_graph>();
+			if (segment_dir.size() && access((segment_dir + "/links").c_str(), F_OK) == 0) {
+				st->get_doc_registry().load(segment_dir + "/registry");
+				graph->load(segment_dir + "/links");
+			}
+
+			engine.add_parser(create_href_parser([anchors, graph, st] (const swarm::url_fetcher::response &reply,
+						const std::string &target, const std::string &text) {
+					const std::string source = reply.url().to_string();
+					anchors->add(source, target, text);
+
+					doc_registry &registry = st->get_doc_registry();
+					graph->add_link(registry.assign(st->transform_key(source), source),
+							registry.assign(st->transform_key(target), target));
+				}));
+			auto delta = std::make_shared<delta_index>(index ?
+					delta_index::local_index_handler(index) :
+					delta_index::storage_handler(*engine.get_storage()),
+					batch_docs);
+			engine.get_storage()->set_delta_index(delta);
+
+			auto indexed = std::make_shared<indexed_docs>();
+			engine.add_processor(rindex_processor::create(engine, url, false, delta, anchors, indexed));
+			engine.add_fallback_processor(rindex_processor::create(engine, url, true, delta, anchors, indexed));
 
 			engine.download(url);
 
-			return engine.run();
+			int err = engine.run();
+
+			// links of the last pages may point to already indexed ones
+			basic_elliptics_splitter splitter;
+			rindex_processor::update_anchors(splitter, *delta, *anchors, *indexed);
+
+			delta->flush();
+			engine.get_storage()->set_delta_index(std::shared_ptr<delta_index>());
+			if (index) {
+				index->wait_merges();
+				engine.get_storage()->get_collection_stats().save(segment_dir + "/stats");
+				anchors->save(segment_dir + "/anchors");
+			}
+
+			if (segment_dir.size()) {
+				st->get_doc_registry().save(segment_dir + "/registry");
+				graph->save(segment_dir + "/links");
+			}
+
+			if (vm.count("pagerank")) {
+				pagerank_params params;
+				params.threads = pagerank_threads;
+
+				mapped_link_graph mapped(segment_dir + "/links");
+				static_rank ranks(pagerank(mapped, params));
+				ranks.save(segment_dir + "/static_rank");
+
+				std::cout << "PageRank of " << mapped.nodes_num() << " documents with " <<
+					mapped.links_num() << " links is stored in " << segment_dir << "/static_rank" << std::endl;
+			}
+
+			return err;
 		}
 	} catch (const std::exception &e) {
 		std::cerr << "main thread exception: " << e.what() << std::endl;